@@ -0,0 +1,129 @@
+#!/bin/bash
+#
+# Times operations through a mount of the daemon against the same
+# operations on the source directory.
+#
+#   readdir [N]    list a directory of N files (default 50000), names only
+#                  and with attributes, on both backends
+#   copy [MB]      read and write a file of MB megabytes (default 1024) on
+#                  both backends, with data spliced and copied through the
+#                  daemon; also prints the CPU time the daemon took
+
+BENCH_DIR=${BENCH_DIR:-/tmp/fuse-bench}
+
+mount | grep meego-ux-mediafsd > /dev/null
+let is_mounted="$?"
+if [[ $is_mounted -eq 0 ]]; then
+	echo "$0: already mounted, release it with fusermount -u first"
+	exit 1
+fi
+
+mkdir -p $BENCH_DIR/{source,mount,thumbs}
+
+# mount_fs [OPTIONS]: mounts source at mount until unmount_fs
+mount_fs() {
+	./meego-ux-mediafsd -s $BENCH_DIR/source -m $BENCH_DIR/mount -t $BENCH_DIR/thumbs -w 1 "$@" || exit 1
+	for i in $(seq 50); do
+		mount | grep -q " $BENCH_DIR/mount " && return
+		sleep 0.1
+	done
+	echo "$0: not mounted"
+	exit 1
+}
+
+unmount_fs() {
+	fusermount -u $BENCH_DIR/mount
+}
+
+# empties the page cache, if we may
+drop_caches() {
+	sync
+	echo 3 > /proc/sys/vm/drop_caches 2> /dev/null
+}
+
+# user and system time of the daemon so far, in ms
+daemon_cpu() {
+	local pid ticks
+
+	pid=$(pgrep -nf "meego-ux-mediafsd -s $BENCH_DIR/source") || { echo 0; return; }
+	ticks=$(awk '{ print $14 + $15 }' /proc/$pid/stat)
+	echo $(( ticks * 1000 / $(getconf CLK_TCK) ))
+}
+
+# timed WHAT COMMAND...: prints the wall clock time COMMAND takes, in ms,
+# and the CPU time the daemon took meanwhile
+timed() {
+	local what="$1" start end cpu
+	shift
+	cpu=$(daemon_cpu)
+	start=$(date +%s%N)
+	"$@" > /dev/null
+	end=$(date +%s%N)
+	printf "%-32s %8d ms %8d ms daemon cpu\n" "$what" \
+		$(( (end - start) / 1000000 )) $(( $(daemon_cpu) - cpu ))
+}
+
+bench_readdir() {
+	local n=${1:-50000} dir=$BENCH_DIR/source/many
+
+	if [ "$(ls -f $dir 2> /dev/null | wc -l)" -ne $((n + 2)) ]; then
+		rm -rf $dir
+		mkdir -p $dir
+		(cd $dir && seq -f "IMG_%06g.jpg" $n | xargs touch)
+	fi
+
+	echo "$0: listing $n entries, cold cache"
+	drop_caches
+	timed "source, names" ls -f $dir
+	drop_caches
+	timed "source, attributes" ls -l $dir
+	for backend in "" -l; do
+		mount_fs $backend
+		drop_caches
+		timed "mount ${backend:-path}, names" ls -f $BENCH_DIR/mount/many
+		drop_caches
+		timed "mount ${backend:-path}, attributes" ls -l $BENCH_DIR/mount/many
+		unmount_fs
+	done
+}
+
+# the file stays in the page cache, to time the daemon rather than the disk
+bench_copy() {
+	local mb=${1:-1024} file=$BENCH_DIR/source/copy.bin data backend
+	local no_splice=no_splice_read,no_splice_write,no_splice_move
+
+	if [ "$(stat -c %s $file 2> /dev/null)" != $((mb * 1048576)) ]; then
+		dd if=/dev/urandom of=$file bs=1M count=$mb status=none
+	fi
+	cat $file > /dev/null
+
+	echo "$0: reading and writing $mb MB, warm cache"
+	for backend in "" -l; do
+		for data in splice copy; do
+			if [ $data = splice ]; then
+				mount_fs $backend
+			else
+				mount_fs $backend -o $no_splice
+			fi
+			timed "${backend:-path}, $data, read" dd if=$BENCH_DIR/mount/copy.bin of=/dev/null bs=1M
+			timed "${backend:-path}, $data, write" dd if=$file of=$BENCH_DIR/mount/copy.out bs=1M
+			rm -f $BENCH_DIR/mount/copy.out
+			unmount_fs
+		done
+	done
+}
+
+case "$1" in
+readdir)
+	shift
+	bench_readdir "$@"
+	;;
+copy)
+	shift
+	bench_copy "$@"
+	;;
+*)
+	echo "Usage: $0 readdir [N] | copy [MB]"
+	exit 1
+	;;
+esac
@@ -0,0 +1,44 @@
+# - Try to find SQLite 3 header and library
+#
+# Usage of this module as follows:
+#
+#     find_package(SQLite3)
+#
+# Variables used by this module, they can change the default behaviour and need
+# to be set before calling find_package:
+#
+#  SQLite3_ROOT_DIR         Set this variable to the root installation of
+#                            SQLite 3 if the module has problems finding the
+#                            proper installation path.
+#
+# Variables defined by this module:
+#
+#  SQLITE3_FOUND              System has SQLite 3 and sqlite3.h
+#  SQLite3_LIBRARY            The SQLite 3 library
+#  SQLite3_INCLUDE_DIR        The location of sqlite3.h
+
+find_path(SQLite3_ROOT_DIR
+	NAMES include/sqlite3.h
+)
+
+find_library(SQLite3_LIBRARY
+	NAMES sqlite3
+	HINTS ${SQLite3_ROOT_DIR}/lib
+)
+
+find_path(SQLite3_INCLUDE_DIR
+	NAMES sqlite3.h
+	HINTS ${SQLite3_ROOT_DIR}/include
+)
+
+include(FindPackageHandleStandardArgs)
+	find_package_handle_standard_args(SQLite3 DEFAULT_MSG
+	SQLite3_LIBRARY
+	SQLite3_INCLUDE_DIR
+)
+
+mark_as_advanced(
+	SQLite3_ROOT_DIR
+	SQLite3_LIBRARY
+	SQLite3_INCLUDE_DIR
+)
@@ -0,0 +1,262 @@
+#include "control.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <glib.h>
+
+#define COMMAND_MAX 256
+
+/* a client gets this long to send its command */
+#define CLIENT_TIMEOUT_S 5
+
+
+
+struct control {
+	char *path;
+	int sock;
+
+	control_handler handler;
+	void *data;
+
+	GThread *thread;
+};
+
+
+
+/* another daemon answering on path? */
+static int
+in_use(const struct sockaddr_un *addr)
+{
+	int sock;
+	int r;
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		return 0;
+	}
+	r = connect(sock, (const struct sockaddr *) addr,
+			sizeof(struct sockaddr_un));
+	close(sock);
+
+	return r == 0;
+}
+
+
+
+struct control *
+control_open(const char *path, control_handler handler, void *data)
+{
+	struct control *control;
+	struct sockaddr_un addr;
+	struct stat st;
+	char *cwd;
+	mode_t mask;
+
+	control = calloc(1, sizeof(struct control));
+	if (! control) {
+		return NULL;
+	}
+	control->handler = handler;
+	control->data = data;
+	control->sock = -1;
+
+	/* daemonizing changes to the root directory */
+	if (g_path_is_absolute(path)) {
+		control->path = g_strdup(path);
+	} else {
+		cwd = g_get_current_dir();
+		control->path = g_build_filename(cwd, path, NULL);
+		g_free(cwd);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(control->path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: path is too long\n", control->path);
+		goto fail;
+	}
+	strcpy(addr.sun_path, control->path);
+
+	if (in_use(&addr)) {
+		fprintf(stderr, "%s: in use by another daemon\n",
+				control->path);
+		goto fail;
+	}
+	/* left behind by one that did not exit cleanly, but nothing else */
+	if (! lstat(control->path, &st)) {
+		if (! S_ISSOCK(st.st_mode)) {
+			fprintf(stderr, "%s: exists and is not a socket\n",
+					control->path);
+			goto fail;
+		}
+		if (unlink(control->path)) {
+			fprintf(stderr, "%s: cannot remove: %s\n",
+					control->path, strerror(errno));
+			goto fail;
+		}
+	} else if (errno != ENOENT) {
+		fprintf(stderr, "%s: %s\n", control->path, strerror(errno));
+		goto fail;
+	}
+
+	control->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (control->sock < 0) {
+		fprintf(stderr, "cannot create control socket: %s\n",
+				strerror(errno));
+		goto fail;
+	}
+
+	/* only for the user running the daemon */
+	mask = umask(0077);
+	if (bind(control->sock, (struct sockaddr *) &addr, sizeof(addr)) ||
+			listen(control->sock, 4)) {
+		fprintf(stderr, "%s: cannot listen: %s\n", control->path,
+				strerror(errno));
+		umask(mask);
+		goto fail;
+	}
+	umask(mask);
+
+	return control;
+
+fail:
+	if (control->sock >= 0) {
+		close(control->sock);
+	}
+	g_free(control->path);
+	free(control);
+	return NULL;
+}
+
+
+
+/* the first line sent, up to len - 1 characters */
+static int
+read_command(int client, char *command, size_t len)
+{
+	size_t have = 0;
+	ssize_t r;
+	char *end;
+
+	while (have < len - 1) {
+		r = recv(client, command + have, len - 1 - have, 0);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		if (r <= 0) {
+			break;
+		}
+		have += r;
+		command[have] = '\0';
+		if (strchr(command, '\n')) {
+			break;
+		}
+	}
+	if (have == 0) {
+		return 1;
+	}
+
+	command[have] = '\0';
+	end = command + strcspn(command, "\r\n");
+	*end = '\0';
+
+	return 0;
+}
+
+
+
+static void
+serve(struct control *control, int client)
+{
+	struct timeval timeout;
+	char command[COMMAND_MAX];
+	FILE *out;
+
+	timeout.tv_sec = CLIENT_TIMEOUT_S;
+	timeout.tv_usec = 0;
+	setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	if (read_command(client, command, sizeof(command))) {
+		close(client);
+		return;
+	}
+
+	out = fdopen(client, "w");
+	if (! out) {
+		close(client);
+		return;
+	}
+	control->handler(command, out, control->data);
+	fclose(out);
+}
+
+
+
+static gpointer
+control_main(gpointer data)
+{
+	struct control *control = data;
+	int client;
+
+	while (1) {
+		client = accept(control->sock, NULL, NULL);
+		if (client < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			/* shut down by control_close() */
+			break;
+		}
+		serve(control, client);
+	}
+
+	return NULL;
+}
+
+
+
+int
+control_start(struct control *control)
+{
+	GError *error = NULL;
+
+	control->thread = g_thread_create(control_main, control, TRUE, &error);
+	if (! control->thread) {
+		fprintf(stderr, "cannot create control thread: %s\n",
+				error ? error->message : "unknown");
+		if (error) {
+			g_error_free(error);
+		}
+		return 1;
+	}
+
+	return 0;
+}
+
+
+
+void
+control_close(struct control *control)
+{
+	if (control == NULL) {
+		return;
+	}
+
+	/* makes accept() fail */
+	shutdown(control->sock, SHUT_RDWR);
+	if (control->thread) {
+		g_thread_join(control->thread);
+	}
+	close(control->sock);
+	unlink(control->path);
+	g_free(control->path);
+	free(control);
+}
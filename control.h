@@ -0,0 +1,25 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stdio.h>
+
+/*
+ * Unix socket taking commands for the daemon, one per connection: the client
+ * sends a line, the handler writes the answer to out and the connection is
+ * closed. E.g. echo reload | socat - UNIX-CONNECT:<path>
+ *
+ * The socket is created by control_open(), before daemonizing so that errors
+ * can still be reported, and served by a thread of its own once
+ * control_start() is called.
+ */
+
+typedef void (*control_handler)(const char *command, FILE *out, void *data);
+
+struct control;
+
+struct control *control_open(const char *path, control_handler handler,
+		void *data);
+int control_start(struct control *control);
+void control_close(struct control *control);
+
+#endif
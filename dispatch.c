@@ -0,0 +1,385 @@
+#include "dispatch.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#define KEY_MAX 127
+
+
+
+/* a wildcard pattern, lowercase and without the '*' */
+struct pattern {
+	char *text;
+	size_t len;
+	int plugin;
+};
+
+
+
+/*
+ * Candidate lists are int arrays of plugin indices in ascending order,
+ * terminated by -1.
+ */
+struct dispatch {
+	GHashTable *exact;	/* mime type -> list */
+	GHashTable *types;	/* "type/" -> list, for whole type patterns */
+	GSList *prefixes;	/* other "prefix*" patterns */
+	GSList *suffixes;	/* "*suffix" patterns */
+	GHashTable *files;	/* file suffix -> list */
+
+	/*
+	 * Candidates of every mime type looked up so far, merged from all of
+	 * the above. Lookups come from the indexing threads.
+	 */
+	GMutex *lock;
+	GHashTable *merged;
+};
+
+
+
+static const int no_plugins[] = { -1 };
+
+
+
+static int *
+list_new(void)
+{
+	int *list;
+
+	list = malloc(sizeof(int));
+	if (list) {
+		list[0] = -1;
+	}
+	return list;
+}
+
+
+
+/* keeps the list ordered and free of duplicates, fails only on ENOMEM */
+static int
+list_add(int **list, int plugin)
+{
+	int *new;
+	int n, i;
+
+	for (n = 0; (*list)[n] >= 0; n++)
+		;
+	for (i = 0; i < n && (*list)[i] < plugin; i++)
+		;
+	if (i < n && (*list)[i] == plugin) {
+		return 0;
+	}
+
+	new = realloc(*list, (n + 2) * sizeof(int));
+	if (! new) {
+		return 1;
+	}
+	/* includes terminator */
+	memmove(new + i + 1, new + i, (n - i + 1) * sizeof(int));
+	new[i] = plugin;
+	*list = new;
+
+	return 0;
+}
+
+
+
+static int
+list_merge(int **list, const int *other)
+{
+	int ret = 0;
+
+	for (; other && *other >= 0; other++) {
+		ret |= list_add(list, *other);
+	}
+	return ret;
+}
+
+
+
+/* lowercase copy of src, fails if it doesn't fit */
+static int
+make_key(char *key, const char *src)
+{
+	size_t i;
+
+	for (i = 0; src[i] != '\0'; i++) {
+		if (i == KEY_MAX) {
+			return 1;
+		}
+		key[i] = tolower((unsigned char) src[i]);
+	}
+	key[i] = '\0';
+
+	return 0;
+}
+
+
+
+static int
+table_add(GHashTable *table, const char *key, int plugin)
+{
+	int *list, *old;
+
+	old = list = g_hash_table_lookup(table, key);
+	if (! list) {
+		list = list_new();
+		if (! list) {
+			return 1;
+		}
+	}
+	if (list_add(&list, plugin)) {
+		if (! old) {
+			free(list);
+		}
+		return 1;
+	}
+	if (list != old) {
+		/* an existing key is kept, the copy is freed */
+		g_hash_table_insert(table, g_strdup(key), list);
+	}
+
+	return 0;
+}
+
+
+
+static int
+pattern_add(GSList **patterns, const char *text, int plugin)
+{
+	struct pattern *pattern;
+
+	pattern = malloc(sizeof(struct pattern));
+	if (! pattern) {
+		return 1;
+	}
+	pattern->text = strdup(text);
+	if (! pattern->text) {
+		free(pattern);
+		return 1;
+	}
+	pattern->len = strlen(text);
+	pattern->plugin = plugin;
+	*patterns = g_slist_append(*patterns, pattern);
+
+	return 0;
+}
+
+
+
+static void
+free_list(gpointer key, gpointer value, gpointer data)
+{
+	free(value);
+}
+
+
+
+static void
+free_table(GHashTable *table)
+{
+	g_hash_table_foreach(table, free_list, NULL);
+	g_hash_table_destroy(table);
+}
+
+
+
+static void
+free_patterns(GSList *patterns)
+{
+	GSList *l;
+
+	for (l = patterns; l; l = l->next) {
+		struct pattern *pattern = l->data;
+		free(pattern->text);
+		free(pattern);
+	}
+	g_slist_free(patterns);
+}
+
+
+
+struct dispatch *
+dispatch_new(void)
+{
+	struct dispatch *dispatch;
+
+	dispatch = calloc(1, sizeof(struct dispatch));
+	if (! dispatch) {
+		return NULL;
+	}
+
+	/* values are freed by hand, see table_add() */
+	dispatch->exact = g_hash_table_new_full(g_str_hash, g_str_equal,
+			g_free, NULL);
+	dispatch->types = g_hash_table_new_full(g_str_hash, g_str_equal,
+			g_free, NULL);
+	dispatch->files = g_hash_table_new_full(g_str_hash, g_str_equal,
+			g_free, NULL);
+	dispatch->merged = g_hash_table_new_full(g_str_hash, g_str_equal,
+			g_free, NULL);
+	dispatch->lock = g_mutex_new();
+
+	return dispatch;
+}
+
+
+
+void
+dispatch_free(struct dispatch *dispatch)
+{
+	if (dispatch == NULL) {
+		return;
+	}
+
+	free_table(dispatch->exact);
+	free_table(dispatch->types);
+	free_table(dispatch->files);
+	free_table(dispatch->merged);
+	free_patterns(dispatch->prefixes);
+	free_patterns(dispatch->suffixes);
+	g_mutex_free(dispatch->lock);
+	free(dispatch);
+}
+
+
+
+int
+dispatch_add_mime(struct dispatch *dispatch, const char *pattern, int plugin)
+{
+	char key[KEY_MAX + 1];
+	char *slash;
+	size_t len;
+
+	if (make_key(key, pattern) || key[0] == '\0') {
+		fprintf(stderr, "%s: bad mime type pattern\n", pattern);
+		return 1;
+	}
+	len = strlen(key);
+
+	if (key[len - 1] == '*') {
+		key[len - 1] = '\0';
+		slash = strchr(key, '/');
+		if (slash && slash[1] == '\0') {
+			return table_add(dispatch->types, key, plugin);
+		}
+		return pattern_add(&dispatch->prefixes, key, plugin);
+	}
+	if (key[0] == '*') {
+		return pattern_add(&dispatch->suffixes, key + 1, plugin);
+	}
+	return table_add(dispatch->exact, key, plugin);
+}
+
+
+
+int
+dispatch_add_suffix(struct dispatch *dispatch, const char *suffix, int plugin)
+{
+	char key[KEY_MAX + 1];
+
+	if (make_key(key, suffix) || key[0] == '\0') {
+		fprintf(stderr, "%s: bad file suffix\n", suffix);
+		return 1;
+	}
+	return table_add(dispatch->files, key, plugin);
+}
+
+
+
+static int *
+merge_mime(struct dispatch *dispatch, const char *key)
+{
+	char type[KEY_MAX + 1];
+	const char *slash;
+	size_t len = strlen(key);
+	int *list;
+	GSList *l;
+	int err;
+
+	list = list_new();
+	if (! list) {
+		return NULL;
+	}
+
+	err = list_merge(&list, g_hash_table_lookup(dispatch->exact, key));
+
+	slash = strchr(key, '/');
+	if (slash) {
+		memcpy(type, key, slash - key + 1);
+		type[slash - key + 1] = '\0';
+		err |= list_merge(&list,
+				g_hash_table_lookup(dispatch->types, type));
+	}
+
+	for (l = dispatch->prefixes; l; l = l->next) {
+		struct pattern *pattern = l->data;
+		if (strncmp(key, pattern->text, pattern->len) == 0) {
+			err |= list_add(&list, pattern->plugin);
+		}
+	}
+	for (l = dispatch->suffixes; l; l = l->next) {
+		struct pattern *pattern = l->data;
+		if (len >= pattern->len &&
+				strcmp(key + len - pattern->len, pattern->text) == 0) {
+			err |= list_add(&list, pattern->plugin);
+		}
+	}
+
+	if (err) {
+		free(list);
+		return NULL;
+	}
+	return list;
+}
+
+
+
+/*
+ * The first lookup of a mime type merges the matching patterns, later ones
+ * only cost a hash lookup.
+ */
+const int *
+dispatch_lookup_mime(struct dispatch *dispatch, const char *mime)
+{
+	char key[KEY_MAX + 1];
+	int *list;
+
+	if (make_key(key, mime)) {
+		return no_plugins;
+	}
+
+	g_mutex_lock(dispatch->lock);
+	list = g_hash_table_lookup(dispatch->merged, key);
+	if (! list) {
+		list = merge_mime(dispatch, key);
+		if (list) {
+			g_hash_table_insert(dispatch->merged, g_strdup(key),
+					list);
+		}
+	}
+	g_mutex_unlock(dispatch->lock);
+
+	return list ? list : no_plugins;
+}
+
+
+
+/* the suffix table is not modified after setup, no locking needed */
+const int *
+dispatch_lookup_suffix(struct dispatch *dispatch, const char *suffix)
+{
+	char key[KEY_MAX + 1];
+	const int *list;
+
+	if (make_key(key, suffix)) {
+		return no_plugins;
+	}
+
+	list = g_hash_table_lookup(dispatch->files, key);
+	return list ? list : no_plugins;
+}
@@ -0,0 +1,32 @@
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+/*
+ * Table of the plugins claiming each mime type and file suffix.
+ *
+ * Built once when the plugins are loaded. Lookups give the candidate plugins
+ * as indices in the order they were added (i.e. plugin order), terminated
+ * by -1. The returned lists stay valid until the table is freed.
+ *
+ * Mime type patterns are matched regardless of case. A pattern ending in '*'
+ * matches every mime type starting with the rest of it (e.g. all of a type),
+ * one starting with '*' every mime type ending with the rest of it (e.g.
+ * "*+xml") and any other one just itself. File suffixes (without the dot)
+ * match exactly, regardless of case.
+ */
+
+struct dispatch;
+
+struct dispatch *dispatch_new(void);
+void dispatch_free(struct dispatch *dispatch);
+
+int dispatch_add_mime(struct dispatch *dispatch, const char *pattern,
+		int plugin);
+int dispatch_add_suffix(struct dispatch *dispatch, const char *suffix,
+		int plugin);
+
+const int *dispatch_lookup_mime(struct dispatch *dispatch, const char *mime);
+const int *dispatch_lookup_suffix(struct dispatch *dispatch,
+		const char *suffix);
+
+#endif
@@ -0,0 +1,195 @@
+/*
+ * Which plugins the dispatch table offers for mime types and file suffixes:
+ * exact matches, whole types, other prefixes and suffixes of mime types,
+ * case, and the order candidates come in.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dispatch.h"
+
+#include <glib.h>
+
+#define END -1
+
+
+
+static int failed;
+
+
+
+#define MAX_EXPECTED 16
+
+/* the list against expected, both ended by END */
+static void
+check(const char *what, const char *key, const int *list,
+		const int *expected)
+{
+	int i;
+
+	for (i = 0; list[i] == expected[i] && expected[i] != END; i++)
+		;
+	fprintf(stdout, "%s %s: %s", what, key,
+			list[i] == expected[i] ? "ok" : "FAILED, got");
+	if (list[i] != expected[i]) {
+		for (i = 0; list[i] >= 0; i++) {
+			fprintf(stdout, " %d", list[i]);
+		}
+		if (i == 0) {
+			fprintf(stdout, " none");
+		}
+		failed = 1;
+	}
+	fputc('\n', stdout);
+}
+
+
+
+/* the plugins passed after ap, up to END */
+static void
+get_expected(va_list ap, int *expected)
+{
+	int i = 0;
+
+	do {
+		expected[i] = va_arg(ap, int);
+	} while (expected[i] != END && ++i < MAX_EXPECTED - 1);
+	expected[i] = END;
+}
+
+
+
+static void
+check_mime(struct dispatch *dispatch, const char *mime, ...)
+{
+	int expected[MAX_EXPECTED];
+	va_list ap;
+
+	va_start(ap, mime);
+	get_expected(ap, expected);
+	va_end(ap);
+
+	check("mime", mime, dispatch_lookup_mime(dispatch, mime), expected);
+}
+
+
+
+static void
+check_suffix(struct dispatch *dispatch, const char *suffix, ...)
+{
+	int expected[MAX_EXPECTED];
+	va_list ap;
+
+	va_start(ap, suffix);
+	get_expected(ap, expected);
+	va_end(ap);
+
+	check("suffix", suffix, dispatch_lookup_suffix(dispatch, suffix),
+			expected);
+}
+
+
+
+static void
+check_add(const char *what, const char *pattern, int r, int expected)
+{
+	fprintf(stdout, "adding %s %s: %s\n", what, pattern,
+			r == expected ? "ok" : "FAILED");
+	if (r != expected) {
+		failed = 1;
+	}
+}
+
+
+
+int
+main(void)
+{
+	struct dispatch *dispatch;
+	char long_pattern[130];	/* longer than any key */
+	const int *first;
+
+	if (! g_thread_supported()) {
+		g_thread_init(NULL);
+	}
+
+	dispatch = dispatch_new();
+	if (! dispatch) {
+		fprintf(stderr, "out of memory!\n");
+		return 1;
+	}
+
+	/* added out of plugin order, and with overlaps */
+	check_add("mime", "image/*", dispatch_add_mime(dispatch, "image/*", 4),
+			0);
+	check_add("mime", "image/jpeg",
+			dispatch_add_mime(dispatch, "image/jpeg", 2), 0);
+	check_add("mime", "Image/JPEG",
+			dispatch_add_mime(dispatch, "Image/JPEG", 0), 0);
+	check_add("mime", "image/jpeg",
+			dispatch_add_mime(dispatch, "image/jpeg", 2), 0);
+	check_add("mime", "video/*", dispatch_add_mime(dispatch, "video/*", 1),
+			0);
+	check_add("mime", "application/x-*",
+			dispatch_add_mime(dispatch, "application/x-*", 3), 0);
+	check_add("mime", "*+xml", dispatch_add_mime(dispatch, "*+xml", 5), 0);
+	check_add("mime", "audio/x-wav",
+			dispatch_add_mime(dispatch, "audio/x-wav", 1), 0);
+	check_add("mime", "(empty)", dispatch_add_mime(dispatch, "", 6), 1);
+	memset(long_pattern, 'x', sizeof(long_pattern) - 1);
+	long_pattern[sizeof(long_pattern) - 1] = '\0';
+	check_add("mime", "(too long)",
+			dispatch_add_mime(dispatch, long_pattern, 6), 1);
+
+	check_add("suffix", "JPG", dispatch_add_suffix(dispatch, "JPG", 4), 0);
+	check_add("suffix", "jpg", dispatch_add_suffix(dispatch, "jpg", 0), 0);
+	check_add("suffix", "mp4", dispatch_add_suffix(dispatch, "mp4", 1), 0);
+	check_add("suffix", "(empty)", dispatch_add_suffix(dispatch, "", 6),
+			1);
+
+	/* exact matches, in plugin order and once each, with the type */
+	check_mime(dispatch, "image/jpeg", 0, 2, 4, END);
+	check_mime(dispatch, "IMAGE/Jpeg", 0, 2, 4, END);
+	check_mime(dispatch, "image/png", 4, END);
+	check_mime(dispatch, "audio/x-wav", 1, END);
+	check_mime(dispatch, "audio/mpeg", END);
+
+	/* whole types only match up to the slash */
+	check_mime(dispatch, "video/mp4", 1, END);
+	check_mime(dispatch, "video/", 1, END);
+	check_mime(dispatch, "videos/mp4", END);
+	check_mime(dispatch, "video", END);
+
+	/* other prefixes and suffixes */
+	check_mime(dispatch, "application/x-matroska", 3, END);
+	check_mime(dispatch, "application/xml", END);
+	check_mime(dispatch, "image/svg+xml", 4, 5, END);
+	check_mime(dispatch, "application/x-foo+XML", 3, 5, END);
+	check_mime(dispatch, "text/xml", END);
+	check_mime(dispatch, "", END);
+	check_mime(dispatch, long_pattern, END);
+
+	/* lookups after the first come from the merged table */
+	first = dispatch_lookup_mime(dispatch, "image/svg+xml");
+	check_mime(dispatch, "image/svg+xml", 4, 5, END);
+	if (dispatch_lookup_mime(dispatch, "IMAGE/SVG+XML") != first) {
+		fprintf(stdout, "mime again: case makes another list\n");
+		failed = 1;
+	}
+
+	/* file suffixes match whole, regardless of case */
+	check_suffix(dispatch, "jpg", 0, 4, END);
+	check_suffix(dispatch, "JpG", 0, 4, END);
+	check_suffix(dispatch, "mp4", 1, END);
+	check_suffix(dispatch, "jpeg", END);
+	check_suffix(dispatch, "pg", END);
+	check_suffix(dispatch, ".jpg", END);
+	check_suffix(dispatch, "", END);
+
+	dispatch_free(dispatch);
+
+	fprintf(stdout, "%s\n", failed ? "FAILED" : "all passed");
+	return failed;
+}
@@ -69,6 +69,23 @@ static char *suffixes[] = {
 	NULL
 };
 
+/*
+ * Still images that may end up here by suffix or when trying every plugin;
+ * setting up a pipeline only to find that out takes long.
+ */
+static const struct {
+	const char *magic;
+	size_t len;
+} still_images[] = {
+	{ "\xff\xd8\xff", 3 },		/* JPEG */
+	{ "\x89PNG\r\n\x1a\n", 8 },	/* PNG */
+	{ "GIF8", 4 },
+	{ "BM", 2 },
+	{ "II*\0", 4 },			/* TIFF */
+	{ "MM\0*", 4 },
+	{ NULL, 0 }
+};
+
 
 
 const char **
@@ -87,6 +104,28 @@ get_suffixes(struct plugin_context *ctx)
 
 
 
+int
+probe(struct plugin_context *ctx, const char *fn, const unsigned char *header,
+		size_t len)
+{
+	int i;
+
+	if (len == 0) {
+		return 1;
+	}
+	for (i = 0; still_images[i].magic; i++) {
+		if (len >= still_images[i].len && memcmp(header,
+					still_images[i].magic,
+					still_images[i].len) == 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+
 struct plugin_context *
 init(const char *self, const char *thumb_dir)
 {
@@ -147,7 +186,10 @@ free_reply(struct plugin_reply *reply)
 		internal->buffer = NULL;
 	}
 #else
-	free(reply->data);
+	/* else the caller frees it */
+	if (! reply->alloc_data) {
+		free(reply->data);
+	}
 #endif
 
 	free(reply->internal);
@@ -245,11 +287,16 @@ handoff_cb(GstElement *bin, GstBuffer *buffer, GstPad *pad, gpointer data)
 		reply->type = PLUGIN_REPLY_TYPE_RAW_PIXELS;
 		data_size = GST_BUFFER_SIZE(buffer);
 
+		/* unpadded straight into memory of the caller if it has some */
 		if (ctx->grab_done == GRAB_FRAME_NONE) {
-			reply->data = malloc(data_size);
+			reply->data = reply->alloc_data ?
+				reply->alloc_data(reply, data_size) :
+				malloc(data_size);
 			ctx->data_size = data_size;
 		} else if (data_size > ctx->data_size) {
-			void *newdata = realloc(reply->data, data_size);
+			void *newdata = reply->alloc_data ?
+				reply->alloc_data(reply, data_size) :
+				realloc(reply->data, data_size);
 			if (newdata) {
 				reply->data = newdata;
 				ctx->data_size = data_size;
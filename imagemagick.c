@@ -70,6 +70,25 @@ uninit(struct plugin_context *ctx)
 
 
 
+/*
+ * The size hint lets e.g. the JPEG decoder scale by a power of two while
+ * decoding, keeping the image at least this big. EXIF orientation is only
+ * known after reading, so the hint is made square to cover both ways.
+ */
+static void
+set_size_hint(ImageInfo *info, int width, int height)
+{
+	char size[MaxTextExtent];
+	int side = width > height ? width : height;
+
+	if (side > 0) {
+		snprintf(size, sizeof(size), "%dx%d", side, side);
+		CloneString(&info->size, size);
+	}
+}
+
+
+
 static Image *
 open_image(const char *fn, ImageInfo *info, ExceptionInfo *exception)
 {
@@ -184,6 +203,10 @@ get_image(struct plugin_context *ctx, const char *fn,
 	reply->internal = internal;
 	internal->ctx = ctx;
 
+	if (reply->request_flags & PLUGIN_REQUEST_DOWNSCALE) {
+		set_size_hint(internal->info, width, height);
+	}
+
 	internal->image = open_image(fn, internal->info, &exception);
 	if (internal->image) {
 		/* returns input image untouched if re-orientation
@@ -1,18 +1,56 @@
 #include <dirent.h>
 #include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 #include <alloca.h>
 
+#include "dispatch.h"
+#include "indexer.h"
+#include "jobqueue.h"
+#include "mediaindex.h"
 #include "plugin.h"
+#include "pluginstats.h"
+#include "sandbox.h"
 #include "thumbnail.h"
+#include "walk.h"
+#include "writeback.h"
 
 #include <glib.h>
 #include <magic.h>
 
 #define DEFAULT_PLUGIN_DIR "/usr/lib/meego-ux-mediafs"
+#define DEFAULT_WORKERS 2
+#define DEFAULT_QUEUE_LEN 64
+#define DEFAULT_DEBOUNCE_MS 500
+#define DEFAULT_LAZY_TIMEOUT_MS 5000
+
+/* thumbnails synced and put in place together, see writeback.h */
+#define COMMIT_BATCH_LEN 64
+#define COMMIT_DELAY_MS 1000
+
+/* within the thumbnail directory */
+#define INDEX_FILE ".mediafs-index"
+
+#define MIME_LEN 64
+
+#define SCAN_THREADS 4
+
+/* files no plugin can handle are tried again after this, doubling each time */
+#define FAILURE_RETRY_S (10 * 60)
+#define FAILURE_RETRY_MAX_S (7 * 24 * 60 * 60)
+
+/* status of a plugin whose probe() declined the file, here or in a reader */
+#define PROBE_DECLINED SANDBOX_DECLINED
+
+/* runs the reader plugins, next to the daemon binary */
+#define SANDBOX_HELPER "meego-ux-mediafs-sandbox"
 
 /* #define TRY_ALL_PLUGINS */
 
@@ -20,24 +58,101 @@
 
 struct indexer_plugin {
 	char *name;
-	void *lib;
-	const char **mime;
-	const char **suffix;
+	void *lib;		/* NULL if only readers load the plugin */
+	char **mime;
+	char **suffix;
+
+	/* of the file loaded, to tell if it changed */
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+
+	/* plugins are not reentrant */
+	GMutex *lock;
 
 	struct plugin plugin;
 };
 
 
+/* a file on its way through the plugins claiming it */
+struct attempt {
+	const char *fn;
+	const char *profile;	/* thumbnails made, see thumbnail.h */
+	int *tried;		/* what get_image() of each plugin returned,
+				   0 if not called */
+	int used;		/* plugin that made the image, -1 if none */
+
+	/* the start of the file for probe(), read when first needed */
+	unsigned char header[PLUGIN_PROBE_LEN];
+	ssize_t header_len;	/* -1 until read */
+};
+
+
 struct indexer {
+	/* to reload plugins and configuration with */
+	char *self;
 	char *plugin_dir;
+	char *thumb_dir;
+	char *conffile;
+
+	/*
+	 * Taken for reading by whatever uses the plugins or the thumbnail
+	 * configuration, for writing to replace them.
+	 */
+	GStaticRWLock reload_lock;
 
 	struct indexer_plugin **plugins;
 	int count;
 	int size;
 
+	/* plugins claiming each mime type and suffix */
+	struct dispatch *dispatch;
+
 	struct thumbnailer *thumbconf;
 
+	/* puts the thumbnails written in place */
+	struct writeback *writeback;
+
+	/* reader processes doing get_image(), NULL to call plugins here */
+	struct sandbox *sandbox;
+
+	/* what has been done already, may be NULL */
+	struct mediaindex *index;
+
+	/* how plugins did with each type of file */
+	struct pluginstats *stats;
+
 	magic_t magic;
+	GMutex *magic_lock;
+
+	struct jobqueue *queue;
+
+	/* reconciliation scan, see indexer_reconcile() */
+	GMutex *scan_lock;
+	GThread *scan_thread;
+	struct walk_root *scan_roots;
+	int n_scan_roots;
+	int scanning;
+	int scan_again;
+	volatile int scan_stop;
+	volatile gint scan_queued;
+
+	/* thumbnails of lazy profiles readers wait for */
+	GMutex *lazy_lock;
+	GCond *lazy_done;
+	GHashTable *lazy_requests;
+	int lazy_timeout_ms;
+};
+
+
+/*
+ * Readers waiting for a thumbnail of a lazy profile, by profile and path, see
+ * indexer_make_lazy()
+ */
+struct lazy_request {
+	int done;
+	int err;
+	int waiters;
 };
 
 
@@ -74,18 +189,22 @@ init_plugin_real(struct indexer_plugin *indexer_plugin, const char *self)
 		return 1;
 	}
 
+	/* copied, as those described by readers are */
 	get_mimetypes = dlsym(indexer_plugin->lib, "get_mimetypes");
 	if (get_mimetypes) {
-		indexer_plugin->mime = get_mimetypes(plugin->ctx);
+		indexer_plugin->mime = g_strdupv(
+				(char **) get_mimetypes(plugin->ctx));
 	} else {
 		indexer_plugin->mime = NULL;
 	}
 	get_suffixes = dlsym(indexer_plugin->lib, "get_suffixes");
 	if (get_suffixes) {
-		indexer_plugin->suffix = get_suffixes(plugin->ctx);
+		indexer_plugin->suffix = g_strdupv(
+				(char **) get_suffixes(plugin->ctx));
 	} else {
 		indexer_plugin->suffix = NULL;
 	}
+	plugin->probe = dlsym(indexer_plugin->lib, "probe");
 
 	return 0;
 }
@@ -114,6 +233,7 @@ init_plugin(const char *fn, const char *self)
 				plugin.name = strdup(libname + 1);
 			}
 			if (plugin.name != NULL) {
+				plugin.lock = g_mutex_new();
 				memcpy(new, &plugin,
 						sizeof(struct indexer_plugin));
 				return new;
@@ -131,27 +251,135 @@ init_plugin(const char *fn, const char *self)
 
 
 
+/*
+ * A plugin the readers of sandbox run, which the daemon knows only by what
+ * one of them tells about it.
+ */
+static struct indexer_plugin *
+describe_plugin(struct sandbox *sandbox, const char *name)
+{
+	struct indexer_plugin *plugin;
+
+	plugin = calloc(1, sizeof(struct indexer_plugin));
+	if (! plugin) {
+		fprintf(stderr, "out of memory!\n");
+		return NULL;
+	}
+	plugin->name = strdup(name);
+	if (! plugin->name ||
+			sandbox_describe(sandbox, name, &plugin->mime,
+				&plugin->suffix)) {
+		fprintf(stderr, "failed to load %s in a reader\n", name);
+		free(plugin->name);
+		free(plugin);
+		return NULL;
+	}
+	plugin->lock = g_mutex_new();
+
+	return plugin;
+}
+
+
+
 static void
 free_plugin(struct indexer_plugin *indexer_plugin)
 {
-	indexer_plugin->plugin.uninit(indexer_plugin->plugin.ctx);
-	dlclose(indexer_plugin->lib);
+	if (indexer_plugin->lib) {
+		indexer_plugin->plugin.uninit(indexer_plugin->plugin.ctx);
+		dlclose(indexer_plugin->lib);
+	}
+	g_strfreev(indexer_plugin->mime);
+	g_strfreev(indexer_plugin->suffix);
+	g_mutex_free(indexer_plugin->lock);
 	free(indexer_plugin->name);
 	free(indexer_plugin);
 }
 
 
 
+static void
+add_dispatch(struct indexer *indexer, int i)
+{
+	struct indexer_plugin *plugin = indexer->plugins[i];
+	char **s;
+
+	for (s = plugin->mime; s && *s != NULL; s++) {
+		if (dispatch_add_mime(indexer->dispatch, *s, i)) {
+			fprintf(stderr, "%s: cannot add mime type %s\n",
+					plugin->name, *s);
+		}
+	}
+	for (s = plugin->suffix; s && *s != NULL; s++) {
+		if (dispatch_add_suffix(indexer->dispatch, *s, i)) {
+			fprintf(stderr, "%s: cannot add suffix %s\n",
+					plugin->name, *s);
+		}
+	}
+}
+
+
+
+/*
+ * The plugin of old named name if its file is still the same. A changed one is
+ * unloaded, as loading the new file would give the old one back otherwise.
+ */
+static struct indexer_plugin *
+take_plugin(struct indexer_plugin **old, int n_old, const char *name,
+		const struct stat *st)
+{
+	struct indexer_plugin *plugin;
+	int i;
+
+	for (i = 0; i < n_old; i++) {
+		if (old[i] && strcmp(old[i]->name, name) == 0) {
+			break;
+		}
+	}
+	if (i == n_old) {
+		return NULL;
+	}
+
+	plugin = old[i];
+	old[i] = NULL;
+	if (plugin->dev == st->st_dev && plugin->ino == st->st_ino &&
+			plugin->mtime == st->st_mtime) {
+		return plugin;
+	}
+
+	fprintf(stdout, "unloading %s, it has changed\n", plugin->name);
+	free_plugin(plugin);
+	return NULL;
+}
+
+
+
+/*
+ * Load the plugins in the readers directory, or have a reader describe them
+ * with the sandbox running. Those of old (n_old of them) are taken over when
+ * their file is unchanged; old is left with the others. *added is how many
+ * plugins were loaded afresh. Fails with no plugins loaded and none taken
+ * over if the directory cannot be read, and with no dispatch table if there
+ * is no memory for one.
+ */
 static int
-open_plugins(struct indexer *indexer, const char *self)
+open_plugins(struct indexer *indexer, const char *self,
+		struct indexer_plugin **old, int n_old, int *added)
 {
 	char dirname[MAXNAMLEN];
 	char fn[MAXNAMLEN + 3];
 	DIR *dir;
 	struct dirent *ent;
+	struct stat st;
 
+	*added = 0;
 	snprintf(dirname, MAXNAMLEN, "%s/readers", indexer->plugin_dir);
 
+	indexer->dispatch = dispatch_new();
+	if (! indexer->dispatch) {
+		fprintf(stderr, "out of memory!\n");
+		return 1;
+	}
+
 	dir = opendir(dirname);
 	if (! dir) {
 		fprintf(stderr, "%s: cannot read\n", dirname);
@@ -188,17 +416,33 @@ open_plugins(struct indexer *indexer, const char *self)
 		}
 
 		snprintf(fn, MAXNAMLEN + 3, "%s/%s", dirname, ent->d_name);
-		indexer->plugins[indexer->count] = init_plugin(fn, self);
-		if (indexer->plugins[indexer->count]) {
+		if (stat(fn, &st)) {
+			continue;
+		}
+		indexer->plugins[indexer->count] = take_plugin(old, n_old,
+				ent->d_name, &st);
+		if (! indexer->plugins[indexer->count]) {
+			indexer->plugins[indexer->count] = indexer->sandbox ?
+				describe_plugin(indexer->sandbox,
+						ent->d_name) :
+				init_plugin(fn, self);
+			if (! indexer->plugins[indexer->count]) {
+				fprintf(stderr, "failed to init %s\n",
+						ent->d_name);
+				continue;
+			}
 			fprintf(stdout, "initialised %s\n", fn);
-			indexer->count++;
-		} else {
-			fprintf(stderr, "failed to init %s\n", ent->d_name);
+			indexer->plugins[indexer->count]->dev = st.st_dev;
+			indexer->plugins[indexer->count]->ino = st.st_ino;
+			indexer->plugins[indexer->count]->mtime = st.st_mtime;
+			(*added)++;
 		}
+		add_dispatch(indexer, indexer->count);
+		indexer->count++;
 	}
 	closedir(dir);
 
-	return indexer->count;
+	return 0;
 }
 
 
@@ -214,16 +458,77 @@ free_plugins(struct indexer *indexer)
 	free(indexer->plugins);
 	indexer->plugins = NULL;
 	indexer->count = indexer->size = 0;
+	dispatch_free(indexer->dispatch);
+	indexer->dispatch = NULL;
+}
+
+
+
+static void run_job(const struct job *job, void *data);
+
+
+
+static void
+free_roots(struct walk_root *roots, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		free((char *) roots[i].src);
+		free((char *) roots[i].dest);
+	}
+	free(roots);
+}
+
+
+
+static struct sandbox *
+open_sandbox(const struct indexer *indexer, const char *self,
+		const struct indexer_options *options)
+{
+	struct sandbox *sandbox;
+	char *dir, *helper;
+
+	/* installed with the plugins, next to the daemon when built */
+	helper = g_build_filename(indexer->plugin_dir, SANDBOX_HELPER, NULL);
+	if (! g_file_test(helper, G_FILE_TEST_IS_EXECUTABLE) &&
+			strchr(self, '/')) {
+		g_free(helper);
+		dir = g_path_get_dirname(self);
+		helper = g_build_filename(dir, SANDBOX_HELPER, NULL);
+		g_free(dir);
+	}
+	if (! g_file_test(helper, G_FILE_TEST_IS_EXECUTABLE)) {
+		g_free(helper);
+		helper = g_find_program_in_path(SANDBOX_HELPER);
+	}
+	if (! helper) {
+		fprintf(stderr, "%s: not found in %s or in PATH\n",
+				SANDBOX_HELPER, indexer->plugin_dir);
+		return NULL;
+	}
+
+	/* one reader per indexing thread, so none has to wait */
+	sandbox = sandbox_new(helper, indexer->plugin_dir,
+			options && options->workers ?
+				options->workers : DEFAULT_WORKERS,
+			options ? options->reader_timeout_s : 0);
+	g_free(helper);
+
+	return sandbox;
 }
 
 
 
 struct indexer *
 indexer_init(const char *self, const char *plugin_dir,
-		const char *thumb_dir, const char *conffile)
+		const char *thumb_dir, const char *conffile,
+		const struct indexer_options *options)
 {
 	struct indexer *indexer;
 	struct thumbnailer *thumbconf;
+	char *index_fn;
+	int added;
 
 	/* init threads as plugins may need that */
 	if (! g_thread_supported()) {
@@ -241,6 +546,24 @@ indexer_init(const char *self, const char *plugin_dir,
 		return NULL;
 	}
 	indexer->thumbconf = thumbconf;
+	g_static_rw_lock_init(&indexer->reload_lock);
+
+	/* nothing is writing thumbnails yet */
+	thumbnail_remove_leftovers(thumbconf);
+	indexer->writeback = writeback_new(
+			options && options->durability >= 0 ?
+				options->durability : WRITEBACK_BATCH,
+			COMMIT_BATCH_LEN, COMMIT_DELAY_MS);
+	thumbnail_set_writeback(thumbconf, indexer->writeback);
+
+	index_fn = g_strdup_printf("%s/%s", thumb_dir, INDEX_FILE);
+	indexer->index = mediaindex_open(index_fn);
+	if (! indexer->index) {
+		fprintf(stderr, "%s: not usable, all files will be indexed\n",
+				index_fn);
+	}
+	g_free(index_fn);
+	indexer->stats = pluginstats_new(indexer->index);
 
 	/* save plugin_dir to allow rereading upon SIGHUP */
 	if (plugin_dir) {
@@ -248,15 +571,35 @@ indexer_init(const char *self, const char *plugin_dir,
 	} else {
 		indexer->plugin_dir = strdup(DEFAULT_PLUGIN_DIR);
 	}
-	if (! indexer->plugin_dir) {
+	indexer->self = strdup(self);
+	indexer->thumb_dir = strdup(thumb_dir);
+	conffile = conffile ? : getenv("INDEXER_RC");
+	indexer->conffile = conffile ? strdup(conffile) : NULL;
+	if (! indexer->plugin_dir || ! indexer->self || ! indexer->thumb_dir) {
+		free(indexer->plugin_dir);
+		free(indexer->self);
+		free(indexer->thumb_dir);
+		free(indexer->conffile);
 		free(indexer);
 		return NULL;
 	}
 
+	indexer->sandbox = NULL;
+	if (! options || ! options->in_process) {
+		indexer->sandbox = open_sandbox(indexer, self, options);
+		if (! indexer->sandbox) {
+			fprintf(stderr, "failed to start reader processes, "
+					"running reader plugins in process!\n");
+		}
+	}
+
+	/* into the daemon only to run them here */
 	indexer->plugins = NULL;
 	indexer->count = indexer->size = 0;
+	indexer->dispatch = NULL;
 
-	open_plugins(indexer, self);
+	/* without the directory there are just no plugins, until a reload */
+	open_plugins(indexer, self, NULL, 0, &added);
 
 	indexer->magic = magic_open(MAGIC_SYMLINK | MAGIC_MIME |
 			MAGIC_CONTINUE | MAGIC_PRESERVE_ATIME);
@@ -270,6 +613,33 @@ indexer_init(const char *self, const char *plugin_dir,
 			indexer->magic = NULL;
 		}
 	}
+	indexer->magic_lock = g_mutex_new();
+
+	indexer->scan_lock = g_mutex_new();
+	indexer->scan_thread = NULL;
+	indexer->scan_roots = NULL;
+	indexer->n_scan_roots = 0;
+	indexer->scanning = indexer->scan_again = indexer->scan_stop = 0;
+
+	indexer->lazy_lock = g_mutex_new();
+	indexer->lazy_done = g_cond_new();
+	indexer->lazy_requests = g_hash_table_new_full(g_str_hash, g_str_equal,
+			g_free, g_free);
+	indexer->lazy_timeout_ms = options && options->lazy_timeout_ms > 0 ?
+		options->lazy_timeout_ms : DEFAULT_LAZY_TIMEOUT_MS;
+
+	indexer->queue = jobqueue_new(
+			options && options->workers ?
+				options->workers : DEFAULT_WORKERS,
+			options && options->queue_len ?
+				options->queue_len : DEFAULT_QUEUE_LEN,
+			options && options->debounce_ms >= 0 ?
+				options->debounce_ms : DEFAULT_DEBOUNCE_MS,
+			run_job, indexer);
+	if (! indexer->queue || ! indexer->dispatch) {
+		indexer_free(indexer);
+		return NULL;
+	}
 
 	return indexer;
 }
@@ -279,54 +649,46 @@ indexer_init(const char *self, const char *plugin_dir,
 void
 indexer_free(struct indexer *indexer)
 {
-	thumbnail_uninit(indexer->thumbconf);
-
 	if (indexer == NULL) {
 		return;
 	}
 
+	/* a scan is given up, it would only queue more work */
+	indexer->scan_stop = 1;
+	jobqueue_stop_low(indexer->queue);
+	if (indexer->scan_thread) {
+		g_thread_join(indexer->scan_thread);
+	}
+	free_roots(indexer->scan_roots, indexer->n_scan_roots);
+	g_mutex_free(indexer->scan_lock);
+
+	/* finish queued jobs before tearing down what they use */
+	jobqueue_free(indexer->queue);
+	g_hash_table_destroy(indexer->lazy_requests);
+	g_cond_free(indexer->lazy_done);
+	g_mutex_free(indexer->lazy_lock);
+	sandbox_free(indexer->sandbox);
+	writeback_free(indexer->writeback);
+
+	thumbnail_uninit(indexer->thumbconf);
+	pluginstats_free(indexer->stats);
+	mediaindex_close(indexer->index);
+
 	if (indexer->magic) {
 		magic_close(indexer->magic);
 	}
+	g_mutex_free(indexer->magic_lock);
+	free(indexer->self);
 	free(indexer->plugin_dir);
+	free(indexer->thumb_dir);
+	free(indexer->conffile);
 	free_plugins(indexer);
+	g_static_rw_lock_free(&indexer->reload_lock);
 	free(indexer);
 }
 
 
 
-static int
-match_mime(const char *pattern, const char *mime)
-{
-	int patlen = strlen(pattern);
-
-#if 0
-	fprintf(stderr, "match_mime: pattern=\"%s\" mime=\"%s\"\n",
-			pattern, mime);
-#endif
-	if (pattern[patlen - 1] == '*') {
-		if (strlen(mime) >= patlen - 1 &&
-				strncasecmp(mime, pattern, patlen - 1) == 0) {
-			return 1;
-		}
-	} else if (pattern[0] == '*') {
-		int mimelen = strlen(mime);
-		if (mimelen >= patlen - 1) {
-			if (strcasecmp(mime + mimelen - patlen + 1,
-						pattern + 1)) {
-				return 1;
-			}
-		}
-	} else {
-		if (strcasecmp(mime, pattern) == 0) {
-			return 1;
-		}
-	}
-	return 0;
-}
-
-
-
 static const StorageType
 get_pixel_storage_type(enum plugin_reply_pixel_type type, int other)
 {
@@ -354,26 +716,30 @@ get_pixel_storage_type(enum plugin_reply_pixel_type type, int other)
 
 static int
 create_thumbnails(const struct indexer *indexer, struct plugin_reply *reply,
-		const char *fn)
+		const char *fn, const struct stat *st, const char *profile)
 {
 	switch (reply->type) {
 		case PLUGIN_REPLY_TYPE_IMAGE:
 			return thumbnail_make_all_from_image(indexer->thumbconf,
-					(Image *) reply->data, fn);
+					(Image *) reply->data, fn, st,
+					profile);
 			break;
 		case PLUGIN_REPLY_TYPE_IMAGE_FILE_DATA:
 			return thumbnail_make_all_from_data(indexer->thumbconf,
-					reply->data, reply->data_len, fn);
+					reply->data, reply->data_len, fn, st,
+					profile);
 			break;
 		case PLUGIN_REPLY_TYPE_RAW_PIXELS:
 			return thumbnail_make_all_from_raw(indexer->thumbconf,
 					reply->data,
 					reply->width, reply->height,
+					reply->original_width,
+					reply->original_height,
 					reply->pixel_format,
 					get_pixel_storage_type(
 						reply->pixel_type,
 						reply->pixel_type_other),
-					fn);
+					fn, st, profile);
 			break;
 
 		default:
@@ -386,26 +752,147 @@ create_thumbnails(const struct indexer *indexer, struct plugin_reply *reply,
 
 
 
+static const unsigned char *
+get_header(struct attempt *attempt, size_t *len)
+{
+	int fd;
+
+	if (attempt->header_len < 0) {
+		attempt->header_len = 0;
+		fd = open(attempt->fn, O_RDONLY | O_CLOEXEC);
+		if (fd >= 0) {
+			attempt->header_len = pread(fd, attempt->header,
+					sizeof(attempt->header), 0);
+			if (attempt->header_len < 0) {
+				attempt->header_len = 0;
+			}
+			close(fd);
+		}
+	}
+
+	*len = attempt->header_len;
+	return attempt->header;
+}
+
+
+
+/* 0 if plugin i made an image of the file, key being what it was picked by */
+static int
+call_plugin(struct indexer *indexer, struct attempt *attempt, int i,
+		const char *key, struct plugin_reply *reply)
+{
+	struct indexer_plugin *plugin = indexer->plugins[i];
+	const unsigned char *header;
+	size_t len;
+	GTimer *timer;
+	int width, height;
+	int r;
+
+	/* readers probe themselves */
+	if (! indexer->sandbox && plugin->plugin.probe) {
+		header = get_header(attempt, &len);
+		g_mutex_lock(plugin->lock);
+		r = plugin->plugin.probe(plugin->plugin.ctx, attempt->fn,
+				header, len);
+		g_mutex_unlock(plugin->lock);
+		if (r) {
+			fprintf(stdout, "%s declined\n", plugin->name);
+			attempt->tried[i] = PROBE_DECLINED;
+			return 1;
+		}
+	}
+
+	/* no bigger than the largest thumbnail needs */
+	thumbnail_request_size(indexer->thumbconf, attempt->profile, &width,
+			&height);
+	memset(reply, 0, sizeof(struct plugin_reply));
+	reply->request_flags = PLUGIN_REQUEST_DOWNSCALE;
+
+	timer = g_timer_new();
+	if (indexer->sandbox) {
+		/* each reader process has its own instance of the plugin */
+		r = sandbox_get_image(indexer->sandbox, plugin->name,
+				attempt->fn, width, height, reply);
+		if (r == SANDBOX_DECLINED) {
+			g_timer_destroy(timer);
+			fprintf(stdout, "%s declined\n", plugin->name);
+			attempt->tried[i] = PROBE_DECLINED;
+			return 1;
+		}
+	} else {
+		g_mutex_lock(plugin->lock);
+		r = plugin->plugin.get_image(plugin->plugin.ctx, attempt->fn,
+				width, height, reply);
+		g_mutex_unlock(plugin->lock);
+	}
+	pluginstats_record(indexer->stats, plugin->name, key, r == 0,
+			g_timer_elapsed(timer, NULL) * 1000);
+	g_timer_destroy(timer);
+
+	attempt->tried[i] = r;
+	if (! r) {
+		fprintf(stdout, "processed with %s\n", plugin->name);
+		attempt->used = i;
+	}
+	return r;
+}
+
+
+
+/*
+ * The candidates not tried yet, cheapest first going by how they did with
+ * files of this key. Those never tried on one come first, so that each gets a
+ * chance; ties keep the order of the list.
+ */
 static int
-try_index_mime(struct indexer *indexer, int *plugins, const char *fn,
-		struct plugin_reply *reply)
+order_candidates(struct indexer *indexer, const struct attempt *attempt,
+		const int *list, const char *key, int *order)
+{
+	double *cost;
+	double c;
+	int n = 0;
+	int i, j;
+
+	cost = alloca(indexer->count * sizeof(double));
+	for (; *list >= 0; list++) {
+		if (attempt->tried[*list]) {
+			continue;
+		}
+		c = pluginstats_cost(indexer->stats,
+				indexer->plugins[*list]->name, key);
+		for (j = n; j > 0 && cost[j - 1] > c; j--) {
+			cost[j] = cost[j - 1];
+			order[j] = order[j - 1];
+		}
+		cost[j] = c;
+		order[j] = *list;
+		n++;
+	}
+
+	return n;
+}
+
+
+
+static int
+try_index_mime(struct indexer *indexer, struct attempt *attempt,
+		struct plugin_reply *reply, char *mime)
 {
 	const char *mime_raw;
-#define MIME_LEN 64
-	char mime[MIME_LEN + 1];
 	char *ptr;
-	const char **s;
-	int i;
-
-	mime_raw = magic_file(indexer->magic, fn);
-	if (! mime_raw) {
-		return 0;
-	}
-	if (strlen(mime_raw) > MIME_LEN) {
+	int *order;
+	int i, n;
+
+	/* libmagic is not thread safe and reuses its result buffer */
+	g_mutex_lock(indexer->magic_lock);
+	mime_raw = magic_file(indexer->magic, attempt->fn);
+	if (! mime_raw || strlen(mime_raw) > MIME_LEN) {
+		g_mutex_unlock(indexer->magic_lock);
 		return 0;
 	}
 	strncpy(mime, mime_raw, MIME_LEN);
 	mime[MIME_LEN] = '\0';
+	g_mutex_unlock(indexer->magic_lock);
 
 	/* strip extra attributes */
 	ptr = strchr(mime, ' ');
@@ -417,26 +904,15 @@ try_index_mime(struct indexer *indexer, int *plugins, const char *fn,
 		*ptr = '\0';
 	}
 
-	for (i = 0; i < indexer->count; i++) {
-		struct plugin *plugin = &indexer->plugins[i]->plugin;
-		if (plugins[i]) {
-			continue;
-		}
-
-		for (s = indexer->plugins[i]->mime; *s != NULL; s++) {
-			if (! match_mime(*s, mime)) {
-				continue;
-			}
-			plugins[i] = 1;
-			fprintf(stdout, "trying %s (mime type %s matches %s)\n",
-					indexer->plugins[i]->name, mime, *s);
-
-			if (! plugin->get_image(plugin->ctx, fn, 1024, 1024,
-						reply)) {
-				fprintf(stdout, "processed with %s\n",
-						indexer->plugins[i]->name);
-				return 1;
-			}
+	order = alloca(indexer->count * sizeof(int));
+	n = order_candidates(indexer, attempt,
+			dispatch_lookup_mime(indexer->dispatch, mime), mime,
+			order);
+	for (i = 0; i < n; i++) {
+		fprintf(stdout, "trying %s (mime type %s)\n",
+				indexer->plugins[order[i]]->name, mime);
+		if (! call_plugin(indexer, attempt, order[i], mime, reply)) {
+			return 1;
 		}
 	}
 	fprintf(stdout, "no parser found for mime type %s\n", mime);
@@ -447,70 +923,66 @@ try_index_mime(struct indexer *indexer, int *plugins, const char *fn,
 
 
 static int
-try_index_suffix(struct indexer *indexer, int *plugins, const char *fn,
+try_index_suffix(struct indexer *indexer, struct attempt *attempt,
 		struct plugin_reply *reply)
 {
 	const char *t, *suffix;
-	int i;
+	char *key;
+	int *order;
+	int i, n;
+	int ok = 0;
 
-	t = strrchr(fn, (int) '/');
-	if (t == fn || t[1] == '\0') {
+	t = strrchr(attempt->fn, (int) '/');
+	if (t == attempt->fn || t[1] == '\0') {
 		return 0;
 	}
-	suffix = strrchr(fn, (int) '.');
+	suffix = strrchr(attempt->fn, (int) '.');
 	if (suffix == NULL || suffix < t) {
 		return 0;
 	}
+	key = g_ascii_strdown(suffix, -1);
 	suffix++;
 
-	for (i = 0; i < indexer->count; i++) {
-		struct indexer_plugin *plugin = indexer->plugins[i];
-		const char **s;
-
-		if (plugins[i] || plugin->suffix == NULL) {
-			continue;
-		}
-
-		for (s = plugin->suffix; *s != NULL; s++) {
-			if (strcasecmp(*s, suffix) != 0) {
-				continue;
-			}
-
-			plugins[i] = 1;
-			fprintf(stdout, "trying %s (suffix %s matches %s)\n",
-					indexer->plugins[i]->name, suffix, *s);
-			if (! plugin->plugin.get_image(plugin->plugin.ctx,
-						fn, 1024, 1024, reply)) {
-				fprintf(stdout, "processed with %s\n",
-						indexer->plugins[i]->name);
-				return 1;
-			}
-		}
+	order = alloca(indexer->count * sizeof(int));
+	n = order_candidates(indexer, attempt,
+			dispatch_lookup_suffix(indexer->dispatch, suffix), key,
+			order);
+	for (i = 0; i < n && ! ok; i++) {
+		fprintf(stdout, "trying %s (suffix %s)\n",
+				indexer->plugins[order[i]]->name, suffix);
+		ok = ! call_plugin(indexer, attempt, order[i], key, reply);
+	}
+	if (! ok) {
+		fprintf(stdout, "no parser found for file suffix %s\n",
+				suffix);
 	}
-	fprintf(stdout, "no parser found for file suffix %s\n", suffix);
+	g_free(key);
 
-	return 0;
+	return ok;
 }
 
 
 
 #ifdef TRY_ALL_PLUGINS
 static int
-try_index_all_plugins(struct indexer *indexer, int *plugins, const char *fn,
+try_index_all_plugins(struct indexer *indexer, struct attempt *attempt,
 		struct plugin_reply *reply)
 {
-	int i;
+	int *all, *order;
+	int i, n;
 
+	all = alloca((indexer->count + 1) * sizeof(int));
 	for (i = 0; i < indexer->count; i++) {
-		struct plugin *plugin = &indexer->plugins[i]->plugin;
-		if (plugins[i]) {
-			continue;
-		}
-		plugins[i] = 1;
-		fprintf(stdout, "trying %s\n", indexer->plugins[i]->name);
-		if (! plugin->get_image(plugin->ctx, fn, 1024, 1024, reply)) {
-			fprintf(stdout, "processed with %s\n",
-					indexer->plugins[i]->name);
+		all[i] = i;
+	}
+	all[i] = -1;
+
+	order = alloca(indexer->count * sizeof(int));
+	n = order_candidates(indexer, attempt, all, "*", order);
+	for (i = 0; i < n; i++) {
+		fprintf(stdout, "trying %s\n",
+				indexer->plugins[order[i]]->name);
+		if (! call_plugin(indexer, attempt, order[i], "*", reply)) {
 			return 1;
 		}
 	}
@@ -521,59 +993,1015 @@ try_index_all_plugins(struct indexer *indexer, int *plugins, const char *fn,
 
 
 
-int
-indexer_process(struct indexer *indexer, const char *src, const char *dest)
+/* 1 if a plugin made an image of the file into reply */
+static int
+read_image(struct indexer *indexer, struct attempt *attempt,
+		struct plugin_reply *reply, char *mime)
 {
-	struct plugin_reply reply;
-	int *tried;
 	int ok = 0;
 
-	fprintf(stdout, "processing %s (%s)\n", dest, src);
-
-	tried = alloca(indexer->count * sizeof(int));
-	memset(tried, 0, indexer->count * sizeof(int));
-
-	reply.free = NULL;
-
 	if (indexer->magic) {
-		ok = try_index_mime(indexer, tried, src, &reply);
+		ok = try_index_mime(indexer, attempt, reply, mime);
 	}
 	if (! ok) {
-		ok = try_index_suffix(indexer, tried, src, &reply);
+		ok = try_index_suffix(indexer, attempt, reply);
 	}
 #ifdef TRY_ALL_PLUGINS
 	if (! ok) {
-		ok = try_index_all_plugins(indexer, tried, src, &reply);
+		ok = try_index_all_plugins(indexer, attempt, reply);
 	}
 #endif
 
-	if (ok) {
-		int ret = create_thumbnails(indexer, &reply, dest);
-		if (reply.free) {
-			reply.free(&reply);
-		}
-		if (ret == 0) {
-			return 0;
-		}
+	return ok;
+}
+
+
+
+static void
+entry_from_stat(const struct stat *st, struct media_entry *entry)
+{
+	memset(entry, 0, sizeof(struct media_entry));
+	entry->dev = st->st_dev;
+	entry->ino = st->st_ino;
+	entry->size = st->st_size;
+	entry->mtime = (int64_t) st->st_mtim.tv_sec * 1000000000 +
+		st->st_mtim.tv_nsec;
+}
+
+
+
+/*
+ * Whether the thumbnails of dest are still those of src as it is now, going
+ * by the index. With @contents, a file small enough to be fingerprinted that
+ * was only touched or written again with the same contents just gets its
+ * entry updated; the fingerprint of src is filled in if it had to be computed.
+ */
+static int
+is_current(struct indexer *indexer, const char *src, const char *dest,
+		struct media_entry *entry, int contents)
+{
+	struct media_entry old;
+	int ret = 0;
+
+	if (mediaindex_lookup(indexer->index, dest, &old)) {
+		return 0;
 	}
 
-	thumbnail_delete_all(indexer->thumbconf, dest);
-	return 1;
+	if (! old.profiles || strcmp(old.profiles,
+				thumbnail_profiles(indexer->thumbconf)) ||
+			! thumbnail_exist_all(indexer->thumbconf, dest)) {
+		/* redo them */
+	} else if (old.dev == entry->dev && old.ino == entry->ino &&
+			old.size == entry->size && old.mtime == entry->mtime) {
+		ret = 1;
+	} else if (contents && old.size == entry->size &&
+			old.fingerprint[0] != '\0' &&
+			! mediaindex_fingerprint(src, entry->size,
+				entry->fingerprint) &&
+			strcmp(old.fingerprint, entry->fingerprint) == 0) {
+		entry->mime = old.mime;
+		entry->width = old.width;
+		entry->height = old.height;
+		entry->plugin = old.plugin;
+		entry->profiles = old.profiles;
+		old.mime = old.plugin = old.profiles = NULL;
+		mediaindex_store(indexer->index, dest, entry);
+		ret = 1;
+	}
+
+	media_entry_clear(&old);
+	return ret;
 }
 
 
 
-int
-indexer_rename(struct indexer *indexer, const char *old_path,
-		const char *new_path)
+/* whether file is known to fail and not due for another try yet */
+static int
+is_failing(struct indexer *indexer, const struct media_entry *entry)
 {
-	return thumbnail_rename_all(indexer->thumbconf, old_path, new_path);
+	struct media_failure failure;
+	int ret;
+
+	if (mediaindex_lookup_failure(indexer->index, entry, &failure)) {
+		return 0;
+	}
+	ret = failure.retry_at > time(NULL);
+	media_failure_clear(&failure);
+
+	return ret;
 }
 
 
 
-int
-indexer_remove(struct indexer *indexer, const char *path)
+static const char *
+describe_status(int status)
+{
+	switch (status) {
+		case SANDBOX_CRASHED:
+			return "crashed";
+		case SANDBOX_TIMED_OUT:
+			return "timed out";
+		case PROBE_DECLINED:
+			return "declined";
+		default:
+			return "failed";
+	}
+}
+
+
+
+static char *
+describe_failure(const struct indexer *indexer,
+		const struct attempt *attempt, const char *mime)
 {
-	return thumbnail_delete_all(indexer->thumbconf, path);
+	const int *tried = attempt->tried;
+	int used = attempt->used;
+	GString *reason;
+	int i;
+
+	reason = g_string_new(NULL);
+	for (i = 0; i < indexer->count; i++) {
+		if (tried[i]) {
+			g_string_append_printf(reason, "%s%s %s",
+					reason->len ? ", " : "",
+					indexer->plugins[i]->name,
+					describe_status(tried[i]));
+		}
+	}
+	if (used >= 0) {
+		g_string_append_printf(reason, "%sno thumbnails from %s",
+				reason->len ? ", " : "",
+				indexer->plugins[used]->name);
+	}
+	if (! reason->len) {
+		g_string_append_printf(reason, "no plugin for %s",
+				mime[0] ? mime : "this type");
+	}
+
+	return g_string_free(reason, FALSE);
+}
+
+
+
+/*
+ * Remember that this version of the file could not be done, so that it is
+ * not probed and decoded again and again until it changes.
+ */
+static void
+record_failure(struct indexer *indexer, const char *dest,
+		const struct media_entry *entry, int attempts,
+		const struct attempt *attempt, const char *mime)
+{
+	struct media_failure failure;
+	int64_t delay = FAILURE_RETRY_S;
+	int i;
+
+	for (i = 1; i < attempts && delay < FAILURE_RETRY_MAX_S; i++) {
+		delay *= 2;
+	}
+	if (delay > FAILURE_RETRY_MAX_S) {
+		delay = FAILURE_RETRY_MAX_S;
+	}
+
+	failure.attempts = attempts;
+	failure.retry_at = time(NULL) + delay;
+	failure.reason = describe_failure(indexer, attempt, mime);
+	fprintf(stdout, "%s: %s, not trying again for %d s\n", dest,
+			failure.reason, (int) delay);
+
+	mediaindex_store_failure(indexer->index, entry, &failure);
+	g_free(failure.reason);
+}
+
+
+
+/* of the image as stored, rather than as decoded */
+static void
+get_reply_dimensions(const struct plugin_reply *reply, int *width,
+		int *height)
+{
+	const Image *image = reply->data;
+	unsigned long w = 0, h = 0;
+
+	switch (reply->type) {
+		case PLUGIN_REPLY_TYPE_IMAGE:
+			w = image->columns;
+			h = image->rows;
+			thumbnail_original_size(image->magick_columns,
+					image->magick_rows, &w, &h);
+			break;
+		case PLUGIN_REPLY_TYPE_RAW_PIXELS:
+			w = reply->width;
+			h = reply->height;
+			thumbnail_original_size(reply->original_width,
+					reply->original_height, &w, &h);
+			break;
+		default:
+			/* not known without decoding the data */
+			break;
+	}
+	*width = w;
+	*height = h;
+}
+
+
+
+static int
+process_file(struct indexer *indexer, const char *src, const char *dest)
+{
+	struct plugin_reply reply;
+	struct media_entry entry;
+	struct media_failure failure;
+	struct attempt attempt;
+	struct stat st;
+	int have_stat;
+	char mime[MIME_LEN + 1] = "";
+	int attempts = 0;
+	int have_entry = 0;
+	int ok = 0;
+
+	fprintf(stdout, "processing %s (%s)\n", dest, src);
+
+	memset(&entry, 0, sizeof(entry));
+	/* what the thumbnails say of the file, as the mount shows it */
+	have_stat = ! stat(src, &st);
+	if (indexer->index && have_stat) {
+		entry_from_stat(&st, &entry);
+		if (is_current(indexer, src, dest, &entry, 1)) {
+			fprintf(stdout, "%s has not changed\n", dest);
+			media_entry_clear(&entry);
+			return 0;
+		}
+		if (! mediaindex_lookup_failure(indexer->index, &entry,
+					&failure)) {
+			attempts = failure.attempts;
+			if (failure.retry_at > time(NULL)) {
+				fprintf(stdout, "%s failed before (%s), "
+						"not trying again yet\n",
+						dest, failure.reason ? : "");
+				media_failure_clear(&failure);
+				return 0;
+			}
+			media_failure_clear(&failure);
+		}
+		have_entry = 1;
+	}
+
+	attempt.fn = src;
+	attempt.profile = NULL;
+	attempt.tried = alloca(indexer->count * sizeof(int));
+	memset(attempt.tried, 0, indexer->count * sizeof(int));
+	attempt.used = -1;
+	attempt.header_len = -1;
+
+	reply.free = NULL;
+
+	ok = read_image(indexer, &attempt, &reply, mime);
+	if (ok) {
+		int ret;
+
+		if (have_entry) {
+			get_reply_dimensions(&reply, &entry.width,
+					&entry.height);
+		}
+		ret = create_thumbnails(indexer, &reply, dest,
+				have_stat ? &st : NULL, NULL);
+		if (reply.free) {
+			reply.free(&reply);
+		}
+		if (ret == 0) {
+			if (have_entry) {
+				if (! entry.fingerprint[0]) {
+					mediaindex_fingerprint(src, entry.size,
+							entry.fingerprint);
+				}
+				entry.mime = mime[0] ? strdup(mime) : NULL;
+				entry.plugin = strdup(
+					indexer->plugins[attempt.used]->name);
+				entry.profiles = strdup(thumbnail_profiles(
+							indexer->thumbconf));
+				mediaindex_store(indexer->index, dest, &entry);
+				media_entry_clear(&entry);
+			}
+			return 0;
+		}
+	}
+
+	if (have_entry) {
+		record_failure(indexer, dest, &entry, attempts + 1, &attempt,
+				mime);
+		media_entry_clear(&entry);
+	}
+	if (indexer->index) {
+		mediaindex_remove(indexer->index, dest);
+	}
+	/* they may be among those waiting to be put in place */
+	writeback_commit(indexer->writeback);
+	thumbnail_delete_all(indexer->thumbconf, dest);
+	/* no plugin could handle it, rather than writing failing */
+	if (! ok) {
+		thumbnail_mark_failed(indexer->thumbconf, dest,
+				have_stat ? &st : NULL);
+	}
+	return 1;
+}
+
+
+
+/*
+ * The thumbnail of a lazy profile a reader is waiting for, and nothing else:
+ * the index already has the file, and a failure tells only the reader.
+ */
+static int
+make_lazy(struct indexer *indexer, const char *src, const char *dest,
+		const char *profile)
+{
+	struct plugin_reply reply;
+	struct attempt attempt;
+	struct stat st;
+	char mime[MIME_LEN + 1] = "";
+	int err = EIO;
+
+	fprintf(stdout, "making %s thumbnail of %s (%s)\n", profile, dest,
+			src);
+	if (stat(src, &st)) {
+		return errno;
+	}
+
+	attempt.fn = src;
+	attempt.profile = profile;
+	attempt.tried = alloca(indexer->count * sizeof(int));
+	memset(attempt.tried, 0, indexer->count * sizeof(int));
+	attempt.used = -1;
+	attempt.header_len = -1;
+
+	reply.free = NULL;
+
+	if (read_image(indexer, &attempt, &reply, mime)) {
+		if (! create_thumbnails(indexer, &reply, dest, &st, profile)) {
+			err = 0;
+		}
+		if (reply.free) {
+			reply.free(&reply);
+		}
+	}
+
+	return err;
+}
+
+
+
+static char *
+lazy_key(const char *profile, const char *path)
+{
+	return g_strconcat(profile, ":", path, NULL);
+}
+
+
+
+/* wakes up the readers waiting for it, if any are left */
+static void
+finish_lazy(struct indexer *indexer, const char *profile, const char *path,
+		int err)
+{
+	struct lazy_request *request;
+	char *key;
+
+	key = lazy_key(profile, path);
+	g_mutex_lock(indexer->lazy_lock);
+	request = g_hash_table_lookup(indexer->lazy_requests, key);
+	if (request) {
+		request->done = 1;
+		request->err = err;
+		if (! request->waiters) {
+			g_hash_table_remove(indexer->lazy_requests, key);
+		}
+		g_cond_broadcast(indexer->lazy_done);
+	}
+	g_mutex_unlock(indexer->lazy_lock);
+	g_free(key);
+}
+
+
+
+/*
+ * Thumbnails are named after the URI of their file, so those of every file
+ * within a renamed directory have to be moved one by one. The directory is
+ * walked under its new name, src.
+ */
+static void
+rename_tree(struct indexer *indexer, const char *src, const char *old_path,
+		const char *new_path)
+{
+	DIR *dir;
+	struct dirent *ent;
+
+	dir = opendir(src);
+	if (! dir) {
+		fprintf(stderr, "%s: cannot read\n", src);
+		return;
+	}
+
+	while ((ent = readdir(dir))) {
+		char *child_src, *child_old, *child_new;
+		int is_dir;
+
+		if (strcmp(ent->d_name, ".") == 0 ||
+				strcmp(ent->d_name, "..") == 0) {
+			continue;
+		}
+
+		child_src = g_strdup_printf("%s/%s", src, ent->d_name);
+		child_old = g_strdup_printf("%s/%s", old_path, ent->d_name);
+		child_new = g_strdup_printf("%s/%s", new_path, ent->d_name);
+
+		is_dir = ent->d_type == DT_DIR;
+		if (ent->d_type == DT_UNKNOWN) {
+			struct stat st;
+			is_dir = lstat(child_src, &st) == 0 && S_ISDIR(st.st_mode);
+		}
+
+		if (is_dir) {
+			rename_tree(indexer, child_src, child_old, child_new);
+		} else {
+			thumbnail_rename_all(indexer->thumbconf, child_old,
+					child_new);
+		}
+
+		g_free(child_src);
+		g_free(child_old);
+		g_free(child_new);
+	}
+	closedir(dir);
+}
+
+
+
+static void
+collect_path(const char *path, void *data)
+{
+	GSList **paths = data;
+
+	*paths = g_slist_prepend(*paths, g_strdup(path));
+}
+
+
+
+/*
+ * Entries within a removed directory, left behind by missed removals, go
+ * with their thumbnails: orphans are only ever found through the index.
+ */
+static void
+remove_dir_entries(struct indexer *indexer, const char *path)
+{
+	GSList *paths = NULL, *l;
+
+	mediaindex_foreach_within(indexer->index, path, collect_path, &paths);
+	for (l = paths; l; l = l->next) {
+		thumbnail_delete_all(indexer->thumbconf, l->data);
+		g_free(l->data);
+	}
+	g_slist_free(paths);
+
+	mediaindex_remove_dir(indexer->index, path);
+}
+
+
+
+static void
+run_job(const struct job *job, void *data)
+{
+	struct indexer *indexer = data;
+
+	g_static_rw_lock_reader_lock(&indexer->reload_lock);
+	/* thumbnails moved or removed must not be waiting to be put in place */
+	if (job->type != JOB_INDEX && job->type != JOB_THUMBNAIL) {
+		writeback_commit(indexer->writeback);
+	}
+	switch (job->type) {
+		case JOB_INDEX:
+			if (process_file(indexer, job->src, job->path)) {
+				fprintf(stderr, "indexing %s (%s) failed\n",
+						job->path, job->src);
+			}
+			writeback_job_done(indexer->writeback);
+			break;
+		case JOB_RENAME:
+			thumbnail_rename_all(indexer->thumbconf,
+					job->path, job->new_path);
+			if (indexer->index) {
+				mediaindex_rename(indexer->index, job->path,
+						job->new_path);
+			}
+			break;
+		case JOB_REMOVE:
+			thumbnail_delete_all(indexer->thumbconf, job->path);
+			if (indexer->index) {
+				mediaindex_remove(indexer->index, job->path);
+			}
+			break;
+		case JOB_RENAME_DIR:
+			fprintf(stdout, "moving thumbnails from %s to %s\n",
+					job->path, job->new_path);
+			rename_tree(indexer, job->src, job->path, job->new_path);
+			if (indexer->index) {
+				mediaindex_rename_dir(indexer->index, job->path,
+						job->new_path);
+			}
+			break;
+		case JOB_REMOVE_DIR:
+			/*
+			 * Only empty directories can be removed, the thumbnails
+			 * of their files went with them one by one. Pending
+			 * index jobs within were cancelled when this was queued.
+			 * Entries left behind by missed removals go now.
+			 */
+			if (indexer->index) {
+				remove_dir_entries(indexer, job->path);
+			}
+			break;
+		case JOB_THUMBNAIL:
+			finish_lazy(indexer, job->new_path, job->path,
+					make_lazy(indexer, job->src, job->path,
+						job->new_path));
+			break;
+	}
+	g_static_rw_lock_reader_unlock(&indexer->reload_lock);
+}
+
+
+
+/* called by the walking threads */
+static void
+scan_file(const char *src, const char *dest, const struct stat *st,
+		void *data)
+{
+	struct indexer *indexer = data;
+	struct media_entry entry;
+	int current;
+
+	/* not held while pushing, which waits for the jobs to make room */
+	g_static_rw_lock_reader_lock(&indexer->reload_lock);
+
+	/* without the index only missing thumbnails can be told */
+	if (indexer->index) {
+		entry_from_stat(st, &entry);
+		current = is_current(indexer, src, dest, &entry, 0) ||
+			is_failing(indexer, &entry);
+	} else {
+		current = thumbnail_exist_all(indexer->thumbconf, dest);
+	}
+	g_static_rw_lock_reader_unlock(&indexer->reload_lock);
+
+	if (! current && ! jobqueue_push_low(indexer->queue, JOB_INDEX, src,
+				dest, NULL)) {
+		g_atomic_int_inc(&indexer->scan_queued);
+	}
+}
+
+
+
+static void
+scan_progress(const struct walk_stats *stats, void *data)
+{
+	struct indexer *indexer = data;
+
+	fprintf(stdout, "reconciling: %d directories, %d files, %d queued\n",
+			stats->dirs, stats->files,
+			g_atomic_int_get(&indexer->scan_queued));
+}
+
+
+
+/*
+ * Forget the files of a tree that are gone: remove jobs are queued for
+ * indexed paths without a source, which keeps them in order with whatever
+ * happens to the paths meanwhile.
+ */
+static int
+remove_orphans(struct indexer *indexer, const struct walk_root *root)
+{
+	GSList *paths = NULL, *l;
+	size_t len = strlen(root->dest);
+	struct stat st;
+	int n = 0;
+
+	mediaindex_foreach_within(indexer->index, root->dest, collect_path,
+			&paths);
+
+	for (l = paths; l; l = l->next) {
+		char *path = l->data;
+		char *src;
+
+		src = g_strdup_printf("%s%s", root->src, path + len);
+		if (! indexer->scan_stop && lstat(src, &st) &&
+				errno == ENOENT &&
+				! jobqueue_push_low(indexer->queue, JOB_REMOVE,
+					NULL, path, NULL)) {
+			n++;
+		}
+		g_free(src);
+		g_free(path);
+	}
+	g_slist_free(paths);
+
+	return n;
+}
+
+
+
+static gpointer
+scan_main(gpointer data)
+{
+	struct indexer *indexer = data;
+	struct walk_stats stats;
+	GTimer *timer;
+	int orphans;
+	int again;
+	int i;
+
+	timer = g_timer_new();
+	do {
+		g_timer_start(timer);
+		g_atomic_int_set(&indexer->scan_queued, 0);
+		fprintf(stdout, "reconciling %d directories\n",
+				indexer->n_scan_roots);
+
+		walk_trees(indexer->scan_roots, indexer->n_scan_roots,
+				SCAN_THREADS, scan_file, scan_progress, indexer,
+				&indexer->scan_stop, &stats);
+
+		orphans = 0;
+		for (i = 0; i < indexer->n_scan_roots && indexer->index; i++) {
+			orphans += remove_orphans(indexer,
+					&indexer->scan_roots[i]);
+		}
+
+		fprintf(stdout, "reconciled %d directories, %d files in %.1f s:"
+				" %d queued, %d orphans, %d errors%s\n",
+				stats.dirs, stats.files,
+				g_timer_elapsed(timer, NULL),
+				g_atomic_int_get(&indexer->scan_queued),
+				orphans, stats.errors,
+				indexer->scan_stop ? " (stopped)" : "");
+
+		g_mutex_lock(indexer->scan_lock);
+		again = indexer->scan_again && ! indexer->scan_stop;
+		indexer->scan_again = 0;
+		if (! again) {
+			indexer->scanning = 0;
+		}
+		g_mutex_unlock(indexer->scan_lock);
+	} while (again);
+	g_timer_destroy(timer);
+
+	return NULL;
+}
+
+
+
+/*
+ * Paths reported by mfuse have repeated and trailing slashes removed, the
+ * paths found by the scan must look the same.
+ */
+static char *
+copy_path(const char *path)
+{
+	char *copy, *p;
+	size_t len;
+
+	copy = strdup(path);
+	if (! copy) {
+		return NULL;
+	}
+	for (p = copy; *p != '\0'; p++) {
+		while (p[0] == '/' && p[1] == '/') {
+			memmove(p, p + 1, strlen(p));
+		}
+	}
+	len = strlen(copy);
+	while (len > 1 && copy[len - 1] == '/') {
+		copy[--len] = '\0';
+	}
+
+	return copy;
+}
+
+
+
+/* a request while a scan is running makes it start over once done */
+int
+indexer_reconcile(struct indexer *indexer, const struct walk_root *roots,
+		int n_roots)
+{
+	struct walk_root *copy;
+	int i;
+
+	g_mutex_lock(indexer->scan_lock);
+	if (indexer->scanning) {
+		indexer->scan_again = 1;
+		g_mutex_unlock(indexer->scan_lock);
+		fprintf(stdout, "reconciling already, will start over\n");
+		return 0;
+	}
+	if (indexer->scan_thread) {
+		/* finished already */
+		g_thread_join(indexer->scan_thread);
+		indexer->scan_thread = NULL;
+	}
+
+	copy = calloc(n_roots, sizeof(struct walk_root));
+	for (i = 0; copy && i < n_roots; i++) {
+		copy[i].src = copy_path(roots[i].src);
+		copy[i].dest = copy_path(roots[i].dest);
+		if (! copy[i].src || ! copy[i].dest) {
+			free_roots(copy, i + 1);
+			copy = NULL;
+		}
+	}
+	if (! copy) {
+		g_mutex_unlock(indexer->scan_lock);
+		fprintf(stderr, "out of memory!\n");
+		return 1;
+	}
+	free_roots(indexer->scan_roots, indexer->n_scan_roots);
+	indexer->scan_roots = copy;
+	indexer->n_scan_roots = n_roots;
+
+	indexer->scanning = 1;
+	indexer->scan_thread = g_thread_create(scan_main, indexer, TRUE, NULL);
+	if (! indexer->scan_thread) {
+		indexer->scanning = 0;
+		g_mutex_unlock(indexer->scan_lock);
+		fprintf(stderr, "cannot create reconciliation thread\n");
+		return 1;
+	}
+	g_mutex_unlock(indexer->scan_lock);
+
+	return 0;
+}
+
+
+
+int
+indexer_process(struct indexer *indexer, const char *src, const char *dest)
+{
+	return jobqueue_push(indexer->queue, JOB_INDEX, src, dest, NULL);
+}
+
+
+
+int
+indexer_rename(struct indexer *indexer, const char *old_path,
+		const char *new_src, const char *new_path)
+{
+	struct stat st;
+
+	if (lstat(new_src, &st) == 0 && S_ISDIR(st.st_mode)) {
+		return jobqueue_push(indexer->queue, JOB_RENAME_DIR, new_src,
+				old_path, new_path);
+	}
+	return jobqueue_push(indexer->queue, JOB_RENAME, new_src, old_path,
+			new_path);
+}
+
+
+
+int
+indexer_remove(struct indexer *indexer, const char *path)
+{
+	return jobqueue_push(indexer->queue, JOB_REMOVE, NULL, path, NULL);
+}
+
+
+
+int
+indexer_remove_dir(struct indexer *indexer, const char *path)
+{
+	return jobqueue_push(indexer->queue, JOB_REMOVE_DIR, NULL, path, NULL);
+}
+
+
+
+/*
+ * Waits for the jobs being run to finish; the next ones wait for the reload
+ * in turn. Plugins whose file did not change are kept loaded as they are.
+ */
+int
+indexer_reload(struct indexer *indexer)
+{
+	struct indexer_plugin **old;
+	struct thumbnailer *thumbconf;
+	struct dispatch *old_dispatch;
+	int n_old, added;
+	int err;
+	int i;
+
+	fprintf(stdout, "reloading plugins and thumbnail configuration\n");
+	thumbconf = thumbnail_init(indexer->self, indexer->thumb_dir,
+			indexer->conffile);
+
+	g_static_rw_lock_writer_lock(&indexer->reload_lock);
+
+	if (thumbconf) {
+		thumbnail_uninit(indexer->thumbconf);
+		indexer->thumbconf = thumbconf;
+		thumbnail_set_writeback(thumbconf, indexer->writeback);
+	} else {
+		fprintf(stderr, "keeping the thumbnail configuration\n");
+	}
+
+	/* readers have the plugins loaded as they were */
+	if (indexer->sandbox) {
+		sandbox_restart(indexer->sandbox);
+	}
+
+	old = indexer->plugins;
+	n_old = indexer->count;
+	old_dispatch = indexer->dispatch;
+	indexer->plugins = NULL;
+	indexer->count = indexer->size = 0;
+	indexer->dispatch = NULL;
+
+	err = open_plugins(indexer, indexer->self, old, n_old, &added);
+	if (err) {
+		/* say mid-upgrade: nothing was taken from old */
+		fprintf(stderr, "keeping the plugins\n");
+		dispatch_free(indexer->dispatch);
+		indexer->plugins = old;
+		indexer->count = indexer->size = n_old;
+		indexer->dispatch = old_dispatch;
+	} else {
+		dispatch_free(old_dispatch);
+		for (i = 0; i < n_old; i++) {
+			if (old[i]) {
+				fprintf(stdout, "unloading %s\n",
+						old[i]->name);
+				free_plugin(old[i]);
+			}
+		}
+		free(old);
+	}
+	/* files no plugin could handle may have one now */
+	if (added && indexer->index) {
+		mediaindex_forget_failures(indexer->index);
+	}
+
+	g_static_rw_lock_writer_unlock(&indexer->reload_lock);
+
+	fprintf(stdout, "%d plugins loaded, %d of them new\n", indexer->count,
+			added);
+
+	return thumbconf && ! err ? 0 : 1;
+}
+
+
+
+void
+indexer_accessed(struct indexer *indexer, const char *path, int is_dir)
+{
+	jobqueue_boost(indexer->queue, path, is_dir);
+}
+
+
+
+/* where the file mirrored at dest is, NULL if under none of the roots */
+static char *
+source_path(struct indexer *indexer, const char *dest)
+{
+	const struct walk_root *root;
+	char *src = NULL;
+	size_t len;
+	int i;
+
+	g_mutex_lock(indexer->scan_lock);
+	for (i = 0; i < indexer->n_scan_roots && ! src; i++) {
+		root = &indexer->scan_roots[i];
+		len = strlen(root->dest);
+		if (! strncmp(dest, root->dest, len) &&
+				(dest[len] == '/' || dest[len] == '\0')) {
+			src = g_strconcat(root->src, dest + len, NULL);
+		}
+	}
+	g_mutex_unlock(indexer->scan_lock);
+
+	return src;
+}
+
+
+
+/*
+ * Readers asking for the same thumbnail meanwhile wait for the same job. One
+ * that gives up leaves it to finish for the next.
+ */
+int
+indexer_make_lazy(struct indexer *indexer, const char *path)
+{
+	char hash[16 * 2 + 1];
+	struct lazy_request *request;
+	const char *name;
+	char *profile = NULL;
+	char *dest = NULL;
+	char *src = NULL;
+	char *key;
+	GTimeVal deadline;
+	int first = 0;
+	int err;
+
+	g_static_rw_lock_reader_lock(&indexer->reload_lock);
+	name = thumbnail_lazy(indexer->thumbconf, path, hash);
+	if (name) {
+		profile = g_strdup(name);
+	}
+	g_static_rw_lock_reader_unlock(&indexer->reload_lock);
+
+	/* only the index knows which file a thumbnail name is of */
+	if (profile && indexer->index &&
+			! mediaindex_lookup_hash(indexer->index, hash, &dest)) {
+		src = source_path(indexer, dest);
+	}
+	if (! src) {
+		g_free(profile);
+		free(dest);
+		return ENOENT;
+	}
+
+	key = lazy_key(profile, dest);
+	g_mutex_lock(indexer->lazy_lock);
+	request = g_hash_table_lookup(indexer->lazy_requests, key);
+	if (! request) {
+		request = g_new0(struct lazy_request, 1);
+		g_hash_table_insert(indexer->lazy_requests, g_strdup(key),
+				request);
+		first = 1;
+	}
+	request->waiters++;
+	if (first) {
+		/* the job may be run right here, without worker threads */
+		g_mutex_unlock(indexer->lazy_lock);
+		/* a job on the file queued earlier has to go first */
+		jobqueue_boost(indexer->queue, dest, 0);
+		if (jobqueue_push_urgent(indexer->queue, JOB_THUMBNAIL, src,
+					dest, profile)) {
+			finish_lazy(indexer, profile, dest, EIO);
+		}
+		g_mutex_lock(indexer->lazy_lock);
+	}
+
+	g_get_current_time(&deadline);
+	g_time_val_add(&deadline, indexer->lazy_timeout_ms * 1000L);
+	while (! request->done && g_cond_timed_wait(indexer->lazy_done,
+				indexer->lazy_lock, &deadline)) {
+		/* woken up for another one */
+	}
+	err = request->done ? request->err : EAGAIN;
+	if (--request->waiters == 0 && request->done) {
+		g_hash_table_remove(indexer->lazy_requests, key);
+	}
+	g_mutex_unlock(indexer->lazy_lock);
+
+	if (err == EAGAIN) {
+		fprintf(stderr, "%s: not made within %d ms\n", path,
+				indexer->lazy_timeout_ms);
+	}
+	g_free(key);
+	g_free(src);
+	free(dest);
+	g_free(profile);
+
+	return err;
+}
+
+
+
+void
+indexer_get_stats(struct indexer *indexer, struct jobqueue_stats *stats)
+{
+	jobqueue_get_stats(indexer->queue, stats);
+}
+
+
+
+void
+indexer_print_plugin_stats(struct indexer *indexer, FILE *out)
+{
+	pluginstats_print(indexer->stats, out);
+}
+
+
+
+void
+indexer_print_thumbnail_stats(struct indexer *indexer, FILE *out)
+{
+	struct writeback_stats stats;
+
+	g_static_rw_lock_reader_lock(&indexer->reload_lock);
+	thumbnail_print_stats(indexer->thumbconf, out);
+	g_static_rw_lock_reader_unlock(&indexer->reload_lock);
+
+	writeback_get_stats(indexer->writeback, &stats);
+	fprintf(out, "put in place %lu thumbnails in %lu synced batches, "
+			"%.2f s syncing, %lu replaced while pending\n",
+			stats.files, stats.batches, stats.sync_s,
+			stats.replaced);
 }
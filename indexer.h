@@ -1,14 +1,72 @@
 #ifndef INDEXER_H
 #define INDEXER_H
 
+#include <stdio.h>
+
+#include "jobqueue.h"
+#include "walk.h"
+
+struct indexer_options {
+	int workers;		/* number of indexing threads */
+	int queue_len;		/* max. queued jobs before writers block */
+	int debounce_ms;	/* settle time before indexing, <0 for default */
+	int in_process;		/* call reader plugins in the daemon itself */
+	int reader_timeout_s;	/* reader process time per file, 0 default */
+	int durability;		/* enum writeback_durability, <0 for default */
+	int lazy_timeout_ms;	/* see indexer_make_lazy(), 0 for default */
+};
+
 struct indexer;
 struct indexer *indexer_init(const char *self, const char *plugin_dir,
-		const char *thumb_dir, const char *conffile);
+		const char *thumb_dir, const char *conffile,
+		const struct indexer_options *options);
 void indexer_free(struct indexer *indexer);
 
+/*
+ * These only queue the work; it is done later by the indexing threads.
+ * indexer_free() waits until every queued job has been done.
+ */
 int indexer_process(struct indexer *indexer, const char *src, const char *dest);
 int indexer_rename(struct indexer *indexer, const char *old_path,
-		const char *new_path);
+		const char *new_src, const char *new_path);
 int indexer_remove(struct indexer *indexer, const char *path);
+int indexer_remove_dir(struct indexer *indexer, const char *path);
+
+/* a reader wants the thumbnails of path (within it if is_dir) soon */
+void indexer_accessed(struct indexer *indexer, const char *path, int is_dir);
+
+/*
+ * A reader looked up path, relative to the thumbnail directory, and did not
+ * find it: if it names a thumbnail of a lazy profile of an indexed file, make
+ * it now, ahead of any other job, and wait for it. 0 once it is there,
+ * ENOENT if there is no such thumbnail to make, EAGAIN if it was not made in
+ * time and EIO if it could not be.
+ */
+int indexer_make_lazy(struct indexer *indexer, const char *path);
+
+/*
+ * Compare each source directory (mirrored at the dest of its root) with the
+ * thumbnails and index in the background: files changed behind our back are
+ * queued at low priority and thumbnails of files that are gone removed.
+ */
+int indexer_reconcile(struct indexer *indexer, const struct walk_root *roots,
+		int n_roots);
+
+/*
+ * Rescan the readers directory of the plugin directory, loading new and
+ * changed plugins and unloading those that are gone, and reread the thumbnail
+ * configuration. Meanwhile no job is run. Whichever of them cannot be read
+ * is kept as it was, and the reload fails.
+ */
+int indexer_reload(struct indexer *indexer);
+
+void indexer_get_stats(struct indexer *indexer, struct jobqueue_stats *stats);
+/* how each plugin did with each mime type and suffix */
+void indexer_print_plugin_stats(struct indexer *indexer, FILE *out);
+/*
+ * Encoding time and size of the thumbnails written, per profile, and how
+ * they were put in place.
+ */
+void indexer_print_thumbnail_stats(struct indexer *indexer, FILE *out);
 
 #endif
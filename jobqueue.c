@@ -0,0 +1,935 @@
+#include "jobqueue.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+/* jobs already waiting in a directory for the next ones to count as bulk */
+#define BULK_JOBS 8
+
+/* directories listed lately, whose new jobs are urgent */
+#define HOT_DIRS 8
+#define HOT_DIR_MS 30000
+
+
+
+struct queued_job {
+	struct job job;
+	GTimeVal pushed;
+	GTimeVal ready;		/* not to be run before this */
+	enum job_priority prio;
+};
+
+
+struct hot_dir {
+	char *path;		/* NULL if unused */
+	GTimeVal until;
+};
+
+
+
+struct jobqueue {
+	GMutex *lock;
+	GCond *work;		/* signalled when a job may have become runnable */
+	GCond *room;		/* signalled when waiting jobs are taken */
+
+	GQueue *waiting;	/* struct queued_job *, in push order */
+	GList *running;		/* struct queued_job * */
+
+	GThread **threads;
+	int n_threads;
+	int max_threads;
+	int started;
+
+	int max_len;
+	int debounce_ms;
+	int quit;
+
+	int max_low;		/* background jobs waiting at most */
+	int low_closed;		/* no more background jobs taken */
+
+	struct hot_dir hot[HOT_DIRS];
+
+	jobqueue_handler handler;
+	void *data;
+
+	struct jobqueue_stats stats;
+};
+
+
+
+static void
+free_job(struct queued_job *qjob)
+{
+	free(qjob->job.src);
+	free(qjob->job.path);
+	free(qjob->job.new_path);
+	free(qjob);
+}
+
+
+
+static struct queued_job *
+new_job(enum job_type type, const char *src, const char *path,
+		const char *new_path)
+{
+	struct queued_job *qjob;
+	struct job *job;
+
+	qjob = calloc(1, sizeof(struct queued_job));
+	if (! qjob) {
+		return NULL;
+	}
+	job = &qjob->job;
+	job->type = type;
+	job->src = src ? strdup(src) : NULL;
+	job->path = path ? strdup(path) : NULL;
+	job->new_path = new_path ? strdup(new_path) : NULL;
+
+	if ((src && ! job->src) || (path && ! job->path) ||
+			(new_path && ! job->new_path)) {
+		free_job(qjob);
+		return NULL;
+	}
+
+	return qjob;
+}
+
+
+
+static int
+time_before(const GTimeVal *a, const GTimeVal *b)
+{
+	return a->tv_sec < b->tv_sec ||
+		(a->tv_sec == b->tv_sec && a->tv_usec < b->tv_usec);
+}
+
+
+
+/* if path is dir or within it, the part of path after dir, else NULL */
+static const char *
+path_under(const char *path, const char *dir)
+{
+	size_t len = strlen(dir);
+
+	if (strncmp(path, dir, len) == 0 &&
+			(path[len] == '\0' || path[len] == '/')) {
+		return path + len;
+	}
+	return NULL;
+}
+
+
+
+static int
+paths_conflict(const char *a, const char *b)
+{
+	return a && b && (path_under(a, b) || path_under(b, a));
+}
+
+
+
+/* the path a job moves things to, if any: a thumbnail job names a profile */
+static const char *
+target_path(const struct job *job)
+{
+	return job->type == JOB_THUMBNAIL ? NULL : job->new_path;
+}
+
+
+
+static int
+jobs_conflict(const struct queued_job *qa, const struct queued_job *qb)
+{
+	const struct job *a = &qa->job;
+	const struct job *b = &qb->job;
+
+	return paths_conflict(a->path, b->path) ||
+		paths_conflict(a->path, target_path(b)) ||
+		paths_conflict(target_path(a), b->path) ||
+		paths_conflict(target_path(a), target_path(b));
+}
+
+
+
+/* whether path is directly within dir, of length len */
+static int
+in_dir(const char *path, const char *dir, size_t len)
+{
+	return strncmp(path, dir, len) == 0 && path[len] == '/' &&
+		! strchr(path + len + 1, '/');
+}
+
+
+
+/*
+ * Find the first ready waiting job that touches no path of a running job nor
+ * of an earlier waiting job. Jobs on the same path thus keep their push order.
+ * Jobs of a lower priority are only picked when none of a higher one can be.
+ * If nothing is ready, @next is set to the time the first job becomes ready.
+ */
+static GList *
+pick_job(struct jobqueue *queue, GTimeVal *next)
+{
+	GList *link, *prev, *run;
+	GTimeVal now;
+	int prio;
+
+	g_get_current_time(&now);
+	next->tv_sec = 0;
+
+	for (prio = 0; prio < JOB_PRIO_N; prio++) {
+		for (link = queue->waiting->head; link; link = link->next) {
+			struct queued_job *job = link->data;
+			int blocked = 0;
+
+			if (job->prio != prio) {
+				continue;
+			}
+
+			/* don't keep the shutdown waiting for debouncing */
+			if (! queue->quit && time_before(&now, &job->ready)) {
+				if (next->tv_sec == 0 ||
+						time_before(&job->ready, next)) {
+					*next = job->ready;
+				}
+				continue;
+			}
+
+			for (run = queue->running; run && ! blocked;
+					run = run->next) {
+				blocked = jobs_conflict(job, run->data);
+			}
+			for (prev = queue->waiting->head;
+					prev != link && ! blocked;
+					prev = prev->next) {
+				blocked = jobs_conflict(job, prev->data);
+			}
+			if (! blocked) {
+				return link;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+
+
+static double
+seconds_since(const GTimeVal *then)
+{
+	GTimeVal now;
+
+	g_get_current_time(&now);
+	return (now.tv_sec - then->tv_sec) +
+		(now.tv_usec - then->tv_usec) / (double) G_USEC_PER_SEC;
+}
+
+
+
+static void
+count_start(struct jobqueue *queue, const struct queued_job *job)
+{
+	struct jobqueue_prio_stats *stats = &queue->stats.prio[job->prio];
+	double wait = seconds_since(&job->pushed);
+
+	stats->started++;
+	stats->wait_total += wait;
+	if (wait > stats->wait_max) {
+		stats->wait_max = wait;
+	}
+}
+
+
+
+static gpointer
+worker_main(gpointer data)
+{
+	struct jobqueue *queue = data;
+	GList *link;
+	struct queued_job *job;
+	GTimeVal next;
+
+	g_mutex_lock(queue->lock);
+	while (1) {
+		link = pick_job(queue, &next);
+		if (! link) {
+			if (queue->quit && g_queue_is_empty(queue->waiting)) {
+				break;
+			}
+			if (next.tv_sec) {
+				g_cond_timed_wait(queue->work, queue->lock,
+						&next);
+			} else {
+				g_cond_wait(queue->work, queue->lock);
+			}
+			continue;
+		}
+
+		job = link->data;
+		g_queue_delete_link(queue->waiting, link);
+		queue->running = g_list_prepend(queue->running, job);
+		queue->stats.depth--;
+		if (job->prio == JOB_PRIO_LOW) {
+			queue->stats.low_depth--;
+		}
+		queue->stats.running++;
+		count_start(queue, job);
+		/* both kinds of push may be waiting */
+		g_cond_broadcast(queue->room);
+		g_mutex_unlock(queue->lock);
+
+		queue->handler(&job->job, queue->data);
+
+		g_mutex_lock(queue->lock);
+		queue->running = g_list_remove(queue->running, job);
+		queue->stats.running--;
+		queue->stats.done++;
+		free_job(job);
+		/* jobs held back by this one may run now */
+		g_cond_broadcast(queue->work);
+	}
+	g_mutex_unlock(queue->lock);
+
+	return NULL;
+}
+
+
+
+/*
+ * Worker threads are started on first push rather than in jobqueue_new():
+ * FUSE forks when it daemonises and threads created before that would not
+ * survive into the child.
+ */
+static void
+start_workers(struct jobqueue *queue)
+{
+	int i;
+
+	queue->started = 1;
+	for (i = 0; i < queue->max_threads; i++) {
+		GError *error = NULL;
+
+		queue->threads[queue->n_threads] = g_thread_create(worker_main,
+				queue, TRUE, &error);
+		if (queue->threads[queue->n_threads]) {
+			queue->n_threads++;
+		} else {
+			fprintf(stderr, "cannot create worker thread: %s\n",
+					error ? error->message : "unknown");
+			if (error) {
+				g_error_free(error);
+			}
+		}
+	}
+	fprintf(stdout, "started %d indexing workers\n", queue->n_threads);
+}
+
+
+
+struct jobqueue *
+jobqueue_new(int workers, int max_len, int debounce_ms,
+		jobqueue_handler handler, void *data)
+{
+	struct jobqueue *queue;
+
+	queue = calloc(1, sizeof(struct jobqueue));
+	if (! queue) {
+		return NULL;
+	}
+
+	queue->max_threads = workers > 0 ? workers : 1;
+	queue->threads = calloc(queue->max_threads, sizeof(GThread *));
+	if (! queue->threads) {
+		free(queue);
+		return NULL;
+	}
+
+	queue->lock = g_mutex_new();
+	queue->work = g_cond_new();
+	queue->room = g_cond_new();
+	queue->waiting = g_queue_new();
+
+	queue->max_len = max_len > 0 ? max_len : 1;
+	queue->max_low = queue->max_len > 1 ? queue->max_len / 2 : 1;
+	queue->debounce_ms = debounce_ms > 0 ? debounce_ms : 0;
+	queue->handler = handler;
+	queue->data = data;
+
+	return queue;
+}
+
+
+
+static void drop_low(struct jobqueue *queue);
+
+
+
+/*
+ * Shutdown drains the queue: every job pushed before jobqueue_free() is run
+ * to completion before the workers are joined, except for background jobs
+ * still waiting. Pushing after this point is not allowed.
+ */
+void
+jobqueue_free(struct jobqueue *queue)
+{
+	static const char *prio_names[JOB_PRIO_N] = {
+		"urgent", "normal", "bulk", "background"
+	};
+	int i;
+
+	if (queue == NULL) {
+		return;
+	}
+
+	g_mutex_lock(queue->lock);
+	queue->quit = 1;
+	drop_low(queue);
+	if (! g_queue_is_empty(queue->waiting)) {
+		fprintf(stdout, "draining %d indexing jobs\n",
+				queue->stats.depth);
+	}
+	g_cond_broadcast(queue->work);
+	g_cond_broadcast(queue->room);
+	g_mutex_unlock(queue->lock);
+
+	for (i = 0; i < queue->n_threads; i++) {
+		g_thread_join(queue->threads[i]);
+	}
+
+	fprintf(stdout, "indexing queue: %lu jobs done, %lu coalesced, "
+			"max depth %d, %lu pushes blocked\n",
+			queue->stats.done, queue->stats.coalesced,
+			queue->stats.max_depth, queue->stats.blocked);
+	for (i = 0; i < JOB_PRIO_N; i++) {
+		const struct jobqueue_prio_stats *prio = &queue->stats.prio[i];
+
+		if (prio->started) {
+			fprintf(stdout, "%s jobs: %lu, waited %.2f s on "
+					"average, %.2f s at most\n",
+					prio_names[i], prio->started,
+					prio->wait_total / prio->started,
+					prio->wait_max);
+		}
+	}
+	for (i = 0; i < HOT_DIRS; i++) {
+		free(queue->hot[i].path);
+	}
+
+	g_queue_free(queue->waiting);
+	g_cond_free(queue->room);
+	g_cond_free(queue->work);
+	g_mutex_free(queue->lock);
+	free(queue->threads);
+	free(queue);
+}
+
+
+
+static GList *
+find_waiting(struct jobqueue *queue, enum job_type type, const char *path)
+{
+	GList *link;
+
+	for (link = queue->waiting->head; link; link = link->next) {
+		struct queued_job *job = link->data;
+		if (job->job.type == type && strcmp(job->job.path, path) == 0) {
+			return link;
+		}
+	}
+
+	return NULL;
+}
+
+
+
+static void
+unqueue(struct jobqueue *queue, GList *link)
+{
+	struct queued_job *job = link->data;
+
+	if (job->prio == JOB_PRIO_LOW) {
+		queue->stats.low_depth--;
+	}
+	free_job(job);
+	g_queue_delete_link(queue->waiting, link);
+	queue->stats.depth--;
+}
+
+
+
+static void
+drop_waiting(struct jobqueue *queue, GList *link)
+{
+	unqueue(queue, link);
+	queue->stats.coalesced++;
+}
+
+
+
+/* background jobs can be found again, no need to wait for them */
+static void
+drop_low(struct jobqueue *queue)
+{
+	GList *link, *next;
+
+	queue->low_closed = 1;
+	for (link = queue->waiting->head; link; link = next) {
+		struct queued_job *job = link->data;
+
+		next = link->next;
+		if (job->prio == JOB_PRIO_LOW) {
+			unqueue(queue, link);
+		}
+	}
+	g_cond_broadcast(queue->room);
+}
+
+
+
+/* waiting jobs on path that are made obsolete by a new index or remove */
+static int
+drop_obsolete(struct jobqueue *queue, const char *path, int dry_run)
+{
+	GList *link;
+	int n = 0;
+
+	while ((link = find_waiting(queue, JOB_INDEX, path)) ||
+			(link = find_waiting(queue, JOB_REMOVE, path))) {
+		if (dry_run) {
+			return 1;
+		}
+		drop_waiting(queue, link);
+		n++;
+	}
+
+	return n;
+}
+
+
+
+/* waiting index jobs within a directory, whose files are gone */
+static int
+drop_within(struct jobqueue *queue, const char *dir, int dry_run)
+{
+	GList *link, *next;
+	int n = 0;
+
+	for (link = queue->waiting->head; link; link = next) {
+		struct queued_job *job = link->data;
+
+		next = link->next;
+		if (job->job.type != JOB_INDEX ||
+				! path_under(job->job.path, dir)) {
+			continue;
+		}
+		if (dry_run) {
+			return 1;
+		}
+		drop_waiting(queue, link);
+		n++;
+	}
+
+	return n;
+}
+
+
+
+/*
+ * Waiting index jobs for files in a renamed directory would look for them
+ * under the old name. Take them out of the queue with the new name, to be
+ * queued again behind the rename.
+ */
+static GList *
+take_renamed(struct jobqueue *queue, const struct job *rename)
+{
+	GList *link, *next, *taken = NULL;
+
+	for (link = queue->waiting->head; link; link = next) {
+		struct queued_job *job = link->data;
+		const char *rest;
+		char *src, *path;
+
+		next = link->next;
+		if (job->job.type != JOB_INDEX) {
+			continue;
+		}
+		rest = path_under(job->job.path, rename->path);
+		if (! rest) {
+			continue;
+		}
+
+		src = malloc(strlen(rename->src) + strlen(rest) + 1);
+		path = malloc(strlen(rename->new_path) + strlen(rest) + 1);
+		if (! src || ! path) {
+			/* leave it be, it will fail to find the file */
+			free(src);
+			free(path);
+			continue;
+		}
+		sprintf(src, "%s%s", rename->src, rest);
+		sprintf(path, "%s%s", rename->new_path, rest);
+		free(job->job.src);
+		free(job->job.path);
+		job->job.src = src;
+		job->job.path = path;
+
+		g_queue_unlink(queue->waiting, link);
+		taken = g_list_concat(taken, link);
+		queue->stats.depth--;
+	}
+
+	return taken;
+}
+
+
+
+/*
+ * Merge a new job with the waiting ones it makes obsolete. Only the last of a
+ * burst of index/remove jobs on a path is kept, and renaming a file still
+ * waiting to be indexed turns into indexing it under its new name (and
+ * dropping what was left under the old one): an atomic save (write foo.tmp,
+ * rename to foo) decodes the file only once.
+ * With @dry_run, only tell if the queue would shrink.
+ */
+static int
+coalesce(struct jobqueue *queue, struct queued_job *qjob, int dry_run)
+{
+	struct job *job = &qjob->job;
+	struct queued_job *old;
+	GList *link;
+	int n;
+
+	switch (job->type) {
+		case JOB_INDEX:
+		case JOB_REMOVE:
+			return drop_obsolete(queue, job->path, dry_run);
+
+		case JOB_RENAME:
+			/* target is replaced, its pending work is moot */
+			n = drop_obsolete(queue, job->new_path, dry_run);
+			link = find_waiting(queue, JOB_INDEX, job->path);
+			if (! link || dry_run) {
+				return n;
+			}
+			old = link->data;
+			old->job.type = JOB_REMOVE;
+			free(old->job.src);
+			old->job.src = NULL;
+			g_get_current_time(&old->ready);
+			queue->stats.coalesced++;
+
+			free(job->path);
+			job->path = job->new_path;
+			job->new_path = NULL;
+			job->type = JOB_INDEX;
+			return n;
+
+		case JOB_REMOVE_DIR:
+			return drop_within(queue, job->path, dry_run);
+
+		case JOB_RENAME_DIR:
+		case JOB_THUMBNAIL:
+			break;
+	}
+
+	return 0;
+}
+
+
+
+static int
+is_hot(struct jobqueue *queue, const char *path)
+{
+	GTimeVal now;
+	int i;
+
+	g_get_current_time(&now);
+	for (i = 0; i < HOT_DIRS; i++) {
+		struct hot_dir *hot = &queue->hot[i];
+
+		if (hot->path && time_before(&now, &hot->until) &&
+				in_dir(path, hot->path, strlen(hot->path))) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+
+/*
+ * A writer filling a directory with many files, e.g. an import, is not to
+ * hold up the others.
+ */
+static int
+is_bulk(struct jobqueue *queue, const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	GList *link;
+	size_t len;
+	int n = 0;
+
+	if (! slash) {
+		return 0;
+	}
+	len = slash - path;
+	for (link = queue->waiting->head; link && n < BULK_JOBS;
+			link = link->next) {
+		struct queued_job *job = link->data;
+
+		if (job->prio != JOB_PRIO_LOW &&
+				in_dir(job->job.path, path, len)) {
+			n++;
+		}
+	}
+
+	return n >= BULK_JOBS;
+}
+
+
+
+static int
+push_job(struct jobqueue *queue, struct queued_job *job)
+{
+	GList *taken = NULL;
+
+	g_mutex_lock(queue->lock);
+	if (! queue->started) {
+		start_workers(queue);
+	}
+	if (queue->n_threads == 0) {
+		/* no threads to serve us, do it ourselves */
+		g_mutex_unlock(queue->lock);
+		queue->handler(&job->job, queue->data);
+		free_job(job);
+		return 0;
+	}
+
+	if (job->prio == JOB_PRIO_LOW) {
+		while (! queue->low_closed &&
+				(queue->stats.low_depth >= queue->max_low ||
+				 queue->stats.depth >= queue->max_len)) {
+			g_cond_wait(queue->room, queue->lock);
+		}
+		/* anything already waiting on the path supersedes it */
+		if (queue->low_closed || drop_obsolete(queue, job->job.path, 1)) {
+			g_mutex_unlock(queue->lock);
+			free_job(job);
+			return queue->low_closed;
+		}
+	} else if (job->prio != JOB_PRIO_URGENT &&
+			queue->stats.depth >= queue->max_len && ! queue->quit &&
+			! coalesce(queue, job, 1)) {
+		queue->stats.blocked++;
+		fprintf(stdout, "indexing queue full (%d jobs), waiting\n",
+				queue->stats.depth);
+		while (queue->stats.depth >= queue->max_len && ! queue->quit &&
+				! coalesce(queue, job, 1)) {
+			g_cond_wait(queue->room, queue->lock);
+		}
+	}
+
+	coalesce(queue, job, 0);
+	if (job->job.type == JOB_RENAME_DIR) {
+		taken = take_renamed(queue, &job->job);
+	}
+	g_get_current_time(&job->pushed);
+	job->ready = job->pushed;
+	if (job->job.type == JOB_INDEX && job->prio == JOB_PRIO_NORMAL) {
+		g_time_val_add(&job->ready, queue->debounce_ms * 1000L);
+	}
+
+	if (is_hot(queue, job->job.path)) {
+		job->prio = JOB_PRIO_URGENT;
+	} else if (job->prio == JOB_PRIO_NORMAL &&
+			is_bulk(queue, job->job.path)) {
+		job->prio = JOB_PRIO_BULK;
+	}
+
+	g_queue_push_tail(queue->waiting, job);
+	queue->stats.depth++;
+	if (job->prio == JOB_PRIO_LOW) {
+		queue->stats.low_depth++;
+	}
+	queue->stats.pushed++;
+	while (taken) {
+		GList *link = taken;
+
+		taken = g_list_remove_link(taken, link);
+		g_queue_push_tail_link(queue->waiting, link);
+		queue->stats.depth++;
+	}
+	if (queue->stats.depth > queue->stats.max_depth) {
+		queue->stats.max_depth = queue->stats.depth;
+	}
+	g_cond_signal(queue->work);
+	g_mutex_unlock(queue->lock);
+
+	return 0;
+}
+
+
+
+/*
+ * Queue a job. Blocks while the queue is full, which throttles the caller
+ * (i.e. the writing application) down to the indexing rate. Index jobs are
+ * held back for the debounce time so that repeated events on a file can be
+ * coalesced into one.
+ */
+int
+jobqueue_push(struct jobqueue *queue, enum job_type type,
+		const char *src, const char *path, const char *new_path)
+{
+	struct queued_job *job;
+
+	job = new_job(type, src, path, new_path);
+	if (! job) {
+		fprintf(stderr, "out of memory!\n");
+		return 1;
+	}
+	job->prio = JOB_PRIO_NORMAL;
+
+	return push_job(queue, job);
+}
+
+
+
+/*
+ * Queue a background job, e.g. one found by a scan rather than caused by a
+ * writer. These are run only when nothing else is runnable and are not
+ * debounced. They may fill half of the queue at most, so that writers don't
+ * have to wait behind them; the pusher blocks instead. A job on a path that
+ * already has one waiting is dropped.
+ */
+int
+jobqueue_push_low(struct jobqueue *queue, enum job_type type,
+		const char *src, const char *path, const char *new_path)
+{
+	struct queued_job *job;
+
+	job = new_job(type, src, path, new_path);
+	if (! job) {
+		fprintf(stderr, "out of memory!\n");
+		return 1;
+	}
+	job->prio = JOB_PRIO_LOW;
+
+	return push_job(queue, job);
+}
+
+
+
+/*
+ * Queue a job a reader is waiting for. It goes ahead of every other job that
+ * may run, and is neither debounced nor held up by a full queue: the reader
+ * is not a writer to be throttled.
+ */
+int
+jobqueue_push_urgent(struct jobqueue *queue, enum job_type type,
+		const char *src, const char *path, const char *new_path)
+{
+	struct queued_job *job;
+
+	job = new_job(type, src, path, new_path);
+	if (! job) {
+		fprintf(stderr, "out of memory!\n");
+		return 1;
+	}
+	job->prio = JOB_PRIO_URGENT;
+
+	return push_job(queue, job);
+}
+
+
+
+/*
+ * Drop the background jobs still waiting and refuse new ones, waking up any
+ * pusher blocked in jobqueue_push_low().
+ */
+void
+jobqueue_stop_low(struct jobqueue *queue)
+{
+	g_mutex_lock(queue->lock);
+	drop_low(queue);
+	g_mutex_unlock(queue->lock);
+}
+
+
+
+void
+jobqueue_get_stats(struct jobqueue *queue, struct jobqueue_stats *stats)
+{
+	g_mutex_lock(queue->lock);
+	memcpy(stats, &queue->stats, sizeof(struct jobqueue_stats));
+	g_mutex_unlock(queue->lock);
+}
+
+
+
+static void
+remember_hot(struct jobqueue *queue, const char *path)
+{
+	struct hot_dir *slot = NULL;
+	GTimeVal now;
+	int i;
+
+	g_get_current_time(&now);
+	for (i = 0; i < HOT_DIRS; i++) {
+		struct hot_dir *hot = &queue->hot[i];
+
+		if (hot->path && strcmp(hot->path, path) == 0) {
+			slot = hot;
+			break;
+		}
+		/* otherwise an unused one, or else the one going cold first */
+		if (! slot || (slot->path && (! hot->path ||
+						time_before(&hot->until,
+							&slot->until)))) {
+			slot = hot;
+		}
+	}
+
+	if (! slot->path || strcmp(slot->path, path)) {
+		free(slot->path);
+		slot->path = strdup(path);
+	}
+	slot->until = now;
+	g_time_val_add(&slot->until, HOT_DIR_MS * 1000L);
+}
+
+
+
+void
+jobqueue_boost(struct jobqueue *queue, const char *path, int is_dir)
+{
+	size_t len = strlen(path);
+	GList *link;
+
+	g_mutex_lock(queue->lock);
+	if (is_dir) {
+		remember_hot(queue, path);
+	}
+
+	for (link = queue->waiting->head; link; link = link->next) {
+		struct queued_job *job = link->data;
+
+		if (job->prio == JOB_PRIO_URGENT || (is_dir ?
+					! in_dir(job->job.path, path, len) :
+					strcmp(job->job.path, path))) {
+			continue;
+		}
+		if (job->prio == JOB_PRIO_LOW) {
+			queue->stats.low_depth--;
+			/* a pusher of background jobs may go on */
+			g_cond_broadcast(queue->room);
+		}
+		job->prio = JOB_PRIO_URGENT;
+		queue->stats.boosted++;
+	}
+	g_mutex_unlock(queue->lock);
+}
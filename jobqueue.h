@@ -0,0 +1,88 @@
+#ifndef JOBQUEUE_H
+#define JOBQUEUE_H
+
+/*
+ * Bounded queue of indexing jobs served by a pool of worker threads.
+ *
+ * Jobs touching the same monitored path, or a directory and a path within it,
+ * are never run concurrently and are always run in the order they were
+ * pushed. Jobs touching different paths may run in parallel. Index jobs wait
+ * for a debounce period during which later jobs on the same path replace them.
+ *
+ * Among the jobs that may run, those of a higher priority go first: jobs on
+ * files a reader is looking at, then the ones caused by writers, then those
+ * of a directory that is being filled in bulk, then background jobs.
+ */
+
+enum job_type {
+	JOB_INDEX,		/* (re)create thumbnails for path */
+	JOB_RENAME,		/* move thumbnails from path to new_path */
+	JOB_REMOVE,		/* delete thumbnails of path */
+	JOB_RENAME_DIR,		/* move thumbnails of everything in directory
+				   src from under path to under new_path */
+	JOB_REMOVE_DIR,		/* directory path is gone */
+	JOB_THUMBNAIL,		/* make the thumbnail of lazy profile new_path
+				   of path from src */
+};
+
+enum job_priority {
+	JOB_PRIO_URGENT,	/* in a directory listed or on a file opened lately */
+	JOB_PRIO_NORMAL,
+	JOB_PRIO_BULK,		/* in a directory with many jobs waiting */
+	JOB_PRIO_LOW,		/* background, see jobqueue_push_low() */
+	JOB_PRIO_N
+};
+
+struct job {
+	enum job_type type;
+	char *src;		/* source path (new one for JOB_RENAME) */
+	char *path;		/* monitored path */
+	char *new_path;		/* JOB_RENAME(_DIR), or the profile of
+				   JOB_THUMBNAIL */
+};
+
+struct jobqueue_prio_stats {
+	unsigned long started;	/* jobs of this priority started */
+	double wait_total;	/* seconds from push to start, summed up */
+	double wait_max;	/* longest wait from push to start */
+};
+
+struct jobqueue_stats {
+	int depth;		/* jobs waiting to be run */
+	int low_depth;		/* background jobs among them */
+	int max_depth;		/* highest depth seen */
+	int running;		/* jobs being run right now */
+	unsigned long pushed;	/* jobs accepted in total */
+	unsigned long done;	/* jobs finished in total */
+	unsigned long coalesced; /* jobs dropped as made obsolete */
+	unsigned long blocked;	/* pushes that had to wait for room */
+	unsigned long boosted;	/* waiting jobs made urgent */
+	struct jobqueue_prio_stats prio[JOB_PRIO_N];
+};
+
+typedef void (*jobqueue_handler)(const struct job *job, void *data);
+
+struct jobqueue;
+
+struct jobqueue *jobqueue_new(int workers, int max_len, int debounce_ms,
+		jobqueue_handler handler, void *data);
+void jobqueue_free(struct jobqueue *queue);
+
+int jobqueue_push(struct jobqueue *queue, enum job_type type,
+		const char *src, const char *path, const char *new_path);
+int jobqueue_push_low(struct jobqueue *queue, enum job_type type,
+		const char *src, const char *path, const char *new_path);
+int jobqueue_push_urgent(struct jobqueue *queue, enum job_type type,
+		const char *src, const char *path, const char *new_path);
+void jobqueue_stop_low(struct jobqueue *queue);
+
+/*
+ * A reader has listed directory path (is_dir) or opened file path: make its
+ * waiting jobs urgent, and those pushed for a while yet in case of a
+ * directory.
+ */
+void jobqueue_boost(struct jobqueue *queue, const char *path, int is_dir);
+
+void jobqueue_get_stats(struct jobqueue *queue, struct jobqueue_stats *stats);
+
+#endif
@@ -1,5 +1,7 @@
 #include "mfuse.h"
 #include "indexer.h"
+#include "control.h"
+#include "writeback.h"
 
 #include <stdio.h>
 #include <unistd.h>
@@ -11,29 +13,78 @@
 #include <assert.h>
 
 static struct indexer *indexer;
+static struct control *control;
 
-char *help_text =	"Usage: %s -s <DIR> -m <DIR> -t <DIR> [OPTIONS]\n"
+#define MAX_DIRS 16
+
+static struct walk_root roots[MAX_DIRS];
+static int n_roots;
+
+char *help_text =	"Usage: %s -s <DIR> -m <DIR> [-s <DIR> -m <DIR>...] -t <DIR> [OPTIONS]\n"
 					"\n"
 					"   -f, --foreground         run in foreground\n"
+					"   -l, --lowlevel           use the inode based low-level FUSE backend\n"
+					"   -C, --cache <SEC>        let the kernel cache attributes and data for\n"
+					"                              SEC seconds, invalidated on changes to\n"
+					"                              the source directory (implies -l)\n"
 					"   -s, --source <DIR>       source directory path\n"
 					"   -m, --monitor <DIR>      target directory path that will be monitored\n"
 					"                              for changes and mirror content of source directory\n"
+					"                              (-s and -m can be given up to 16 times, the\n"
+					"                              n-th -m mirrors the n-th -s)\n"
 					"   -t, --thumb <DIR>        path to directory where thumbnails will be stored\n"
+					"   -V, --virtual <DIR>      mount the thumbnail directory read only at DIR,\n"
+					"                              where thumbnails of lazy profiles are made\n"
+					"                              when first looked up\n"
+					"   -L, --lazy-timeout <MS>  give up on making one after MS milliseconds\n"
+					"                              (default 5000)\n"
 					"   -p, --plugin-dir <DIR>   path to plugin directory\n"
 					"   -c, --config <FILE>      path to configuration file\n"
+					"   -o <OPTIONS>             extra FUSE mount options\n"
+					"   -w, --workers <N>        number of indexing threads (default 2)\n"
+					"   -q, --queue-len <N>      max. pending indexing jobs before writers\n"
+					"                              are made to wait (default 64)\n"
+					"   -d, --debounce <MS>      wait MS milliseconds for a file to settle\n"
+					"                              before indexing it (default 500)\n"
+					"   -i, --in-process         run reader plugins inside the daemon instead\n"
+					"                              of separate reader processes\n"
+					"   -T, --reader-timeout <SEC>\n"
+					"                            kill a reader process busy with one file\n"
+					"                              for more than SEC seconds (default 30)\n"
+					"   -D, --durability <LEVEL>\n"
+					"                            none: thumbnails are renamed into place\n"
+					"                              unsynced, batch (default): synced and\n"
+					"                              renamed in batches, sync: also before\n"
+					"                              each job is done\n"
+					"   -S, --control <PATH>     take commands (reload, rescan, stats,\n"
+					"                              plugins) on a unix socket at PATH\n"
 					"   -h, --help               print this message\n"
 					"\n"
+					"SIGHUP reloads the reader plugins and the configuration file,\n"
+					"SIGUSR1 looks for changes made to the source directories.\n"
+					"\n"
 					"Examples:\n"
 					"   %s -s /tmp/fuse-test/.photos-hidden -m /tmp/fuse-test/home/Photos\n"
 					"                 -t /tmp/fuse-test/home/.thumbnails\n";
 
 static struct option long_options[] = {
 	{"foreground",	no_argument,		NULL, 'f'},
+	{"lowlevel",	no_argument,		NULL, 'l'},
+	{"cache",		required_argument,	NULL, 'C'},
 	{"source",		required_argument,	NULL, 's'},
 	{"monitor",		required_argument,	NULL, 'm'},
 	{"thumb",		required_argument,	NULL, 't'},
+	{"virtual",		required_argument,	NULL, 'V'},
+	{"lazy-timeout",	required_argument,	NULL, 'L'},
 	{"config",		required_argument,	NULL, 'c'},
 	{"plugin-dir",	required_argument,	NULL, 'p'},
+	{"workers",		required_argument,	NULL, 'w'},
+	{"queue-len",	required_argument,	NULL, 'q'},
+	{"debounce",	required_argument,	NULL, 'd'},
+	{"in-process",	no_argument,		NULL, 'i'},
+	{"reader-timeout",	required_argument,	NULL, 'T'},
+	{"durability",	required_argument,	NULL, 'D'},
+	{"control",		required_argument,	NULL, 'S'},
 	{"help",		no_argument,		NULL, 'h'},
 	{NULL,			0,					NULL, 0}
 };
@@ -41,14 +92,14 @@ static struct option long_options[] = {
 static int index_file(const char *src, const char *dest, void *user_data)
 {
 	if (indexer_process(indexer, src, dest))
-		fprintf(stderr, "indexing %s (%s) failed\n", dest, src);
+		fprintf(stderr, "cannot queue %s (%s) for indexing\n", dest, src);
 	return 0;
 }
 
 static int on_renamed(const char *old_dest, const char *new_src,
 		const char *new_dest, void *user_data)
 {
-	indexer_rename(indexer, old_dest, new_dest);
+	indexer_rename(indexer, old_dest, new_src, new_dest);
 	return 0;
 }
 
@@ -58,16 +109,103 @@ static int remove_thumbnail(const char *path, void *user_data)
 	return 0;
 }
 
+static int on_dir_removed(const char *path, void *user_data)
+{
+	indexer_remove_dir(indexer, path);
+	return 0;
+}
+
+static int on_accessed(const char *path, int is_dir, void *user_data)
+{
+	indexer_accessed(indexer, path, is_dir);
+	return 0;
+}
+
+static int on_missing(const char *path, void *user_data)
+{
+	return indexer_make_lazy(indexer, path);
+}
+
+static int reconcile(void *user_data)
+{
+	if (indexer_reconcile(indexer, roots, n_roots))
+		fprintf(stderr, "cannot start reconciliation\n");
+	return 0;
+}
+
+/* new plugins may handle files that failed so far */
+static int reload(void *user_data)
+{
+	int ret = indexer_reload(indexer);
+	reconcile(user_data);
+	return ret;
+}
+
+static void print_stats(FILE *out)
+{
+	struct jobqueue_stats stats;
+	static const char *prio_names[JOB_PRIO_N] = {
+		"urgent", "normal", "bulk", "background"
+	};
+	int i;
+
+	indexer_get_stats(indexer, &stats);
+	fprintf(out, "waiting %d (%d background, at most %d), running %d\n",
+			stats.depth, stats.low_depth, stats.max_depth, stats.running);
+	fprintf(out, "pushed %lu, done %lu, coalesced %lu, blocked %lu, "
+			"boosted %lu\n", stats.pushed, stats.done, stats.coalesced,
+			stats.blocked, stats.boosted);
+	for (i = 0; i < JOB_PRIO_N; i++) {
+		const struct jobqueue_prio_stats *prio = &stats.prio[i];
+		fprintf(out, "%s: %lu started, waited %.2f s on average, "
+				"%.2f s at most\n", prio_names[i], prio->started,
+				prio->started ? prio->wait_total / prio->started : 0.0,
+				prio->wait_max);
+	}
+	indexer_print_thumbnail_stats(indexer, out);
+}
+
+static void on_command(const char *command, FILE *out, void *user_data)
+{
+	if (strcmp(command, "reload") == 0) {
+		fprintf(out, reload(NULL) ? "reloaded plugins, configuration "
+				"unreadable\n" : "reloaded\n");
+	} else if (strcmp(command, "rescan") == 0) {
+		fprintf(out, indexer_reconcile(indexer, roots, n_roots) ?
+				"cannot rescan\n" : "rescanning\n");
+	} else if (strcmp(command, "stats") == 0) {
+		print_stats(out);
+	} else if (strcmp(command, "plugins") == 0) {
+		indexer_print_plugin_stats(indexer, out);
+	} else {
+		fprintf(out, "unknown command '%s', try reload, rescan, stats or "
+				"plugins\n", command);
+	}
+}
+
+static int on_started(void *user_data)
+{
+	if (control && control_start(control))
+		fprintf(stderr, "not taking commands\n");
+	return 0;
+}
+
 static struct mfuse_callbacks cb = {
 	.write_closed = index_file,
 	.renamed = on_renamed,
-	.removed = remove_thumbnail
+	.removed = remove_thumbnail,
+	.removed_dir = on_dir_removed,
+	.accessed = on_accessed,
+	.rescan = reconcile,
+	.reload = reload,
+	.started = on_started,
+	.missing = on_missing
 };
 
 int main(int argc, char *argv[])
 {
 	int ret = 0;
-#define FUSE_ARGV_SIZE 16
+#define FUSE_ARGV_SIZE 32
 	int fuse_argc = 0;
 	char *fuse_argv[FUSE_ARGV_SIZE];
 	int i;
@@ -75,30 +213,66 @@ int main(int argc, char *argv[])
 		fuse_argv[i] = (char *)calloc(256, sizeof(char));
 	strcpy(fuse_argv[++fuse_argc - 1], argv[0]);
 
-	char *source_dir = NULL;
-	char *monitor_dir = NULL;
+	char *source_dirs[MAX_DIRS];
+	char *monitor_dirs[MAX_DIRS];
+	struct mfuse_dir dirs[MAX_DIRS];
+	int n_sources = 0, n_monitors = 0;
 	char *thumb_dir = NULL;
+	char *virtual_dir = NULL;
+	struct mfuse_thumbs thumbs;
 	char *plugin_dir = NULL;
 	char *conf_file = NULL;
+	char *control_path = NULL;
+	int lowlevel = 0;
+	double cache_timeout = 0.0;
+	struct indexer_options options;
+	memset(&options, 0, sizeof(options));
+	options.debounce_ms = -1;
+	options.durability = -1;
 
 	int arg;
-	while ((arg = getopt_long(argc, argv, "fs:m:t:p:c:h", long_options, NULL)) != -1) {
+	while ((arg = getopt_long(argc, argv, "flC:s:m:t:V:L:p:c:o:w:q:d:iT:D:S:h", long_options, NULL)) != -1) {
 		switch (arg) {
 		case 'f':
 			strcpy(fuse_argv[++fuse_argc - 1], "-d");
 			break;
+		case 'l':
+			lowlevel = 1;
+			break;
+		case 'C':
+			cache_timeout = atof(optarg);
+			/* invalidation needs the low-level API */
+			lowlevel = 1;
+			break;
 		case 's':
-			source_dir = strdup(optarg);
-			assert(source_dir);
+			if (n_sources == MAX_DIRS) {
+				fprintf(stderr, "%s: too many -s options\n", argv[0]);
+				return 1;
+			}
+			source_dirs[n_sources] = strdup(optarg);
+			assert(source_dirs[n_sources]);
+			n_sources++;
 			break;
 		case 'm':
-			monitor_dir = strdup(optarg);
-			assert(monitor_dir);
+			if (n_monitors == MAX_DIRS) {
+				fprintf(stderr, "%s: too many -m options\n", argv[0]);
+				return 1;
+			}
+			monitor_dirs[n_monitors] = strdup(optarg);
+			assert(monitor_dirs[n_monitors]);
+			n_monitors++;
 			break;
 		case 't':
 			thumb_dir = strdup(optarg);
 			assert(thumb_dir);
 			break;
+		case 'V':
+			virtual_dir = strdup(optarg);
+			assert(virtual_dir);
+			break;
+		case 'L':
+			options.lazy_timeout_ms = atoi(optarg);
+			break;
 		case 'p':
 			plugin_dir = strdup(optarg);
 			assert(plugin_dir);
@@ -107,6 +281,41 @@ int main(int argc, char *argv[])
 			conf_file = strdup(optarg);
 			assert(conf_file);
 			break;
+		case 'o':
+			if (fuse_argc + 2 > FUSE_ARGV_SIZE - 16) {
+				fprintf(stderr, "%s: too many -o options\n", argv[0]);
+				return 1;
+			}
+			strcpy(fuse_argv[++fuse_argc - 1], "-o");
+			strncpy(fuse_argv[++fuse_argc - 1], optarg, 255);
+			break;
+		case 'w':
+			options.workers = atoi(optarg);
+			break;
+		case 'q':
+			options.queue_len = atoi(optarg);
+			break;
+		case 'd':
+			options.debounce_ms = atoi(optarg);
+			break;
+		case 'i':
+			options.in_process = 1;
+			break;
+		case 'T':
+			options.reader_timeout_s = atoi(optarg);
+			break;
+		case 'D':
+			options.durability = writeback_parse_durability(optarg);
+			if (options.durability < 0) {
+				fprintf(stderr, "%s: unknown durability %s\n",
+						argv[0], optarg);
+				return 1;
+			}
+			break;
+		case 'S':
+			control_path = strdup(optarg);
+			assert(control_path);
+			break;
 		case 'h':
 			printf(help_text, argv[0], argv[0]);
 			return 0;
@@ -117,34 +326,58 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (!source_dir) {
+	if (!n_sources) {
 		fprintf(stderr, "%s: -indexer: -s option is mandatory\n", argv[0]);
 		return 1;
 	}
-	if (!monitor_dir) {
+	if (!n_monitors) {
 		fprintf(stderr, "%s: -m option is mandatory\n", argv[0]);
 		return 1;
 	}
+	if (n_sources != n_monitors) {
+		fprintf(stderr, "%s: -s and -m options must come in pairs\n",
+				argv[0]);
+		return 1;
+	}
+	for (i = 0; i < n_sources; i++) {
+		dirs[i].source_path = source_dirs[i];
+		dirs[i].monitor_path = monitor_dirs[i];
+		roots[i].src = source_dirs[i];
+		roots[i].dest = monitor_dirs[i];
+	}
+	n_roots = n_sources;
 	if (!thumb_dir) {
 		fprintf(stderr, "%s: -t option is mandatory\n", argv[0]);
 		return 1;
 	}
+	thumbs.thumb_path = thumb_dir;
+	thumbs.mount_path = virtual_dir;
 
-	strcpy(fuse_argv[++fuse_argc - 1], monitor_dir);
-	strcpy(fuse_argv[++fuse_argc - 1], "-o");
-	strcpy(fuse_argv[++fuse_argc - 1], "modules=subdir");
-	strcpy(fuse_argv[++fuse_argc - 1], "-o");
-	strcpy(fuse_argv[++fuse_argc - 1], "subdir=");
-	strcat(fuse_argv[fuse_argc - 1], source_dir);
+	/* mount points and source directories are added per mount */
 	strcpy(fuse_argv[++fuse_argc - 1], "-o");
 	strcpy(fuse_argv[++fuse_argc - 1], "nonempty");
+	strcpy(fuse_argv[++fuse_argc - 1], "-o");
+	strcpy(fuse_argv[++fuse_argc - 1], "big_writes,max_write=131072");
+
+	if (control_path) {
+		control = control_open(control_path, on_command, NULL);
+		if (!control)
+			return 1;
+	}
 
-	indexer = indexer_init(argv[0], plugin_dir, thumb_dir, conf_file);
+	indexer = indexer_init(argv[0], plugin_dir, thumb_dir, conf_file,
+			&options);
 	if (indexer) {
-		ret = mfuse_main(fuse_argc, fuse_argv, source_dir, monitor_dir,
-				&cb, NULL);
+		if (lowlevel)
+			ret = mfuse_ll_main(fuse_argc, fuse_argv, dirs, n_sources,
+					cache_timeout, virtual_dir ? &thumbs : NULL, &cb, NULL);
+		else
+			ret = mfuse_main(fuse_argc, fuse_argv, dirs, n_sources,
+					virtual_dir ? &thumbs : NULL, &cb, NULL);
+		control_close(control);
 		indexer_free(indexer);
 	} else {
+		control_close(control);
 		ret = EXIT_FAILURE;
 	}
 
@@ -152,10 +385,14 @@ int main(int argc, char *argv[])
 		free(fuse_argv[i]);
 
 	free(conf_file);
+	free(control_path);
 	free(plugin_dir);
-	free(source_dir);
-	free(monitor_dir);
+	for (i = 0; i < n_sources; ++i)
+		free(source_dirs[i]);
+	for (i = 0; i < n_monitors; ++i)
+		free(monitor_dirs[i]);
 	free(thumb_dir);
+	free(virtual_dir);
 
 	return ret;
 }
@@ -0,0 +1,784 @@
+#include "mediaindex.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <sqlite3.h>
+
+#define SCHEMA_VERSION 4
+
+/* failures not retried for this long are of files long gone */
+#define FAILURE_KEEP_S (30 * 24 * 60 * 60)
+
+/* read at a time when fingerprinting */
+#define CHUNK_LEN (64 * 1024)
+
+
+
+enum {
+	STMT_LOOKUP,
+	STMT_LOOKUP_HASH,
+	STMT_STORE,
+	STMT_RENAME,
+	STMT_REMOVE,
+	STMT_RENAME_DIR,
+	STMT_REMOVE_DIR,
+	STMT_LIST_DIR,
+	STMT_LOOKUP_FAILURE,
+	STMT_STORE_FAILURE,
+	STMT_FORGET_FAILURE,
+	STMT_LIST_COSTS,
+	STMT_STORE_COST,
+	STMT_N
+};
+
+
+/*
+ * Paths within directory ?1 are those between "?1/" and "?10", '0' being the
+ * character after '/'. Unlike LIKE this uses the primary key index and needs
+ * no escaping. The hash of a path is kept with it, see thumb_hash().
+ */
+static const char *statements[STMT_N] = {
+	[STMT_LOOKUP] = "SELECT dev, ino, size, mtime, fingerprint, mime, "
+			"width, height, plugin, profiles "
+			"FROM files WHERE path = ?1",
+	[STMT_LOOKUP_HASH] = "SELECT path FROM files WHERE hash = ?1 LIMIT 1",
+	[STMT_STORE] = "INSERT OR REPLACE INTO files (path, dev, ino, size, "
+			"mtime, fingerprint, mime, width, height, plugin, "
+			"profiles, hash) "
+			"VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11, "
+				"thumb_hash(?1))",
+	[STMT_RENAME] = "UPDATE OR REPLACE files "
+			"SET path = ?2, hash = thumb_hash(?2) "
+			"WHERE path = ?1",
+	[STMT_REMOVE] = "DELETE FROM files WHERE path = ?1",
+	[STMT_RENAME_DIR] = "UPDATE OR REPLACE files "
+			"SET path = ?2 || substr(path, length(?1) + 1), "
+			"hash = thumb_hash(?2 || substr(path, length(?1) + 1)) "
+			"WHERE path > ?1 || '/' AND path < ?1 || '0'",
+	[STMT_REMOVE_DIR] = "DELETE FROM files "
+			"WHERE path > ?1 || '/' AND path < ?1 || '0'",
+	[STMT_LIST_DIR] = "SELECT path FROM files "
+			"WHERE path > ?1 || '/' AND path < ?1 || '0'",
+	[STMT_LOOKUP_FAILURE] = "SELECT size, mtime, attempts, retry_at, "
+			"reason FROM failures WHERE dev = ?1 AND ino = ?2",
+	[STMT_STORE_FAILURE] = "INSERT OR REPLACE INTO failures (dev, ino, "
+			"size, mtime, attempts, retry_at, reason) "
+			"VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7)",
+	[STMT_FORGET_FAILURE] = "DELETE FROM failures "
+			"WHERE dev = ?1 AND ino = ?2",
+	[STMT_LIST_COSTS] = "SELECT plugin, key, tries, successes, total_ms, "
+			"histogram FROM plugin_costs",
+	[STMT_STORE_COST] = "INSERT OR REPLACE INTO plugin_costs (plugin, "
+			"key, tries, successes, total_ms, histogram) "
+			"VALUES (?1, ?2, ?3, ?4, ?5, ?6)",
+};
+
+
+static const char *schema =
+	"CREATE TABLE IF NOT EXISTS files ("
+		"path TEXT PRIMARY KEY NOT NULL, "
+		"dev INTEGER, "
+		"ino INTEGER, "
+		"size INTEGER, "
+		"mtime INTEGER, "
+		"fingerprint TEXT, "
+		"mime TEXT, "
+		"width INTEGER, "
+		"height INTEGER, "
+		"plugin TEXT, "
+		"profiles TEXT, "
+		"hash TEXT"
+	"); "
+	"CREATE INDEX IF NOT EXISTS files_hash ON files (hash); "
+	"CREATE TABLE IF NOT EXISTS failures ("
+		"dev INTEGER NOT NULL, "
+		"ino INTEGER NOT NULL, "
+		"size INTEGER, "
+		"mtime INTEGER, "
+		"attempts INTEGER, "
+		"retry_at INTEGER, "
+		"reason TEXT, "
+		"PRIMARY KEY (dev, ino)"
+	"); "
+	"CREATE TABLE IF NOT EXISTS plugin_costs ("
+		"plugin TEXT NOT NULL, "
+		"key TEXT NOT NULL, "
+		"tries INTEGER, "
+		"successes INTEGER, "
+		"total_ms REAL, "
+		"histogram TEXT, "
+		"PRIMARY KEY (plugin, key)"
+	");";
+
+
+struct mediaindex {
+	char *fn;
+	sqlite3 *db;
+	sqlite3_stmt *stmt[STMT_N];
+
+	/* the connection is opened without SQLite's own locking */
+	GMutex *lock;
+};
+
+
+
+static int
+exec(struct mediaindex *index, const char *sql)
+{
+	char *msg = NULL;
+
+	if (sqlite3_exec(index->db, sql, NULL, NULL, &msg) != SQLITE_OK) {
+		fprintf(stderr, "%s: %s\n", index->fn, msg ? : "failed");
+		sqlite3_free(msg);
+		return 1;
+	}
+	return 0;
+}
+
+
+
+static int
+get_version(struct mediaindex *index)
+{
+	sqlite3_stmt *stmt;
+	int version = -1;
+
+	if (sqlite3_prepare_v2(index->db, "PRAGMA user_version", -1, &stmt,
+				NULL) != SQLITE_OK) {
+		return -1;
+	}
+	if (sqlite3_step(stmt) == SQLITE_ROW) {
+		version = sqlite3_column_int(stmt, 0);
+	}
+	sqlite3_finalize(stmt);
+
+	return version;
+}
+
+
+
+/*
+ * thumb_hash(path): the MD5 sum of the URI of path, which thumbnails are
+ * named after, so that a file can be found by the name of its thumbnail.
+ */
+static void
+thumb_hash(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+	const char *path = (const char *) sqlite3_value_text(argv[0]);
+	gchar *uri;
+
+	if (! path) {
+		sqlite3_result_null(ctx);
+		return;
+	}
+	uri = g_strconcat("file://", path, NULL);
+	sqlite3_result_text(ctx, g_compute_checksum_for_string(G_CHECKSUM_MD5,
+				uri, -1), -1, g_free);
+	g_free(uri);
+}
+
+
+
+/*
+ * The index only saves work, so one from an unknown version is simply
+ * thrown away. Older versions only lack tables: version 1 the failures and
+ * plugin_costs tables, version 2 the latter; and up to version 3 the hash
+ * column of files, which is filled in.
+ */
+static int
+init_schema(struct mediaindex *index)
+{
+	char *sql;
+	int version;
+	int r;
+
+	version = get_version(index);
+	if (version == SCHEMA_VERSION) {
+		return 0;
+	}
+	if (version < 0) {
+		fprintf(stderr, "%s: %s\n", index->fn,
+				sqlite3_errmsg(index->db));
+		return 1;
+	}
+	if (version > SCHEMA_VERSION) {
+		fprintf(stderr, "%s: unknown version %d, starting over\n",
+				index->fn, version);
+	}
+
+	sql = g_strdup_printf("BEGIN; %s %s "
+			"PRAGMA user_version = %d; COMMIT;",
+			version > 0 && version < SCHEMA_VERSION ?
+				"ALTER TABLE files ADD COLUMN hash TEXT; "
+				"UPDATE files SET hash = thumb_hash(path);" :
+				"DROP TABLE IF EXISTS files; "
+				"DROP TABLE IF EXISTS failures; "
+				"DROP TABLE IF EXISTS plugin_costs;",
+			schema, SCHEMA_VERSION);
+	r = exec(index, sql);
+	g_free(sql);
+	if (r) {
+		exec(index, "ROLLBACK");
+	}
+
+	return r;
+}
+
+
+
+struct mediaindex *
+mediaindex_open(const char *fn)
+{
+	struct mediaindex *index;
+	char *sql;
+	int i;
+
+	index = calloc(1, sizeof(struct mediaindex));
+	if (! index) {
+		return NULL;
+	}
+	index->fn = strdup(fn);
+	if (! index->fn) {
+		free(index);
+		return NULL;
+	}
+	index->lock = g_mutex_new();
+
+	if (sqlite3_open_v2(fn, &index->db,
+				SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE |
+				SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) {
+		fprintf(stderr, "%s: cannot open: %s\n", fn,
+				index->db ? sqlite3_errmsg(index->db) :
+					"out of memory");
+		mediaindex_close(index);
+		return NULL;
+	}
+	sqlite3_busy_timeout(index->db, 1000);
+	sqlite3_create_function(index->db, "thumb_hash", 1, SQLITE_UTF8, NULL,
+			thumb_hash, NULL, NULL);
+
+	/*
+	 * Losing the last few updates on a crash only means redoing some
+	 * thumbnails.
+	 */
+	if (exec(index, "PRAGMA journal_mode = WAL") ||
+			exec(index, "PRAGMA synchronous = NORMAL") ||
+			init_schema(index)) {
+		mediaindex_close(index);
+		return NULL;
+	}
+
+	sql = g_strdup_printf("DELETE FROM failures WHERE retry_at < %lld",
+			(long long) time(NULL) - FAILURE_KEEP_S);
+	exec(index, sql);
+	g_free(sql);
+
+	for (i = 0; i < STMT_N; i++) {
+		if (sqlite3_prepare_v2(index->db, statements[i], -1,
+					&index->stmt[i], NULL) != SQLITE_OK) {
+			fprintf(stderr, "%s: %s\n", fn,
+					sqlite3_errmsg(index->db));
+			mediaindex_close(index);
+			return NULL;
+		}
+	}
+
+	return index;
+}
+
+
+
+void
+mediaindex_close(struct mediaindex *index)
+{
+	int i;
+
+	if (index == NULL) {
+		return;
+	}
+
+	for (i = 0; i < STMT_N; i++) {
+		sqlite3_finalize(index->stmt[i]);
+	}
+	sqlite3_close(index->db);
+	g_mutex_free(index->lock);
+	free(index->fn);
+	free(index);
+}
+
+
+
+static char *
+column_strdup(sqlite3_stmt *stmt, int col)
+{
+	const unsigned char *text;
+
+	text = sqlite3_column_text(stmt, col);
+	return text ? strdup((const char *) text) : NULL;
+}
+
+
+
+int
+mediaindex_lookup(struct mediaindex *index, const char *path,
+		struct media_entry *entry)
+{
+	sqlite3_stmt *stmt = index->stmt[STMT_LOOKUP];
+	const unsigned char *fingerprint;
+	int r;
+
+	g_mutex_lock(index->lock);
+	sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+
+	r = sqlite3_step(stmt);
+	if (r == SQLITE_ROW) {
+		entry->dev = sqlite3_column_int64(stmt, 0);
+		entry->ino = sqlite3_column_int64(stmt, 1);
+		entry->size = sqlite3_column_int64(stmt, 2);
+		entry->mtime = sqlite3_column_int64(stmt, 3);
+		fingerprint = sqlite3_column_text(stmt, 4);
+		g_strlcpy(entry->fingerprint,
+				fingerprint ? (const char *) fingerprint : "",
+				sizeof(entry->fingerprint));
+		entry->mime = column_strdup(stmt, 5);
+		entry->width = sqlite3_column_int(stmt, 6);
+		entry->height = sqlite3_column_int(stmt, 7);
+		entry->plugin = column_strdup(stmt, 8);
+		entry->profiles = column_strdup(stmt, 9);
+	} else if (r != SQLITE_DONE) {
+		fprintf(stderr, "%s: lookup of %s failed: %s\n", index->fn,
+				path, sqlite3_errmsg(index->db));
+	}
+
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	g_mutex_unlock(index->lock);
+
+	return r == SQLITE_ROW ? 0 : 1;
+}
+
+
+
+int
+mediaindex_lookup_hash(struct mediaindex *index, const char *hash,
+		char **path)
+{
+	sqlite3_stmt *stmt = index->stmt[STMT_LOOKUP_HASH];
+	int r;
+
+	g_mutex_lock(index->lock);
+	sqlite3_bind_text(stmt, 1, hash, -1, SQLITE_STATIC);
+
+	r = sqlite3_step(stmt);
+	if (r == SQLITE_ROW) {
+		*path = column_strdup(stmt, 0);
+	} else if (r != SQLITE_DONE) {
+		fprintf(stderr, "%s: lookup of %s failed: %s\n", index->fn,
+				hash, sqlite3_errmsg(index->db));
+	}
+
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	g_mutex_unlock(index->lock);
+
+	return r == SQLITE_ROW && *path ? 0 : 1;
+}
+
+
+
+void
+media_entry_clear(struct media_entry *entry)
+{
+	free(entry->mime);
+	free(entry->plugin);
+	free(entry->profiles);
+	entry->mime = entry->plugin = entry->profiles = NULL;
+}
+
+
+
+/* runs a statement taking one or two paths, with the lock held */
+static int
+run_paths(struct mediaindex *index, int which, const char *path,
+		const char *new_path)
+{
+	sqlite3_stmt *stmt = index->stmt[which];
+	int r;
+
+	sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+	if (new_path) {
+		sqlite3_bind_text(stmt, 2, new_path, -1, SQLITE_STATIC);
+	}
+
+	r = sqlite3_step(stmt);
+	if (r != SQLITE_DONE) {
+		fprintf(stderr, "%s: updating %s failed: %s\n", index->fn,
+				path, sqlite3_errmsg(index->db));
+	}
+
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+
+	return r == SQLITE_DONE ? 0 : 1;
+}
+
+
+
+/* runs a statement keyed by the device and inode of file, lock held */
+static int
+run_file(struct mediaindex *index, int which, const struct media_entry *file)
+{
+	sqlite3_stmt *stmt = index->stmt[which];
+	int r;
+
+	sqlite3_bind_int64(stmt, 1, file->dev);
+	sqlite3_bind_int64(stmt, 2, file->ino);
+
+	r = sqlite3_step(stmt);
+	if (r != SQLITE_DONE) {
+		fprintf(stderr, "%s: updating failures failed: %s\n",
+				index->fn, sqlite3_errmsg(index->db));
+	}
+
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+
+	return r == SQLITE_DONE ? 0 : 1;
+}
+
+
+
+int
+mediaindex_store(struct mediaindex *index, const char *path,
+		const struct media_entry *entry)
+{
+	sqlite3_stmt *stmt = index->stmt[STMT_STORE];
+	int r;
+
+	g_mutex_lock(index->lock);
+	sqlite3_bind_int64(stmt, 2, entry->dev);
+	sqlite3_bind_int64(stmt, 3, entry->ino);
+	sqlite3_bind_int64(stmt, 4, entry->size);
+	sqlite3_bind_int64(stmt, 5, entry->mtime);
+	sqlite3_bind_text(stmt, 6, entry->fingerprint, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 7, entry->mime, -1, SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 8, entry->width);
+	sqlite3_bind_int(stmt, 9, entry->height);
+	sqlite3_bind_text(stmt, 10, entry->plugin, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 11, entry->profiles, -1, SQLITE_STATIC);
+	r = run_paths(index, STMT_STORE, path, NULL);
+	if (! r) {
+		r = run_file(index, STMT_FORGET_FAILURE, entry);
+	}
+	g_mutex_unlock(index->lock);
+
+	return r;
+}
+
+
+
+static int
+update(struct mediaindex *index, int which, const char *path,
+		const char *new_path)
+{
+	int r;
+
+	g_mutex_lock(index->lock);
+	r = run_paths(index, which, path, new_path);
+	g_mutex_unlock(index->lock);
+
+	return r;
+}
+
+
+
+int
+mediaindex_rename(struct mediaindex *index, const char *old_path,
+		const char *new_path)
+{
+	return update(index, STMT_RENAME, old_path, new_path);
+}
+
+
+
+int
+mediaindex_remove(struct mediaindex *index, const char *path)
+{
+	return update(index, STMT_REMOVE, path, NULL);
+}
+
+
+
+int
+mediaindex_rename_dir(struct mediaindex *index, const char *old_path,
+		const char *new_path)
+{
+	return update(index, STMT_RENAME_DIR, old_path, new_path);
+}
+
+
+
+int
+mediaindex_remove_dir(struct mediaindex *index, const char *path)
+{
+	return update(index, STMT_REMOVE_DIR, path, NULL);
+}
+
+
+
+int
+mediaindex_foreach_within(struct mediaindex *index, const char *dir,
+		mediaindex_path_fn fn, void *data)
+{
+	sqlite3_stmt *stmt = index->stmt[STMT_LIST_DIR];
+	int r;
+
+	g_mutex_lock(index->lock);
+	sqlite3_bind_text(stmt, 1, dir, -1, SQLITE_STATIC);
+	while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+		fn((const char *) sqlite3_column_text(stmt, 0), data);
+	}
+	if (r != SQLITE_DONE) {
+		fprintf(stderr, "%s: listing %s failed: %s\n", index->fn,
+				dir, sqlite3_errmsg(index->db));
+	}
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	g_mutex_unlock(index->lock);
+
+	return r == SQLITE_DONE ? 0 : 1;
+}
+
+
+
+int
+mediaindex_lookup_failure(struct mediaindex *index,
+		const struct media_entry *file, struct media_failure *failure)
+{
+	sqlite3_stmt *stmt = index->stmt[STMT_LOOKUP_FAILURE];
+	int found = 0;
+	int r;
+
+	g_mutex_lock(index->lock);
+	sqlite3_bind_int64(stmt, 1, file->dev);
+	sqlite3_bind_int64(stmt, 2, file->ino);
+
+	r = sqlite3_step(stmt);
+	if (r == SQLITE_ROW) {
+		/* a failure of an earlier version of the file does not count */
+		found = sqlite3_column_int64(stmt, 0) == file->size &&
+			sqlite3_column_int64(stmt, 1) == file->mtime;
+		if (found) {
+			failure->attempts = sqlite3_column_int(stmt, 2);
+			failure->retry_at = sqlite3_column_int64(stmt, 3);
+			failure->reason = column_strdup(stmt, 4);
+		}
+	} else if (r != SQLITE_DONE) {
+		fprintf(stderr, "%s: failure lookup failed: %s\n", index->fn,
+				sqlite3_errmsg(index->db));
+	}
+
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	g_mutex_unlock(index->lock);
+
+	return found ? 0 : 1;
+}
+
+
+
+int
+mediaindex_store_failure(struct mediaindex *index,
+		const struct media_entry *file,
+		const struct media_failure *failure)
+{
+	sqlite3_stmt *stmt = index->stmt[STMT_STORE_FAILURE];
+	int r;
+
+	g_mutex_lock(index->lock);
+	sqlite3_bind_int64(stmt, 3, file->size);
+	sqlite3_bind_int64(stmt, 4, file->mtime);
+	sqlite3_bind_int(stmt, 5, failure->attempts);
+	sqlite3_bind_int64(stmt, 6, failure->retry_at);
+	sqlite3_bind_text(stmt, 7, failure->reason, -1, SQLITE_STATIC);
+	r = run_file(index, STMT_STORE_FAILURE, file);
+	g_mutex_unlock(index->lock);
+
+	return r;
+}
+
+
+
+int
+mediaindex_forget_failures(struct mediaindex *index)
+{
+	int r;
+
+	g_mutex_lock(index->lock);
+	r = exec(index, "DELETE FROM failures");
+	g_mutex_unlock(index->lock);
+
+	return r;
+}
+
+
+
+void
+media_failure_clear(struct media_failure *failure)
+{
+	free(failure->reason);
+	failure->reason = NULL;
+}
+
+
+
+int
+mediaindex_foreach_cost(struct mediaindex *index, mediaindex_cost_fn fn,
+		void *data)
+{
+	sqlite3_stmt *stmt = index->stmt[STMT_LIST_COSTS];
+	struct media_cost cost;
+	const char *histogram;
+	char *end;
+	int i;
+	int r;
+
+	g_mutex_lock(index->lock);
+	while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+		memset(&cost, 0, sizeof(cost));
+		cost.tries = sqlite3_column_int(stmt, 2);
+		cost.successes = sqlite3_column_int(stmt, 3);
+		cost.total_ms = sqlite3_column_double(stmt, 4);
+		histogram = (const char *) sqlite3_column_text(stmt, 5);
+		for (i = 0; histogram && i < MEDIAINDEX_COST_BUCKETS; i++) {
+			cost.histogram[i] = strtoul(histogram, &end, 10);
+			if (end == histogram) {
+				break;
+			}
+			histogram = end;
+		}
+		fn((const char *) sqlite3_column_text(stmt, 0),
+				(const char *) sqlite3_column_text(stmt, 1),
+				&cost, data);
+	}
+	if (r != SQLITE_DONE) {
+		fprintf(stderr, "%s: listing plugin costs failed: %s\n",
+				index->fn, sqlite3_errmsg(index->db));
+	}
+	sqlite3_reset(stmt);
+	g_mutex_unlock(index->lock);
+
+	return r == SQLITE_DONE ? 0 : 1;
+}
+
+
+
+int
+mediaindex_store_cost(struct mediaindex *index, const char *plugin,
+		const char *key, const struct media_cost *cost)
+{
+	sqlite3_stmt *stmt = index->stmt[STMT_STORE_COST];
+	GString *histogram;
+	int i;
+	int r;
+
+	histogram = g_string_new(NULL);
+	for (i = 0; i < MEDIAINDEX_COST_BUCKETS; i++) {
+		g_string_append_printf(histogram, "%s%u", i ? " " : "",
+				cost->histogram[i]);
+	}
+
+	g_mutex_lock(index->lock);
+	sqlite3_bind_text(stmt, 1, plugin, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 2, key, -1, SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 3, cost->tries);
+	sqlite3_bind_int(stmt, 4, cost->successes);
+	sqlite3_bind_double(stmt, 5, cost->total_ms);
+	sqlite3_bind_text(stmt, 6, histogram->str, -1, SQLITE_STATIC);
+
+	r = sqlite3_step(stmt);
+	if (r != SQLITE_DONE) {
+		fprintf(stderr, "%s: storing cost of %s failed: %s\n",
+				index->fn, plugin, sqlite3_errmsg(index->db));
+	}
+
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	g_mutex_unlock(index->lock);
+	g_string_free(histogram, TRUE);
+
+	return r == SQLITE_DONE ? 0 : 1;
+}
+
+
+
+static int
+checksum_range(GChecksum *checksum, int fd, char *buf, int64_t offset,
+		int64_t len)
+{
+	ssize_t r;
+
+	while (len > 0) {
+		r = pread(fd, buf, len < CHUNK_LEN ? len : CHUNK_LEN,
+				offset);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		if (r <= 0) {
+			return 1;
+		}
+		g_checksum_update(checksum, (const guchar *) buf, r);
+		offset += r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+
+
+int
+mediaindex_fingerprint(const char *fn, int64_t size,
+		char fingerprint[MEDIAINDEX_FINGERPRINT_LEN + 1])
+{
+	GChecksum *checksum;
+	char *buf;
+	int fd;
+	int err;
+
+	if (size > MEDIAINDEX_FINGERPRINT_MAX) {
+		return 1;
+	}
+	fd = open(fn, O_RDONLY);
+	if (fd < 0) {
+		return 1;
+	}
+	buf = malloc(CHUNK_LEN);
+	if (! buf) {
+		close(fd);
+		return 1;
+	}
+
+	checksum = g_checksum_new(G_CHECKSUM_MD5);
+	g_checksum_update(checksum, (const guchar *) &size, sizeof(size));
+
+	err = checksum_range(checksum, fd, buf, 0, size);
+
+	if (! err) {
+		g_strlcpy(fingerprint, g_checksum_get_string(checksum),
+				MEDIAINDEX_FINGERPRINT_LEN + 1);
+	}
+
+	g_checksum_free(checksum);
+	free(buf);
+	close(fd);
+
+	return err;
+}
@@ -0,0 +1,114 @@
+#ifndef MEDIAINDEX_H
+#define MEDIAINDEX_H
+
+#include <stdint.h>
+
+/*
+ * Persistent record of the files thumbnails have been made for, keyed by
+ * monitored path.
+ *
+ * Lets the indexer tell whether a file has changed since it was last
+ * processed without decoding it again. Backed by an SQLite database; safe to
+ * use from several threads.
+ */
+
+#define MEDIAINDEX_FINGERPRINT_LEN 32
+/* larger files get no fingerprint: a change of mtime is taken as one */
+#define MEDIAINDEX_FINGERPRINT_MAX (4 * 1024 * 1024)
+
+struct media_entry {
+	uint64_t dev;
+	uint64_t ino;
+	int64_t size;
+	int64_t mtime;		/* in nanoseconds */
+	char fingerprint[MEDIAINDEX_FINGERPRINT_LEN + 1];
+
+	char *mime;		/* detected mime type, may be NULL */
+	int width, height;	/* of the decoded image, 0 if not known */
+	char *plugin;		/* name of the plugin that succeeded */
+	char *profiles;		/* thumbnail profiles made, see
+				   thumbnail_profiles() */
+};
+
+struct mediaindex;
+
+struct mediaindex *mediaindex_open(const char *fn);
+void mediaindex_close(struct mediaindex *index);
+
+/* 0 if found, the strings in entry are to be freed by media_entry_clear() */
+int mediaindex_lookup(struct mediaindex *index, const char *path,
+		struct media_entry *entry);
+/*
+ * 0 if found, the path of a file whose thumbnails are named after hash, as
+ * thumbnail.c makes it, to be freed
+ */
+int mediaindex_lookup_hash(struct mediaindex *index, const char *hash,
+		char **path);
+int mediaindex_store(struct mediaindex *index, const char *path,
+		const struct media_entry *entry);
+void media_entry_clear(struct media_entry *entry);
+
+int mediaindex_rename(struct mediaindex *index, const char *old_path,
+		const char *new_path);
+int mediaindex_remove(struct mediaindex *index, const char *path);
+/* as above, for everything within a directory */
+int mediaindex_rename_dir(struct mediaindex *index, const char *old_path,
+		const char *new_path);
+int mediaindex_remove_dir(struct mediaindex *index, const char *path);
+
+/*
+ * Files no plugin could make thumbnails of, keyed by device and inode so that
+ * renames keep them, and valid only as long as size and modification time
+ * are the same. Storing an entry for the file forgets its failure.
+ */
+struct media_failure {
+	int attempts;		/* failed in a row */
+	int64_t retry_at;	/* not worth trying before, seconds since epoch */
+	char *reason;		/* how each plugin tried failed */
+};
+
+/* 0 if found for this version of file, free by media_failure_clear() */
+int mediaindex_lookup_failure(struct mediaindex *index,
+		const struct media_entry *file, struct media_failure *failure);
+int mediaindex_store_failure(struct mediaindex *index,
+		const struct media_entry *file,
+		const struct media_failure *failure);
+void media_failure_clear(struct media_failure *failure);
+/* all of them, e.g. when there are new plugins */
+int mediaindex_forget_failures(struct mediaindex *index);
+
+/*
+ * How a plugin fared with the files of one mime type or suffix, see
+ * pluginstats.h.
+ */
+#define MEDIAINDEX_COST_BUCKETS 16
+
+struct media_cost {
+	unsigned int tries;
+	unsigned int successes;
+	double total_ms;	/* spent in all the tries */
+	/* tries taking under 1 ms, 1-2 ms, 2-4 ms... the last one open ended */
+	unsigned int histogram[MEDIAINDEX_COST_BUCKETS];
+};
+
+/* fn is called with the index locked and must not use it */
+typedef void (*mediaindex_cost_fn)(const char *plugin, const char *key,
+		const struct media_cost *cost, void *data);
+int mediaindex_foreach_cost(struct mediaindex *index, mediaindex_cost_fn fn,
+		void *data);
+int mediaindex_store_cost(struct mediaindex *index, const char *plugin,
+		const char *key, const struct media_cost *cost);
+
+/* fn is called with the index locked and must not use it */
+typedef void (*mediaindex_path_fn)(const char *path, void *data);
+int mediaindex_foreach_within(struct mediaindex *index, const char *dir,
+		mediaindex_path_fn fn, void *data);
+
+/*
+ * Digest of the whole contents of file fn of the given size. Fails for files
+ * larger than MEDIAINDEX_FINGERPRINT_MAX.
+ */
+int mediaindex_fingerprint(const char *fn, int64_t size,
+		char fingerprint[MEDIAINDEX_FINGERPRINT_LEN + 1]);
+
+#endif
@@ -1,10 +1,14 @@
 #define FUSE_USE_VERSION 26
-#define _XOPEN_SOURCE 500
+#define _XOPEN_SOURCE 700
 #define FILENAME_MAX 512
 
 #include "mfuse.h"
+#include "mfuse_private.h"
 
 #include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
+#include <signal.h>
 #include <string.h>
 #include <errno.h>
 #include <dirent.h>
@@ -12,23 +16,104 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-static struct mfuse_callbacks mfuse_cb;
-static uint64_t write_fh;
-static char monitor_dir[FILENAME_MAX];
-static char source_dir[FILENAME_MAX];
-static int source_dir_len;
+#define MFUSE_WAKE_SIG SIGUSR2
+
+/* one mounted directory */
+struct mfuse_fs {
+	struct mfuse_callbacks cb;
+	void *user_data;
+	char monitor_dir[FILENAME_MAX];
+	char source_dir[FILENAME_MAX];
+	int source_dir_len;
+
+	char *mountpoint;
+	struct fuse_chan *ch;
+	struct fuse *fuse;
+	int multithreaded;
+	int foreground;
+};
+
+static struct mfuse_fs *mfuse_fs(void)
+{
+	return fuse_get_context()->private_data;
+}
 
-char * monitored_path(const char *sourced_path)
+static char *monitored_path(struct mfuse_fs *fs, const char *sourced_path)
 {
 	char *monitored = (char *)calloc(FILENAME_MAX, sizeof(char));
-	if (strncmp(sourced_path, source_dir, source_dir_len) != 0) {
+	if (strncmp(sourced_path, fs->source_dir, fs->source_dir_len) != 0) {
 		fprintf(stderr, "%s: path not matching prefix %s!\n",
-				sourced_path, source_dir);
+				sourced_path, fs->source_dir);
 	}
-	snprintf(monitored, FILENAME_MAX, "%s/%s", monitor_dir, sourced_path + source_dir_len);
+	snprintf(monitored, FILENAME_MAX, "%s/%s", fs->monitor_dir,
+			sourced_path + fs->source_dir_len);
 	return monitored;
 }
 
+/* file handles (= fds) written to since last flush, indexed by fd */
+static pthread_mutex_t dirty_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char *dirty;
+static size_t dirty_size;
+
+void mfuse_set_dirty(uint64_t fh)
+{
+	pthread_mutex_lock(&dirty_lock);
+	if (fh >= dirty_size) {
+		size_t size = dirty_size ? dirty_size : 64;
+		unsigned char *new;
+		while (size <= fh)
+			size *= 2;
+		new = realloc(dirty, size);
+		if (new == NULL) {
+			fprintf(stderr, "mfuse_set_dirty() : out of memory\n");
+			pthread_mutex_unlock(&dirty_lock);
+			return;
+		}
+		memset(new + dirty_size, 0, size - dirty_size);
+		dirty = new;
+		dirty_size = size;
+	}
+	dirty[fh] = 1;
+	pthread_mutex_unlock(&dirty_lock);
+}
+
+int mfuse_take_dirty(uint64_t fh)
+{
+	int was_dirty = 0;
+
+	pthread_mutex_lock(&dirty_lock);
+	if (fh < dirty_size) {
+		was_dirty = dirty[fh];
+		dirty[fh] = 0;
+	}
+	pthread_mutex_unlock(&dirty_lock);
+
+	return was_dirty;
+}
+
+static void write_closed(const char *path)
+{
+	struct mfuse_fs *fs = mfuse_fs();
+
+	if (path && fs->cb.write_closed) {
+		char *mon = monitored_path(fs, path);
+		fs->cb.write_closed(path, mon, fs->user_data);
+		free(mon);
+	}
+}
+
+static void accessed(const char *path, int is_dir)
+{
+	struct mfuse_fs *fs = mfuse_fs();
+
+	if (fs->cb.accessed) {
+		char *mon = monitored_path(fs, path);
+		mfuse_trim_path(mon);
+		fs->cb.accessed(mon, is_dir, fs->user_data);
+		free(mon);
+	}
+}
+
 static int mfuse_getattr(const char *path, struct stat *stat_buf)
 {
 	int res = lstat(path, stat_buf);
@@ -38,28 +123,77 @@ static int mfuse_getattr(const char *path, struct stat *stat_buf)
 	return 0;
 }
 
+/* open directory stream, kept between readdir calls */
+struct mfuse_dirp {
+	DIR *dp;
+	struct dirent *entry;	/* read but not yet passed to filler */
+	off_t offset;
+};
+
+static int mfuse_opendir(const char *path, struct fuse_file_info *fi)
+{
+	struct mfuse_dirp *d = malloc(sizeof(struct mfuse_dirp));
+	if (d == NULL)
+		return -ENOMEM;
+
+	d->dp = opendir(path);
+	if (d->dp == NULL) {
+		int res = -errno;
+		free(d);
+		return res;
+	}
+	d->entry = NULL;
+	d->offset = 0;
+	fi->fh = (uintptr_t) d;
+
+	return 0;
+}
+
 static int mfuse_readdir(const char *path, void *buf,
 						fuse_fill_dir_t filler, off_t offset,
 						struct fuse_file_info *fi)
 {
-	(void) offset;
-	(void) fi;
+	struct mfuse_dirp *d = (struct mfuse_dirp *) (uintptr_t) fi->fh;
 
-	DIR *dp = opendir(path);
-	if (dp == NULL)
-		return -errno;
+	if (offset == 0)
+		accessed(path, 1);
+
+	if (offset != d->offset) {
+		seekdir(d->dp, offset);
+		d->entry = NULL;
+		d->offset = offset;
+	}
 
-	struct dirent *de;
-	while ((de = readdir(dp)) != NULL) {
+	while (1) {
 		struct stat st;
+		off_t nextoff;
+
+		if (d->entry == NULL) {
+			d->entry = readdir(d->dp);
+			if (d->entry == NULL)
+				break;
+		}
+
 		memset(&st, 0, sizeof(st));
-		st.st_ino = de->d_ino;
-		st.st_mode = de->d_type << 12;
-		if (filler(buf, de->d_name, &st, 0))
+		st.st_ino = d->entry->d_ino;
+		st.st_mode = d->entry->d_type << 12;
+		nextoff = telldir(d->dp);
+		if (filler(buf, d->entry->d_name, &st, nextoff))
 			break;
+
+		d->entry = NULL;
+		d->offset = nextoff;
 	}
 
-	closedir(dp);
+	return 0;
+}
+
+static int mfuse_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	struct mfuse_dirp *d = (struct mfuse_dirp *) (uintptr_t) fi->fh;
+
+	closedir(d->dp);
+	free(d);
 	return 0;
 }
 
@@ -69,6 +203,7 @@ static int mfuse_open(const char *path, struct fuse_file_info *fi)
 	if (fd < 0)
 		return -errno;
 	fi->fh = fd;
+	accessed(path, 0);
 
 	return 0;
 }
@@ -83,6 +218,23 @@ static int mfuse_read(const char *path, char *buf, size_t size,
 	return res;
 }
 
+/* hand the backing fd to FUSE so that data can be spliced */
+static int mfuse_read_buf(const char *path, struct fuse_bufvec **bufp,
+					size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec *src = malloc(sizeof(struct fuse_bufvec));
+	if (src == NULL)
+		return -ENOMEM;
+
+	*src = FUSE_BUFVEC_INIT(size);
+	src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	src->buf[0].fd = fi->fh;
+	src->buf[0].pos = offset;
+	*bufp = src;
+
+	return 0;
+}
+
 static int mfuse_create(const char *path, mode_t mode,
 					struct fuse_file_info *fi)
 {
@@ -90,6 +242,7 @@ static int mfuse_create(const char *path, mode_t mode,
 	if (fd < 0)
 		return -errno;
 	fi->fh = fd;
+	mfuse_set_dirty(fi->fh);
 	printf("create: %s\n", path);
 
 	return 0;
@@ -106,11 +259,12 @@ static int mfuse_mkdir(const char *path, mode_t mode)
 
 static int mfuse_rm(const char *path)
 {
+	struct mfuse_fs *fs = mfuse_fs();
 	int res = unlink(path);
 
-	if (res == 0 && mfuse_cb.removed) {
-		char *mon = monitored_path(path);
-		mfuse_cb.removed(mon, NULL);
+	if (res == 0 && fs->cb.removed) {
+		char *mon = monitored_path(fs, path);
+		fs->cb.removed(mon, fs->user_data);
 		free(mon);
 	}
 
@@ -122,7 +276,15 @@ static int mfuse_rm(const char *path)
 
 static int mfuse_rmdir(const char *path)
 {
+	struct mfuse_fs *fs = mfuse_fs();
 	int res = rmdir(path);
+
+	if (res == 0 && fs->cb.removed_dir) {
+		char *mon = monitored_path(fs, path);
+		fs->cb.removed_dir(mon, fs->user_data);
+		free(mon);
+	}
+
 	if (res < 0)
 		return -errno;
 
@@ -145,23 +307,38 @@ static int mfuse_write(const char *path, const char *buf,
 	int res = pwrite(fi->fh, buf, size, offset);
 	if (res < 0)
 		res = -errno;
+	else
+		mfuse_set_dirty(fi->fh);
 
-	if (write_fh == -1)
-		write_fh = fi->fh;
-	else if (write_fh != fi->fh)
-		fprintf(stderr, "mfuse_write() : re-assigning write_fh\n");
+	return res;
+}
+
+static int mfuse_write_buf(const char *path, struct fuse_bufvec *buf,
+					off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+	int res;
+
+	dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	dst.buf[0].fd = fi->fh;
+	dst.buf[0].pos = offset;
+
+	res = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+	if (res >= 0)
+		mfuse_set_dirty(fi->fh);
 
 	return res;
 }
 
 static int mfuse_rename(const char *old_path, const char *new_path)
 {
+	struct mfuse_fs *fs = mfuse_fs();
 	int res = rename(old_path, new_path);
 
-	if (res == 0 && mfuse_cb.renamed) {
-			char *mon_old = monitored_path(old_path);
-			char *mon_new = monitored_path(new_path);
-			mfuse_cb.renamed(mon_old, new_path, mon_new, NULL);
+	if (res == 0 && fs->cb.renamed) {
+			char *mon_old = monitored_path(fs, old_path);
+			char *mon_new = monitored_path(fs, new_path);
+			fs->cb.renamed(mon_old, new_path, mon_new, fs->user_data);
 			free(mon_old);
 			free(mon_new);
 	}
@@ -262,34 +439,46 @@ static int mfuse_fsync(const char *path, int is_datasync,
 
 static int mfuse_flush(const char *path, struct fuse_file_info *fi)
 {
-	if (write_fh != -1) {
-		if (write_fh != fi->fh) {
-			fprintf(stderr, "mfuse_flush() : wrong write_fh\n");
-			return -1;
-		} else {
-			if (mfuse_cb.write_closed) {
-				char *mon = monitored_path(path);
-				mfuse_cb.write_closed(path, mon, NULL);
-				free(mon);
-			}
-			write_fh = -1;
-		}
-	}
+	if (mfuse_take_dirty(fi->fh))
+		write_closed(path);
+
+	return 0;
+}
+
+static int mfuse_release(const char *path, struct fuse_file_info *fi)
+{
+	/* written but never flushed */
+	if (mfuse_take_dirty(fi->fh))
+		write_closed(path);
 
+	close(fi->fh);
 	return 0;
 }
 
+static void *mfuse_init(struct fuse_conn_info *conn)
+{
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ |
+			FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+
+	return fuse_get_context()->private_data;
+}
+
 static struct fuse_operations mfuse_oper = {
+	.init		= mfuse_init,
 	.getattr	= mfuse_getattr,
+	.opendir	= mfuse_opendir,
 	.readdir	= mfuse_readdir,
+	.releasedir	= mfuse_releasedir,
 	.open		= mfuse_open,
 	.read		= mfuse_read,
+	.read_buf	= mfuse_read_buf,
 	.create		= mfuse_create,
 	.mkdir		= mfuse_mkdir,
 	.unlink		= mfuse_rm,
 	.rmdir		= mfuse_rmdir,
 	.utime		= mfuse_utime,
 	.write		= mfuse_write,
+	.write_buf	= mfuse_write_buf,
 	.rename		= mfuse_rename,
 	.link		= mfuse_link,
 	.symlink	= mfuse_symlink,
@@ -301,10 +490,68 @@ static struct fuse_operations mfuse_oper = {
 	.statfs		= mfuse_statfs,
 	.fsync		= mfuse_fsync,
 	.flush		= mfuse_flush,
+	.release	= mfuse_release,
+};
+
+/*
+ * The thumbnail directory, read only. A thumbnail that is not there may be
+ * one of a lazy profile, made when asked for: the missing callback is given
+ * the chance to, and the lookup repeated.
+ */
+static int make_missing(const char *path)
+{
+	struct mfuse_fs *fs = mfuse_fs();
+
+	if (!fs->cb.missing ||
+			strncmp(path, fs->source_dir, fs->source_dir_len) != 0)
+		return ENOENT;
+	return fs->cb.missing(path + fs->source_dir_len, fs->user_data);
+}
+
+static int thumbs_getattr(const char *path, struct stat *stat_buf)
+{
+	int res = lstat(path, stat_buf);
+	if (res < 0 && errno == ENOENT) {
+		res = make_missing(path);
+		if (res)
+			return -res;
+		res = lstat(path, stat_buf);
+	}
+	if (res < 0)
+		return -errno;
+
+	return 0;
+}
+
+static int thumbs_open(const char *path, struct fuse_file_info *fi)
+{
+	int fd = open(path, fi->flags);
+	if (fd < 0 && errno == ENOENT && make_missing(path) == 0)
+		fd = open(path, fi->flags);
+	if (fd < 0)
+		return -errno;
+	fi->fh = fd;
+
+	return 0;
+}
+
+static struct fuse_operations thumbs_oper = {
+	.init		= mfuse_init,
+	.getattr	= thumbs_getattr,
+	.opendir	= mfuse_opendir,
+	.readdir	= mfuse_readdir,
+	.releasedir	= mfuse_releasedir,
+	.open		= thumbs_open,
+	.read		= mfuse_read,
+	.read_buf	= mfuse_read_buf,
+	.readlink	= mfuse_readlink,
+	.access		= mfuse_access,
+	.statfs		= mfuse_statfs,
+	.release	= mfuse_release,
 };
 
-static void
-trim_path(char *path)
+void
+mfuse_trim_path(char *path)
 {
 	char *ptr;
 	for (ptr = path; *ptr != '\0'; ptr++) {
@@ -326,27 +573,283 @@ trim_path(char *path)
 	}
 }
 
-int mfuse_main(int argc, char *argv[], const char *source_path,
-		const char *monitor_path, const struct mfuse_callbacks *mc,
-		void *user_data)
+static pthread_mutex_t run_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t run_thread;
+static int run_count;
+
+static void wake_handler(int sig)
+{
+}
+
+static void *mount_main(void *data)
+{
+	struct mfuse_mount *m = data;
+	sigset_t wake;
+
+	/* let mfuse_run() interrupt the loop */
+	sigemptyset(&wake);
+	sigaddset(&wake, MFUSE_WAKE_SIG);
+	pthread_sigmask(SIG_UNBLOCK, &wake, NULL);
+
+	m->err = m->loop(m);
+
+	pthread_mutex_lock(&run_lock);
+	if (--run_count == 0)
+		pthread_kill(run_thread, MFUSE_WAKE_SIG);
+	pthread_mutex_unlock(&run_lock);
+	return NULL;
+}
+
+/*
+ * Serve every mount from a thread of its own until all of them are unmounted
+ * or a terminating signal is caught. The signal handlers of libfuse know of
+ * a single session only, so signals are taken here with sigwait() and every
+ * loop is then woken with MFUSE_WAKE_SIG to notice that it has to exit.
+ * SIGUSR1 asks for a rescan, as is done once everything is running, and
+ * SIGHUP for a reload if there is a callback for it.
+ */
+int mfuse_run(struct mfuse_mount *mounts, int count, int foreground,
+		const struct mfuse_callbacks *mc, void *user_data)
+{
+	struct sigaction sa;
+	sigset_t set;
+	int i, sig, running, err = 0;
+
+	if (fuse_daemonize(foreground) == -1)
+		return 1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+	/* no SA_RESTART, blocking calls of the loops must fail with EINTR */
+	sa.sa_handler = wake_handler;
+	sigaction(MFUSE_WAKE_SIG, &sa, NULL);
+
+	/* blocked in every thread created from here on */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGHUP);
+	sigaddset(&set, SIGQUIT);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, MFUSE_WAKE_SIG);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	run_thread = pthread_self();
+	pthread_mutex_lock(&run_lock);
+	for (i = 0; i < count; i++) {
+		if (pthread_create(&mounts[i].thread, NULL, mount_main,
+					&mounts[i])) {
+			fprintf(stderr, "%s: cannot create thread\n",
+					mounts[i].mountpoint);
+			mounts[i].err = 1;
+			continue;
+		}
+		mounts[i].started = 1;
+		run_count++;
+	}
+	pthread_mutex_unlock(&run_lock);
+
+	/* after daemonizing, threads started by the callbacks must survive */
+	if (mc->started)
+		mc->started(user_data);
+	if (mc->rescan)
+		mc->rescan(user_data);
+
+	while (1) {
+		pthread_mutex_lock(&run_lock);
+		running = run_count;
+		pthread_mutex_unlock(&run_lock);
+		if (running == 0)
+			break;
+
+		if (sigwait(&set, &sig) != 0 || sig == MFUSE_WAKE_SIG)
+			continue;
+		if (sig == SIGUSR1) {
+			if (mc->rescan)
+				mc->rescan(user_data);
+			continue;
+		}
+		if (sig == SIGHUP && mc->reload) {
+			mc->reload(user_data);
+			continue;
+		}
+
+		fprintf(stdout, "caught signal %d, exiting\n", sig);
+		for (i = 0; i < count; i++) {
+			if (!mounts[i].started)
+				continue;
+			fuse_session_exit(mounts[i].se);
+			pthread_kill(mounts[i].thread, MFUSE_WAKE_SIG);
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		if (mounts[i].started)
+			pthread_join(mounts[i].thread, NULL);
+		err |= mounts[i].err;
+	}
+
+	return err;
+}
+
+static int mfuse_loop(struct mfuse_mount *m)
 {
+	struct mfuse_fs *fs = m->data;
+
+	if (fs->multithreaded)
+		return fuse_loop_mt(fs->fuse);
+	return fuse_loop(fs->fuse);
+}
+
+static int mfuse_fs_mount(struct mfuse_fs *fs, int argc, char *argv[],
+		const struct mfuse_dir *dir, const struct fuse_operations *oper,
+		int read_only)
+{
+	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	char subdir[FILENAME_MAX + 10];
+	int i, res = 0;
+
 	/* copy and trim source and monitor paths */
-	strcpy(monitor_dir, monitor_path);
-	trim_path(monitor_dir);
+	if (strlen(dir->monitor_path) >= FILENAME_MAX ||
+			strlen(dir->source_path) >= FILENAME_MAX) {
+		fprintf(stderr, "%s: path is too long!\n", dir->monitor_path);
+		return 1;
+	}
+	strcpy(fs->monitor_dir, dir->monitor_path);
+	mfuse_trim_path(fs->monitor_dir);
 
-	strcpy(source_dir, source_path);
-	trim_path(source_dir);
-	if (strlen(source_dir) + 1 >= FILENAME_MAX) {
+	strcpy(fs->source_dir, dir->source_path);
+	mfuse_trim_path(fs->source_dir);
+	snprintf(subdir, sizeof(subdir), "-osubdir=%s", fs->source_dir);
+	if (strlen(fs->source_dir) + 1 >= FILENAME_MAX) {
 		fprintf(stderr, "source_dir is too long!\n");
 		return 1;
 	} else {
-		strcat(source_dir, "/");
+		strcat(fs->source_dir, "/");
+	}
+	fs->source_dir_len = strlen(fs->source_dir);
+
+	/* the subdir module maps mount paths onto the source directory */
+	for (i = 0; i < argc; i++)
+		res |= fuse_opt_add_arg(&args, argv[i]);
+	res |= fuse_opt_add_arg(&args, fs->monitor_dir);
+	res |= fuse_opt_add_arg(&args, "-omodules=subdir");
+	res |= fuse_opt_add_arg(&args, subdir);
+	if (read_only)
+		res |= fuse_opt_add_arg(&args, "-oro");
+	if (res == -1 || fuse_parse_cmdline(&args, &fs->mountpoint,
+				&fs->multithreaded, &fs->foreground) == -1)
+		goto out;
+
+	fs->ch = fuse_mount(fs->mountpoint, &args);
+	if (fs->ch == NULL)
+		goto out;
+
+	fs->fuse = fuse_new(fs->ch, &args, oper, sizeof(*oper), fs);
+	if (fs->fuse == NULL) {
+		fuse_unmount(fs->mountpoint, fs->ch);
+		fs->ch = NULL;
 	}
-	source_dir_len = strlen(source_dir);
 
-	mfuse_cb = *mc;
-	write_fh = -1;
-	return fuse_main(argc, argv, &mfuse_oper, user_data);
+out:
+	fuse_opt_free_args(&args);
+	return fs->fuse == NULL;
+}
+
+static void mfuse_fs_unmount(struct mfuse_fs *fs)
+{
+	if (fs->fuse) {
+		fuse_unmount(fs->mountpoint, fs->ch);
+		fuse_destroy(fs->fuse);
+	}
+	free(fs->mountpoint);
+}
+
+int mfuse_thumbs_mount(struct mfuse_mount *m, int argc, char *argv[],
+		const struct mfuse_thumbs *thumbs,
+		const struct mfuse_callbacks *mc, void *user_data)
+{
+	struct mfuse_fs *fs = calloc(1, sizeof(struct mfuse_fs));
+	struct mfuse_dir dir;
+
+	if (fs == NULL) {
+		fprintf(stderr, "mfuse_thumbs_mount() : out of memory\n");
+		return 1;
+	}
+	/* nothing is written here, only missing thumbnails are told of */
+	fs->cb.missing = mc->missing;
+	fs->user_data = user_data;
+
+	dir.source_path = thumbs->thumb_path;
+	dir.monitor_path = thumbs->mount_path;
+	if (mfuse_fs_mount(fs, argc, argv, &dir, &thumbs_oper, 1)) {
+		fprintf(stderr, "%s: cannot mount\n", thumbs->mount_path);
+		mfuse_fs_unmount(fs);
+		free(fs);
+		return 1;
+	}
+	m->mountpoint = fs->mountpoint;
+	m->se = fuse_get_session(fs->fuse);
+	m->loop = mfuse_loop;
+	m->data = fs;
+
+	return 0;
+}
+
+void mfuse_thumbs_unmount(struct mfuse_mount *m)
+{
+	mfuse_fs_unmount(m->data);
+	free(m->data);
+}
+
+int mfuse_main(int argc, char *argv[], const struct mfuse_dir *dirs,
+		int n_dirs, const struct mfuse_thumbs *thumbs,
+		const struct mfuse_callbacks *mc, void *user_data)
+{
+	struct mfuse_fs *fs;
+	struct mfuse_mount *mounts;
+	struct mfuse_mount *thumbs_mount = NULL;
+	int i, count = 0, foreground = 0;
+	int err = 1;
+
+	fs = calloc(n_dirs, sizeof(struct mfuse_fs));
+	mounts = calloc(n_dirs + 1, sizeof(struct mfuse_mount));
+	if (fs == NULL || mounts == NULL) {
+		fprintf(stderr, "mfuse_main() : out of memory\n");
+		goto out;
+	}
+
+	for (i = 0; i < n_dirs; i++) {
+		fs[i].cb = *mc;
+		fs[i].user_data = user_data;
+		if (mfuse_fs_mount(&fs[i], argc, argv, &dirs[i], &mfuse_oper, 0)) {
+			fprintf(stderr, "%s: cannot mount\n", dirs[i].monitor_path);
+			continue;
+		}
+		mounts[count].mountpoint = fs[i].mountpoint;
+		mounts[count].se = fuse_get_session(fs[i].fuse);
+		mounts[count].loop = mfuse_loop;
+		mounts[count].data = &fs[i];
+		foreground = fs[i].foreground;
+		count++;
+	}
+	if (thumbs && !mfuse_thumbs_mount(&mounts[count], argc, argv, thumbs,
+				mc, user_data))
+		thumbs_mount = &mounts[count++];
+
+	if (count > 0)
+		err = mfuse_run(mounts, count, foreground, mc, user_data);
+
+	if (thumbs_mount)
+		mfuse_thumbs_unmount(thumbs_mount);
+	for (i = 0; i < n_dirs; i++)
+		mfuse_fs_unmount(&fs[i]);
+
+out:
+	free(mounts);
+	free(fs);
+	return err;
 }
 
 /* vim: set ts=4 sw=4: */
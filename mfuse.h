@@ -1,16 +1,62 @@
 #ifndef M_FUSE_H
 #define M_FUSE_H
 
+/* a source directory and the path where it is mounted for monitoring */
+struct mfuse_dir {
+	const char *source_path;
+	const char *monitor_path;
+};
+
+/*
+ * The thumbnail directory and where it is mounted, read only, for thumbnails
+ * of the profiles made only when asked for to be looked up
+ */
+struct mfuse_thumbs {
+	const char *thumb_path;
+	const char *mount_path;
+};
+
 struct mfuse_callbacks {
 	int (*write_closed) (const char *src, const char *dest, void *user_data);
 	int (*renamed) (const char *old_dest, const char *new_src,
 			const char *new_dest, void *user_data);
 	int (*removed) (const char *path, void *user_data);
+	int (*removed_dir) (const char *path, void *user_data);
+	/* directory path is being listed or file path was opened */
+	int (*accessed) (const char *path, int is_dir, void *user_data);
+	/* look for changes made behind our back, at start and on SIGUSR1 */
+	int (*rescan) (void *user_data);
+	/* reload plugins and configuration, on SIGHUP */
+	int (*reload) (void *user_data);
+	/*
+	 * the mounts are being served, by the process and after the fork of
+	 * daemonizing, so that threads may be started
+	 */
+	int (*started) (void *user_data);
+	/*
+	 * path, relative to the thumbnail directory, was looked up through its
+	 * mount and is not there: 0 once it has been made, else an errno
+	 */
+	int (*missing) (const char *path, void *user_data);
 };
 
-int mfuse_main(int argc, char *argv[], const char *source_path,
-		const char *monitor_path, const struct mfuse_callbacks *mc,
-		void *user_data);
+/*
+ * Mount every directory of dirs with the FUSE options in argv (which holds
+ * no mount point), and thumbs if not NULL, and serve them all from this
+ * process until they are unmounted or the process is told to exit.
+ */
+int mfuse_main(int argc, char *argv[], const struct mfuse_dir *dirs,
+		int n_dirs, const struct mfuse_thumbs *thumbs,
+		const struct mfuse_callbacks *mc, void *user_data);
+
+/*
+ * Same as mfuse_main() but uses the inode based low-level backend. A positive
+ * cache_timeout (seconds) enables kernel caching with inotify based
+ * invalidation.
+ */
+int mfuse_ll_main(int argc, char *argv[], const struct mfuse_dir *dirs,
+		int n_dirs, double cache_timeout, const struct mfuse_thumbs *thumbs,
+		const struct mfuse_callbacks *mc, void *user_data);
 
 #endif
 
@@ -0,0 +1,1097 @@
+#define FUSE_USE_VERSION 26
+#define _GNU_SOURCE
+
+/*
+ * Inode based backend on top of the low-level FUSE API.
+ *
+ * Every inode known to the kernel holds an O_PATH descriptor of the backing
+ * file, and all operations work relative to those descriptors with the
+ * *at() system calls. Paths are built only when a callback has to be
+ * reported.
+ *
+ * In caching mode the kernel is allowed to keep attributes, entries and file
+ * pages for a long time. Changes made to the source directory behind the
+ * mount's back are caught with inotify and the affected kernel caches are
+ * invalidated.
+ */
+
+#include "mfuse.h"
+#include "mfuse_private.h"
+
+#include <fuse_lowlevel.h>
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/statvfs.h>
+#include <sys/time.h>
+
+#define PROC_FD_MAX 32
+#define DEFAULT_TIMEOUT 1.0
+#define NOTIFY_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+		IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_ONLYDIR)
+
+struct mll_inode {
+	int fd;					/* O_PATH descriptor */
+	dev_t dev;
+	ino_t ino;
+	uint64_t nlookup;
+	int wd;					/* inotify watch, 0 if none */
+	struct mll_inode *next;	/* hash chain */
+};
+
+struct mll_dirp {
+	DIR *dp;
+	struct dirent *entry;
+	off_t offset;
+};
+
+/* one mounted directory */
+struct mll_fs {
+	struct mfuse_callbacks cb;
+	void *user_data;
+	char monitor_dir[PATH_MAX];
+	char source_dir[PATH_MAX];
+	int source_dir_len;
+
+	struct mll_inode root;
+	pthread_mutex_t table_lock;
+	struct mll_inode **table;
+	size_t table_size;
+	size_t table_count;
+
+	/* caching mode */
+	double cache_timeout;
+	int caching;
+	struct fuse_chan *chan;
+	int notify_fd;
+	pthread_t notify_thread;
+	struct mll_inode **watches;	/* indexed by watch descriptor */
+	int watches_size;
+
+	char *mountpoint;
+	struct fuse_session *se;
+	int multithreaded;
+	int foreground;
+};
+
+static struct mll_inode *mll_inode(struct mll_fs *fs, fuse_ino_t ino)
+{
+	if (ino == FUSE_ROOT_ID)
+		return &fs->root;
+	return (struct mll_inode *) (uintptr_t) ino;
+}
+
+static void proc_path(char *buf, int fd)
+{
+	snprintf(buf, PROC_FD_MAX, "/proc/self/fd/%d", fd);
+}
+
+static size_t hash_inode(struct mll_fs *fs, dev_t dev, ino_t ino)
+{
+	return ((size_t) ino ^ ((size_t) dev << 7)) & (fs->table_size - 1);
+}
+
+/* called with table_lock held */
+static int grow_table(struct mll_fs *fs)
+{
+	size_t new_size = fs->table_size ? fs->table_size * 2 : 1024;
+	struct mll_inode **new;
+	size_t i;
+
+	new = calloc(new_size, sizeof(struct mll_inode *));
+	if (new == NULL)
+		return -1;
+
+	for (i = 0; i < fs->table_size; i++) {
+		struct mll_inode *inode = fs->table[i];
+		while (inode) {
+			struct mll_inode *next = inode->next;
+			size_t h = ((size_t) inode->ino ^
+					((size_t) inode->dev << 7)) & (new_size - 1);
+			inode->next = new[h];
+			new[h] = inode;
+			inode = next;
+		}
+	}
+	free(fs->table);
+	fs->table = new;
+	fs->table_size = new_size;
+	return 0;
+}
+
+/* called with table_lock held */
+static struct mll_inode *find_inode(struct mll_fs *fs, dev_t dev, ino_t ino)
+{
+	struct mll_inode *inode;
+
+	if (fs->table_size == 0)
+		return NULL;
+	for (inode = fs->table[hash_inode(fs, dev, ino)]; inode;
+			inode = inode->next)
+		if (inode->dev == dev && inode->ino == ino)
+			return inode;
+	return NULL;
+}
+
+/* called with table_lock held */
+static void unhash_inode(struct mll_fs *fs, struct mll_inode *inode)
+{
+	struct mll_inode **p = &fs->table[hash_inode(fs, inode->dev, inode->ino)];
+
+	while (*p && *p != inode)
+		p = &(*p)->next;
+	if (*p) {
+		*p = inode->next;
+		fs->table_count--;
+	}
+}
+
+static fuse_ino_t inode_id(struct mll_fs *fs, struct mll_inode *inode)
+{
+	return inode == &fs->root ? FUSE_ROOT_ID : (uintptr_t) inode;
+}
+
+/* called with table_lock held */
+static void add_watch(struct mll_fs *fs, struct mll_inode *inode)
+{
+	char proc[PROC_FD_MAX];
+	int wd;
+
+	if (fs->notify_fd < 0)
+		return;
+
+	proc_path(proc, inode->fd);
+	wd = inotify_add_watch(fs->notify_fd, proc, NOTIFY_MASK);
+	if (wd < 0) {
+		fprintf(stderr, "cannot watch directory: %s\n", strerror(errno));
+		return;
+	}
+	if (wd >= fs->watches_size) {
+		int size = fs->watches_size ? fs->watches_size : 256;
+		struct mll_inode **new;
+		while (size <= wd)
+			size *= 2;
+		new = realloc(fs->watches, size * sizeof(struct mll_inode *));
+		if (new == NULL) {
+			inotify_rm_watch(fs->notify_fd, wd);
+			return;
+		}
+		memset(new + fs->watches_size, 0,
+				(size - fs->watches_size) * sizeof(struct mll_inode *));
+		fs->watches = new;
+		fs->watches_size = size;
+	}
+	fs->watches[wd] = inode;
+	inode->wd = wd;
+}
+
+/* called with table_lock held */
+static void remove_watch(struct mll_fs *fs, struct mll_inode *inode)
+{
+	if (inode->wd <= 0)
+		return;
+	inotify_rm_watch(fs->notify_fd, inode->wd);
+	fs->watches[inode->wd] = NULL;
+	inode->wd = 0;
+}
+
+static int mll_do_lookup(struct mll_fs *fs, fuse_ino_t parent,
+						const char *name, struct fuse_entry_param *e)
+{
+	struct mll_inode *inode;
+	int fd, res;
+
+	memset(e, 0, sizeof(*e));
+	e->attr_timeout = fs->cache_timeout;
+	e->entry_timeout = fs->cache_timeout;
+
+	fd = openat(mll_inode(fs, parent)->fd, name, O_PATH | O_NOFOLLOW);
+	if (fd < 0)
+		return errno;
+
+	res = fstatat(fd, "", &e->attr, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+	if (res < 0) {
+		res = errno;
+		close(fd);
+		return res;
+	}
+
+	pthread_mutex_lock(&fs->table_lock);
+	inode = find_inode(fs, e->attr.st_dev, e->attr.st_ino);
+	if (inode) {
+		close(fd);
+	} else {
+		if (fs->table_count >= fs->table_size && grow_table(fs) < 0) {
+			pthread_mutex_unlock(&fs->table_lock);
+			close(fd);
+			return ENOMEM;
+		}
+		inode = calloc(1, sizeof(struct mll_inode));
+		if (inode == NULL) {
+			pthread_mutex_unlock(&fs->table_lock);
+			close(fd);
+			return ENOMEM;
+		}
+		inode->fd = fd;
+		inode->dev = e->attr.st_dev;
+		inode->ino = e->attr.st_ino;
+		inode->next = fs->table[hash_inode(fs, inode->dev, inode->ino)];
+		fs->table[hash_inode(fs, inode->dev, inode->ino)] = inode;
+		fs->table_count++;
+		if (fs->caching && S_ISDIR(e->attr.st_mode))
+			add_watch(fs, inode);
+	}
+	inode->nlookup++;
+	pthread_mutex_unlock(&fs->table_lock);
+
+	e->ino = (uintptr_t) inode;
+	return 0;
+}
+
+static void mll_forget_one(struct mll_fs *fs, fuse_ino_t ino, uint64_t nlookup)
+{
+	struct mll_inode *inode = mll_inode(fs, ino);
+
+	if (inode == &fs->root)
+		return;
+
+	pthread_mutex_lock(&fs->table_lock);
+	inode->nlookup -= nlookup < inode->nlookup ? nlookup : inode->nlookup;
+	if (inode->nlookup == 0) {
+		remove_watch(fs, inode);
+		unhash_inode(fs, inode);
+		close(inode->fd);
+		free(inode);
+	}
+	pthread_mutex_unlock(&fs->table_lock);
+}
+
+/* path of the backing file of fd relative to monitor_dir */
+static int source_path(char *buf, size_t len, int fd)
+{
+	char proc[PROC_FD_MAX];
+	ssize_t res;
+
+	proc_path(proc, fd);
+	res = readlink(proc, buf, len - 1);
+	if (res < 0 || res == len - 1)
+		return -1;
+	buf[res] = '\0';
+
+	/* removed files can't be reported */
+	if (res > 10 && strcmp(buf + res - 10, " (deleted)") == 0)
+		return -1;
+	return 0;
+}
+
+static int child_source_path(struct mll_fs *fs, char *buf, size_t len,
+						fuse_ino_t parent, const char *name)
+{
+	size_t dir_len;
+
+	if (source_path(buf, len, mll_inode(fs, parent)->fd) < 0)
+		return -1;
+	dir_len = strlen(buf);
+	if (snprintf(buf + dir_len, len - dir_len, "/%s", name) >= len - dir_len)
+		return -1;
+	return 0;
+}
+
+static int monitored_path(struct mll_fs *fs, char *buf, size_t len,
+						const char *src)
+{
+	const char *rel;
+
+	if (strncmp(src, fs->source_dir, fs->source_dir_len) == 0) {
+		rel = src + fs->source_dir_len;
+	} else if (strncmp(src, fs->source_dir, fs->source_dir_len - 1) == 0 &&
+			src[fs->source_dir_len - 1] == '\0') {
+		rel = "";
+	} else {
+		fprintf(stderr, "%s: path not matching prefix %s!\n",
+				src, fs->source_dir);
+		return -1;
+	}
+	if (snprintf(buf, len, "%s/%s", fs->monitor_dir, rel) >= len)
+		return -1;
+	return 0;
+}
+
+static void write_closed(struct mll_fs *fs, int fd)
+{
+	char src[PATH_MAX];
+	char mon[PATH_MAX];
+
+	if (fs->cb.write_closed == NULL)
+		return;
+	if (source_path(src, sizeof(src), fd) < 0 ||
+			monitored_path(fs, mon, sizeof(mon), src) < 0)
+		return;
+	fs->cb.write_closed(src, mon, fs->user_data);
+}
+
+static void accessed(struct mll_fs *fs, int fd, int is_dir)
+{
+	char src[PATH_MAX];
+	char mon[PATH_MAX];
+
+	if (fs->cb.accessed == NULL)
+		return;
+	if (source_path(src, sizeof(src), fd) < 0 ||
+			monitored_path(fs, mon, sizeof(mon), src) < 0)
+		return;
+	mfuse_trim_path(mon);
+	fs->cb.accessed(mon, is_dir, fs->user_data);
+}
+
+static void mll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct mll_fs *fs = fuse_req_userdata(req);
+	struct fuse_entry_param e;
+	int err = mll_do_lookup(fs, parent, name, &e);
+
+	if (err)
+		fuse_reply_err(req, err);
+	else
+		fuse_reply_entry(req, &e);
+}
+
+static void mll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+	struct mll_fs *fs = fuse_req_userdata(req);
+
+	mll_forget_one(fs, ino, nlookup);
+	fuse_reply_none(req);
+}
+
+static void mll_getattr(fuse_req_t req, fuse_ino_t ino,
+						struct fuse_file_info *fi)
+{
+	struct mll_fs *fs = fuse_req_userdata(req);
+	struct stat st;
+	int res = fstatat(mll_inode(fs, ino)->fd, "", &st,
+			AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+	if (res < 0)
+		fuse_reply_err(req, errno);
+	else
+		fuse_reply_attr(req, &st, fs->cache_timeout);
+}
+
+static void mll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+						int valid, struct fuse_file_info *fi)
+{
+	struct mll_fs *fs = fuse_req_userdata(req);
+	struct mll_inode *inode = mll_inode(fs, ino);
+	char proc[PROC_FD_MAX];
+	int res;
+
+	proc_path(proc, inode->fd);
+
+	if (valid & FUSE_SET_ATTR_MODE) {
+		res = chmod(proc, attr->st_mode);
+		if (res < 0)
+			goto out_err;
+	}
+	if (valid & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+		uid_t uid = (valid & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t) -1;
+		gid_t gid = (valid & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t) -1;
+		res = fchownat(inode->fd, "", uid, gid,
+				AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+		if (res < 0)
+			goto out_err;
+	}
+	if (valid & FUSE_SET_ATTR_SIZE) {
+		if (fi) {
+			res = ftruncate(fi->fh, attr->st_size);
+			if (res == 0)
+				mfuse_set_dirty(fi->fh);
+		} else {
+			res = truncate(proc, attr->st_size);
+		}
+		if (res < 0)
+			goto out_err;
+	}
+	if (valid & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
+		struct timespec tv[2];
+
+		tv[0].tv_sec = tv[1].tv_sec = 0;
+		tv[0].tv_nsec = tv[1].tv_nsec = UTIME_OMIT;
+		if (valid & FUSE_SET_ATTR_ATIME_NOW)
+			tv[0].tv_nsec = UTIME_NOW;
+		else if (valid & FUSE_SET_ATTR_ATIME)
+			tv[0] = attr->st_atim;
+		if (valid & FUSE_SET_ATTR_MTIME_NOW)
+			tv[1].tv_nsec = UTIME_NOW;
+		else if (valid & FUSE_SET_ATTR_MTIME)
+			tv[1] = attr->st_mtim;
+
+		if (fi)
+			res = futimens(fi->fh, tv);
+		else
+			res = utimensat(AT_FDCWD, proc, tv, 0);
+		if (res < 0)
+			goto out_err;
+	}
+
+	mll_getattr(req, ino, fi);
+	return;
+
+out_err:
+	fuse_reply_err(req, errno);
+}
+
+static void mll_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+	struct mll_fs *fs = fuse_req_userdata(req);
+	char buf[PATH_MAX + 1];
+	int res = readlinkat(mll_inode(fs, ino)->fd, "", buf, sizeof(buf));
+	if (res < 0)
+		fuse_reply_err(req, errno);
+	else if (res == sizeof(buf))
+		fuse_reply_err(req, ENAMETOOLONG);
+	else {
+		buf[res] = '\0';
+		fuse_reply_readlink(req, buf);
+	}
+}
+
+static void mll_reply_new_entry(fuse_req_t req, fuse_ino_t parent,
+						const char *name, int res)
+{
+	struct mll_fs *fs = fuse_req_userdata(req);
+	struct fuse_entry_param e;
+	int err;
+
+	if (res < 0) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+	err = mll_do_lookup(fs, parent, name, &e);
+	if (err)
+		fuse_reply_err(req, err);
+	else
+		fuse_reply_entry(req, &e);
+}
+
+static void mll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+						mode_t mode)
+{
+	struct mll_fs *fs = fuse_req_userdata(req);
+	int res = mkdirat(mll_inode(fs, parent)->fd, name, mode);
+	mll_reply_new_entry(req, parent, name, res);
+}
+
+static void mll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+						const char *name)
+{
+	struct mll_fs *fs = fuse_req_userdata(req);
+	int res = symlinkat(link, mll_inode(fs, parent)->fd, name);
+	mll_reply_new_entry(req, parent, name, res);
+}
+
+static void mll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t parent,
+						const char *name)
+{
+	struct mll_fs *fs = fuse_req_userdata(req);
+	char proc[PROC_FD_MAX];
+	int res;
+
+	proc_path(proc, mll_inode(fs, ino)->fd);
+	res = linkat(AT_FDCWD, proc, mll_inode(fs, parent)->fd, name,
+			AT_SYMLINK_FOLLOW);
+	mll_reply_new_entry(req, parent, name, res);
+}
+
+static void mll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct mll_fs *fs = fuse_req_userdata(req);
+	char src[PATH_MAX];
+	char mon[PATH_MAX];
+	int have_path;
+	int res;
+
+	/* resolve before the name is gone */
+	have_path = fs->cb.removed &&
+		child_source_path(fs, src, sizeof(src), parent, name) == 0 &&
+		monitored_path(fs, mon, sizeof(mon), src) == 0;
+
+	res = unlinkat(mll_inode(fs, parent)->fd, name, 0);
+	if (res == 0 && have_path)
+		fs->cb.removed(mon, fs->user_data);
+
+	fuse_reply_err(req, res < 0 ? errno : 0);
+}
+
+static void mll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct mll_fs *fs = fuse_req_userdata(req);
+	char src[PATH_MAX];
+	char mon[PATH_MAX];
+	int have_path;
+	int res;
+
+	have_path = fs->cb.removed_dir &&
+		child_source_path(fs, src, sizeof(src), parent, name) == 0 &&
+		monitored_path(fs, mon, sizeof(mon), src) == 0;
+
+	res = unlinkat(mll_inode(fs, parent)->fd, name, AT_REMOVEDIR);
+	if (res == 0 && have_path)
+		fs->cb.removed_dir(mon, fs->user_data);
+
+	fuse_reply_err(req, res < 0 ? errno : 0);
+}
+
+static void mll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+						fuse_ino_t newparent, const char *newname)
+{
+	struct mll_fs *fs = fuse_req_userdata(req);
+	char old_src[PATH_MAX], new_src[PATH_MAX];
+	char old_mon[PATH_MAX], new_mon[PATH_MAX];
+	int have_paths;
+	int res;
+
+	have_paths = fs->cb.renamed &&
+		child_source_path(fs, old_src, sizeof(old_src), parent,
+				name) == 0 &&
+		child_source_path(fs, new_src, sizeof(new_src), newparent,
+				newname) == 0 &&
+		monitored_path(fs, old_mon, sizeof(old_mon), old_src) == 0 &&
+		monitored_path(fs, new_mon, sizeof(new_mon), new_src) == 0;
+
+	res = renameat(mll_inode(fs, parent)->fd, name,
+			mll_inode(fs, newparent)->fd, newname);
+	if (res == 0 && have_paths)
+		fs->cb.renamed(old_mon, new_src, new_mon, fs->user_data);
+
+	fuse_reply_err(req, res < 0 ? errno : 0);
+}
+
+static void mll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct mll_fs *fs = fuse_req_userdata(req);
+	char proc[PROC_FD_MAX];
+	int fd;
+
+	proc_path(proc, mll_inode(fs, ino)->fd);
+	fd = open(proc, fi->flags & ~O_NOFOLLOW);
+	if (fd < 0) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+	fi->fh = fd;
+	fi->keep_cache = fs->caching;
+	/* fd may be released as soon as the reply is out */
+	accessed(fs, fd, 0);
+	fuse_reply_open(req, fi);
+}
+
+static void mll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+						mode_t mode, struct fuse_file_info *fi)
+{
+	struct mll_fs *fs = fuse_req_userdata(req);
+	struct fuse_entry_param e;
+	int fd, err;
+
+	fd = openat(mll_inode(fs, parent)->fd, name,
+			(fi->flags | O_CREAT) & ~O_NOFOLLOW, mode);
+	if (fd < 0) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	err = mll_do_lookup(fs, parent, name, &e);
+	if (err) {
+		close(fd);
+		fuse_reply_err(req, err);
+		return;
+	}
+
+	fi->fh = fd;
+	mfuse_set_dirty(fi->fh);
+	fuse_reply_create(req, &e, fi);
+}
+
+static void mll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+						off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+
+	/* let FUSE splice straight from the backing file */
+	buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	buf.buf[0].fd = fi->fh;
+	buf.buf[0].pos = offset;
+
+	fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+}
+
+static void mll_write_buf(fuse_req_t req, fuse_ino_t ino,
+						struct fuse_bufvec *in_buf, off_t offset,
+						struct fuse_file_info *fi)
+{
+	struct fuse_bufvec out_buf = FUSE_BUFVEC_INIT(fuse_buf_size(in_buf));
+	ssize_t res;
+
+	out_buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	out_buf.buf[0].fd = fi->fh;
+	out_buf.buf[0].pos = offset;
+
+	res = fuse_buf_copy(&out_buf, in_buf, FUSE_BUF_SPLICE_NONBLOCK);
+	if (res < 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	mfuse_set_dirty(fi->fh);
+	fuse_reply_write(req, res);
+}
+
+static void mll_flush(fuse_req_t req, fuse_ino_t ino,
+						struct fuse_file_info *fi)
+{
+	struct mll_fs *fs = fuse_req_userdata(req);
+
+	if (mfuse_take_dirty(fi->fh))
+		write_closed(fs, fi->fh);
+	fuse_reply_err(req, 0);
+}
+
+static void mll_release(fuse_req_t req, fuse_ino_t ino,
+						struct fuse_file_info *fi)
+{
+	struct mll_fs *fs = fuse_req_userdata(req);
+
+	/* written but never flushed */
+	if (mfuse_take_dirty(fi->fh))
+		write_closed(fs, fi->fh);
+	close(fi->fh);
+	fuse_reply_err(req, 0);
+}
+
+static void mll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+						struct fuse_file_info *fi)
+{
+	int res = datasync ? fdatasync(fi->fh) : fsync(fi->fh);
+	fuse_reply_err(req, res < 0 ? errno : 0);
+}
+
+static void mll_opendir(fuse_req_t req, fuse_ino_t ino,
+						struct fuse_file_info *fi)
+{
+	struct mll_fs *fs = fuse_req_userdata(req);
+	struct mll_dirp *d;
+	int fd;
+
+	d = calloc(1, sizeof(struct mll_dirp));
+	if (d == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	fd = openat(mll_inode(fs, ino)->fd, ".", O_RDONLY | O_DIRECTORY);
+	if (fd < 0 || (d->dp = fdopendir(fd)) == NULL) {
+		int err = errno;
+		if (fd >= 0)
+			close(fd);
+		free(d);
+		fuse_reply_err(req, err);
+		return;
+	}
+
+	fi->fh = (uintptr_t) d;
+	fuse_reply_open(req, fi);
+}
+
+static void mll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+						off_t offset, struct fuse_file_info *fi)
+{
+	struct mll_dirp *d = (struct mll_dirp *) (uintptr_t) fi->fh;
+	char *buf, *p;
+	size_t rem;
+
+	if (offset == 0)
+		accessed(fuse_req_userdata(req), dirfd(d->dp), 1);
+
+	buf = calloc(1, size);
+	if (buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	if (offset != d->offset) {
+		seekdir(d->dp, offset);
+		d->entry = NULL;
+		d->offset = offset;
+	}
+
+	p = buf;
+	rem = size;
+	while (1) {
+		struct stat st;
+		size_t entsize;
+		off_t nextoff;
+
+		if (d->entry == NULL) {
+			d->entry = readdir(d->dp);
+			if (d->entry == NULL)
+				break;
+		}
+
+		memset(&st, 0, sizeof(st));
+		st.st_ino = d->entry->d_ino;
+		st.st_mode = d->entry->d_type << 12;
+		nextoff = telldir(d->dp);
+		entsize = fuse_add_direntry(req, p, rem, d->entry->d_name,
+				&st, nextoff);
+		if (entsize > rem)
+			break;
+
+		p += entsize;
+		rem -= entsize;
+		d->entry = NULL;
+		d->offset = nextoff;
+	}
+
+	fuse_reply_buf(req, buf, size - rem);
+	free(buf);
+}
+
+static void mll_releasedir(fuse_req_t req, fuse_ino_t ino,
+						struct fuse_file_info *fi)
+{
+	struct mll_dirp *d = (struct mll_dirp *) (uintptr_t) fi->fh;
+
+	closedir(d->dp);
+	free(d);
+	fuse_reply_err(req, 0);
+}
+
+static void mll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct mll_fs *fs = fuse_req_userdata(req);
+	char proc[PROC_FD_MAX];
+	struct statvfs stbuf;
+	int res;
+
+	proc_path(proc, mll_inode(fs, ino)->fd);
+	res = statvfs(proc, &stbuf);
+	if (res < 0)
+		fuse_reply_err(req, errno);
+	else
+		fuse_reply_statfs(req, &stbuf);
+}
+
+static void mll_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+	struct mll_fs *fs = fuse_req_userdata(req);
+	char proc[PROC_FD_MAX];
+	int res;
+
+	proc_path(proc, mll_inode(fs, ino)->fd);
+	res = access(proc, mask);
+	fuse_reply_err(req, res < 0 ? errno : 0);
+}
+
+static void mll_notify_event(struct mll_fs *fs,
+						const struct inotify_event *ev)
+{
+	fuse_ino_t parent = 0, child = 0;
+	struct stat st;
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		fprintf(stderr, "inotify queue overflow, "
+				"kernel caches may be stale\n");
+		return;
+	}
+
+	pthread_mutex_lock(&fs->table_lock);
+	if (ev->wd > 0 && ev->wd < fs->watches_size && fs->watches[ev->wd]) {
+		struct mll_inode *dir = fs->watches[ev->wd];
+
+		parent = inode_id(fs, dir);
+		if (ev->mask & IN_IGNORED) {
+			fs->watches[ev->wd] = NULL;
+			dir->wd = 0;
+		} else if (ev->len && (ev->mask & (IN_ATTRIB | IN_CLOSE_WRITE)) &&
+				fstatat(dir->fd, ev->name, &st,
+					AT_SYMLINK_NOFOLLOW) == 0) {
+			struct mll_inode *inode = find_inode(fs, st.st_dev,
+					st.st_ino);
+			if (inode)
+				child = inode_id(fs, inode);
+		}
+	}
+	pthread_mutex_unlock(&fs->table_lock);
+
+	/*
+	 * Notifications are sent without table_lock: the kernel may have to
+	 * wait for requests that need the lock. A stale id is harmless, the
+	 * kernel ignores unknown inodes.
+	 */
+	if (parent == 0)
+		return;
+	if (ev->len && (ev->mask & (IN_CREATE | IN_DELETE |
+					IN_MOVED_FROM | IN_MOVED_TO))) {
+		fuse_lowlevel_notify_inval_entry(fs->chan, parent, ev->name,
+				strlen(ev->name));
+		fuse_lowlevel_notify_inval_inode(fs->chan, parent, -1, 0);
+	}
+	if (ev->len == 0 && (ev->mask & IN_ATTRIB))
+		fuse_lowlevel_notify_inval_inode(fs->chan, parent, -1, 0);
+	if (child)
+		fuse_lowlevel_notify_inval_inode(fs->chan, child, 0, 0);
+}
+
+static void *mll_notify_main(void *data)
+{
+	struct mll_fs *fs = data;
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t len;
+	char *p;
+
+	while (1) {
+		len = read(fs->notify_fd, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "inotify: %s\n", strerror(errno));
+			break;
+		}
+		for (p = buf; p < buf + len;
+				p += sizeof(struct inotify_event) + ev->len) {
+			ev = (const struct inotify_event *) p;
+			mll_notify_event(fs, ev);
+		}
+	}
+
+	return NULL;
+}
+
+/* must be called after daemonising, threads don't survive fork() */
+static int mll_notify_start(struct mll_fs *fs)
+{
+	fs->notify_fd = inotify_init();
+	if (fs->notify_fd < 0) {
+		fprintf(stderr, "inotify: %s\n", strerror(errno));
+		return -1;
+	}
+
+	pthread_mutex_lock(&fs->table_lock);
+	add_watch(fs, &fs->root);
+	pthread_mutex_unlock(&fs->table_lock);
+
+	if (pthread_create(&fs->notify_thread, NULL, mll_notify_main, fs)) {
+		fprintf(stderr, "cannot create inotify thread\n");
+		close(fs->notify_fd);
+		fs->notify_fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+static void mll_notify_stop(struct mll_fs *fs)
+{
+	if (fs->notify_fd < 0)
+		return;
+	pthread_cancel(fs->notify_thread);
+	pthread_join(fs->notify_thread, NULL);
+	close(fs->notify_fd);
+	fs->notify_fd = -1;
+	free(fs->watches);
+	fs->watches = NULL;
+	fs->watches_size = 0;
+}
+
+static void mll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ |
+			FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+}
+
+static struct fuse_lowlevel_ops mll_oper = {
+	.init		= mll_init,
+	.lookup		= mll_lookup,
+	.forget		= mll_forget,
+	.getattr	= mll_getattr,
+	.setattr	= mll_setattr,
+	.readlink	= mll_readlink,
+	.mkdir		= mll_mkdir,
+	.symlink	= mll_symlink,
+	.link		= mll_link,
+	.unlink		= mll_unlink,
+	.rmdir		= mll_rmdir,
+	.rename		= mll_rename,
+	.open		= mll_open,
+	.create		= mll_create,
+	.read		= mll_read,
+	.write_buf	= mll_write_buf,
+	.flush		= mll_flush,
+	.release	= mll_release,
+	.fsync		= mll_fsync,
+	.opendir	= mll_opendir,
+	.readdir	= mll_readdir,
+	.releasedir	= mll_releasedir,
+	.statfs		= mll_statfs,
+	.access		= mll_access,
+};
+
+/* runs in the mount's own thread, after daemonising */
+static int mll_loop(struct mfuse_mount *m)
+{
+	struct mll_fs *fs = m->data;
+	int err;
+
+	if (fs->caching && mll_notify_start(fs) < 0) {
+		/* can't keep caches coherent */
+		fs->caching = 0;
+		fs->cache_timeout = DEFAULT_TIMEOUT;
+	}
+	if (fs->multithreaded)
+		err = fuse_session_loop_mt(fs->se);
+	else
+		err = fuse_session_loop(fs->se);
+	mll_notify_stop(fs);
+
+	return err;
+}
+
+static int mll_fs_mount(struct mll_fs *fs, int argc, char *argv[],
+		const struct mfuse_dir *dir)
+{
+	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	struct stat st;
+	int i, res = 0;
+
+	if (strlen(dir->monitor_path) >= PATH_MAX) {
+		fprintf(stderr, "monitor_dir is too long!\n");
+		return 1;
+	}
+	strcpy(fs->monitor_dir, dir->monitor_path);
+	mfuse_trim_path(fs->monitor_dir);
+
+	/* readlink() of /proc/self/fd gives canonical paths */
+	if (realpath(dir->source_path, fs->source_dir) == NULL) {
+		fprintf(stderr, "%s: %s\n", dir->source_path, strerror(errno));
+		return 1;
+	}
+	if (strlen(fs->source_dir) + 1 >= PATH_MAX) {
+		fprintf(stderr, "source_dir is too long!\n");
+		return 1;
+	}
+	strcat(fs->source_dir, "/");
+	fs->source_dir_len = strlen(fs->source_dir);
+
+	fs->root.fd = open(fs->source_dir, O_PATH);
+	if (fs->root.fd < 0 || fstat(fs->root.fd, &st) < 0) {
+		fprintf(stderr, "%s: %s\n", fs->source_dir, strerror(errno));
+		if (fs->root.fd >= 0)
+			close(fs->root.fd);
+		fs->root.fd = -1;
+		return 1;
+	}
+	fs->root.dev = st.st_dev;
+	fs->root.ino = st.st_ino;
+	fs->root.nlookup = 2;
+
+	for (i = 0; i < argc; i++)
+		res |= fuse_opt_add_arg(&args, argv[i]);
+	res |= fuse_opt_add_arg(&args, fs->monitor_dir);
+	if (res == -1 || fuse_parse_cmdline(&args, &fs->mountpoint,
+				&fs->multithreaded, &fs->foreground) == -1)
+		goto out;
+
+	fs->chan = fuse_mount(fs->mountpoint, &args);
+	if (fs->chan == NULL)
+		goto out;
+
+	fs->se = fuse_lowlevel_new(&args, &mll_oper, sizeof(mll_oper), fs);
+	if (fs->se == NULL) {
+		fuse_unmount(fs->mountpoint, fs->chan);
+		fs->chan = NULL;
+		goto out;
+	}
+	fuse_session_add_chan(fs->se, fs->chan);
+
+out:
+	fuse_opt_free_args(&args);
+	return fs->se == NULL;
+}
+
+static void mll_fs_unmount(struct mll_fs *fs)
+{
+	if (fs->se) {
+		fuse_session_remove_chan(fs->chan);
+		fuse_session_destroy(fs->se);
+		fuse_unmount(fs->mountpoint, fs->chan);
+	}
+	free(fs->mountpoint);
+	if (fs->root.fd >= 0)
+		close(fs->root.fd);
+	pthread_mutex_destroy(&fs->table_lock);
+}
+
+int mfuse_ll_main(int argc, char *argv[], const struct mfuse_dir *dirs,
+		int n_dirs, double timeout, const struct mfuse_thumbs *thumbs,
+		const struct mfuse_callbacks *mc, void *user_data)
+{
+	struct mll_fs *fs;
+	struct mfuse_mount *mounts;
+	struct mfuse_mount *thumbs_mount = NULL;
+	int i, count = 0, foreground = 0;
+	int err = 1;
+
+	fs = calloc(n_dirs, sizeof(struct mll_fs));
+	mounts = calloc(n_dirs + 1, sizeof(struct mfuse_mount));
+	if (fs == NULL || mounts == NULL) {
+		fprintf(stderr, "mfuse_ll_main() : out of memory\n");
+		goto out;
+	}
+
+	for (i = 0; i < n_dirs; i++) {
+		fs[i].cb = *mc;
+		fs[i].user_data = user_data;
+		fs[i].root.fd = -1;
+		pthread_mutex_init(&fs[i].table_lock, NULL);
+		fs[i].caching = timeout > 0.0;
+		fs[i].cache_timeout = fs[i].caching ? timeout : DEFAULT_TIMEOUT;
+		fs[i].notify_fd = -1;
+
+		if (mll_fs_mount(&fs[i], argc, argv, &dirs[i])) {
+			fprintf(stderr, "%s: cannot mount\n", dirs[i].monitor_path);
+			continue;
+		}
+		mounts[count].mountpoint = fs[i].mountpoint;
+		mounts[count].se = fs[i].se;
+		mounts[count].loop = mll_loop;
+		mounts[count].data = &fs[i];
+		foreground = fs[i].foreground;
+		count++;
+	}
+	/* nothing to invalidate there, the path based backend does */
+	if (thumbs && !mfuse_thumbs_mount(&mounts[count], argc, argv, thumbs,
+				mc, user_data))
+		thumbs_mount = &mounts[count++];
+
+	if (count > 0)
+		err = mfuse_run(mounts, count, foreground, mc, user_data);
+
+	if (thumbs_mount)
+		mfuse_thumbs_unmount(thumbs_mount);
+	for (i = 0; i < n_dirs; i++)
+		mll_fs_unmount(&fs[i]);
+
+out:
+	free(mounts);
+	free(fs);
+	return err;
+}
+
+/* vim: set ts=4 sw=4: */
@@ -0,0 +1,45 @@
+#ifndef M_FUSE_PRIVATE_H
+#define M_FUSE_PRIVATE_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+struct fuse_session;
+
+/* helpers shared by the path based and the inode based backends */
+
+void mfuse_set_dirty(uint64_t fh);
+int mfuse_take_dirty(uint64_t fh);
+
+void mfuse_trim_path(char *path);
+
+/* a mounted session, served by a thread of its own in mfuse_run() */
+struct mfuse_mount {
+	const char *mountpoint;
+	struct fuse_session *se;
+	int (*loop)(struct mfuse_mount *m);	/* runs the session loop */
+	void *data;							/* backend's per-mount state */
+
+	pthread_t thread;
+	int started;
+	int err;
+};
+
+struct mfuse_callbacks;
+struct mfuse_thumbs;
+
+int mfuse_run(struct mfuse_mount *mounts, int count, int foreground,
+		const struct mfuse_callbacks *mc, void *user_data);
+
+/*
+ * The thumbnail directory is served by the path based backend whichever
+ * serves the monitored ones. 0 if mounted, with m filled in for mfuse_run().
+ */
+int mfuse_thumbs_mount(struct mfuse_mount *m, int argc, char *argv[],
+		const struct mfuse_thumbs *thumbs,
+		const struct mfuse_callbacks *mc, void *user_data);
+void mfuse_thumbs_unmount(struct mfuse_mount *m);
+
+#endif
+
+/* vim: set ts=4 sw=4: */
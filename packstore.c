@@ -0,0 +1,702 @@
+#define _GNU_SOURCE
+#include "packstore.h"
+#include "thumbpack.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#define INITIAL_SLOTS 1024
+
+/* dead records are dropped once they outweigh the live ones, and this much */
+#define COMPACT_MIN_BYTES (1024 * 1024)
+
+
+
+struct packstore {
+	char *thumb_dir;
+	char *profile;
+	char *index_fn;
+
+	/* threads of this process; flock() of index_fd keeps out others */
+	GMutex *lock;
+
+	int index_fd;
+	struct thumbpack_header *header;
+	struct thumbpack_slot *slots;
+	size_t index_len;
+
+	int data_fd;
+};
+
+
+
+static size_t
+record_size(uint32_t length)
+{
+	return (sizeof(struct thumbpack_record) + length +
+			THUMBPACK_ALIGN - 1) & ~(size_t) (THUMBPACK_ALIGN - 1);
+}
+
+
+
+static size_t
+index_size(uint32_t n_slots)
+{
+	return sizeof(struct thumbpack_header) +
+		(size_t) n_slots * sizeof(struct thumbpack_slot);
+}
+
+
+
+static void
+close_index(struct packstore *store)
+{
+	if (store->header) {
+		munmap(store->header, store->index_len);
+		store->header = NULL;
+	}
+	if (store->index_fd >= 0) {
+		close(store->index_fd);
+		store->index_fd = -1;
+	}
+	if (store->data_fd >= 0) {
+		close(store->data_fd);
+		store->data_fd = -1;
+	}
+}
+
+
+
+/* fd, mapped at header, becomes the index of store */
+static int
+adopt_index(struct packstore *store, int fd, struct thumbpack_header *header,
+		size_t len)
+{
+	char *fn;
+
+	store->index_fd = fd;
+	store->header = header;
+	store->slots = (struct thumbpack_slot *) (header + 1);
+	store->index_len = len;
+
+	fn = thumbpack_data_name(store->thumb_dir, store->profile,
+			header->generation);
+	store->data_fd = fn ? open(fn, O_RDWR) : -1;
+	if (store->data_fd < 0) {
+		fprintf(stderr, "%s: cannot open: %s\n", fn, strerror(errno));
+		free(fn);
+		return 1;
+	}
+	free(fn);
+
+	return 0;
+}
+
+
+
+static int
+map_index(struct packstore *store, int fd)
+{
+	struct thumbpack_header *header;
+	struct stat st;
+	void *map;
+
+	if (fstat(fd, &st) ||
+			(size_t) st.st_size < sizeof(struct thumbpack_header)) {
+		close(fd);
+		return 1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+			0);
+	if (map == MAP_FAILED) {
+		close(fd);
+		return 1;
+	}
+	header = map;
+	if (header->magic != THUMBPACK_MAGIC ||
+			header->version != THUMBPACK_VERSION ||
+			header->n_slots == 0 ||
+			(header->n_slots & (header->n_slots - 1)) ||
+			(size_t) st.st_size < index_size(header->n_slots)) {
+		fprintf(stderr, "%s: not a thumbnail pack index\n",
+				store->index_fn);
+		munmap(map, st.st_size);
+		close(fd);
+		return 1;
+	}
+
+	return adopt_index(store, fd, header, st.st_size);
+}
+
+
+
+static int
+create_data(struct packstore *store, uint64_t generation)
+{
+	struct thumbpack_file_header header;
+	char *fn;
+	int fd;
+
+	fn = thumbpack_data_name(store->thumb_dir, store->profile,
+			generation);
+	fd = fn ? open(fn, O_RDWR | O_CREAT | O_TRUNC, 0600) : -1;
+	if (fd < 0) {
+		fprintf(stderr, "%s: cannot create: %s\n", fn,
+				strerror(errno));
+		free(fn);
+		return -1;
+	}
+	free(fn);
+
+	memset(&header, 0, sizeof(header));
+	header.magic = THUMBPACK_MAGIC;
+	header.version = THUMBPACK_VERSION;
+	header.generation = generation;
+	if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+
+/*
+ * An empty index, locked, in a temporary file whose name goes to tmp, for
+ * it to be renamed into place when filled in.
+ */
+static int
+new_index(struct packstore *store, uint32_t n_slots, uint64_t generation,
+		char *tmp, size_t tmp_len, struct thumbpack_header **header)
+{
+	size_t len = index_size(n_slots);
+	void *map;
+	int fd;
+
+	snprintf(tmp, tmp_len, "%s.XXXXXX", store->index_fn);
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		fprintf(stderr, "%s: cannot create: %s\n", tmp,
+				strerror(errno));
+		return -1;
+	}
+	if (flock(fd, LOCK_EX) || ftruncate(fd, len)) {
+		goto fail;
+	}
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		goto fail;
+	}
+
+	*header = map;
+	(*header)->magic = THUMBPACK_MAGIC;
+	(*header)->version = THUMBPACK_VERSION;
+	(*header)->n_slots = n_slots;
+	(*header)->generation = generation;
+
+	return fd;
+
+fail:
+	fprintf(stderr, "%s: %s\n", tmp, strerror(errno));
+	close(fd);
+	unlink(tmp);
+	return -1;
+}
+
+
+
+/*
+ * The slot with key, or without for_insert NULL if there is none. With it
+ * the slot to put key in: the first deleted one on the way, if any.
+ */
+static struct thumbpack_slot *
+find_slot(struct thumbpack_slot *slots, uint32_t n_slots, const uint8_t *key,
+		int for_insert)
+{
+	struct thumbpack_slot *deleted = NULL;
+	struct thumbpack_slot *slot;
+	uint32_t mask = n_slots - 1;
+	uint32_t i, n;
+
+	i = thumbpack_first_slot(key, n_slots);
+	for (n = 0; n < n_slots; n++, i = (i + 1) & mask) {
+		slot = &slots[i];
+		if (slot->state == THUMBPACK_SLOT_EMPTY) {
+			return for_insert ? (deleted ? : slot) : NULL;
+		}
+		if (! memcmp(slot->key, key, THUMBPACK_KEY_LEN)) {
+			return slot;
+		}
+		if (slot->state == THUMBPACK_SLOT_DELETED && ! deleted) {
+			deleted = slot;
+		}
+	}
+
+	return for_insert ? deleted : NULL;
+}
+
+
+
+/* readers check the record, so the order slots are written in is moot */
+static void
+set_slot(struct thumbpack_header *header, struct thumbpack_slot *slot,
+		const uint8_t *key, uint64_t offset, uint32_t length)
+{
+	if (slot->state == THUMBPACK_SLOT_LIVE) {
+		header->live_bytes -= record_size(slot->length);
+		header->dead_bytes += record_size(slot->length);
+	} else if (slot->state == THUMBPACK_SLOT_EMPTY) {
+		header->used++;
+	}
+	memcpy(slot->key, key, THUMBPACK_KEY_LEN);
+	slot->offset = offset;
+	slot->length = length;
+	slot->state = THUMBPACK_SLOT_LIVE;
+	header->live_bytes += record_size(length);
+}
+
+
+
+static void
+kill_slot(struct thumbpack_header *header, struct thumbpack_slot *slot)
+{
+	if (slot->state == THUMBPACK_SLOT_LIVE) {
+		slot->state = THUMBPACK_SLOT_DELETED;
+		header->live_bytes -= record_size(slot->length);
+		header->dead_bytes += record_size(slot->length);
+	}
+}
+
+
+
+/* at the end of fd, data being len bytes long, padded */
+static int
+append_record(int fd, const uint8_t *key, const void *data, uint32_t len,
+		uint64_t *offset)
+{
+	struct thumbpack_record *record;
+	size_t size = record_size(len);
+	struct stat st;
+	off_t end;
+	ssize_t w;
+
+	if (fstat(fd, &st)) {
+		return 1;
+	}
+	/* past whatever a failed append left */
+	end = (st.st_size + THUMBPACK_ALIGN - 1) &
+		~(off_t) (THUMBPACK_ALIGN - 1);
+	record = g_malloc0(size);
+	record->magic = THUMBPACK_RECORD_MAGIC;
+	record->length = len;
+	memcpy(record->key, key, THUMBPACK_KEY_LEN);
+	record->checksum = thumbpack_checksum(data, len);
+	memcpy(record + 1, data, len);
+
+	w = pwrite(fd, record, size, end);
+	g_free(record);
+	if (w != (ssize_t) size) {
+		/*
+		 * Whatever was written stays: readers may have mapped it
+		 * already, and truncating would make them fault. No slot
+		 * points there, and compacting drops it.
+		 */
+		fprintf(stderr, "cannot append to thumbnail pack: %s\n",
+				w < 0 ? strerror(errno) : "short write");
+		return 1;
+	}
+	*offset = end;
+
+	return 0;
+}
+
+
+
+/* the image of a live slot, checked, in memory to be g_free()d */
+static void *
+read_record(int fd, const struct thumbpack_slot *slot)
+{
+	struct thumbpack_record *record;
+	size_t size = record_size(slot->length);
+
+	record = g_malloc(size);
+	if (pread(fd, record, size, slot->offset) != (ssize_t) size ||
+			record->magic != THUMBPACK_RECORD_MAGIC ||
+			record->length != slot->length ||
+			memcmp(record->key, slot->key, THUMBPACK_KEY_LEN) ||
+			thumbpack_checksum(record + 1, record->length) !=
+			record->checksum) {
+		g_free(record);
+		return NULL;
+	}
+
+	return record;
+}
+
+
+
+/*
+ * Into a new index with n_slots, and with compact the live records into a
+ * new data file. Readers and other writers see the old index replaced.
+ */
+static int
+rebuild(struct packstore *store, uint32_t n_slots, int compact)
+{
+	struct thumbpack_header *old = store->header;
+	struct thumbpack_header *header;
+	struct thumbpack_record *record;
+	struct thumbpack_slot *slots;
+	struct thumbpack_slot *slot;
+	char tmp[FILENAME_MAX];
+	char *old_data = NULL;
+	uint64_t generation;
+	uint64_t offset;
+	int data_fd;
+	int fd;
+	uint32_t i;
+
+	generation = old->generation + (compact ? 1 : 0);
+	fd = new_index(store, n_slots, generation, tmp, sizeof(tmp),
+			&header);
+	if (fd < 0) {
+		return 1;
+	}
+	slots = (struct thumbpack_slot *) (header + 1);
+	data_fd = compact ? create_data(store, generation) : store->data_fd;
+	if (data_fd < 0) {
+		goto fail;
+	}
+
+	for (i = 0; i < old->n_slots; i++) {
+		slot = &store->slots[i];
+		if (slot->state != THUMBPACK_SLOT_LIVE) {
+			continue;
+		}
+		offset = slot->offset;
+		if (compact) {
+			record = read_record(store->data_fd, slot);
+			if (! record || append_record(data_fd, slot->key,
+						record + 1, slot->length,
+						&offset)) {
+				g_free(record);
+				continue;
+			}
+			g_free(record);
+		}
+		set_slot(header, find_slot(slots, n_slots, slot->key, 1),
+				slot->key, offset, slot->length);
+	}
+	/* the data file is kept, and what is dead in it with it */
+	if (! compact) {
+		header->dead_bytes = old->dead_bytes;
+	}
+
+	if ((compact && fdatasync(data_fd)) ||
+			msync(header, index_size(n_slots), MS_SYNC) ||
+			rename(tmp, store->index_fn)) {
+		fprintf(stderr, "%s: cannot replace: %s\n", store->index_fn,
+				strerror(errno));
+		goto fail;
+	}
+	old->replaced = 1;
+
+	if (compact) {
+		old_data = thumbpack_data_name(store->thumb_dir,
+				store->profile, old->generation);
+		close(store->data_fd);
+		store->data_fd = -1;
+	}
+	/* keeps data_fd unless compacting */
+	munmap(store->header, store->index_len);
+	store->header = NULL;
+	close(store->index_fd);
+	store->index_fd = fd;
+	store->header = header;
+	store->slots = slots;
+	store->index_len = index_size(n_slots);
+	store->data_fd = data_fd;
+
+	if (old_data) {
+		/* readers that have it mapped keep it until they remap */
+		unlink(old_data);
+		free(old_data);
+	}
+	fprintf(stdout, "%s: %u slots, generation %llu\n", store->index_fn,
+			n_slots, (unsigned long long) generation);
+
+	return 0;
+
+fail:
+	if (compact && data_fd >= 0) {
+		close(data_fd);
+		old_data = thumbpack_data_name(store->thumb_dir,
+				store->profile, generation);
+		unlink(old_data);
+		free(old_data);
+	}
+	munmap(header, index_size(n_slots));
+	close(fd);
+	unlink(tmp);
+	return 1;
+}
+
+
+
+/* locks the pack, taking up the index that replaced ours if there is one */
+static int
+begin(struct packstore *store)
+{
+	int fd;
+
+	g_mutex_lock(store->lock);
+	if (store->header && flock(store->index_fd, LOCK_EX)) {
+		g_mutex_unlock(store->lock);
+		return 1;
+	}
+	while (! store->header || store->header->replaced) {
+		close_index(store);
+		fd = open(store->index_fn, O_RDWR);
+		if (fd < 0) {
+			goto fail;
+		}
+		if (flock(fd, LOCK_EX)) {
+			close(fd);
+			goto fail;
+		}
+		/* takes fd */
+		if (map_index(store, fd)) {
+			goto fail;
+		}
+	}
+
+	return 0;
+
+fail:
+	close_index(store);
+	g_mutex_unlock(store->lock);
+	return 1;
+}
+
+
+
+/* grows or compacts the pack as needed, and unlocks it */
+static void
+end(struct packstore *store)
+{
+	struct thumbpack_header *header = store->header;
+	uint32_t live = 0;
+	uint32_t i;
+
+	if (header->used * 2 > header->n_slots) {
+		/* deleted slots count as used, but are not carried over */
+		for (i = 0; i < header->n_slots; i++) {
+			if (store->slots[i].state == THUMBPACK_SLOT_LIVE) {
+				live++;
+			}
+		}
+		rebuild(store, header->n_slots * (live * 4 > header->n_slots ?
+					2 : 1), 0);
+	} else if (header->dead_bytes > header->live_bytes &&
+			header->dead_bytes >= COMPACT_MIN_BYTES) {
+		rebuild(store, header->n_slots, 1);
+	}
+
+	flock(store->index_fd, LOCK_UN);
+	g_mutex_unlock(store->lock);
+}
+
+
+
+struct packstore *
+packstore_open(const char *thumb_dir, const char *profile)
+{
+	struct thumbpack_header *header;
+	struct packstore *store;
+	char tmp[FILENAME_MAX];
+	int data_fd;
+	int fd;
+
+	store = calloc(1, sizeof(struct packstore));
+	if (! store) {
+		return NULL;
+	}
+	store->index_fd = store->data_fd = -1;
+	store->thumb_dir = strdup(thumb_dir);
+	store->profile = strdup(profile);
+	store->index_fn = thumbpack_index_name(thumb_dir, profile);
+	store->lock = g_mutex_new();
+	if (! store->thumb_dir || ! store->profile || ! store->index_fn) {
+		packstore_close(store);
+		return NULL;
+	}
+
+	if (access(store->index_fn, F_OK) && errno == ENOENT) {
+		data_fd = create_data(store, 1);
+		if (data_fd < 0) {
+			packstore_close(store);
+			return NULL;
+		}
+		close(data_fd);
+		fd = new_index(store, INITIAL_SLOTS, 1, tmp, sizeof(tmp),
+				&header);
+		if (fd < 0) {
+			packstore_close(store);
+			return NULL;
+		}
+		munmap(header, index_size(INITIAL_SLOTS));
+		close(fd);
+		if (rename(tmp, store->index_fn)) {
+			fprintf(stderr, "%s: cannot create: %s\n",
+					store->index_fn, strerror(errno));
+			unlink(tmp);
+			packstore_close(store);
+			return NULL;
+		}
+	}
+
+	/* maps it */
+	if (begin(store)) {
+		fprintf(stderr, "%s: cannot open\n", store->index_fn);
+		packstore_close(store);
+		return NULL;
+	}
+	end(store);
+
+	return store;
+}
+
+
+
+void
+packstore_close(struct packstore *store)
+{
+	if (store == NULL) {
+		return;
+	}
+
+	if (store->header) {
+		msync(store->header, store->index_len, MS_SYNC);
+	}
+	if (store->data_fd >= 0) {
+		fdatasync(store->data_fd);
+	}
+	close_index(store);
+	g_mutex_free(store->lock);
+	free(store->thumb_dir);
+	free(store->profile);
+	free(store->index_fn);
+	free(store);
+}
+
+
+
+int
+packstore_put(struct packstore *store, const char *hash, const void *data,
+		size_t len)
+{
+	uint8_t key[THUMBPACK_KEY_LEN];
+	struct thumbpack_slot *slot;
+	uint64_t offset;
+	int err = 1;
+
+	if (thumbpack_parse_key(hash, key) || len > UINT32_MAX ||
+			begin(store)) {
+		return 1;
+	}
+	slot = find_slot(store->slots, store->header->n_slots, key, 1);
+	/* the table is never full, see end() */
+	if (slot && ! append_record(store->data_fd, key, data, len,
+				&offset)) {
+		set_slot(store->header, slot, key, offset, len);
+		err = 0;
+	}
+	end(store);
+
+	return err;
+}
+
+
+
+int
+packstore_delete(struct packstore *store, const char *hash)
+{
+	uint8_t key[THUMBPACK_KEY_LEN];
+	struct thumbpack_slot *slot;
+
+	if (thumbpack_parse_key(hash, key) || begin(store)) {
+		return 1;
+	}
+	slot = find_slot(store->slots, store->header->n_slots, key, 0);
+	if (slot) {
+		kill_slot(store->header, slot);
+	}
+	end(store);
+
+	return 0;
+}
+
+
+
+/* keys are in the records, so the image is appended again */
+int
+packstore_rename(struct packstore *store, const char *old_hash,
+		const char *new_hash)
+{
+	uint8_t old_key[THUMBPACK_KEY_LEN];
+	uint8_t new_key[THUMBPACK_KEY_LEN];
+	struct thumbpack_record *record = NULL;
+	struct thumbpack_slot *slot;
+	uint64_t offset;
+	int err = 1;
+
+	if (thumbpack_parse_key(old_hash, old_key) ||
+			thumbpack_parse_key(new_hash, new_key) ||
+			begin(store)) {
+		return 1;
+	}
+	slot = find_slot(store->slots, store->header->n_slots, old_key, 0);
+	if (slot && slot->state == THUMBPACK_SLOT_LIVE) {
+		record = read_record(store->data_fd, slot);
+	}
+	if (record && ! append_record(store->data_fd, new_key, record + 1,
+				record->length, &offset)) {
+		kill_slot(store->header, slot);
+		set_slot(store->header, find_slot(store->slots,
+					store->header->n_slots, new_key, 1),
+				new_key, offset, record->length);
+		err = 0;
+	}
+	g_free(record);
+	end(store);
+
+	return err;
+}
+
+
+
+int
+packstore_exists(struct packstore *store, const char *hash)
+{
+	uint8_t key[THUMBPACK_KEY_LEN];
+	struct thumbpack_slot *slot;
+	int ret;
+
+	if (thumbpack_parse_key(hash, key) || begin(store)) {
+		return 0;
+	}
+	slot = find_slot(store->slots, store->header->n_slots, key, 0);
+	ret = slot && slot->state == THUMBPACK_SLOT_LIVE;
+	end(store);
+
+	return ret;
+}
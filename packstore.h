@@ -0,0 +1,30 @@
+#ifndef PACKSTORE_H
+#define PACKSTORE_H
+
+#include <stddef.h>
+
+/*
+ * Writing side of the thumbnail packs of thumbpack.h, for the profiles kept
+ * in one. Records are appended and the index updated in place, under an
+ * flock() of the index so that several writers (the daemon across a reload,
+ * say) can share a pack. The table is grown when half full and the data
+ * compacted into the next generation when most of it is dead. Safe to use
+ * from several threads.
+ */
+
+struct packstore;
+
+/* creates the pack if there is none */
+struct packstore *packstore_open(const char *thumb_dir, const char *profile);
+/* syncs the pack */
+void packstore_close(struct packstore *store);
+
+/* hash is that of thumbpack_lookup() */
+int packstore_put(struct packstore *store, const char *hash,
+		const void *data, size_t len);
+int packstore_delete(struct packstore *store, const char *hash);
+int packstore_rename(struct packstore *store, const char *old_hash,
+		const char *new_hash);
+int packstore_exists(struct packstore *store, const char *hash);
+
+#endif
@@ -3,6 +3,9 @@
 
 #include <stdlib.h>
 
+/* at most this much of the file is passed to probe() */
+#define PLUGIN_PROBE_LEN 4096
+
 /*
  * Introduction to meego-ux-mediafs reader plugins
  *
@@ -25,6 +28,11 @@
  * remaining plugins if file suffix match fails. Note that it is also possible
  * that get_image() fails.
  *
+ * Plugins claiming the same mime type or suffix are tried in the order they
+ * are expected to succeed soonest, going by how they did with earlier files
+ * of that type. A plugin may also implement probe() to decline a file from
+ * its first bytes before get_image() is called.
+ *
  *
  * In pseudo-code:
  *
@@ -137,9 +145,40 @@ struct plugin_reply {
 	void (*free)(struct plugin_reply *reply);
 
 	void *internal;	/* pluguin internal, free to use */
+
+	/*
+	 * Set by meego-ux-mediafs before get_image() is called, an or of
+	 * PLUGIN_REQUEST_* flags. Plugins built before this field was added
+	 * never look at it.
+	 */
+	unsigned int request_flags;
+
+	/*
+	 * Size of the image as stored, where a PLUGIN_REPLY_TYPE_RAW_PIXELS
+	 * reply was decoded smaller than that, or 0. An Image tells its own
+	 * in magick_columns and magick_rows.
+	 */
+	int original_width;
+	int original_height;
+
+	/*
+	 * Set by meego-ux-mediafs where it can take the reply data without
+	 * copying it, else NULL. Gives memory for @len bytes of @data, which
+	 * the caller frees: #free must leave it alone. Calling it again gives
+	 * a new block in place of the last one, which is kept if that fails.
+	 * NULL if out of memory.
+	 */
+	void *(*alloc_data)(struct plugin_reply *reply, size_t len);
 };
 
 
+/*
+ * The image returned may be scaled down by the reader, e.g. decoded at a
+ * reduced resolution, as long as it still covers the requested size.
+ */
+#define PLUGIN_REQUEST_DOWNSCALE	0x1
+
+
 struct plugin {
 	/* required plugin functions */
 
@@ -195,7 +234,10 @@ struct plugin {
 	 *
 	 * Note that the plugin is not required to return an image with
 	 * requested dimensions; size request should only be used as reference.
-	 * Unless very large, reader plugins should /not/ scale a bitmap image.
+	 * Unless very large, reader plugins should /not/ scale a bitmap image,
+	 * except when %PLUGIN_REQUEST_DOWNSCALE is set in
+	 * @reply->request_flags: then the image only needs to cover the
+	 * requested size and decoding it at a lower resolution saves work.
 	 * If the source file does not have native pixel dimensions (e.g. the
 	 * file is a SVG file), plugin should create an image at least as big
 	 * as the requested size.
@@ -230,6 +272,22 @@ struct plugin {
 	 */
 	const char **(*get_suffixes)(struct plugin_context *ctx);
 
+	/*
+	 * probe:
+	 * @ctx: plugin context (from #struct plugin)
+	 * @fn: path to file
+	 * @header: the first bytes of the file
+	 * @len: length of @header, PLUGIN_PROBE_LEN unless the file is shorter
+	 *
+	 * Tell from @header alone whether get_image() is worth calling. Runs
+	 * right before it in the same process, so it must be cheap and not
+	 * open the file.
+	 *
+	 * Returns: 0 to go on with get_image(), non-0 to decline the file.
+	 */
+	int (*probe)(struct plugin_context *ctx, const char *fn,
+			const unsigned char *header, size_t len);
+
 
 	/* plugin-private pointer */
 	struct plugin_context *ctx;
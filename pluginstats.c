@@ -0,0 +1,287 @@
+#include "pluginstats.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+/* how long changes wait to be stored, at most while plugins are called */
+#define SAVE_INTERVAL_S 60
+
+
+
+struct pluginstats {
+	/* to keep them in, may be NULL */
+	struct mediaindex *index;
+
+	GMutex *lock;
+	GHashTable *costs;	/* "<plugin>\t<key>" to struct media_cost */
+	GHashTable *dirty;	/* those of costs changed since stored */
+	GTimer *since_save;
+	int saving;
+};
+
+
+/* a cost as it was when it came to be stored */
+struct saved_cost {
+	char *key;
+	struct media_cost cost;
+};
+
+
+
+static char *
+make_key(const char *plugin, const char *key)
+{
+	return g_strdup_printf("%s\t%s", plugin, key);
+}
+
+
+
+static void
+load_cost(const char *plugin, const char *key, const struct media_cost *cost,
+		void *data)
+{
+	struct pluginstats *stats = data;
+
+	if (! plugin || ! key) {
+		return;
+	}
+	g_hash_table_replace(stats->costs, make_key(plugin, key),
+			g_memdup(cost, sizeof(struct media_cost)));
+}
+
+
+
+struct pluginstats *
+pluginstats_new(struct mediaindex *index)
+{
+	struct pluginstats *stats;
+
+	stats = calloc(1, sizeof(struct pluginstats));
+	if (! stats) {
+		return NULL;
+	}
+	stats->index = index;
+	stats->lock = g_mutex_new();
+	stats->costs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+			g_free);
+	/* the keys and values of costs */
+	stats->dirty = g_hash_table_new(g_str_hash, g_str_equal);
+	stats->since_save = g_timer_new();
+
+	if (index) {
+		mediaindex_foreach_cost(index, load_cost, stats);
+	}
+
+	return stats;
+}
+
+
+
+static void
+copy_cost(gpointer key, gpointer value, gpointer data)
+{
+	GSList **copies = data;
+	struct saved_cost *copy;
+
+	copy = g_new(struct saved_cost, 1);
+	copy->key = g_strdup(key);
+	copy->cost = *(const struct media_cost *) value;
+	*copies = g_slist_prepend(*copies, copy);
+}
+
+
+
+/*
+ * Stores the costs changed since the last time, unless that was less than
+ * SAVE_INTERVAL_S ago and not forced. The index is written outside the
+ * lock, so that plugin calls recording meanwhile don't wait for the disk,
+ * and by one thread at a time, so that the last version stored is the
+ * latest.
+ */
+static void
+save(struct pluginstats *stats, int force)
+{
+	GSList *copies = NULL, *l;
+	struct saved_cost *copy;
+	char *tab;
+
+	g_mutex_lock(stats->lock);
+	if (stats->saving || (! force && g_timer_elapsed(stats->since_save,
+					NULL) < SAVE_INTERVAL_S)) {
+		g_mutex_unlock(stats->lock);
+		return;
+	}
+	g_hash_table_foreach(stats->dirty, copy_cost, &copies);
+	g_hash_table_remove_all(stats->dirty);
+	g_timer_start(stats->since_save);
+	stats->saving = 1;
+	g_mutex_unlock(stats->lock);
+
+	for (l = copies; l; l = l->next) {
+		copy = l->data;
+		tab = strchr(copy->key, '\t');
+		*tab = '\0';
+		mediaindex_store_cost(stats->index, copy->key, tab + 1,
+				&copy->cost);
+		g_free(copy->key);
+		g_free(copy);
+	}
+	g_slist_free(copies);
+
+	g_mutex_lock(stats->lock);
+	stats->saving = 0;
+	g_mutex_unlock(stats->lock);
+}
+
+
+
+void
+pluginstats_free(struct pluginstats *stats)
+{
+	if (stats == NULL) {
+		return;
+	}
+
+	if (stats->index) {
+		save(stats, 1);
+	}
+	g_timer_destroy(stats->since_save);
+	g_hash_table_destroy(stats->dirty);
+	g_hash_table_destroy(stats->costs);
+	g_mutex_free(stats->lock);
+	free(stats);
+}
+
+
+
+static int
+bucket(double ms)
+{
+	int i;
+
+	for (i = 0; ms >= 1.0 && i < MEDIAINDEX_COST_BUCKETS - 1; i++) {
+		ms /= 2;
+	}
+	return i;
+}
+
+
+
+void
+pluginstats_record(struct pluginstats *stats, const char *plugin,
+		const char *key, int ok, double ms)
+{
+	struct media_cost *cost;
+	gpointer stored_key;
+	char *k;
+	int due;
+
+	k = make_key(plugin, key);
+	g_mutex_lock(stats->lock);
+	if (g_hash_table_lookup_extended(stats->costs, k, &stored_key,
+				(gpointer *) &cost)) {
+		g_free(k);
+		k = stored_key;
+	} else {
+		cost = g_new0(struct media_cost, 1);
+		g_hash_table_insert(stats->costs, k, cost);
+	}
+
+	cost->tries++;
+	if (ok) {
+		cost->successes++;
+	}
+	cost->total_ms += ms;
+	cost->histogram[bucket(ms)]++;
+
+	g_hash_table_insert(stats->dirty, k, cost);
+	due = ! stats->saving &&
+		g_timer_elapsed(stats->since_save, NULL) >= SAVE_INTERVAL_S;
+	g_mutex_unlock(stats->lock);
+
+	if (due && stats->index) {
+		save(stats, 0);
+	}
+}
+
+
+
+/*
+ * Mean time of a try over the chance of success, which starts at one half
+ * and follows the success rate as tries add up.
+ */
+static double
+expected_cost(const struct media_cost *cost)
+{
+	if (! cost || cost->tries == 0) {
+		return 0;
+	}
+	return cost->total_ms / cost->tries /
+		((cost->successes + 1.0) / (cost->tries + 2.0));
+}
+
+
+
+double
+pluginstats_cost(struct pluginstats *stats, const char *plugin,
+		const char *key)
+{
+	double ret;
+	char *k;
+
+	k = make_key(plugin, key);
+	g_mutex_lock(stats->lock);
+	ret = expected_cost(g_hash_table_lookup(stats->costs, k));
+	g_mutex_unlock(stats->lock);
+	g_free(k);
+
+	return ret;
+}
+
+
+
+/* upper bound of the bucket the median try falls in */
+static double
+median_ms(const struct media_cost *cost)
+{
+	unsigned int seen = 0;
+	int i;
+
+	for (i = 0; i < MEDIAINDEX_COST_BUCKETS - 1; i++) {
+		seen += cost->histogram[i];
+		if (seen * 2 >= cost->tries) {
+			break;
+		}
+	}
+	return (double) (1 << i);
+}
+
+
+
+static void
+print_cost(gpointer key, gpointer value, gpointer data)
+{
+	const struct media_cost *cost = value;
+	const char *k = key;
+	FILE *out = data;
+	int len;
+
+	len = strchr(k, '\t') - k;
+	fprintf(out, "%.*s %s: %u tries, %u succeeded, %.1f ms on average, "
+			"median under %.0f ms, %.1f ms per image\n",
+			len, k, k + len + 1, cost->tries, cost->successes,
+			cost->tries ? cost->total_ms / cost->tries : 0.0,
+			median_ms(cost), expected_cost(cost));
+}
+
+
+
+void
+pluginstats_print(struct pluginstats *stats, FILE *out)
+{
+	g_mutex_lock(stats->lock);
+	g_hash_table_foreach(stats->costs, print_cost, out);
+	g_mutex_unlock(stats->lock);
+}
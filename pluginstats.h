@@ -0,0 +1,37 @@
+#ifndef PLUGINSTATS_H
+#define PLUGINSTATS_H
+
+#include <stdio.h>
+
+#include "mediaindex.h"
+
+/*
+ * How often and how fast each plugin has made an image of the files of each
+ * mime type or suffix, so that those claiming a file can be tried in the
+ * order they are expected to succeed soonest. Kept in the media index, if
+ * there is one, across restarts: changes are stored along with the first one
+ * recorded a minute after they last were, and when freed. Safe to use from
+ * several threads.
+ */
+
+struct pluginstats;
+
+/* index may be NULL */
+struct pluginstats *pluginstats_new(struct mediaindex *index);
+void pluginstats_free(struct pluginstats *stats);
+
+/* key is a mime type, ".<suffix>" or "*" for plugins tried on anything */
+void pluginstats_record(struct pluginstats *stats, const char *plugin,
+		const char *key, int ok, double ms);
+
+/*
+ * Milliseconds the plugin is expected to take per image it makes of such a
+ * file, 0 if it has never been tried on one.
+ */
+double pluginstats_cost(struct pluginstats *stats, const char *plugin,
+		const char *key);
+
+/* a line per plugin and key */
+void pluginstats_print(struct pluginstats *stats, FILE *out);
+
+#endif
@@ -0,0 +1,559 @@
+#define _GNU_SOURCE
+#include "sandbox.h"
+#include "sandbox_proto.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <glib.h>
+
+#define DEFAULT_TIMEOUT_S 30
+
+
+
+struct reader {
+	pid_t pid;		/* 0 if not running */
+	int sock;
+	int busy;
+	int generation;		/* of the sandbox when started */
+};
+
+
+struct sandbox {
+	char *helper;
+	char *plugin_dir;
+	int timeout_ms;
+
+	GMutex *lock;
+	GCond *idle;		/* signalled when a reader is released */
+	struct reader *readers;
+	int n;
+	int generation;		/* bumped by sandbox_restart() */
+};
+
+
+/* what a reply has mapped */
+struct shared_data {
+	void *addr;
+	size_t len;
+};
+
+
+
+struct sandbox *
+sandbox_new(const char *helper, const char *plugin_dir, int readers,
+		int timeout_s)
+{
+	struct sandbox *sandbox;
+
+	if (access(helper, X_OK)) {
+		fprintf(stderr, "%s: cannot run: %s\n", helper, strerror(errno));
+		return NULL;
+	}
+
+	sandbox = calloc(1, sizeof(struct sandbox));
+	if (! sandbox) {
+		return NULL;
+	}
+	sandbox->n = readers > 0 ? readers : 1;
+	sandbox->readers = calloc(sandbox->n, sizeof(struct reader));
+	sandbox->helper = strdup(helper);
+	sandbox->plugin_dir = strdup(plugin_dir);
+	if (! sandbox->readers || ! sandbox->helper || ! sandbox->plugin_dir) {
+		free(sandbox->readers);
+		free(sandbox->helper);
+		free(sandbox->plugin_dir);
+		free(sandbox);
+		return NULL;
+	}
+	sandbox->timeout_ms = (timeout_s > 0 ? timeout_s : DEFAULT_TIMEOUT_S) *
+		1000;
+	sandbox->lock = g_mutex_new();
+	sandbox->idle = g_cond_new();
+
+	return sandbox;
+}
+
+
+
+static void
+reap(struct reader *reader, const char *why)
+{
+	int status;
+
+	close(reader->sock);
+	reader->sock = -1;
+	if (waitpid(reader->pid, &status, 0) == reader->pid && why) {
+		if (WIFSIGNALED(status)) {
+			fprintf(stderr, "reader %d %s, killed by signal %d\n",
+					(int) reader->pid, why,
+					WTERMSIG(status));
+		} else {
+			fprintf(stderr, "reader %d %s, exit status %d\n",
+					(int) reader->pid, why,
+					WEXITSTATUS(status));
+		}
+	}
+	reader->pid = 0;
+}
+
+
+
+void
+sandbox_free(struct sandbox *sandbox)
+{
+	int i;
+
+	if (sandbox == NULL) {
+		return;
+	}
+
+	/* idle readers exit when their socket is closed */
+	for (i = 0; i < sandbox->n; i++) {
+		if (sandbox->readers[i].pid) {
+			reap(&sandbox->readers[i], NULL);
+		}
+	}
+
+	g_cond_free(sandbox->idle);
+	g_mutex_free(sandbox->lock);
+	free(sandbox->readers);
+	free(sandbox->helper);
+	free(sandbox->plugin_dir);
+	free(sandbox);
+}
+
+
+
+static int
+spawn(struct sandbox *sandbox, struct reader *reader)
+{
+	char *argv[3];
+	int sv[2];
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv)) {
+		fprintf(stderr, "cannot create reader socket: %s\n",
+				strerror(errno));
+		return 1;
+	}
+	argv[0] = sandbox->helper;
+	argv[1] = sandbox->plugin_dir;
+	argv[2] = NULL;
+
+	pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "cannot start reader: %s\n", strerror(errno));
+		close(sv[0]);
+		close(sv[1]);
+		return 1;
+	}
+	if (pid == 0) {
+		/* only async-signal-safe calls until exec */
+		if (sv[1] == SANDBOX_FD) {
+			fcntl(SANDBOX_FD, F_SETFD, 0);
+		} else if (dup2(sv[1], SANDBOX_FD) < 0) {
+			_exit(127);
+		}
+		execv(argv[0], argv);
+		_exit(127);
+	}
+
+	close(sv[1]);
+	reader->sock = sv[0];
+	reader->pid = pid;
+	reader->generation = sandbox->generation;
+
+	return 0;
+}
+
+
+
+static struct reader *
+take_reader(struct sandbox *sandbox)
+{
+	struct reader *reader = NULL;
+	int stale;
+	int i;
+
+	g_mutex_lock(sandbox->lock);
+	while (! reader) {
+		for (i = 0; i < sandbox->n && ! reader; i++) {
+			if (! sandbox->readers[i].busy) {
+				reader = &sandbox->readers[i];
+			}
+		}
+		if (! reader) {
+			g_cond_wait(sandbox->idle, sandbox->lock);
+		}
+	}
+	reader->busy = 1;
+	stale = reader->pid && reader->generation != sandbox->generation;
+	g_mutex_unlock(sandbox->lock);
+
+	if (stale) {
+		/* it exits when its socket is closed */
+		reap(reader, NULL);
+	}
+
+	return reader;
+}
+
+
+
+void
+sandbox_restart(struct sandbox *sandbox)
+{
+	g_mutex_lock(sandbox->lock);
+	sandbox->generation++;
+	g_mutex_unlock(sandbox->lock);
+}
+
+
+
+static void
+release_reader(struct sandbox *sandbox, struct reader *reader)
+{
+	g_mutex_lock(sandbox->lock);
+	reader->busy = 0;
+	g_cond_signal(sandbox->idle);
+	g_mutex_unlock(sandbox->lock);
+}
+
+
+
+/* the response and the descriptor of its data, -1 if none came along */
+static int
+receive(struct reader *reader, struct sandbox_response *res, int *fd)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	ssize_t len;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = res;
+	iov.iov_len = sizeof(struct sandbox_response);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	*fd = -1;
+	do {
+		len = recvmsg(reader->sock, &msg, MSG_CMSG_CLOEXEC);
+	} while (len < 0 && errno == EINTR);
+
+	cmsg = len > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+			cmsg->cmsg_type == SCM_RIGHTS) {
+		memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+
+	if (len != sizeof(struct sandbox_response)) {
+		if (*fd >= 0) {
+			close(*fd);
+		}
+		return 1;
+	}
+	return 0;
+}
+
+
+
+static void
+free_shared(struct plugin_reply *reply)
+{
+	struct shared_data *shared = reply->internal;
+
+	munmap(shared->addr, shared->len);
+	free(shared);
+}
+
+
+
+/*
+ * len bytes of the shared memory file a reader sent, NULL if it could still
+ * shrink or is short: reading past its end would kill the daemon.
+ */
+static void *
+map_shared(int fd, size_t len)
+{
+	struct stat st;
+	void *addr;
+#ifdef SANDBOX_SEALS
+	int seals;
+
+	seals = fcntl(fd, F_GET_SEALS);
+	if (seals < 0 || (seals & SANDBOX_SEALS) != SANDBOX_SEALS) {
+		fprintf(stderr, "reader data is not sealed\n");
+		return NULL;
+	}
+#endif
+	if (fstat(fd, &st) || st.st_size < 0 || (size_t) st.st_size < len) {
+		fprintf(stderr, "reader data is shorter than said\n");
+		return NULL;
+	}
+	addr = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		fprintf(stderr, "cannot map reader data: %s\n",
+				strerror(errno));
+		return NULL;
+	}
+
+	return addr;
+}
+
+
+
+/* whether the data of a raw pixel response holds all its pixels */
+static int
+holds_pixels(const struct sandbox_response *res)
+{
+	size_t channels, size;
+
+	channels = strnlen(res->pixel_format, sizeof(res->pixel_format) - 1);
+	size = sandbox_pixel_size(res->pixel_type, res->pixel_type_other);
+	if (res->width <= 0 || res->height <= 0 || ! channels || ! size) {
+		return 0;
+	}
+
+	return (uint64_t) res->width * res->height <=
+		res->data_len / (channels * size);
+}
+
+
+
+static int
+map_reply(const struct sandbox_response *res, int fd,
+		struct plugin_reply *reply)
+{
+	struct shared_data *shared;
+
+	if (fd < 0 || res->data_len == 0 || res->data_len > SIZE_MAX) {
+		return 1;
+	}
+	if (res->type == PLUGIN_REPLY_TYPE_RAW_PIXELS && ! holds_pixels(res)) {
+		fprintf(stderr, "reader data is too short for %dx%d pixels\n",
+				res->width, res->height);
+		return 1;
+	}
+	shared = malloc(sizeof(struct shared_data));
+	if (! shared) {
+		return 1;
+	}
+	shared->len = res->data_len;
+	shared->addr = map_shared(fd, shared->len);
+	if (! shared->addr) {
+		free(shared);
+		return 1;
+	}
+
+	reply->type = res->type;
+	reply->data = shared->addr;
+	reply->data_len = shared->len;
+	reply->width = res->width;
+	reply->height = res->height;
+	reply->original_width = res->original_width;
+	reply->original_height = res->original_height;
+	memcpy(reply->pixel_format, res->pixel_format,
+			sizeof(reply->pixel_format));
+	reply->pixel_format[sizeof(reply->pixel_format) - 1] = '\0';
+	reply->pixel_type = res->pixel_type;
+	reply->pixel_type_other = res->pixel_type_other;
+	reply->internal = shared;
+	reply->free = free_shared;
+
+	return 0;
+}
+
+
+
+/*
+ * Has a reader serve req and gives its response, with the descriptor of the
+ * data in *fd if it sent one, else -1. 0 or the SANDBOX_* failure.
+ */
+static int
+transact(struct sandbox *sandbox, const struct sandbox_request *req,
+		struct sandbox_response *res, int *fd)
+{
+	struct reader *reader;
+	struct pollfd pfd;
+	int r;
+	int err = 0;
+
+	*fd = -1;
+	reader = take_reader(sandbox);
+	if (! reader->pid && spawn(sandbox, reader)) {
+		release_reader(sandbox, reader);
+		return 1;
+	}
+
+	if (send(reader->sock, req, sizeof(*req), MSG_NOSIGNAL) !=
+			sizeof(*req)) {
+		reap(reader, "is gone");
+		release_reader(sandbox, reader);
+		return 1;
+	}
+
+	pfd.fd = reader->sock;
+	pfd.events = POLLIN;
+	do {
+		r = poll(&pfd, 1, sandbox->timeout_ms);
+	} while (r < 0 && errno == EINTR);
+
+	if (r == 0) {
+		fprintf(stderr, "%s: reader %d timed out, killing it\n",
+				req->fn[0] ? req->fn : req->plugin,
+				(int) reader->pid);
+		kill(reader->pid, SIGKILL);
+		reap(reader, NULL);
+		err = SANDBOX_TIMED_OUT;
+	} else if (r < 0 || receive(reader, res, fd)) {
+		/* most likely the decoder crashed */
+		fprintf(stderr, "%s: reader failed\n",
+				req->fn[0] ? req->fn : req->plugin);
+		reap(reader, "died");
+		err = SANDBOX_CRASHED;
+	}
+	release_reader(sandbox, reader);
+
+	return err;
+}
+
+
+
+int
+sandbox_get_image(struct sandbox *sandbox, const char *plugin,
+		const char *fn, int width, int height,
+		struct plugin_reply *reply)
+{
+	struct sandbox_request req;
+	struct sandbox_response res;
+	int fd;
+	int err;
+
+	if (strlen(plugin) >= sizeof(req.plugin) ||
+			strlen(fn) >= sizeof(req.fn)) {
+		return 1;
+	}
+	memset(&req, 0, sizeof(req));
+	req.op = SANDBOX_GET_IMAGE;
+	strcpy(req.plugin, plugin);
+	strcpy(req.fn, fn);
+	req.width = width;
+	req.height = height;
+	req.flags = reply->request_flags;
+
+	err = transact(sandbox, &req, &res, &fd);
+	if (! err) {
+		err = res.status == 0 ? map_reply(&res, fd, reply) :
+			res.status;
+	}
+
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	return err;
+}
+
+
+
+/*
+ * The list of strings starting at *pos, up to an empty one. What the reader
+ * sent has to end there.
+ */
+static char **
+parse_list(const char *data, size_t len, size_t *pos)
+{
+	GPtrArray *list;
+	const char *s;
+	const char *end;
+
+	list = g_ptr_array_new();
+	while (*pos < len) {
+		s = data + *pos;
+		end = memchr(s, '\0', len - *pos);
+		if (! end) {
+			break;
+		}
+		*pos += end - s + 1;
+		if (end == s) {
+			g_ptr_array_add(list, NULL);
+			return (char **) g_ptr_array_free(list, FALSE);
+		}
+		g_ptr_array_add(list, g_strdup(s));
+	}
+
+	g_ptr_array_add(list, NULL);
+	g_strfreev((char **) g_ptr_array_free(list, FALSE));
+	return NULL;
+}
+
+
+
+int
+sandbox_describe(struct sandbox *sandbox, const char *plugin,
+		char ***mime, char ***suffix)
+{
+	struct sandbox_request req;
+	struct sandbox_response res;
+	void *data;
+	size_t pos = 0;
+	int fd;
+	int err;
+
+	*mime = *suffix = NULL;
+	if (strlen(plugin) >= sizeof(req.plugin)) {
+		return 1;
+	}
+	memset(&req, 0, sizeof(req));
+	req.op = SANDBOX_DESCRIBE;
+	strcpy(req.plugin, plugin);
+
+	err = transact(sandbox, &req, &res, &fd);
+	if (! err) {
+		err = res.status;
+	}
+	if (! err && (fd < 0 || res.data_len == 0 ||
+				res.data_len > SIZE_MAX)) {
+		err = 1;
+	}
+	if (! err) {
+		data = map_shared(fd, res.data_len);
+		if (! data) {
+			err = 1;
+		} else {
+			*mime = parse_list(data, res.data_len, &pos);
+			*suffix = parse_list(data, res.data_len, &pos);
+			munmap(data, res.data_len);
+			if (! *mime || ! *suffix) {
+				fprintf(stderr, "%s: bad description\n",
+						plugin);
+				g_strfreev(*mime);
+				g_strfreev(*suffix);
+				*mime = *suffix = NULL;
+				err = 1;
+			}
+		}
+	}
+
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	return err;
+}
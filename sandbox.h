@@ -0,0 +1,47 @@
+#ifndef SANDBOX_H
+#define SANDBOX_H
+
+#include "plugin.h"
+
+/*
+ * Pool of reader processes running the reader plugins on behalf of the
+ * daemon, so that a crashing or hanging decoder only takes its own process
+ * down, and plugins that are not reentrant can still decode in parallel.
+ *
+ * Readers are started on first use and restarted after they die. A reader
+ * taking longer than the timeout is killed.
+ */
+
+struct sandbox;
+
+struct sandbox *sandbox_new(const char *helper, const char *plugin_dir,
+		int readers, int timeout_s);
+void sandbox_free(struct sandbox *sandbox);
+
+/* readers are restarted before their next file, e.g. to load new plugins */
+void sandbox_restart(struct sandbox *sandbox);
+
+/* returned by sandbox_get_image() when the reader itself failed */
+#define SANDBOX_CRASHED -2
+#define SANDBOX_TIMED_OUT -3
+/* ... and when probe() of the plugin declined the file */
+#define SANDBOX_DECLINED -4
+
+/*
+ * Same as probe(), if the plugin in file readers/<plugin> has one, and then
+ * get_image() of it; the data of the reply is shared with the reader and
+ * read only.
+ */
+int sandbox_get_image(struct sandbox *sandbox, const char *plugin,
+		const char *fn, int width, int height,
+		struct plugin_reply *reply);
+
+/*
+ * Loads the plugin in a reader for the mime types and the suffixes it
+ * claims, NULL-terminated lists to free with g_strfreev(). Plugins are not
+ * loaded into the daemon itself.
+ */
+int sandbox_describe(struct sandbox *sandbox, const char *plugin,
+		char ***mime, char ***suffix);
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef SANDBOX_PROTO_H
+#define SANDBOX_PROTO_H
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "plugin.h"
+
+#include <magick/api.h>
+
+/*
+ * Messages between the daemon and its reader processes, over a
+ * SOCK_SEQPACKET socket that the reader gets as file descriptor
+ * SANDBOX_FD.
+ *
+ * The daemon sends a request, the reader runs probe() and get_image() and
+ * answers with a response. Image data comes along as a file descriptor
+ * (SCM_RIGHTS) of a shared memory file holding data_len bytes, which the
+ * daemon maps. The reader seals the file first: the daemon only maps one it
+ * can't shrink, as touching pages past its end would kill the daemon. Image
+ * replies are turned into raw pixels by the reader, as an Image can't be
+ * shared.
+ *
+ * Asked to describe a plugin instead, the reader loads it and sends its mime
+ * types and then its suffixes the same way, each list as strings ended by
+ * '\0' with an empty one after the last.
+ */
+
+#define SANDBOX_FD 3
+#define SANDBOX_NAME_MAX 256
+
+#if defined(MFD_ALLOW_SEALING) && defined(F_SEAL_SHRINK)
+#define SANDBOX_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)
+#endif
+
+enum {
+	SANDBOX_GET_IMAGE,
+	SANDBOX_DESCRIBE,
+};
+
+struct sandbox_request {
+	int op;
+	char plugin[SANDBOX_NAME_MAX];	/* file name in readers/ */
+	char fn[PATH_MAX];
+	int width;
+	int height;
+	unsigned int flags;		/* request_flags of the reply */
+};
+
+struct sandbox_response {
+	int status;			/* as returned by get_image(), or
+					   SANDBOX_DECLINED */
+	int type;			/* enum plugin_reply_type */
+	int width;
+	int height;
+	int original_width;		/* as stored, or 0 */
+	int original_height;
+	char pixel_format[16];
+	int pixel_type;			/* enum plugin_reply_pixel_type */
+	int pixel_type_other;
+	uint64_t data_len;
+};
+
+
+
+/* bytes per colour component of raw pixels, 0 if not known */
+static inline size_t
+sandbox_pixel_size(enum plugin_reply_pixel_type type, int other)
+{
+	switch (type) {
+		case PLUGIN_REPLY_CHAR_PIXEL:
+			return sizeof(char);
+		case PLUGIN_REPLY_DOUBLE_PIXEL:
+			return sizeof(double);
+		case PLUGIN_REPLY_FLOAT_PIXEL:
+			return sizeof(float);
+		case PLUGIN_REPLY_OTHER_PIXEL:
+			break;
+		default:
+			return 0;
+	}
+
+	switch ((StorageType) other) {
+		case CharPixel:
+			return sizeof(char);
+		case ShortPixel:
+			return sizeof(short);
+		case IntegerPixel:
+			return sizeof(int);
+		case LongPixel:
+			return sizeof(long);
+		case FloatPixel:
+			return sizeof(float);
+		case DoublePixel:
+			return sizeof(double);
+		default:
+			return 0;
+	}
+}
+
+#endif
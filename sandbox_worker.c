@@ -0,0 +1,546 @@
+/*
+ * Reader process: runs reader plugins for the daemon, see sandbox.h and
+ * sandbox_proto.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "plugin.h"
+#include "sandbox.h"
+#include "sandbox_proto.h"
+
+#include <glib.h>
+#include <magick/api.h>
+
+#define READER_NICE 10
+
+
+
+struct reader_plugin {
+	char *name;
+	void *lib;
+	struct plugin plugin;
+};
+
+
+/* memory handed to a plugin through alloc_data() of its reply */
+struct shared {
+	int fd;			/* -1 if none */
+	void *addr;
+	size_t len;
+};
+
+
+static GSList *plugins;	/* struct reader_plugin *, loaded so far */
+static struct shared shared = { -1, NULL, 0 };
+
+
+
+static struct reader_plugin *
+load_plugin(const char *self, const char *plugin_dir, const char *name)
+{
+	struct reader_plugin *rp;
+	char *fn;
+
+	rp = calloc(1, sizeof(struct reader_plugin));
+	if (! rp) {
+		return NULL;
+	}
+
+	fn = g_strdup_printf("%s/readers/%s", plugin_dir, name);
+	rp->lib = dlopen(fn, RTLD_NOW);
+	if (! rp->lib) {
+		fprintf(stderr, "dlopening %s failed: %s\n", fn, dlerror());
+		goto fail;
+	}
+	rp->plugin.init = dlsym(rp->lib, "init");
+	rp->plugin.uninit = dlsym(rp->lib, "uninit");
+	rp->plugin.get_image = dlsym(rp->lib, "get_image");
+	rp->plugin.get_mimetypes = dlsym(rp->lib, "get_mimetypes");
+	rp->plugin.get_suffixes = dlsym(rp->lib, "get_suffixes");
+	rp->plugin.probe = dlsym(rp->lib, "probe");
+	if (! rp->plugin.init || ! rp->plugin.uninit ||
+			! rp->plugin.get_image) {
+		fprintf(stderr, "%s: not a reader plugin\n", fn);
+		goto fail;
+	}
+	rp->plugin.ctx = rp->plugin.init(self);
+	if (! rp->plugin.ctx) {
+		fprintf(stderr, "%s: init() failed\n", fn);
+		goto fail;
+	}
+	rp->name = strdup(name);
+	g_free(fn);
+
+	return rp;
+
+fail:
+	if (rp->lib) {
+		dlclose(rp->lib);
+	}
+	g_free(fn);
+	free(rp);
+	return NULL;
+}
+
+
+
+static struct reader_plugin *
+get_plugin(const char *self, const char *plugin_dir, const char *name)
+{
+	struct reader_plugin *rp;
+	GSList *l;
+
+	for (l = plugins; l; l = l->next) {
+		rp = l->data;
+		if (rp->name && strcmp(rp->name, name) == 0) {
+			return rp;
+		}
+	}
+
+	rp = load_plugin(self, plugin_dir, name);
+	if (rp) {
+		plugins = g_slist_prepend(plugins, rp);
+	}
+	return rp;
+}
+
+
+
+/* shared memory file of len bytes, mapped at *addr */
+static int
+make_shared(size_t len, void **addr)
+{
+	int fd;
+
+#ifdef SANDBOX_SEALS
+	fd = memfd_create("mediafs-reader", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+	char tmpl[] = "/dev/shm/mediafs-reader-XXXXXX";
+
+	fd = mkstemp(tmpl);
+	if (fd >= 0) {
+		unlink(tmpl);
+	}
+#endif
+	if (fd < 0) {
+		fprintf(stderr, "cannot create shared memory: %s\n",
+				strerror(errno));
+		return -1;
+	}
+	if (ftruncate(fd, len)) {
+		fprintf(stderr, "cannot size shared memory: %s\n",
+				strerror(errno));
+		close(fd);
+		return -1;
+	}
+	*addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (*addr == MAP_FAILED) {
+		fprintf(stderr, "cannot map shared memory: %s\n",
+				strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+
+/* before handing fd over: the daemon checks that it can't change */
+static int
+seal_shared(int fd)
+{
+#ifdef SANDBOX_SEALS
+	if (fcntl(fd, F_ADD_SEALS, SANDBOX_SEALS)) {
+		fprintf(stderr, "cannot seal shared memory: %s\n",
+				strerror(errno));
+		return 1;
+	}
+#endif
+
+	return 0;
+}
+
+
+
+static void
+drop_shared(void)
+{
+	if (shared.fd >= 0) {
+		munmap(shared.addr, shared.len);
+		close(shared.fd);
+		shared.fd = -1;
+	}
+}
+
+
+
+/* alloc_data() of replies: plugins decode straight into shared memory */
+static void *
+alloc_shared(struct plugin_reply *reply, size_t len)
+{
+	void *addr;
+	int fd;
+
+	if (len == 0) {
+		return NULL;
+	}
+	fd = make_shared(len, &addr);
+	if (fd < 0) {
+		return NULL;
+	}
+	drop_shared();
+	shared.fd = fd;
+	shared.addr = addr;
+	shared.len = len;
+
+	return addr;
+}
+
+
+
+/*
+ * Image replies are exported as 8 bit RGB(A) straight into shared memory,
+ * others are there already if the plugin used alloc_data(), else they are
+ * copied there as they are.
+ */
+static int
+share_reply(struct plugin_reply *reply, struct sandbox_response *res)
+{
+	ExceptionInfo exception;
+	Image *image;
+	const char *map;
+	size_t len;
+	void *addr;
+	int fd;
+
+	res->type = reply->type;
+	switch (reply->type) {
+		case PLUGIN_REPLY_TYPE_IMAGE:
+			image = reply->data;
+			map = image->matte ? "RGBA" : "RGB";
+			len = (size_t) image->columns * image->rows *
+				strlen(map);
+			res->type = PLUGIN_REPLY_TYPE_RAW_PIXELS;
+			res->width = image->columns;
+			res->height = image->rows;
+			res->original_width = image->magick_columns;
+			res->original_height = image->magick_rows;
+			strcpy(res->pixel_format, map);
+			res->pixel_type = PLUGIN_REPLY_CHAR_PIXEL;
+			break;
+		case PLUGIN_REPLY_TYPE_IMAGE_FILE_DATA:
+			len = reply->data_len;
+			break;
+		case PLUGIN_REPLY_TYPE_RAW_PIXELS:
+			res->width = reply->width;
+			res->height = reply->height;
+			res->original_width = reply->original_width;
+			res->original_height = reply->original_height;
+			memcpy(res->pixel_format, reply->pixel_format,
+					sizeof(res->pixel_format));
+			res->pixel_format[sizeof(res->pixel_format) - 1] = '\0';
+			res->pixel_type = reply->pixel_type;
+			res->pixel_type_other = reply->pixel_type_other;
+			len = (size_t) reply->width * reply->height *
+				strlen(res->pixel_format) *
+				sandbox_pixel_size(reply->pixel_type,
+						reply->pixel_type_other);
+			break;
+		default:
+			fprintf(stderr, "unrecognised reply: %d\n", reply->type);
+			return -1;
+	}
+	if (len == 0) {
+		return -1;
+	}
+
+	if (reply->type != PLUGIN_REPLY_TYPE_IMAGE && shared.fd >= 0 &&
+			reply->data == shared.addr && len <= shared.len) {
+		fd = shared.fd;
+		shared.fd = -1;
+		munmap(shared.addr, shared.len);
+		res->data_len = len;
+		return fd;
+	}
+
+	fd = make_shared(len, &addr);
+	if (fd < 0) {
+		return -1;
+	}
+
+	if (reply->type == PLUGIN_REPLY_TYPE_IMAGE) {
+		GetExceptionInfo(&exception);
+		if (! DispatchImage(image, 0, 0, image->columns, image->rows,
+					map, CharPixel, addr, &exception)) {
+			fprintf(stderr, "cannot export image pixels\n");
+			close(fd);
+			fd = -1;
+		}
+		DestroyExceptionInfo(&exception);
+	} else {
+		memcpy(addr, reply->data, len);
+	}
+	munmap(addr, len);
+	res->data_len = len;
+
+	return fd;
+}
+
+
+
+static int
+respond(int sock, const struct sandbox_response *res, int fd)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = (void *) res;
+	iov.iov_len = sizeof(struct sandbox_response);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (fd >= 0) {
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	return sendmsg(sock, &msg, MSG_NOSIGNAL) ==
+		sizeof(struct sandbox_response) ? 0 : 1;
+}
+
+
+
+/* the mime types and suffixes of the plugin, see sandbox_proto.h */
+static int
+describe(struct reader_plugin *rp, struct sandbox_response *res)
+{
+	const char **lists[2] = { NULL, NULL };
+	const char **s;
+	GString *data;
+	void *addr;
+	int fd;
+	int i;
+
+	if (rp->plugin.get_mimetypes) {
+		lists[0] = rp->plugin.get_mimetypes(rp->plugin.ctx);
+	}
+	if (rp->plugin.get_suffixes) {
+		lists[1] = rp->plugin.get_suffixes(rp->plugin.ctx);
+	}
+
+	data = g_string_new(NULL);
+	for (i = 0; i < 2; i++) {
+		for (s = lists[i]; s && *s; s++) {
+			if (**s) {
+				g_string_append_len(data, *s, strlen(*s) + 1);
+			}
+		}
+		g_string_append_c(data, '\0');
+	}
+
+	fd = make_shared(data->len, &addr);
+	if (fd >= 0) {
+		memcpy(addr, data->str, data->len);
+		munmap(addr, data->len);
+		res->data_len = data->len;
+	}
+	g_string_free(data, TRUE);
+
+	return fd;
+}
+
+
+
+/* probe() of the plugin, if it has one, on the start of the file */
+static int
+probe(struct reader_plugin *rp, const char *fn)
+{
+	unsigned char header[PLUGIN_PROBE_LEN];
+	ssize_t len = -1;
+	int fd;
+
+	if (! rp->plugin.probe) {
+		return 0;
+	}
+	fd = open(fn, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		len = pread(fd, header, sizeof(header), 0);
+		close(fd);
+	}
+	if (len < 0) {
+		/* get_image() will fail and say why */
+		return 0;
+	}
+
+	return rp->plugin.probe(rp->plugin.ctx, fn, header, len);
+}
+
+
+
+static int
+serve(const char *self, const char *plugin_dir,
+		const struct sandbox_request *req, int sock)
+{
+	struct sandbox_response res;
+	struct plugin_reply reply;
+	struct reader_plugin *rp;
+	int fd = -1;
+	int r;
+
+	memset(&res, 0, sizeof(res));
+	res.status = 1;
+
+	rp = get_plugin(self, plugin_dir, req->plugin);
+	if (rp && req->op == SANDBOX_DESCRIBE) {
+		fd = describe(rp, &res);
+		res.status = fd < 0;
+	} else if (rp && probe(rp, req->fn)) {
+		res.status = SANDBOX_DECLINED;
+	} else if (rp) {
+		memset(&reply, 0, sizeof(reply));
+		reply.request_flags = req->flags;
+		reply.alloc_data = alloc_shared;
+		res.status = rp->plugin.get_image(rp->plugin.ctx, req->fn,
+				req->width, req->height, &reply);
+		if (res.status == 0) {
+			fd = share_reply(&reply, &res);
+			if (fd < 0) {
+				res.status = 1;
+			}
+			if (reply.free) {
+				reply.free(&reply);
+			}
+		}
+		/* what the plugin allocated and did not return */
+		drop_shared();
+	}
+	if (fd >= 0 && seal_shared(fd)) {
+		close(fd);
+		fd = -1;
+		res.status = 1;
+	}
+
+	r = respond(sock, &res, fd);
+	if (fd >= 0) {
+		close(fd);
+	}
+	return r;
+}
+
+
+
+/*
+ * Keep the damage a decoder can do small: die with the daemon, run at a
+ * lower priority, leave no core dumps and hold no descriptors of the daemon.
+ */
+static void
+confine(void)
+{
+	struct rlimit rl;
+	sigset_t set;
+	int fd, max;
+
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+	if (getppid() == 1) {
+		exit(0);
+	}
+
+	/* the mask of the spawning thread survives exec */
+	sigemptyset(&set);
+	sigprocmask(SIG_SETMASK, &set, NULL);
+
+	rl.rlim_cur = rl.rlim_max = 0;
+	setrlimit(RLIMIT_CORE, &rl);
+	if (nice(READER_NICE) == -1 && errno) {
+		fprintf(stderr, "cannot lower priority: %s\n", strerror(errno));
+	}
+
+	max = sysconf(_SC_OPEN_MAX);
+	for (fd = SANDBOX_FD + 1; fd < max; fd++) {
+		close(fd);
+	}
+	fd = open("/dev/null", O_RDONLY);
+	if (fd >= 0) {
+		dup2(fd, STDIN_FILENO);
+		close(fd);
+	}
+}
+
+
+
+int
+main(int argc, char *argv[])
+{
+	struct sandbox_request req;
+	ssize_t len;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <PLUGIN DIR>\n"
+				"Not to be run by hand, "
+				"started by meego-ux-mediafsd.\n", argv[0]);
+		return 1;
+	}
+
+	confine();
+
+	/* init threads as plugins may need that */
+	if (! g_thread_supported()) {
+		g_thread_init(NULL);
+	}
+
+	while (1) {
+		len = recv(SANDBOX_FD, &req, sizeof(req), 0);
+		if (len < 0 && errno == EINTR) {
+			continue;
+		}
+		if (len <= 0) {
+			/* daemon is done with us */
+			break;
+		}
+		if (len != sizeof(req) ||
+				! memchr(req.plugin, '\0', sizeof(req.plugin)) ||
+				! memchr(req.fn, '\0', sizeof(req.fn)) ||
+				strchr(req.plugin, '/')) {
+			fprintf(stderr, "bad request\n");
+			break;
+		}
+		if (serve(argv[0], argv[1], &req, SANDBOX_FD)) {
+			break;
+		}
+	}
+
+	while (plugins) {
+		struct reader_plugin *rp = plugins->data;
+
+		rp->plugin.uninit(rp->plugin.ctx);
+		dlclose(rp->lib);
+		free(rp->name);
+		free(rp);
+		plugins = g_slist_remove(plugins, rp);
+	}
+
+	return 0;
+}
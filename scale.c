@@ -0,0 +1,593 @@
+#include "scale.h"
+
+#include <alloca.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2
+#endif
+
+/* areas are averaged down to no less than this times the target size */
+#define REDUCE_GAP 2
+/* keeps the sums of a column of an area within 16 bits */
+#define REDUCE_MAX 256
+
+#define LANCZOS_A 3.0
+
+/* of the filter weights */
+#define PRECISION_BITS 14
+
+
+
+/* weights of the source pixels making each target pixel along one axis */
+struct coeffs {
+	int *start;		/* first source pixel */
+	int *count;		/* number of source pixels */
+	int16_t *weight;	/* taps per target pixel */
+	int taps;
+};
+
+
+/* the inner loops, of which there are SIMD versions */
+struct kernels {
+	/* sum[i] += row[i] */
+	void (*add_row)(uint16_t *sum, const unsigned char *row, int n);
+	/* out[i] = sum of rows[t][i] * weight[t], t < taps, from <= i < n */
+	void (*convolve_rows)(unsigned char *out, const unsigned char **rows,
+			const int16_t *weight, int taps, int from, int n);
+};
+
+
+
+static inline int
+min(int a, int b)
+{
+	return a < b ? a : b;
+}
+
+
+
+static inline int
+max(int a, int b)
+{
+	return a > b ? a : b;
+}
+
+
+
+static inline unsigned char
+clamp(int32_t v)
+{
+	v >>= PRECISION_BITS;
+	return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+
+
+static void
+add_row_scalar(uint16_t *sum, const unsigned char *row, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		sum[i] += row[i];
+	}
+}
+
+
+
+static void
+convolve_rows_scalar(unsigned char *out, const unsigned char **rows,
+		const int16_t *weight, int taps, int from, int n)
+{
+	int32_t acc;
+	int i, t;
+
+	for (i = from; i < n; i++) {
+		acc = 1 << (PRECISION_BITS - 1);
+		for (t = 0; t < taps; t++) {
+			acc += rows[t][i] * weight[t];
+		}
+		out[i] = clamp(acc);
+	}
+}
+
+
+
+#ifdef __SSE2__
+static void
+add_row_sse2(uint16_t *sum, const unsigned char *row, int n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i v, lo, hi;
+	int i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		v = _mm_loadu_si128((const __m128i *) (row + i));
+		lo = _mm_loadu_si128((const __m128i *) (sum + i));
+		hi = _mm_loadu_si128((const __m128i *) (sum + i + 8));
+		lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(v, zero));
+		hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(v, zero));
+		_mm_storeu_si128((__m128i *) (sum + i), lo);
+		_mm_storeu_si128((__m128i *) (sum + i + 8), hi);
+	}
+	add_row_scalar(sum + i, row + i, n - i);
+}
+
+
+
+/*
+ * Two rows at a time: their pixels widened to 16 bits and interleaved, so
+ * that one multiply-add applies both weights.
+ */
+static void
+convolve_rows_sse2(unsigned char *out, const unsigned char **rows,
+		const int16_t *weight, int taps, int from, int n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_set1_epi32(1 << (PRECISION_BITS - 1));
+	__m128i acc_lo, acc_hi, w, a, b;
+	int i, t;
+
+	for (i = from; i + 8 <= n; i += 8) {
+		acc_lo = acc_hi = round;
+		for (t = 0; t < taps; t += 2) {
+			a = _mm_unpacklo_epi8(_mm_loadl_epi64(
+						(const __m128i *) (rows[t] + i)),
+					zero);
+			if (t + 1 < taps) {
+				b = _mm_unpacklo_epi8(_mm_loadl_epi64(
+						(const __m128i *)
+						(rows[t + 1] + i)), zero);
+				w = _mm_set1_epi32((uint16_t) weight[t] |
+						(uint32_t) weight[t + 1] << 16);
+			} else {
+				b = zero;
+				w = _mm_set1_epi32((uint16_t) weight[t]);
+			}
+			acc_lo = _mm_add_epi32(acc_lo, _mm_madd_epi16(
+						_mm_unpacklo_epi16(a, b), w));
+			acc_hi = _mm_add_epi32(acc_hi, _mm_madd_epi16(
+						_mm_unpackhi_epi16(a, b), w));
+		}
+		acc_lo = _mm_srai_epi32(acc_lo, PRECISION_BITS);
+		acc_hi = _mm_srai_epi32(acc_hi, PRECISION_BITS);
+		a = _mm_packs_epi32(acc_lo, acc_hi);
+		_mm_storel_epi64((__m128i *) (out + i),
+				_mm_packus_epi16(a, a));
+	}
+	convolve_rows_scalar(out, rows, weight, taps, i, n);
+}
+#endif
+
+
+
+#ifdef HAVE_AVX2
+__attribute__((target("avx2")))
+static void
+add_row_avx2(uint16_t *sum, const unsigned char *row, int n)
+{
+	__m256i lo, hi;
+	int i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		lo = _mm256_cvtepu8_epi16(_mm_loadu_si128(
+					(const __m128i *) (row + i)));
+		hi = _mm256_cvtepu8_epi16(_mm_loadu_si128(
+					(const __m128i *) (row + i + 16)));
+		lo = _mm256_add_epi16(lo, _mm256_loadu_si256(
+					(const __m256i *) (sum + i)));
+		hi = _mm256_add_epi16(hi, _mm256_loadu_si256(
+					(const __m256i *) (sum + i + 16)));
+		_mm256_storeu_si256((__m256i *) (sum + i), lo);
+		_mm256_storeu_si256((__m256i *) (sum + i + 16), hi);
+	}
+	add_row_scalar(sum + i, row + i, n - i);
+}
+
+
+
+/* as the SSE2 version, on 16 pixels at a time */
+__attribute__((target("avx2")))
+static void
+convolve_rows_avx2(unsigned char *out, const unsigned char **rows,
+		const int16_t *weight, int taps, int from, int n)
+{
+	const __m256i round = _mm256_set1_epi32(1 << (PRECISION_BITS - 1));
+	__m256i acc_lo, acc_hi, w, a, b;
+	int i, t;
+
+	for (i = from; i + 16 <= n; i += 16) {
+		acc_lo = acc_hi = round;
+		for (t = 0; t < taps; t += 2) {
+			a = _mm256_cvtepu8_epi16(_mm_loadu_si128(
+						(const __m128i *) (rows[t] + i)));
+			if (t + 1 < taps) {
+				b = _mm256_cvtepu8_epi16(_mm_loadu_si128(
+						(const __m128i *)
+						(rows[t + 1] + i)));
+				w = _mm256_set1_epi32((uint16_t) weight[t] |
+						(uint32_t) weight[t + 1] << 16);
+			} else {
+				b = _mm256_setzero_si256();
+				w = _mm256_set1_epi32((uint16_t) weight[t]);
+			}
+			/* within each 128 bit lane, as all of these are */
+			acc_lo = _mm256_add_epi32(acc_lo, _mm256_madd_epi16(
+						_mm256_unpacklo_epi16(a, b), w));
+			acc_hi = _mm256_add_epi32(acc_hi, _mm256_madd_epi16(
+						_mm256_unpackhi_epi16(a, b), w));
+		}
+		acc_lo = _mm256_srai_epi32(acc_lo, PRECISION_BITS);
+		acc_hi = _mm256_srai_epi32(acc_hi, PRECISION_BITS);
+		a = _mm256_packs_epi32(acc_lo, acc_hi);
+		a = _mm256_packus_epi16(a, a);
+		/* the low 64 bits of each lane hold the pixels */
+		a = _mm256_permute4x64_epi64(a, 0xd8);
+		_mm_storeu_si128((__m128i *) (out + i),
+				_mm256_castsi256_si128(a));
+	}
+	convolve_rows_scalar(out, rows, weight, taps, i, n);
+}
+#endif
+
+
+
+static gpointer
+select_kernels(gpointer data)
+{
+	struct kernels *k = data;
+
+	k->add_row = add_row_scalar;
+	k->convolve_rows = convolve_rows_scalar;
+#ifdef __SSE2__
+	k->add_row = add_row_sse2;
+	k->convolve_rows = convolve_rows_sse2;
+#endif
+#ifdef HAVE_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		k->add_row = add_row_avx2;
+		k->convolve_rows = convolve_rows_avx2;
+	}
+#endif
+
+	return k;
+}
+
+
+
+static struct kernels kernels;
+
+static const struct kernels *
+get_kernels(void)
+{
+	static GOnce once = G_ONCE_INIT;
+
+	return g_once(&once, select_kernels, &kernels);
+}
+
+
+
+int
+scale_use_kernels(const char *name)
+{
+	get_kernels();
+	if (strcmp(name, "scalar") == 0) {
+		kernels.add_row = add_row_scalar;
+		kernels.convolve_rows = convolve_rows_scalar;
+		return 0;
+	}
+#ifdef __SSE2__
+	if (strcmp(name, "sse2") == 0) {
+		kernels.add_row = add_row_sse2;
+		kernels.convolve_rows = convolve_rows_sse2;
+		return 0;
+	}
+#endif
+#ifdef HAVE_AVX2
+	if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+		kernels.add_row = add_row_avx2;
+		kernels.convolve_rows = convolve_rows_avx2;
+		return 0;
+	}
+#endif
+	return 1;
+}
+
+
+
+void
+scale_view(const struct scale_image *image, int x, int y, int width,
+		int height, struct scale_image *view)
+{
+	view->pixels = image->pixels + y * image->stride + x * image->channels;
+	view->width = width;
+	view->height = height;
+	view->channels = image->channels;
+	view->stride = image->stride;
+}
+
+
+
+static int
+alloc_image(struct scale_image *image, int width, int height, int channels)
+{
+	image->width = width;
+	image->height = height;
+	image->channels = channels;
+	image->stride = (size_t) width * channels;
+	image->pixels = malloc(image->stride * height);
+
+	return image->pixels ? 0 : 1;
+}
+
+
+
+/*
+ * Each target pixel the average of a kx by ky area of the source; those at
+ * the right and bottom edges may be of a smaller one.
+ */
+static int
+box_reduce(const struct scale_image *src, int kx, int ky,
+		struct scale_image *dst)
+{
+	const struct kernels *k = get_kernels();
+	int channels = src->channels;
+	uint16_t *sum;
+	unsigned char *out;
+	int x, y, c, i, rows, cols;
+	uint32_t total;
+
+	if (alloc_image(dst, (src->width + kx - 1) / kx,
+				(src->height + ky - 1) / ky, channels)) {
+		return 1;
+	}
+	sum = malloc(src->width * channels * sizeof(uint16_t));
+	if (! sum) {
+		free(dst->pixels);
+		return 1;
+	}
+
+	for (y = 0; y < dst->height; y++) {
+		rows = min(ky, src->height - y * ky);
+		memset(sum, 0, src->width * channels * sizeof(uint16_t));
+		for (i = 0; i < rows; i++) {
+			k->add_row(sum, src->pixels +
+					(size_t) (y * ky + i) * src->stride,
+					src->width * channels);
+		}
+
+		out = dst->pixels + y * dst->stride;
+		for (x = 0; x < dst->width; x++) {
+			cols = min(kx, src->width - x * kx);
+			for (c = 0; c < channels; c++) {
+				total = 0;
+				for (i = 0; i < cols; i++) {
+					total += sum[(x * kx + i) * channels +
+						c];
+				}
+				*out++ = (total + rows * cols / 2) /
+					(rows * cols);
+			}
+		}
+	}
+
+	free(sum);
+	return 0;
+}
+
+
+
+static double
+lanczos(double x)
+{
+	if (x == 0.0) {
+		return 1.0;
+	}
+	if (x <= -LANCZOS_A || x >= LANCZOS_A) {
+		return 0.0;
+	}
+	x *= M_PI;
+	return LANCZOS_A * sin(x) * sin(x / LANCZOS_A) / (x * x);
+}
+
+
+
+static void
+free_coeffs(struct coeffs *c)
+{
+	free(c->start);
+	free(c->count);
+	free(c->weight);
+}
+
+
+
+/* the filter is widened when scaling down, to cover every source pixel */
+static int
+make_coeffs(int in_size, int out_size, struct coeffs *c)
+{
+	double scale = (double) in_size / out_size;
+	double filterscale = scale > 1.0 ? scale : 1.0;
+	double support = LANCZOS_A * filterscale;
+	double center, total;
+	double *w;
+	int i, j, first, last;
+
+	c->taps = (int) ceil(support) * 2 + 1;
+	c->start = malloc(out_size * sizeof(int));
+	c->count = malloc(out_size * sizeof(int));
+	c->weight = calloc((size_t) out_size * c->taps, sizeof(int16_t));
+	w = malloc(c->taps * sizeof(double));
+	if (! c->start || ! c->count || ! c->weight || ! w) {
+		free_coeffs(c);
+		free(w);
+		return 1;
+	}
+
+	for (i = 0; i < out_size; i++) {
+		center = (i + 0.5) * scale;
+		first = max((int) (center - support + 0.5), 0);
+		last = min((int) (center + support + 0.5), in_size);
+		if (last - first > c->taps) {
+			last = first + c->taps;
+		}
+
+		total = 0.0;
+		for (j = first; j < last; j++) {
+			w[j - first] = lanczos((j - center + 0.5) /
+					filterscale);
+			total += w[j - first];
+		}
+		for (j = first; j < last; j++) {
+			c->weight[i * c->taps + j - first] = (int16_t)
+				lrint(w[j - first] / total *
+						(1 << PRECISION_BITS));
+		}
+		c->start[i] = first;
+		c->count[i] = last - first;
+	}
+
+	free(w);
+	return 0;
+}
+
+
+
+/* channels is a constant where inlined, for the compiler to unroll by */
+static inline void
+scale_row(const unsigned char *row, const struct coeffs *c, int width,
+		const int channels, unsigned char *out)
+{
+	const unsigned char *in;
+	const int16_t *weight;
+	int32_t acc[SCALE_MAX_CHANNELS];
+	int x, ch, t;
+
+	for (x = 0; x < width; x++) {
+		in = row + c->start[x] * channels;
+		weight = c->weight + x * c->taps;
+		for (ch = 0; ch < channels; ch++) {
+			acc[ch] = 1 << (PRECISION_BITS - 1);
+		}
+		for (t = 0; t < c->count[x]; t++) {
+			for (ch = 0; ch < channels; ch++) {
+				acc[ch] += *in++ * weight[t];
+			}
+		}
+		for (ch = 0; ch < channels; ch++) {
+			*out++ = clamp(acc[ch]);
+		}
+	}
+}
+
+
+
+static void
+scale_horizontal(const struct scale_image *src, const struct coeffs *c,
+		struct scale_image *dst)
+{
+	const unsigned char *row;
+	unsigned char *out;
+	int y;
+
+	for (y = 0; y < src->height; y++) {
+		row = src->pixels + y * src->stride;
+		out = dst->pixels + y * dst->stride;
+		switch (src->channels) {
+			case 3:
+				scale_row(row, c, dst->width, 3, out);
+				break;
+			case 4:
+				scale_row(row, c, dst->width, 4, out);
+				break;
+			default:
+				scale_row(row, c, dst->width, src->channels,
+						out);
+				break;
+		}
+	}
+}
+
+
+
+static void
+scale_vertical(const struct scale_image *src, const struct coeffs *c,
+		struct scale_image *dst)
+{
+	const struct kernels *k = get_kernels();
+	const unsigned char **rows;
+	int y, t;
+
+	rows = alloca(c->taps * sizeof(const unsigned char *));
+	for (y = 0; y < dst->height; y++) {
+		for (t = 0; t < c->count[y]; t++) {
+			rows[t] = src->pixels + (c->start[y] + t) * src->stride;
+		}
+		k->convolve_rows(dst->pixels + y * dst->stride, rows,
+				c->weight + y * c->taps, c->count[y], 0,
+				dst->width * dst->channels);
+	}
+}
+
+
+
+int
+scale_image(const struct scale_image *src, int width, int height,
+		struct scale_image *dst)
+{
+	struct scale_image reduced, tall;
+	const struct scale_image *from = src;
+	struct coeffs cx, cy;
+	int kx, ky;
+	int err = 1;
+
+	if (width <= 0 || height <= 0 || src->width <= 0 ||
+			src->height <= 0 || src->channels < 1 ||
+			src->channels > SCALE_MAX_CHANNELS) {
+		return 1;
+	}
+
+	reduced.pixels = tall.pixels = NULL;
+	kx = max(min(src->width / (width * REDUCE_GAP), REDUCE_MAX), 1);
+	ky = max(min(src->height / (height * REDUCE_GAP), REDUCE_MAX), 1);
+	if (kx > 1 || ky > 1) {
+		if (box_reduce(src, kx, ky, &reduced)) {
+			return 1;
+		}
+		from = &reduced;
+	}
+
+	if (make_coeffs(from->width, width, &cx)) {
+		goto out;
+	}
+	if (make_coeffs(from->height, height, &cy)) {
+		free_coeffs(&cx);
+		goto out;
+	}
+
+	/* vertically first, as that has SIMD versions for the wider rows */
+	if (! alloc_image(&tall, from->width, height, from->channels) &&
+			! alloc_image(dst, width, height, from->channels)) {
+		scale_vertical(from, &cy, &tall);
+		scale_horizontal(&tall, &cx, dst);
+		err = 0;
+	}
+
+	free_coeffs(&cx);
+	free_coeffs(&cy);
+out:
+	free(tall.pixels);
+	free(reduced.pixels);
+	return err;
+}
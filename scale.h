@@ -0,0 +1,41 @@
+#ifndef SCALE_H
+#define SCALE_H
+
+#include <stddef.h>
+
+/*
+ * Downscaling of 8 bit pixels with interleaved channels, straight from a
+ * plugin's buffer rather than through ImageMagick: areas of the source are
+ * averaged down to two to four times the target size, the rest is done with
+ * a Lanczos filter. Uses SSE2 or AVX2 where the CPU has them; the results
+ * are the same either way.
+ *
+ * Channels are filtered independently, so an alpha channel should be
+ * opaque or premultiplied.
+ */
+
+#define SCALE_MAX_CHANNELS 4
+
+struct scale_image {
+	unsigned char *pixels;
+	int width, height;
+	int channels;
+	size_t stride;		/* bytes from the start of a row to the next */
+};
+
+/* the given part of image, sharing its pixels */
+void scale_view(const struct scale_image *image, int x, int y, int width,
+		int height, struct scale_image *view);
+
+/* src scaled to width x height, into pixels of dst allocated by malloc() */
+int scale_image(const struct scale_image *src, int width, int height,
+		struct scale_image *dst);
+
+/*
+ * Use the inner loops named, "scalar", "sse2" or "avx2", rather than the
+ * best ones the CPU has, e.g. to test them against each other. Not while
+ * images are being scaled. 1 if those are not available here.
+ */
+int scale_use_kernels(const char *name);
+
+#endif
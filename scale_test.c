@@ -0,0 +1,237 @@
+/*
+ * Scales fixed synthetic images with each set of inner loops the CPU has and
+ * compares the results with those checked in, which were made with the
+ * scalar ones: every version has to give the same pixels. With -w, prints
+ * the results in the format of the expected file instead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scale.h"
+
+#include <glib.h>
+
+#define LINE_MAX_LEN 4096
+
+
+
+struct test_case {
+	const char *name;
+	int width, height, channels;	/* of the source */
+	int x, y, view_width, view_height;	/* scaled part, 0 for all */
+	int to_width, to_height;
+};
+
+
+static const struct test_case cases[] = {
+	{ "odd-rgb", 97, 61, 3, 0, 0, 0, 0, 13, 9 },
+	{ "lanczos-rgb", 33, 17, 3, 0, 0, 0, 0, 20, 11 },
+	{ "rgba", 120, 80, 4, 0, 0, 0, 0, 31, 19 },
+	{ "crop-rgb", 100, 80, 3, 7, 5, 61, 43, 17, 12 },
+	{ "crop-rgba", 50, 300, 4, 3, 10, 41, 277, 9, 64 },
+	{ "wide-rgb", 1201, 9, 3, 0, 0, 0, 0, 4, 3 },
+	{ "single-rgb", 31, 29, 3, 0, 0, 0, 0, 1, 1 },
+};
+
+#define N_CASES (sizeof(cases) / sizeof(cases[0]))
+
+static const char *kernel_names[] = { "scalar", "sse2", "avx2" };
+
+#define N_KERNELS (sizeof(kernel_names) / sizeof(kernel_names[0]))
+
+
+
+/*
+ * Noise, with a hard edge and smooth gradients in places, so that the
+ * filters overshoot and have to clamp.
+ */
+static void
+make_source(const struct test_case *tc, struct scale_image *image)
+{
+	unsigned int seed = 12345;
+	unsigned char *p;
+	int x, y, c;
+
+	image->width = tc->width;
+	image->height = tc->height;
+	image->channels = tc->channels;
+	/* rows padded, as plugins' buffers may be */
+	image->stride = (size_t) tc->width * tc->channels + 5;
+	image->pixels = calloc(image->stride, tc->height);
+	if (! image->pixels) {
+		abort();
+	}
+
+	for (y = 0; y < tc->height; y++) {
+		p = image->pixels + y * image->stride;
+		for (x = 0; x < tc->width; x++) {
+			for (c = 0; c < tc->channels; c++) {
+				seed = seed * 1103515245 + 12345;
+				if (x < tc->width / 3) {
+					*p++ = (seed >> 16) & 0xff;
+				} else if (x < 2 * tc->width / 3) {
+					*p++ = (y / 4 + x / 4) % 2 ? 255 : 0;
+				} else {
+					*p++ = (x * 255 / tc->width + c * 60 +
+							y) & 0xff;
+				}
+			}
+		}
+	}
+}
+
+
+
+static int
+run_case(const struct test_case *tc, struct scale_image *dst)
+{
+	struct scale_image src, view;
+	int r;
+
+	make_source(tc, &src);
+	if (tc->view_width) {
+		scale_view(&src, tc->x, tc->y, tc->view_width,
+				tc->view_height, &view);
+	} else {
+		view = src;
+	}
+	r = scale_image(&view, tc->to_width, tc->to_height, dst);
+	free(src.pixels);
+
+	return r;
+}
+
+
+
+/* a line per row, of two hex digits per byte */
+static void
+print_result(FILE *out, const struct test_case *tc,
+		const struct scale_image *image)
+{
+	const unsigned char *p;
+	int x, y;
+
+	fprintf(out, "%s %dx%dx%d\n", tc->name, image->width, image->height,
+			image->channels);
+	for (y = 0; y < image->height; y++) {
+		p = image->pixels + y * image->stride;
+		for (x = 0; x < image->width * image->channels; x++) {
+			fprintf(out, "%02x", p[x]);
+		}
+		fputc('\n', out);
+	}
+}
+
+
+
+/* the expected result of tc as print_result() has it, NULL if none */
+static char *
+read_expected(const char *fn, const struct test_case *tc)
+{
+	char line[LINE_MAX_LEN];
+	size_t name_len = strlen(tc->name);
+	GString *text = NULL;
+	FILE *in;
+
+	in = fopen(fn, "r");
+	if (! in) {
+		perror(fn);
+		return NULL;
+	}
+	while (fgets(line, sizeof(line), in)) {
+		if (text) {
+			/* the next case */
+			if (strchr(line, ' ')) {
+				break;
+			}
+			g_string_append(text, line);
+		} else if (strncmp(line, tc->name, name_len) == 0 &&
+				line[name_len] == ' ') {
+			text = g_string_new(line);
+		}
+	}
+	fclose(in);
+
+	return text ? g_string_free(text, FALSE) : NULL;
+}
+
+
+
+static int
+check_case(const char *expected_fn, const struct test_case *tc,
+		const char *kernels)
+{
+	struct scale_image dst;
+	char *expected, *got;
+	size_t len;
+	FILE *out;
+	int err;
+
+	if (run_case(tc, &dst)) {
+		fprintf(stderr, "%s, %s: scaling failed\n", tc->name,
+				kernels);
+		return 1;
+	}
+	out = open_memstream(&got, &len);
+	print_result(out, tc, &dst);
+	fclose(out);
+	free(dst.pixels);
+
+	expected = read_expected(expected_fn, tc);
+	err = ! expected || strcmp(expected, got);
+	fprintf(stdout, "%s, %s: %s\n", tc->name, kernels,
+			! expected ? "no expected result" :
+			err ? "FAILED" : "ok");
+	if (expected && err) {
+		fprintf(stdout, "expected:\n%sgot:\n%s", expected, got);
+	}
+	g_free(expected);
+	free(got);
+
+	return err;
+}
+
+
+
+int
+main(int argc, char *argv[])
+{
+	struct scale_image dst;
+	unsigned int i, k;
+	int err = 0;
+
+	if (argc == 2 && strcmp(argv[1], "-w") == 0) {
+		scale_use_kernels("scalar");
+		for (i = 0; i < N_CASES; i++) {
+			if (run_case(&cases[i], &dst)) {
+				fprintf(stderr, "%s: scaling failed\n",
+						cases[i].name);
+				return 1;
+			}
+			print_result(stdout, &cases[i], &dst);
+			free(dst.pixels);
+		}
+		return 0;
+	}
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <EXPECTED FILE> | -w\n",
+				argv[0]);
+		return 2;
+	}
+
+	for (k = 0; k < N_KERNELS; k++) {
+		if (scale_use_kernels(kernel_names[k])) {
+			fprintf(stdout, "%s: not available, skipped\n",
+					kernel_names[k]);
+			continue;
+		}
+		for (i = 0; i < N_CASES; i++) {
+			err |= check_case(argv[1], &cases[i],
+					kernel_names[k]);
+		}
+	}
+
+	return err;
+}
@@ -1,6 +1,10 @@
 #include "thumbnail.h"
+#include "packstore.h"
+#include "scale.h"
+#include "writeback.h"
 
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
 #include <math.h>
 #include <stdio.h>
@@ -11,6 +15,7 @@
 
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 
 #include <glib.h>
 
@@ -24,6 +29,15 @@
 
 #define DEFAULT_CONFFILE "/etc/meego-ux-mediafs.conf"
 
+/* size asked from the readers if the profiles don't tell */
+#define DEFAULT_REQUEST_PX 1024
+
+/*
+ * A thumbnail is scaled from a smaller intermediate than the source only if
+ * that is at least this much larger, so that resampling twice does not blur.
+ */
+#define CASCADE_MIN_RATIO 2.0
+
 
 enum {
 	THUMB_MAIN = 0,
@@ -41,12 +55,77 @@ enum {
 };
 
 
+enum {
+	FORMAT_PNG,
+	FORMAT_JPEG,
+	FORMAT_WEBP,
+	FORMAT_N
+};
+
+
+/* the output format is picked by ImageMagick from the file suffix */
+static const struct {
+	const char *name;
+	const char *suffix;
+} formats[FORMAT_N] = {
+	[FORMAT_PNG] = { "png", "png" },
+	[FORMAT_JPEG] = { "jpeg", "jpg" },
+	[FORMAT_WEBP] = { "webp", "webp" },
+};
+
+
+/* PNG row filters, by their number in ImageMagick's PNG quality */
+static const char *png_filters[] = {
+	"none", "sub", "up", "average", "paeth", "adaptive", NULL
+};
+
+/* ImageMagick's own, for PNG zlib level 7 and adaptive filtering */
+#define DEFAULT_QUALITY 75
+
+/*
+ * Where the thumbnail spec has a program mark the files it could not make a
+ * thumbnail of, for other programs not to try either.
+ */
+#define FAIL_DIR "fail"
+#define FAIL_PROFILE FAIL_DIR "/meego-ux-mediafs"
+
+
+/* what writing the thumbnails of a profile has cost */
+struct encode_stats {
+	GMutex *lock;
+	unsigned long count;
+	double cpu_s;
+	uint64_t bytes;
+};
+
+
 struct config {
 	char *name;
 	int max_width_px;
 	int max_height_px;
 	double ratio;
 	int resize;
+
+	int format;
+	/* as ImageInfo has it, for PNG the zlib level * 10 + the filter */
+	unsigned long quality;
+
+	/* thumbnails go into a pack rather than files of their own */
+	int pack;
+	struct packstore *store;
+
+	/* thumbnails are made only when asked for, see thumbnail_lazy() */
+	int lazy;
+
+	struct encode_stats *stats;
+};
+
+
+/* markers are named and written like thumbnails of this profile */
+static const struct config fail_config = {
+	.name = FAIL_PROFILE,
+	.format = FORMAT_PNG,
+	.quality = DEFAULT_QUALITY,
 };
 
 
@@ -55,6 +134,15 @@ struct thumbnailer {
 	struct config **config;
 	int n;
 
+	/* profile names, see thumbnail_profiles() */
+	char *profiles;
+
+	/* scale thumbnails from larger ones, see thumbnail_set_cascade() */
+	int cascade;
+
+	/* puts written thumbnails in place, see thumbnail_set_writeback() */
+	struct writeback *writeback;
+
 	double hdpmm, vdpmm;
 };
 
@@ -68,6 +156,86 @@ min(int a, int b)
 
 
 
+static inline int
+max(int a, int b)
+{
+	return a > b ? a : b;
+}
+
+
+
+/* whether ImageMagick was built with an encoder for format */
+static int
+can_encode(int format)
+{
+	ExceptionInfo exception;
+	const MagickInfo *info;
+
+	GetExceptionInfo(&exception);
+	info = GetMagickInfo(formats[format].name, &exception);
+	DestroyExceptionInfo(&exception);
+
+	return info && info->encoder;
+}
+
+
+
+static int
+parse_format(const char *val)
+{
+	int i;
+
+	for (i = 0; i < FORMAT_N; i++) {
+		if (! strcasecmp(val, formats[i].name) ||
+				! strcasecmp(val, formats[i].suffix)) {
+			if (can_encode(i)) {
+				return i;
+			}
+			fprintf(stderr, "format %s: ImageMagick has no "
+					"encoder for it\n", val);
+			return FORMAT_PNG;
+		}
+	}
+	fprintf(stderr, "unrecognised format: %s\n", val);
+
+	return FORMAT_PNG;
+}
+
+
+
+/* "<zlib level>[,<filter>]" into PNG quality, -1 if not valid */
+static int
+parse_compression(const char *val)
+{
+	const char *filter;
+	char *end;
+	int level;
+	int i;
+
+	level = strtol(val, &end, 10);
+	if (end == val || level < 0 || level > 9 ||
+			(*end != '\0' && *end != ',')) {
+		fprintf(stderr, "bad compression: %s\n", val);
+		return -1;
+	}
+	if (*end == '\0') {
+		/* adaptive */
+		return level * 10 + 5;
+	}
+
+	filter = end + 1;
+	for (i = 0; png_filters[i]; i++) {
+		if (! strcasecmp(filter, png_filters[i])) {
+			return level * 10 + i;
+		}
+	}
+	fprintf(stderr, "unrecognised PNG filter: %s\n", filter);
+
+	return -1;
+}
+
+
+
 static int
 read_config(struct thumbnailer *ctx, const char *conffile)
 {
@@ -83,6 +251,8 @@ read_config(struct thumbnailer *ctx, const char *conffile)
 	char *lf_ptr;
 	char *lf_ptr_r;
 
+	int quality, compression;
+
 	fptr = fopen(conffile, "r");
 	if (! fptr) {
 		fprintf(stderr, "%s: cannot read\n", conffile);
@@ -118,6 +288,12 @@ read_config(struct thumbnailer *ctx, const char *conffile)
 		tn.resize = RESIZE_NONE;
 		tn.max_width_px = tn.max_height_px = 0;
 		tn.ratio = -1.0;
+		tn.format = FORMAT_PNG;
+		tn.quality = DEFAULT_QUALITY;
+		tn.pack = 0;
+		tn.store = NULL;
+		tn.lazy = 0;
+		quality = compression = -1;
 
 		for (ptr = strtok_r(NULL, " \t", &ptr_r); ptr;
 				ptr = strtok_r(NULL, " \t", &ptr_r)) {
@@ -142,6 +318,16 @@ read_config(struct thumbnailer *ctx, const char *conffile)
 				tn.resize = RESIZE_CROP_CENTRE;
 			} else if (! strcasecmp(key, "ratio") && val) {
 				tn.ratio = atof(val);
+			} else if (! strcasecmp(key, "format") && val) {
+				tn.format = parse_format(val);
+			} else if (! strcasecmp(key, "quality") && val) {
+				quality = CLAMP(atoi(val), 1, 100);
+			} else if (! strcasecmp(key, "compression") && val) {
+				compression = parse_compression(val);
+			} else if (! strcasecmp(key, "pack")) {
+				tn.pack = 1;
+			} else if (! strcasecmp(key, "lazy")) {
+				tn.lazy = 1;
 			} else {
 				fprintf(stderr, "unrecognised config key: %s\n",
 						key);
@@ -151,6 +337,30 @@ read_config(struct thumbnailer *ctx, const char *conffile)
 		if (! (tn.max_width_px || tn.max_height_px)) {
 			continue;
 		}
+		/* a bound not given is the same as the other one */
+		if (! tn.max_width_px) {
+			tn.max_width_px = tn.max_height_px;
+		} else if (! tn.max_height_px) {
+			tn.max_height_px = tn.max_width_px;
+		}
+		if (tn.format == FORMAT_PNG ? quality >= 0 :
+				compression >= 0) {
+			fprintf(stderr, "%s: %s does not apply to %s\n",
+					tn.name, tn.format == FORMAT_PNG ?
+						"quality" : "compression",
+					formats[tn.format].name);
+		}
+		/* a pack is there to be read without asking the daemon */
+		if (tn.lazy && tn.pack) {
+			fprintf(stderr, "%s: lazy does not apply to packed "
+					"profiles\n", tn.name);
+			tn.lazy = 0;
+		}
+		if (tn.format == FORMAT_PNG && compression >= 0) {
+			tn.quality = compression;
+		} else if (tn.format != FORMAT_PNG && quality >= 0) {
+			tn.quality = quality;
+		}
 		new = realloc(ctx->config,
 				(ctx->n + 1) * sizeof(struct config *));
 		if (new) {
@@ -160,6 +370,8 @@ read_config(struct thumbnailer *ctx, const char *conffile)
 			assert(ctx->config[ctx->n]);
 			tn.name = strdup(tn.name);
 			assert(tn.name);
+			tn.stats = g_new0(struct encode_stats, 1);
+			tn.stats->lock = g_mutex_new();
 			memcpy(ctx->config[ctx->n], &tn, sizeof(struct config));
 			ctx->n++;
 #ifdef DEBUG
@@ -171,6 +383,14 @@ read_config(struct thumbnailer *ctx, const char *conffile)
 			if (tn.resize != RESIZE_NONE) {
 				printf(" rs=%d", tn.resize);
 			}
+			printf(" f=%s q=%lu", formats[tn.format].name,
+					tn.quality);
+			if (tn.pack) {
+				printf(" pack");
+			}
+			if (tn.lazy) {
+				printf(" lazy");
+			}
 			printf("\n");
 #endif
 
@@ -192,15 +412,57 @@ free_config(struct thumbnailer *ctx)
 	int i;
 	free(ctx->thumb_dir);
 	for (i = 0; i < ctx->n; i++) {
+		packstore_close(ctx->config[i]->store);
+		g_mutex_free(ctx->config[i]->stats->lock);
+		g_free(ctx->config[i]->stats);
 		free(ctx->config[i]->name);
 		free(ctx->config[i]);
 	}
 	free(ctx->config);
+	free(ctx->profiles);
 	free(ctx);
 }
 
 
 
+static char *
+make_profiles(const struct thumbnailer *ctx)
+{
+	GString *profiles;
+	char *ret;
+	int i;
+
+	profiles = g_string_new("");
+	for (i = 0; i < ctx->n; i++) {
+		const struct config *conf = ctx->config[i];
+		g_string_append_printf(profiles, "%s%s:%dx%d:%.2f:%d",
+				i ? "," : "", conf->name,
+				conf->max_width_px, conf->max_height_px,
+				conf->ratio, conf->resize);
+		/* left out by default, so that the string stays the same */
+		if (conf->format != FORMAT_PNG ||
+				conf->quality != DEFAULT_QUALITY) {
+			g_string_append_printf(profiles, ":%s:%lu",
+					formats[conf->format].name,
+					conf->quality);
+		}
+		if (conf->pack) {
+			g_string_append(profiles, ":pack");
+		}
+		if (conf->lazy) {
+			g_string_append(profiles, ":lazy");
+		}
+	}
+
+	/* the thumbnailer's own allocations are all malloc()ed */
+	ret = strdup(profiles->str);
+	g_string_free(profiles, TRUE);
+
+	return ret;
+}
+
+
+
 static struct thumbnailer *
 make_config(const char *thumb_dir, const char *conffile)
 {
@@ -210,6 +472,7 @@ make_config(const char *thumb_dir, const char *conffile)
 	if (! config) {
 		return NULL;
 	}
+	config->profiles = NULL;
 	config->thumb_dir = strdup(thumb_dir);
 	if (! config->thumb_dir) {
 		free_config(config);
@@ -218,12 +481,20 @@ make_config(const char *thumb_dir, const char *conffile)
 
 	config->n = 0;
 	config->config = NULL;
+	config->cascade = 1;
+	config->writeback = NULL;
 
 	if (read_config(config, conffile ? : DEFAULT_CONFFILE)) {
 		free_config(config);
 		return NULL;
 	}
 
+	config->profiles = make_profiles(config);
+	if (! config->profiles) {
+		free_config(config);
+		return NULL;
+	}
+
 	return config;
 }
 
@@ -246,6 +517,62 @@ make_hash(char *hash, const char *fn)
 
 
 
+/* the file thumbnails are made of, with what the spec has them tell of it */
+struct source {
+	char hash[16 * 2 + 1];
+	char uri[FILENAME_MAX + 8];	/* what hash is of */
+	const struct stat *st;		/* of the file, may be NULL */
+	unsigned long width, height;	/* of the image, 0 if not known */
+};
+
+
+
+static void
+make_source(struct source *source, const char *fn, const struct stat *st,
+		unsigned long width, unsigned long height)
+{
+	make_hash(source->hash, fn);
+	snprintf(source->uri, sizeof(source->uri), "file://%s", fn);
+	source->st = st;
+	source->width = width;
+	source->height = height;
+}
+
+
+
+void
+thumbnail_original_size(unsigned long stored_width,
+		unsigned long stored_height, unsigned long *width,
+		unsigned long *height)
+{
+	if (stored_width < *width || stored_height < *height) {
+		/* not scaled down, or not known */
+		return;
+	}
+	/* it may have been turned upright since */
+	if ((stored_width > stored_height) != (*width > *height)) {
+		*width = stored_height;
+		*height = stored_width;
+	} else {
+		*width = stored_width;
+		*height = stored_height;
+	}
+}
+
+
+
+static void
+get_original_size(const Image *image, unsigned long *width,
+		unsigned long *height)
+{
+	*width = image->columns;
+	*height = image->rows;
+	thumbnail_original_size(image->magick_columns, image->magick_rows,
+			width, height);
+}
+
+
+
 static int
 get_thumbnail_dir(char *dir, size_t dir_len, const char *base_dir,
 		const char *type)
@@ -265,18 +592,20 @@ get_thumbnail_dir(char *dir, size_t dir_len, const char *base_dir,
 
 static int
 build_filename(char *fn, size_t len, const char *thumb_dir, const char *hash,
-		const char *type)
+		const struct config *conf)
 {
+	const char *suffix = formats[conf->format].suffix;
 	char dir[len];
 	int w;
-	if (get_thumbnail_dir(dir, len - 16 - 4 - 1, thumb_dir, type)) {
+	if (get_thumbnail_dir(dir, len - 16 - strlen(suffix) - 1, thumb_dir,
+				conf->name)) {
 		return 1;
 	}
 	/*
 	 * get_thumbnail_dir should fail is len is not enough. Still, there's
 	 * no harm in additional checks.
 	 */
-	w = snprintf(fn, len, "%s/%s.png", dir, hash);
+	w = snprintf(fn, len, "%s/%s.%s", dir, hash, suffix);
 	return (w < len) ? 0 : 1;
 }
 
@@ -398,249 +727,914 @@ make_thumbnail_mm(const char *target_dir,
 
 
 
-static int
-make_thumbnail(const struct config *conf,
-		Image *image, ImageInfo *info, ExceptionInfo *exc,
-		const char *thumb_dir, const char *hash)
-{
-	Image *edit = NULL;
-	Image *use, *thumb;
+/* how the thumbnail of a profile is made of a source image */
+struct plan {
+	const struct config *conf;
+
+	/* part of the source shown, in source pixels */
+	RectangleInfo crop;
+	/* size of the thumbnail */
 	int width, height;
-	int err;
+	/* size of the whole source scaled as much as the thumbnail is */
+	int frame_width, frame_height;
+};
 
-	use = image;
-	if (conf->ratio >= 0.0 &&
-			fabs((image->rows * conf->ratio - image->columns) /
-				image->columns) >= 0.01) {
-		RectangleInfo crop;
 
-		if ((double) image->columns / image->rows >= conf->ratio) {
-			crop.width = (int) (image->rows * conf->ratio);
-			crop.height = (int) image->rows;
-		} else {
-			crop.width = (int) image->columns;
-			crop.height = (int) (image->columns / conf->ratio);
-		}
 
+static void
+plan_thumbnail(const struct config *conf, unsigned long columns,
+		unsigned long rows, struct plan *plan)
+{
+	RectangleInfo *crop = &plan->crop;
+
+	plan->conf = conf;
+	crop->x = crop->y = 0;
+	crop->width = columns;
+	crop->height = rows;
+
+	if (conf->ratio >= 0.0 &&
+			fabs((rows * conf->ratio - columns) /
+				columns) >= 0.01) {
 		switch (conf->resize) {
 			case RESIZE_CROP_CENTRE:
-				crop.x = (image->columns - crop.width) / 2;
-				crop.y = (image->rows - crop.height) / 2;
+				if ((double) columns / rows >=
+						conf->ratio) {
+					crop->width = max(1, (int)
+						(rows * conf->ratio));
+				} else {
+					crop->height = max(1, (int)
+						(columns / conf->ratio));
+				}
+				crop->x = (columns - crop->width) / 2;
+				crop->y = (rows - crop->height) / 2;
 				break;
 			case RESIZE_NONE:
 				fprintf(stderr, "image ratio (%dx%d=%.2f) "
 						"doesn't match requested "
 						"thumbnail ratio (%.2f) "
 						"and cropping isn't allowed!\n",
-						(int) image->columns,
-						(int) image->rows,
-						(double) image->columns /
-							image->rows,
+						(int) columns,
+						(int) rows,
+						(double) columns /
+							rows,
 							conf->ratio);
-				crop.x = crop.y = 0;
-				crop.width = image->columns;
-				crop.height = image->rows;
 				break;
 		}
-
-		if (crop.x || crop.y || crop.width != image->columns ||
-				crop.height != image->rows) {
-#ifdef DEBUG
-			fprintf(stdout, "cropping %dx%d to %dx%d+%d+%d\n",
-					(int) image->columns, (int) image->rows,
-					(int) crop.width, (int) crop.height,
-					(int) crop.x, (int) crop.y);
-#endif
-			edit = CropImage(image, &crop, exc);
-			if (edit) {
-				use = edit;
-			} else {
-				fprintf(stderr, "failed to crop image!\n");
-			}
-		}
 	}
 
 	if (conf->ratio <= 0.0) {
 		/* preserve ratio */
-		if (use->columns > use->rows) {
-			width = min(use->columns, conf->max_width_px);
-			height = width * use->rows / use->columns;
+		if (crop->width > crop->height) {
+			plan->width = min(crop->width, conf->max_width_px);
+			plan->height = plan->width * crop->height /
+				crop->width;
 		} else {
-			height = min(use->rows, conf->max_height_px);
-			width = height * use->columns / use->rows;
+			plan->height = min(crop->height, conf->max_height_px);
+			plan->width = plan->height * crop->width /
+				crop->height;
 		}
 	} else {
 		if (conf->ratio >= 1.0) {
-			width = min(use->columns, conf->max_width_px);
-			height = (int) (width / conf->ratio);
+			plan->width = min(crop->width, conf->max_width_px);
+			plan->height = (int) (plan->width / conf->ratio);
 		} else {
-			height = min(use->rows, conf->max_height_px);
-			width = (int) (height * conf->ratio);
+			plan->height = min(crop->height, conf->max_height_px);
+			plan->width = (int) (plan->height * conf->ratio);
 		}
 	}
+	plan->width = max(plan->width, 1);
+	plan->height = max(plan->height, 1);
+
+	plan->frame_width = (int) ((double) columns * plan->width /
+			crop->width + 0.5);
+	plan->frame_height = (int) ((double) rows * plan->height /
+			crop->height + 0.5);
 #ifdef DEBUG
-	fprintf(stderr, "thumbnail size: %dx%d\n", width, height);
+	fprintf(stderr, "thumbnail size: %dx%d of %dx%d+%d+%d\n",
+			plan->width, plan->height,
+			(int) crop->width, (int) crop->height,
+			(int) crop->x, (int) crop->y);
 #endif
-
-	thumb = ThumbnailImage(use, width, height, exc);
-	if (edit) {
-		DestroyImage(edit);
-	}
-
-	if (thumb) {
-		int r;
-
-		if (build_filename(thumb->filename, MaxTextExtent,
-					thumb_dir, hash, conf->name)) {
-			fprintf(stderr, "building filename failed!\n");
-			return 1;
-		}
-		fprintf(stdout, "wrote %s\n", thumb->filename);
-		/* magick (= output format) is guessed from file suffix */
-
-		r = WriteImage(info, thumb);
-		if (r) {
-			err = 0;
-		} else if (thumb->exception.severity != UndefinedException) {
-			CatchException(&thumb->exception);
-		}
-		DestroyImage(thumb);
-	}
-
-
-	return 0;
 }
 
 
 
-int
-thumbnail_make_all_from_image(const struct thumbnailer *ctx,
-		Image *image, const char *fn)
+/* largest frame first */
+static int
+compare_plans(const void *a, const void *b)
 {
-	ImageInfo *info;
-	ExceptionInfo exception;
-	char hexhash[16 * 2 + 1];
-	int i;
-	int err = 0;
-
-	make_hash(hexhash, fn);
+	const struct plan *pa = a, *pb = b;
+	int64_t area_a = (int64_t) pa->frame_width * pa->frame_height;
+	int64_t area_b = (int64_t) pb->frame_width * pb->frame_height;
 
-	GetExceptionInfo(&exception);
-	info = CloneImageInfo((ImageInfo *) NULL);
+	return area_a < area_b ? 1 : area_a > area_b ? -1 : 0;
+}
 
-	for (i = 0; i < ctx->n; i++) {
-		err |= make_thumbnail(ctx->config[i],
-				image, info, &exception,
-				ctx->thumb_dir, hexhash);
-	}
 
-	DestroyImageInfo(info);
-	DestroyExceptionInfo(&exception);
 
-	return err;
+/* made now: every profile but the lazy ones, or only the one named */
+static int
+is_wanted(const struct config *conf, const char *profile)
+{
+	return profile ? ! strcmp(conf->name, profile) : ! conf->lazy;
 }
 
 
 
-int
-thumbnail_make_all_from_data(const struct thumbnailer *ctx,
-		void *data, size_t data_len, const char *fn)
+/* profiles planned for a source, largest frame first if cascading */
+static struct plan *
+make_plans(const struct thumbnailer *ctx, unsigned long columns,
+		unsigned long rows, const char *profile, int *n)
 {
-	Image *image;
-	ImageInfo *info;
-	ExceptionInfo exception;
-	int r;
+	struct plan *plans;
+	int i;
 
-	info = CloneImageInfo((ImageInfo *) NULL);
-	if (! info) {
-		return 1;
+	plans = g_new(struct plan, ctx->n);
+	*n = 0;
+	for (i = 0; i < ctx->n; i++) {
+		if (is_wanted(ctx->config[i], profile)) {
+			plan_thumbnail(ctx->config[i], columns, rows,
+					&plans[(*n)++]);
+		}
 	}
-	GetExceptionInfo(&exception);
-
-	image = BlobToImage(info, data, data_len, &exception);
-	if (image) {
-		r = thumbnail_make_all_from_image(ctx, image, fn);
-		DestroyImage(image);
-	} else {
-		fprintf(stderr, "failed to build image from blob!\n");
-		r = 1;
+	if (ctx->cascade) {
+		qsort(plans, *n, sizeof(struct plan), compare_plans);
 	}
 
-	DestroyImageInfo(info);
-	DestroyExceptionInfo(&exception);
-
-	return r;
+	return plans;
 }
 
 
 
-int
-thumbnail_make_all_from_raw(const struct thumbnailer *ctx,
-		void *data, int width, int height, const char *format,
-		const StorageType type, const char *fn)
+/* the crop of plan in pixels of a frame of the given size */
+static void
+frame_crop(const struct plan *plan, unsigned long columns, unsigned long rows,
+		unsigned long frame_columns, unsigned long frame_rows,
+		RectangleInfo *crop)
 {
-	Image *image;
-	ImageInfo *info;
-	ExceptionInfo exception;
-	int r;
+	crop->width = min(plan->width, frame_columns);
+	crop->height = min(plan->height, frame_rows);
+	crop->x = min((double) plan->crop.x * frame_columns / columns + 0.5,
+			frame_columns - crop->width);
+	crop->y = min((double) plan->crop.y * frame_rows / rows + 0.5,
+			frame_rows - crop->height);
+}
 
-	info = CloneImageInfo((ImageInfo *) NULL);
-	if (! info) {
-		return 1;
-	}
-	GetExceptionInfo(&exception);
 
-	image = ConstituteImage(width, height, format, type, data, &exception);
-	if (image) {
-		r = thumbnail_make_all_from_image(ctx, image, fn);
-		DestroyImage(image);
-	} else {
-		fprintf(stderr, "failed build image from raw data!\n");
-		r = 1;
-	}
 
-	DestroyImageInfo(info);
-	DestroyExceptionInfo(&exception);
+static double
+thread_cpu_seconds(void)
+{
+	struct timespec ts;
 
-	return r;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
 
 
+/*
+ * Into a temporary file next to fn, put in place by wb if not NULL and right
+ * away otherwise, so that nobody sees it half written. What encoding took
+ * goes to stats, if not NULL.
+ */
 static int
-rename_thumbnail(const char *target_dir, const char *old_hash,
-		const char *new_hash, const char *type)
+write_file(Image *image, ImageInfo *info, const char *fn, int format,
+		struct writeback *wb, struct encode_stats *stats)
 {
-	char old_fn[FILENAME_MAX];
-	char new_fn[FILENAME_MAX];
-	int r;
+	char tmp[MaxTextExtent];
+	struct stat st;
+	double start;
+	int ok;
+	int fd;
 
-	if (build_filename(old_fn, FILENAME_MAX, target_dir, old_hash, type)) {
+	if (snprintf(tmp, MaxTextExtent, "%s.XXXXXX", fn) >= MaxTextExtent) {
+		return 1;
+	}
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		fprintf(stderr, "%s: cannot create: %s\n", tmp,
+				strerror(errno));
 		return 1;
 	}
-	if (build_filename(new_fn, FILENAME_MAX, target_dir, new_hash, type)) {
+	close(fd);
+	/* its suffix is not the thumbnail's, so the format is given */
+	snprintf(image->filename, MaxTextExtent, "%s:%s",
+			formats[format].name, tmp);
+
+	start = thread_cpu_seconds();
+	ok = WriteImage(info, image);
+	if (! ok || stat(tmp, &st)) {
+		if (image->exception.severity != UndefinedException) {
+			CatchException(&image->exception);
+		}
+		unlink(tmp);
 		return 1;
 	}
+	if (stats) {
+		g_mutex_lock(stats->lock);
+		stats->count++;
+		stats->cpu_s += thread_cpu_seconds() - start;
+		stats->bytes += st.st_size;
+		g_mutex_unlock(stats->lock);
+	}
 
-	r = rename(old_fn, new_fn);
-	if (r == 0) {
-		fprintf(stdout, "renamed %s to %s\n", old_fn, new_fn);
-		return 0;
-	} else {
-		fprintf(stderr, "%s: cannot rename to %s: %s\n",
-				old_fn, new_fn, strerror(errno));
+	if (wb) {
+		return writeback_add(wb, tmp, fn);
+	}
+	if (rename(tmp, fn)) {
+		fprintf(stderr, "%s: cannot rename to %s: %s\n", tmp, fn,
+				strerror(errno));
+		unlink(tmp);
 		return 1;
 	}
+
+	return 0;
 }
 
 
 
-int
-thumbnail_rename_all(const struct thumbnailer *ctx,
-		const char *old_fn, const char *new_fn)
+/* thumbnails are cloned from each other, attributes and all */
+static void
+replace_attribute(Image *image, const char *key, const char *value)
+{
+	SetImageAttribute(image, key, NULL);
+	SetImageAttribute(image, key, value);
+}
+
+
+
+/*
+ * The Thumb:: keys of the spec, which ImageMagick writes into PNG files as
+ * tEXt chunks: with them, clients can tell whether a thumbnail is current
+ * and how large the image is without looking at the file.
+ */
+static void
+set_thumb_attributes(Image *image, const struct source *source)
+{
+	char value[32];
+
+	replace_attribute(image, "Thumb::URI", source->uri);
+	if (source->st) {
+		snprintf(value, sizeof(value), "%ld",
+				(long) source->st->st_mtime);
+		replace_attribute(image, "Thumb::MTime", value);
+		snprintf(value, sizeof(value), "%lld",
+				(long long) source->st->st_size);
+		replace_attribute(image, "Thumb::Size", value);
+	}
+	if (source->width && source->height) {
+		snprintf(value, sizeof(value), "%lu", source->width);
+		replace_attribute(image, "Thumb::Image::Width", value);
+		snprintf(value, sizeof(value), "%lu", source->height);
+		replace_attribute(image, "Thumb::Image::Height", value);
+	}
+}
+
+
+
+/*
+ * Encoded in memory and appended to the pack of the profile. The pack is
+ * synced only when closed: its thumbnails can always be made again.
+ */
+static int
+write_packed(Image *image, ImageInfo *info, const struct config *conf,
+		const char *hash)
+{
+	size_t len = 0;
+	double start;
+	void *blob;
+	int err;
+
+	snprintf(image->magick, MaxTextExtent, "%s",
+			formats[conf->format].name);
+	snprintf(image->filename, MaxTextExtent, "%s:",
+			formats[conf->format].name);
+
+	start = thread_cpu_seconds();
+	blob = ImageToBlob(info, image, &len, &image->exception);
+	if (! blob) {
+		if (image->exception.severity != UndefinedException) {
+			CatchException(&image->exception);
+		}
+		return 1;
+	}
+	g_mutex_lock(conf->stats->lock);
+	conf->stats->count++;
+	conf->stats->cpu_s += thread_cpu_seconds() - start;
+	conf->stats->bytes += len;
+	g_mutex_unlock(conf->stats->lock);
+
+	err = packstore_put(conf->store, hash, blob, len);
+	MagickFree(blob);
+
+	return err;
+}
+
+
+
+static int
+write_thumbnail(const struct config *conf, Image *thumb, ImageInfo *info,
+		const struct thumbnailer *ctx, const struct source *source)
+{
+	char fn[MaxTextExtent];
+	int err;
+
+	set_thumb_attributes(thumb, source);
+	info->quality = conf->quality;
+
+	if (conf->store) {
+		err = write_packed(thumb, info, conf, source->hash);
+		if (! err) {
+			fprintf(stdout, "packed %s into %s\n", source->hash,
+					conf->name);
+		}
+		return err;
+	}
+
+	if (build_filename(fn, MaxTextExtent, ctx->thumb_dir, source->hash,
+				conf)) {
+		fprintf(stderr, "building filename failed!\n");
+		return 1;
+	}
+
+	/* someone is waiting for a lazy one, and it can be made again */
+	err = write_file(thumb, info, fn, conf->format,
+			conf->lazy ? NULL : ctx->writeback, conf->stats);
+	if (! err) {
+		fprintf(stdout, "wrote %s\n", fn);
+	}
+
+	return err;
+}
+
+
+
+/* there are thumbnails of it now */
+static void
+remove_fail_marker(const struct thumbnailer *ctx, const struct source *source)
+{
+	char fn[FILENAME_MAX];
+
+	if (! build_filename(fn, FILENAME_MAX, ctx->thumb_dir, source->hash,
+				&fail_config)) {
+		unlink(fn);
+	}
+}
+
+
+
+/*
+ * Thumbnails of lazy profiles are made again when next asked for: those made
+ * of an older version of the file would not be.
+ */
+static void
+remove_lazy(const struct thumbnailer *ctx, const struct source *source)
+{
+	char fn[FILENAME_MAX];
+	int i;
+
+	for (i = 0; i < ctx->n; i++) {
+		if (ctx->config[i]->lazy && ! build_filename(fn,
+					FILENAME_MAX, ctx->thumb_dir,
+					source->hash, ctx->config[i])) {
+			unlink(fn);
+		}
+	}
+}
+
+
+
+/* cropped, then scaled from the source */
+static int
+make_thumbnail(const struct plan *plan, Image *image, ImageInfo *info,
+		ExceptionInfo *exc, const struct thumbnailer *ctx,
+		const struct source *source)
+{
+	Image *edit = NULL;
+	Image *use, *thumb;
+	int err;
+
+	use = image;
+	if (plan->crop.width != image->columns ||
+			plan->crop.height != image->rows) {
+		edit = CropImage(image, &plan->crop, exc);
+		if (! edit) {
+			fprintf(stderr, "failed to crop image!\n");
+			return 1;
+		}
+		use = edit;
+	}
+
+	thumb = ThumbnailImage(use, plan->width, plan->height, exc);
+	if (edit) {
+		DestroyImage(edit);
+	}
+	if (! thumb) {
+		fprintf(stderr, "failed to scale image!\n");
+		return 1;
+	}
+
+	err = write_thumbnail(plan->conf, thumb, info, ctx, source);
+	DestroyImage(thumb);
+
+	return err;
+}
+
+
+
+/*
+ * The source scaled to the frame size of plan: the source itself if that
+ * needs no scaling, else scaled from the smallest of the frames made so far
+ * that is large enough, and added to them.
+ */
+static Image *
+get_frame(const struct plan *plan, Image *image, Image **frames,
+		int *n_frames, ExceptionInfo *exc)
+{
+	Image *from = image;
+	Image *frame;
+	int i;
+
+	/* either not scaled down at all or only by rounding */
+	if (plan->frame_width >= (int) image->columns ||
+			plan->frame_height >= (int) image->rows) {
+		return image;
+	}
+
+	for (i = 0; i < *n_frames; i++) {
+		if ((int) frames[i]->columns == plan->frame_width &&
+				(int) frames[i]->rows == plan->frame_height) {
+			return frames[i];
+		}
+		if (frames[i]->columns >= CASCADE_MIN_RATIO *
+					plan->frame_width &&
+				frames[i]->rows >= CASCADE_MIN_RATIO *
+					plan->frame_height) {
+			from = frames[i];
+		}
+	}
+
+	frame = ThumbnailImage(from, plan->frame_width, plan->frame_height,
+			exc);
+	if (frame) {
+		frames[(*n_frames)++] = frame;
+	}
+	return frame;
+}
+
+
+
+/* cropped out of a frame of the source scaled as a whole */
+static int
+make_thumbnail_from_frame(const struct plan *plan, Image *image,
+		Image **frames, int *n_frames, ImageInfo *info,
+		ExceptionInfo *exc, const struct thumbnailer *ctx,
+		const struct source *source)
+{
+	Image *frame, *thumb;
+	RectangleInfo crop;
+	int err;
+
+	frame = get_frame(plan, image, frames, n_frames, exc);
+	if (! frame) {
+		fprintf(stderr, "failed to scale image!\n");
+		return 1;
+	}
+
+	frame_crop(plan, image->columns, image->rows, frame->columns,
+			frame->rows, &crop);
+
+	if (crop.width == frame->columns && crop.height == frame->rows) {
+		return write_thumbnail(plan->conf, frame, info, ctx,
+				source);
+	}
+
+	thumb = CropImage(frame, &crop, exc);
+	if (! thumb) {
+		fprintf(stderr, "failed to crop image!\n");
+		return 1;
+	}
+	err = write_thumbnail(plan->conf, thumb, info, ctx, source);
+	DestroyImage(thumb);
+
+	return err;
+}
+
+
+
+/*
+ * With cascading, the largest thumbnail is scaled from the source and each
+ * smaller one from the closest larger intermediate, rather than every one
+ * from the full resolution source.
+ */
+int
+thumbnail_make_all_from_image(const struct thumbnailer *ctx,
+		Image *image, const char *fn, const struct stat *st,
+		const char *profile)
+{
+	ImageInfo *info;
+	ExceptionInfo exception;
+	struct source source;
+	unsigned long width, height;
+	struct plan *plans;
+	Image **frames;
+	int n_frames = 0;
+	int n;
+	int i;
+	int err = 0;
+
+	if (ctx->n == 0) {
+		return 0;
+	}
+	get_original_size(image, &width, &height);
+	make_source(&source, fn, st, width, height);
+	if (! profile) {
+		remove_lazy(ctx, &source);
+	}
+
+	plans = make_plans(ctx, image->columns, image->rows, profile, &n);
+	frames = g_new(Image *, ctx->n);
+
+	GetExceptionInfo(&exception);
+	info = CloneImageInfo((ImageInfo *) NULL);
+
+	for (i = 0; i < n; i++) {
+		if (ctx->cascade) {
+			err |= make_thumbnail_from_frame(&plans[i], image,
+					frames, &n_frames, info, &exception,
+					ctx, &source);
+		} else {
+			err |= make_thumbnail(&plans[i], image, info,
+					&exception, ctx, &source);
+		}
+	}
+
+	for (i = 0; i < n_frames; i++) {
+		DestroyImage(frames[i]);
+	}
+	DestroyImageInfo(info);
+	DestroyExceptionInfo(&exception);
+	g_free(frames);
+	g_free(plans);
+
+	if (! err) {
+		remove_fail_marker(ctx, &source);
+	}
+
+	return err;
+}
+
+
+
+void
+thumbnail_set_cascade(struct thumbnailer *ctx, int cascade)
+{
+	ctx->cascade = cascade;
+}
+
+
+
+void
+thumbnail_set_writeback(struct thumbnailer *ctx, struct writeback *wb)
+{
+	ctx->writeback = wb;
+}
+
+
+
+int
+thumbnail_make_all_from_data(const struct thumbnailer *ctx,
+		void *data, size_t data_len, const char *fn,
+		const struct stat *st, const char *profile)
+{
+	Image *image;
+	ImageInfo *info;
+	ExceptionInfo exception;
+	int r;
+
+	info = CloneImageInfo((ImageInfo *) NULL);
+	if (! info) {
+		return 1;
+	}
+	GetExceptionInfo(&exception);
+
+	image = BlobToImage(info, data, data_len, &exception);
+	if (image) {
+		r = thumbnail_make_all_from_image(ctx, image, fn, st,
+				profile);
+		DestroyImage(image);
+	} else {
+		fprintf(stderr, "failed to build image from blob!\n");
+		r = 1;
+	}
+
+	DestroyImageInfo(info);
+	DestroyExceptionInfo(&exception);
+
+	return r;
+}
+
+
+
+/* 8 bit pixels of a thumbnail handed to ImageMagick only to be written */
+static int
+write_pixels(const struct config *conf, const struct scale_image *pixels,
+		const char *format, ImageInfo *info, ExceptionInfo *exc,
+		const struct thumbnailer *ctx, const struct source *source)
+{
+	size_t row_len = (size_t) pixels->width * pixels->channels;
+	unsigned char *packed = NULL;
+	const unsigned char *data = pixels->pixels;
+	Image *thumb;
+	int y;
+	int err;
+
+	/* rows of a view are apart */
+	if (pixels->stride != row_len) {
+		packed = malloc(row_len * pixels->height);
+		if (! packed) {
+			return 1;
+		}
+		for (y = 0; y < pixels->height; y++) {
+			memcpy(packed + y * row_len,
+					pixels->pixels + y * pixels->stride,
+					row_len);
+		}
+		data = packed;
+	}
+
+	thumb = ConstituteImage(pixels->width, pixels->height, format,
+			CharPixel, data, exc);
+	free(packed);
+	if (! thumb) {
+		fprintf(stderr, "failed build image from raw data!\n");
+		return 1;
+	}
+	err = write_thumbnail(conf, thumb, info, ctx, source);
+	DestroyImage(thumb);
+
+	return err;
+}
+
+
+
+/* as make_thumbnail(), of 8 bit pixels */
+static int
+make_thumbnail_raw(const struct plan *plan, const struct scale_image *src,
+		const char *format, ImageInfo *info, ExceptionInfo *exc,
+		const struct thumbnailer *ctx, const struct source *source)
+{
+	struct scale_image view, thumb;
+	int err;
+
+	scale_view(src, plan->crop.x, plan->crop.y, plan->crop.width,
+			plan->crop.height, &view);
+	if (plan->width == view.width && plan->height == view.height) {
+		return write_pixels(plan->conf, &view, format, info, exc,
+				ctx, source);
+	}
+	if (scale_image(&view, plan->width, plan->height, &thumb)) {
+		fprintf(stderr, "failed to scale image!\n");
+		return 1;
+	}
+	err = write_pixels(plan->conf, &thumb, format, info, exc, ctx,
+			source);
+	free(thumb.pixels);
+
+	return err;
+}
+
+
+
+/* as get_frame(), of 8 bit pixels */
+static const struct scale_image *
+get_raw_frame(const struct plan *plan, const struct scale_image *src,
+		struct scale_image *frames, int *n_frames)
+{
+	const struct scale_image *from = src;
+	int i;
+
+	if (plan->frame_width >= src->width ||
+			plan->frame_height >= src->height) {
+		return src;
+	}
+
+	for (i = 0; i < *n_frames; i++) {
+		if (frames[i].width == plan->frame_width &&
+				frames[i].height == plan->frame_height) {
+			return &frames[i];
+		}
+		if (frames[i].width >= CASCADE_MIN_RATIO * plan->frame_width &&
+				frames[i].height >= CASCADE_MIN_RATIO *
+					plan->frame_height) {
+			from = &frames[i];
+		}
+	}
+
+	if (scale_image(from, plan->frame_width, plan->frame_height,
+				&frames[*n_frames])) {
+		return NULL;
+	}
+	return &frames[(*n_frames)++];
+}
+
+
+
+/* as make_thumbnail_from_frame(), of 8 bit pixels */
+static int
+make_thumbnail_from_raw_frame(const struct plan *plan,
+		const struct scale_image *src, struct scale_image *frames,
+		int *n_frames, const char *format, ImageInfo *info,
+		ExceptionInfo *exc, const struct thumbnailer *ctx,
+		const struct source *source)
+{
+	const struct scale_image *frame;
+	struct scale_image view;
+	RectangleInfo crop;
+
+	frame = get_raw_frame(plan, src, frames, n_frames);
+	if (! frame) {
+		fprintf(stderr, "failed to scale image!\n");
+		return 1;
+	}
+
+	frame_crop(plan, src->width, src->height, frame->width,
+			frame->height, &crop);
+	scale_view(frame, crop.x, crop.y, crop.width, crop.height, &view);
+
+	return write_pixels(plan->conf, &view, format, info, exc, ctx,
+			source);
+}
+
+
+
+/*
+ * 8 bit pixels are scaled and cropped here, straight from the buffer of the
+ * plugin, and only the thumbnails made into images.
+ */
+static int
+make_all_from_pixels(const struct thumbnailer *ctx,
+		const struct scale_image *src, unsigned long width,
+		unsigned long height, const char *format, const char *fn,
+		const struct stat *st, const char *profile)
+{
+	ImageInfo *info;
+	ExceptionInfo exception;
+	struct source source;
+	struct plan *plans;
+	struct scale_image *frames;
+	int n_frames = 0;
+	int n;
+	int i;
+	int err = 0;
+
+	if (ctx->n == 0) {
+		return 0;
+	}
+	make_source(&source, fn, st, width, height);
+	if (! profile) {
+		remove_lazy(ctx, &source);
+	}
+
+	info = CloneImageInfo((ImageInfo *) NULL);
+	if (! info) {
+		return 1;
+	}
+	GetExceptionInfo(&exception);
+
+	plans = make_plans(ctx, src->width, src->height, profile, &n);
+	frames = g_new(struct scale_image, ctx->n);
+
+	for (i = 0; i < n; i++) {
+		if (ctx->cascade) {
+			err |= make_thumbnail_from_raw_frame(&plans[i], src,
+					frames, &n_frames, format, info,
+					&exception, ctx, &source);
+		} else {
+			err |= make_thumbnail_raw(&plans[i], src, format,
+					info, &exception, ctx,
+					&source);
+		}
+	}
+
+	for (i = 0; i < n_frames; i++) {
+		free(frames[i].pixels);
+	}
+	DestroyImageInfo(info);
+	DestroyExceptionInfo(&exception);
+	g_free(frames);
+	g_free(plans);
+
+	if (! err) {
+		remove_fail_marker(ctx, &source);
+	}
+
+	return err;
+}
+
+
+
+int
+thumbnail_make_all_from_raw(const struct thumbnailer *ctx,
+		void *data, int width, int height, int original_width,
+		int original_height, const char *format,
+		const StorageType type, const char *fn, const struct stat *st,
+		const char *profile)
+{
+	struct scale_image src;
+	unsigned long orig_width = width, orig_height = height;
+	Image *image;
+	ImageInfo *info;
+	ExceptionInfo exception;
+	int r;
+
+	thumbnail_original_size(original_width, original_height,
+			&orig_width, &orig_height);
+	if (type == CharPixel && strlen(format) >= 1 &&
+			strlen(format) <= SCALE_MAX_CHANNELS) {
+		src.pixels = data;
+		src.width = width;
+		src.height = height;
+		src.channels = strlen(format);
+		src.stride = (size_t) width * src.channels;
+		return make_all_from_pixels(ctx, &src, orig_width,
+				orig_height, format, fn, st, profile);
+	}
+
+	info = CloneImageInfo((ImageInfo *) NULL);
+	if (! info) {
+		return 1;
+	}
+	GetExceptionInfo(&exception);
+
+	image = ConstituteImage(width, height, format, type, data, &exception);
+	if (image) {
+		image->magick_columns = orig_width;
+		image->magick_rows = orig_height;
+		r = thumbnail_make_all_from_image(ctx, image, fn, st,
+				profile);
+		DestroyImage(image);
+	} else {
+		fprintf(stderr, "failed build image from raw data!\n");
+		r = 1;
+	}
+
+	DestroyImageInfo(info);
+	DestroyExceptionInfo(&exception);
+
+	return r;
+}
+
+
+
+static int
+rename_thumbnail(const char *target_dir, const char *old_hash,
+		const char *new_hash, const struct config *conf)
+{
+	char old_fn[FILENAME_MAX];
+	char new_fn[FILENAME_MAX];
+	int r;
+
+	if (conf->store) {
+		r = packstore_rename(conf->store, old_hash, new_hash);
+		if (r == 0) {
+			fprintf(stdout, "renamed %s to %s in %s\n", old_hash,
+					new_hash, conf->name);
+		}
+		return r;
+	}
+
+	if (build_filename(old_fn, FILENAME_MAX, target_dir, old_hash, conf)) {
+		return 1;
+	}
+	if (build_filename(new_fn, FILENAME_MAX, target_dir, new_hash, conf)) {
+		return 1;
+	}
+
+	r = rename(old_fn, new_fn);
+	if (r == 0) {
+		fprintf(stdout, "renamed %s to %s\n", old_fn, new_fn);
+		return 0;
+	} else if (errno == ENOENT && conf->lazy) {
+		/* not asked for yet */
+		return 0;
+	} else {
+		fprintf(stderr, "%s: cannot rename to %s: %s\n",
+				old_fn, new_fn, strerror(errno));
+		return 1;
+	}
+}
+
+
+
+int
+thumbnail_rename_all(const struct thumbnailer *ctx,
+		const char *old_fn, const char *new_fn)
 {
 	char old_hash[16 * 2 + 1];
 	char new_hash[16 * 2 + 1];
+	char marker[FILENAME_MAX];
 	int i;
 	int r = 0;
 
@@ -649,7 +1643,12 @@ thumbnail_rename_all(const struct thumbnailer *ctx,
 
 	for (i = 0; i < ctx->n; i++) {
 		r |= rename_thumbnail(ctx->thumb_dir, old_hash, new_hash,
-				ctx->config[i]->name);
+				ctx->config[i]);
+	}
+	/* it would tell of the old name */
+	if (! build_filename(marker, FILENAME_MAX, ctx->thumb_dir, old_hash,
+				&fail_config)) {
+		unlink(marker);
 	}
 
 	return r;
@@ -658,12 +1657,22 @@ thumbnail_rename_all(const struct thumbnailer *ctx,
 
 
 static int
-delete_thumbnail(const char *target_dir, const char *hash, const char *type)
+delete_thumbnail(const char *target_dir, const char *hash,
+		const struct config *conf)
 {
 	char fn[FILENAME_MAX];
 	int r;
 
-	if (build_filename(fn, FILENAME_MAX, target_dir, hash, type)) {
+	if (conf->store) {
+		r = packstore_delete(conf->store, hash);
+		if (r == 0) {
+			fprintf(stdout, "deleted %s from %s\n", hash,
+					conf->name);
+		}
+		return r;
+	}
+
+	if (build_filename(fn, FILENAME_MAX, target_dir, hash, conf)) {
 		return 1;
 	}
 
@@ -683,13 +1692,18 @@ int
 thumbnail_delete_all(const struct thumbnailer *ctx, const char *fn)
 {
 	char hexhash[16 * 2 + 1];
+	char marker[FILENAME_MAX];
 	int r = 0;
 	int i;
 
 	make_hash(hexhash, fn);
 	for (i = 0; i < ctx->n; i++) {
 		r |= delete_thumbnail(ctx->thumb_dir, hexhash,
-				ctx->config[i]->name);
+				ctx->config[i]);
+	}
+	if (! build_filename(marker, FILENAME_MAX, ctx->thumb_dir, hexhash,
+				&fail_config)) {
+		unlink(marker);
 	}
 
 	return r;
@@ -697,11 +1711,277 @@ thumbnail_delete_all(const struct thumbnailer *ctx, const char *fn)
 
 
 
+/*
+ * A 1x1 PNG with the URI and modification time of the file, as the spec has
+ * it. Not put through the writeback: that could put it in place after the
+ * thumbnails of a later version of the file have removed it.
+ */
+int
+thumbnail_mark_failed(const struct thumbnailer *ctx, const char *fn,
+		const struct stat *st)
+{
+	static const unsigned char pixel[4] = { 0, 0, 0, 0 };
+	char marker[MaxTextExtent];
+	struct source source;
+	ExceptionInfo exception;
+	ImageInfo *info;
+	Image *image;
+	int err;
+
+	make_source(&source, fn, st, 0, 0);
+	if (build_filename(marker, MaxTextExtent, ctx->thumb_dir, source.hash,
+				&fail_config)) {
+		return 1;
+	}
+
+	info = CloneImageInfo((ImageInfo *) NULL);
+	if (! info) {
+		return 1;
+	}
+	GetExceptionInfo(&exception);
+
+	image = ConstituteImage(1, 1, "RGBA", CharPixel, pixel, &exception);
+	if (image) {
+		set_thumb_attributes(image, &source);
+		err = write_file(image, info, marker, FORMAT_PNG, NULL, NULL);
+		DestroyImage(image);
+	} else {
+		err = 1;
+	}
+	if (! err) {
+		fprintf(stdout, "wrote %s\n", marker);
+	}
+
+	DestroyImageInfo(info);
+	DestroyExceptionInfo(&exception);
+
+	return err;
+}
+
+
+
+static void
+get_profile_size(const struct config *conf, int *width, int *height)
+{
+	if (conf->ratio <= 0.0) {
+		*width = conf->max_width_px;
+		*height = conf->max_height_px;
+	} else if (conf->ratio >= 1.0) {
+		*width = conf->max_width_px;
+		*height = (int) (conf->max_width_px / conf->ratio);
+	} else {
+		*width = (int) (conf->max_height_px * conf->ratio);
+		*height = conf->max_height_px;
+	}
+}
+
+
+
+/*
+ * An image covering the size given here in both dimensions is enough for every
+ * profile: none of them is scaled up from it, cropped or not.
+ */
+void
+thumbnail_request_size(const struct thumbnailer *ctx, const char *profile,
+		int *width, int *height)
+{
+	int i;
+
+	*width = *height = 0;
+	for (i = 0; i < ctx->n; i++) {
+		int w, h;
+
+		if (! is_wanted(ctx->config[i], profile)) {
+			continue;
+		}
+		get_profile_size(ctx->config[i], &w, &h);
+		*width = max(*width, w);
+		*height = max(*height, h);
+	}
+
+	/* no profile to make */
+	if (*width <= 0 || *height <= 0) {
+		*width = *height = DEFAULT_REQUEST_PX;
+	}
+}
+
+
+
+int
+thumbnail_exist_all(const struct thumbnailer *ctx, const char *fn)
+{
+	char hexhash[16 * 2 + 1];
+	char thumb_fn[FILENAME_MAX];
+	int i;
+
+	make_hash(hexhash, fn);
+	for (i = 0; i < ctx->n; i++) {
+		if (ctx->config[i]->lazy) {
+			continue;
+		}
+		if (ctx->config[i]->store) {
+			if (! packstore_exists(ctx->config[i]->store,
+						hexhash)) {
+				return 0;
+			}
+			continue;
+		}
+		if (build_filename(thumb_fn, FILENAME_MAX, ctx->thumb_dir,
+					hexhash, ctx->config[i])) {
+			return 0;
+		}
+		/* written but not in place yet */
+		if (ctx->writeback &&
+				writeback_pending(ctx->writeback, thumb_fn)) {
+			continue;
+		}
+		if (access(thumb_fn, F_OK)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+
+
+const char *
+thumbnail_lazy(const struct thumbnailer *ctx, const char *path, char *hash)
+{
+	const struct config *conf;
+	const char *file;
+	size_t len;
+	int i;
+
+	for (i = 0; i < ctx->n; i++) {
+		conf = ctx->config[i];
+		len = strlen(conf->name);
+		if (! conf->lazy || strncmp(path, conf->name, len) ||
+				path[len] != '/') {
+			continue;
+		}
+		file = path + len + 1;
+		if (strspn(file, "0123456789abcdef") != 32 ||
+				file[32] != '.' || strcmp(file + 33,
+					formats[conf->format].suffix)) {
+			return NULL;
+		}
+		memcpy(hash, file, 32);
+		hash[32] = '\0';
+		return conf->name;
+	}
+
+	return NULL;
+}
+
+
+
+const char *
+thumbnail_profiles(const struct thumbnailer *ctx)
+{
+	return ctx->profiles;
+}
+
+
+
+void
+thumbnail_print_stats(const struct thumbnailer *ctx, FILE *out)
+{
+	const struct config *conf;
+	struct encode_stats st;
+	int i;
+
+	for (i = 0; i < ctx->n; i++) {
+		conf = ctx->config[i];
+		g_mutex_lock(conf->stats->lock);
+		st = *conf->stats;
+		g_mutex_unlock(conf->stats->lock);
+
+		fprintf(out, "%s %s q=%lu: %lu written, %.2f ms and %.0f bytes "
+				"each\n", conf->name, formats[conf->format].name,
+				conf->quality, st.count,
+				st.count ? st.cpu_s * 1000 / st.count : 0.0,
+				st.count ? (double) st.bytes / st.count : 0.0);
+	}
+}
+
+
+
+/* temporary files are named <32 hex digits>.<suffix>.XXXXXX */
+static void
+remove_leftovers(const char *dirname)
+{
+	char fn[FILENAME_MAX];
+	struct dirent *ent;
+	const char *dot;
+	DIR *dir;
+
+	dir = opendir(dirname);
+	if (! dir) {
+		return;
+	}
+	while ((ent = readdir(dir))) {
+		dot = strrchr(ent->d_name, '.');
+		if (! dot || strlen(dot) != 7 || dot - ent->d_name < 34 ||
+				ent->d_name[32] != '.') {
+			continue;
+		}
+		snprintf(fn, FILENAME_MAX, "%s/%s", dirname, ent->d_name);
+		fprintf(stdout, "removing %s\n", fn);
+		unlink(fn);
+	}
+	closedir(dir);
+}
+
+
+
+void
+thumbnail_remove_leftovers(const struct thumbnailer *ctx)
+{
+	char dir[FILENAME_MAX];
+	int i;
+
+	for (i = 0; i < ctx->n; i++) {
+		if (ctx->config[i]->pack) {
+			continue;
+		}
+		if (! get_thumbnail_dir(dir, FILENAME_MAX, ctx->thumb_dir,
+					ctx->config[i]->name)) {
+			remove_leftovers(dir);
+		}
+	}
+	if (! get_thumbnail_dir(dir, FILENAME_MAX, ctx->thumb_dir,
+				FAIL_PROFILE)) {
+		remove_leftovers(dir);
+	}
+}
+
+
+
+static int
+make_thumbnail_dir(const char *thumb_dir, const char *type)
+{
+	char dir[FILENAME_MAX];
+	int ret;
+
+	if (! get_thumbnail_dir(dir, FILENAME_MAX, thumb_dir, type)) {
+		ret = mkdir(dir, 0700);
+		if (! (ret == 0 || errno == EEXIST)) {
+			fprintf(stderr, "%s: cannot create: %s\n",
+					dir, strerror(errno));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+
 struct thumbnailer *
 thumbnail_init(const char *self, const char *thumb_dir, const char *conffile)
 {
 	struct thumbnailer *config;
-	char dir[FILENAME_MAX];
 	int i;
 
 	config = make_config(thumb_dir, conffile);
@@ -710,16 +1990,22 @@ thumbnail_init(const char *self, const char *thumb_dir, const char *conffile)
 	}
 
 	for (i = 0; i < config->n; i++) {
-		if (! get_thumbnail_dir(dir, FILENAME_MAX, thumb_dir,
-					config->config[i]->name)) {
-			int ret;
-			ret = mkdir(dir, 0700);
-			if (! (ret == 0 || errno == EEXIST)) {
-				fprintf(stderr, "%s: cannot create: %s\n",
-						dir, strerror(errno));
+		struct config *conf = config->config[i];
+
+		if (! conf->pack) {
+			if (make_thumbnail_dir(thumb_dir, conf->name)) {
 				return NULL;
 			}
+			continue;
 		}
+		conf->store = packstore_open(thumb_dir, conf->name);
+		if (! conf->store) {
+			return NULL;
+		}
+	}
+	if (make_thumbnail_dir(thumb_dir, FAIL_DIR) ||
+			make_thumbnail_dir(thumb_dir, FAIL_PROFILE)) {
+		return NULL;
 	}
 
 	if (!getenv("DISPLAY") || get_dpmm(getenv("DISPLAY"), 0,
@@ -2,11 +2,14 @@
 #define THUMBNAIL_H_
 
 #include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
 #include <magick/api.h>
 
 
 
 struct thumbnailer;
+struct writeback;
 
 
 struct thumbnailer *thumbnail_init(
@@ -14,13 +17,41 @@ struct thumbnailer *thumbnail_init(
 		const char *conffile);
 void thumbnail_uninit(struct thumbnailer *ctx);
 
+/*
+ * The thumbnails tell the URI of fn, st's modification time and size and
+ * the image's dimensions. st may be NULL. Made are those of every profile but
+ * the lazy ones if profile is NULL, whose thumbnails of fn it removes, and
+ * else only those of the profile named.
+ */
 int thumbnail_make_all_from_image(const struct thumbnailer *ctx,
-		Image *image, const char *fn);
+		Image *image, const char *fn, const struct stat *st,
+		const char *profile);
+
+/*
+ * Whether thumbnails are scaled from the next larger one made of the same
+ * image, where that is large enough, rather than each from the source. On by
+ * default.
+ */
+void thumbnail_set_cascade(struct thumbnailer *ctx, int cascade);
+
+/*
+ * Thumbnails are written to temporary files and put in place by wb, if not
+ * NULL, rather than right away. Not set by default.
+ */
+void thumbnail_set_writeback(struct thumbnailer *ctx, struct writeback *wb);
+
 int thumbnail_make_all_from_data(const struct thumbnailer *ctx,
-		void *data, size_t data_len, const char *fn);
+		void *data, size_t data_len, const char *fn,
+		const struct stat *st, const char *profile);
+/*
+ * The pixels may have been decoded smaller than the image is stored, which is
+ * original_width by original_height then, else 0 by 0.
+ */
 int thumbnail_make_all_from_raw(const struct thumbnailer *ctx,
-		void *data, int width, int height, const char *pixel_format,
-		const StorageType pixel_type, const char *fn);
+		void *data, int width, int height, int original_width,
+		int original_height, const char *pixel_format,
+		const StorageType pixel_type, const char *fn,
+		const struct stat *st, const char *profile);
 
 int thumbnail_rename_all(const struct thumbnailer *ctx,
 		const char *old_fn, const char *new_fn);
@@ -28,6 +59,61 @@ int thumbnail_rename_all(const struct thumbnailer *ctx,
 int thumbnail_delete_all(const struct thumbnailer *ctx,
 		const char *fn);
 
+/*
+ * Leave a marker in the spec's fail directory, for desktop thumbnailers not
+ * to try fn either. Making thumbnails of it or deleting them removes it.
+ */
+int thumbnail_mark_failed(const struct thumbnailer *ctx, const char *fn,
+		const struct stat *st);
+
+/*
+ * smallest source image size to make the thumbnails of profile from, as
+ * thumbnail_make_all_from_image() has it
+ */
+void thumbnail_request_size(const struct thumbnailer *ctx, const char *profile,
+		int *width, int *height);
+
+/*
+ * The size of an image as stored, which decoders may have scaled down to
+ * width by height and turned upright; stored_width and stored_height are 0 if
+ * not known. Replaces width and height.
+ */
+void thumbnail_original_size(unsigned long stored_width,
+		unsigned long stored_height, unsigned long *width,
+		unsigned long *height);
+
+/*
+ * 1 if every configured thumbnail of fn but the lazy ones is there, or
+ * pending in the writeback
+ */
+int thumbnail_exist_all(const struct thumbnailer *ctx, const char *fn);
+
+/*
+ * Profiles configured with "lazy" are made only when a thumbnail of theirs is
+ * looked up. If path, relative to the thumbnail directory, names one, its
+ * profile, with the hash it is named after in hash, else NULL.
+ */
+const char *thumbnail_lazy(const struct thumbnailer *ctx, const char *path,
+		char *hash);
+
+/*
+ * Remove the temporary files a crash left in the thumbnail directories. Not
+ * while thumbnails may be being written.
+ */
+void thumbnail_remove_leftovers(const struct thumbnailer *ctx);
+
+/*
+ * The configured profiles and their settings as a string, which changes
+ * whenever the thumbnails made would.
+ */
+const char *thumbnail_profiles(const struct thumbnailer *ctx);
+
+/*
+ * A line per profile: how many thumbnails have been written and the CPU time
+ * and bytes encoding one has taken on average.
+ */
+void thumbnail_print_stats(const struct thumbnailer *ctx, FILE *out);
+
 void thumbnail_calc_dimensions_mm(const struct thumbnailer *ctx,
 		int image_width, int image_height,
 		int width_mm, int height_mm,
@@ -0,0 +1,189 @@
+/*
+ * CPU time making the configured thumbnails takes per photo: of decoded
+ * images, each profile scaled from the source and cascaded, and of 8 bit RGB
+ * pixels as video frames come, through ImageMagick and scaled natively.
+ * Decoding is not counted. Then, per profile, what encoding a thumbnail has
+ * cost in CPU time and bytes with its format and quality.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+#include "thumbnail.h"
+
+#include <magick/api.h>
+
+#define ROUNDS 5
+
+
+
+enum {
+	FROM_IMAGE,
+	FROM_IMAGE_CASCADED,
+	FROM_PIXELS_MAGICK,
+	FROM_PIXELS,
+	MODE_N
+};
+
+
+static const char *mode_names[MODE_N] = {
+	[FROM_IMAGE] = "image, from the source",
+	[FROM_IMAGE_CASCADED] = "image, cascaded",
+	[FROM_PIXELS_MAGICK] = "RGB pixels, ImageMagick",
+	[FROM_PIXELS] = "RGB pixels, native",
+};
+
+
+struct photo {
+	const char *fn;
+	Image *image;
+	unsigned char *pixels;	/* the image as 8 bit RGB */
+};
+
+
+
+static double
+cpu_seconds(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+		(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+
+
+/* the way thumbnail_make_all_from_raw() used to go for every format */
+static void
+make_through_magick(struct thumbnailer *ctx, const struct photo *photo)
+{
+	ExceptionInfo exception;
+	Image *image;
+
+	GetExceptionInfo(&exception);
+	image = ConstituteImage(photo->image->columns, photo->image->rows,
+			"RGB", CharPixel, photo->pixels, &exception);
+	if (image) {
+		thumbnail_make_all_from_image(ctx, image, photo->fn, NULL,
+				NULL);
+		DestroyImage(image);
+	}
+	DestroyExceptionInfo(&exception);
+}
+
+
+
+static double
+run(struct thumbnailer *ctx, const struct photo *photos, int n, int mode)
+{
+	const struct photo *photo;
+	double start;
+	int round, i;
+
+	thumbnail_set_cascade(ctx, mode != FROM_IMAGE);
+	start = cpu_seconds();
+	for (round = 0; round < ROUNDS; round++) {
+		for (i = 0; i < n; i++) {
+			photo = &photos[i];
+			switch (mode) {
+				case FROM_IMAGE:
+				case FROM_IMAGE_CASCADED:
+					thumbnail_make_all_from_image(ctx,
+							photo->image,
+							photo->fn, NULL,
+							NULL);
+					break;
+				case FROM_PIXELS_MAGICK:
+					make_through_magick(ctx, photo);
+					break;
+				case FROM_PIXELS:
+					thumbnail_make_all_from_raw(ctx,
+							photo->pixels,
+							photo->image->columns,
+							photo->image->rows,
+							0, 0, "RGB", CharPixel,
+							photo->fn, NULL,
+							NULL);
+					break;
+			}
+		}
+	}
+
+	return (cpu_seconds() - start) / (ROUNDS * n);
+}
+
+
+
+int
+main(int argc, char *argv[])
+{
+	struct thumbnailer *ctx;
+	ExceptionInfo exception;
+	ImageInfo *info;
+	struct photo *photos;
+	Image *image;
+	int n = argc - 3;
+	int i;
+
+	if (argc < 4) {
+		fprintf(stderr, "Usage: %s <CONFIG FILE> <THUMBNAIL DIR> "
+				"<PHOTO>...\n", argv[0]);
+		return 1;
+	}
+
+	InitializeMagick(argv[0]);
+	ctx = thumbnail_init(argv[0], argv[2], argv[1]);
+	if (! ctx) {
+		return 1;
+	}
+
+	GetExceptionInfo(&exception);
+	info = CloneImageInfo((ImageInfo *) NULL);
+	photos = calloc(n, sizeof(struct photo));
+	for (i = 0; i < n; i++) {
+		photos[i].fn = argv[i + 3];
+		strncpy(info->filename, photos[i].fn, MaxTextExtent - 1);
+		image = ReadImage(info, &exception);
+		if (! image) {
+			fprintf(stderr, "%s: cannot read\n", photos[i].fn);
+			return 1;
+		}
+		photos[i].image = image;
+		photos[i].pixels = malloc((size_t) image->columns *
+				image->rows * 3);
+		if (! photos[i].pixels || ! DispatchImage(image, 0, 0,
+					image->columns, image->rows, "RGB",
+					CharPixel, photos[i].pixels,
+					&exception)) {
+			fprintf(stderr, "%s: cannot get pixels\n",
+					photos[i].fn);
+			return 1;
+		}
+	}
+
+	/* the thumbnails written are reported on stdout */
+	fprintf(stderr, "%d photos, %d rounds, ms of CPU per photo:\n", n,
+			ROUNDS);
+	for (i = 0; i < MODE_N; i++) {
+		fprintf(stderr, "%-26s %8.1f\n", mode_names[i],
+				run(ctx, photos, n, i) * 1000);
+	}
+	thumbnail_print_stats(ctx, stderr);
+
+	for (i = 0; i < n; i++) {
+		thumbnail_delete_all(ctx, photos[i].fn);
+		DestroyImage(photos[i].image);
+		free(photos[i].pixels);
+	}
+	free(photos);
+	DestroyImageInfo(info);
+	DestroyExceptionInfo(&exception);
+	thumbnail_uninit(ctx);
+	DestroyMagick();
+
+	return 0;
+}
@@ -0,0 +1,374 @@
+#define _GNU_SOURCE
+#include "thumbpack.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+
+struct thumbpack {
+	char *thumb_dir;
+	char *profile;
+
+	const struct thumbpack_header *header;
+	const struct thumbpack_slot *slots;
+	size_t index_len;
+
+	const unsigned char *data;
+	size_t data_len;
+	int data_fd;		/* kept to see how far it has grown */
+};
+
+
+
+static int
+hex_digit(char c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+	return -1;
+}
+
+
+
+/* on every lookup, so not through sscanf() */
+int
+thumbpack_parse_key(const char *hash, uint8_t *key)
+{
+	int hi, lo;
+	int i;
+
+	for (i = 0; i < THUMBPACK_KEY_LEN; i++) {
+		hi = hex_digit(hash[i * 2]);
+		lo = hi < 0 ? -1 : hex_digit(hash[i * 2 + 1]);
+		if (lo < 0) {
+			return 1;
+		}
+		key[i] = hi << 4 | lo;
+	}
+
+	return hash[THUMBPACK_KEY_LEN * 2] != '\0';
+}
+
+
+
+/*
+ * Fletcher's two sums, of 64 bit words: it is run on every lookup, and
+ * takes a fraction of what a multiply per word would. Both sums are folded
+ * in, so that moved and zeroed data tell too.
+ */
+uint32_t
+thumbpack_checksum(const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	uint64_t a = len, b = 0;
+	uint64_t word;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&word, p, 8);
+		a += word;
+		b += a;
+	}
+	for (; len; p++, len--) {
+		a += *p;
+		b += a;
+	}
+
+	return (uint32_t) (a ^ a >> 32) * 2654435761u ^ (uint32_t) (b ^ b >> 32);
+}
+
+
+
+/* keys are MD5 sums, any four bytes of them will do */
+uint32_t
+thumbpack_first_slot(const uint8_t *key, uint32_t n_slots)
+{
+	uint32_t h;
+
+	memcpy(&h, key, 4);
+	return h & (n_slots - 1);
+}
+
+
+
+char *
+thumbpack_index_name(const char *thumb_dir, const char *profile)
+{
+	char *fn;
+
+	if (asprintf(&fn, "%s/%s.idx", thumb_dir, profile) < 0) {
+		return NULL;
+	}
+	return fn;
+}
+
+
+
+char *
+thumbpack_data_name(const char *thumb_dir, const char *profile,
+		uint64_t generation)
+{
+	char *fn;
+
+	if (asprintf(&fn, "%s/%s.pack.%llu", thumb_dir, profile,
+				(unsigned long long) generation) < 0) {
+		return NULL;
+	}
+	return fn;
+}
+
+
+
+static void
+unmap(struct thumbpack *pack)
+{
+	if (pack->header) {
+		munmap((void *) pack->header, pack->index_len);
+		pack->header = NULL;
+	}
+	if (pack->data) {
+		munmap((void *) pack->data, pack->data_len);
+		pack->data = NULL;
+	}
+	if (pack->data_fd >= 0) {
+		close(pack->data_fd);
+		pack->data_fd = -1;
+	}
+}
+
+
+
+/* as far as the data file has been written yet */
+static int
+map_data(struct thumbpack *pack)
+{
+	struct stat st;
+	void *map;
+
+	if (fstat(pack->data_fd, &st)) {
+		return 1;
+	}
+	if (pack->data && (size_t) st.st_size == pack->data_len) {
+		return 0;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, pack->data_fd,
+			0);
+	if (map == MAP_FAILED) {
+		return 1;
+	}
+	if (pack->data) {
+		munmap((void *) pack->data, pack->data_len);
+	}
+	pack->data = map;
+	pack->data_len = st.st_size;
+
+	return 0;
+}
+
+
+
+static int
+map_pack(struct thumbpack *pack)
+{
+	const struct thumbpack_header *header;
+	struct stat st;
+	char *fn;
+	void *map;
+	int fd;
+
+	fn = thumbpack_index_name(pack->thumb_dir, pack->profile);
+	fd = fn ? open(fn, O_RDONLY) : -1;
+	free(fn);
+	if (fd < 0) {
+		return 1;
+	}
+	if (fstat(fd, &st) || (size_t) st.st_size <
+			sizeof(struct thumbpack_header)) {
+		close(fd);
+		return 1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return 1;
+	}
+	pack->header = header = map;
+	pack->index_len = st.st_size;
+	if (header->magic != THUMBPACK_MAGIC ||
+			header->version != THUMBPACK_VERSION ||
+			header->n_slots == 0 ||
+			(header->n_slots & (header->n_slots - 1)) ||
+			(size_t) st.st_size < sizeof(struct thumbpack_header) +
+			(size_t) header->n_slots *
+			sizeof(struct thumbpack_slot)) {
+		unmap(pack);
+		return 1;
+	}
+	pack->slots = (const struct thumbpack_slot *) (header + 1);
+
+	fn = thumbpack_data_name(pack->thumb_dir, pack->profile,
+			header->generation);
+	pack->data_fd = fn ? open(fn, O_RDONLY) : -1;
+	free(fn);
+	if (pack->data_fd < 0 || map_data(pack)) {
+		unmap(pack);
+		return 1;
+	}
+
+	return 0;
+}
+
+
+
+/* again, if the daemon has replaced the index since */
+static int
+remap(struct thumbpack *pack)
+{
+	int tries;
+
+	if (pack->header && ! pack->header->replaced) {
+		return 0;
+	}
+	/* the data file of a compacted index goes right after */
+	for (tries = 0; tries < 2; tries++) {
+		unmap(pack);
+		if (! map_pack(pack)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+
+
+struct thumbpack *
+thumbpack_open(const char *thumb_dir, const char *profile)
+{
+	struct thumbpack *pack;
+
+	pack = calloc(1, sizeof(struct thumbpack));
+	if (! pack) {
+		return NULL;
+	}
+	pack->data_fd = -1;
+	pack->thumb_dir = strdup(thumb_dir);
+	pack->profile = strdup(profile);
+	if (! pack->thumb_dir || ! pack->profile || remap(pack)) {
+		thumbpack_close(pack);
+		return NULL;
+	}
+
+	return pack;
+}
+
+
+
+void
+thumbpack_close(struct thumbpack *pack)
+{
+	if (pack == NULL) {
+		return;
+	}
+
+	unmap(pack);
+	free(pack->thumb_dir);
+	free(pack->profile);
+	free(pack);
+}
+
+
+
+int
+thumbpack_lookup(struct thumbpack *pack, const char *hash,
+		const void **data, size_t *len)
+{
+	uint8_t key[THUMBPACK_KEY_LEN];
+	const struct thumbpack_record *record;
+	struct thumbpack_slot slot;
+	uint32_t mask;
+	uint32_t i, n;
+	uint64_t end;
+
+	if (thumbpack_parse_key(hash, key) || remap(pack)) {
+		return 1;
+	}
+
+	mask = pack->header->n_slots - 1;
+	i = thumbpack_first_slot(key, pack->header->n_slots);
+	for (n = 0; n <= mask; n++, i = (i + 1) & mask) {
+		/*
+		 * Read once: the daemon changes slots in place meanwhile, and
+		 * the offset checked has to be the one used.
+		 */
+		slot = pack->slots[i];
+		if (slot.state == THUMBPACK_SLOT_EMPTY) {
+			return 1;
+		}
+		if (! memcmp(slot.key, key, THUMBPACK_KEY_LEN)) {
+			break;
+		}
+	}
+	if (n > mask || slot.state != THUMBPACK_SLOT_LIVE) {
+		return 1;
+	}
+
+	if (slot.offset % THUMBPACK_ALIGN) {
+		return 1;
+	}
+	end = slot.offset + sizeof(struct thumbpack_record) + slot.length;
+	if (end < slot.offset || (end > pack->data_len && (map_data(pack) ||
+				end > pack->data_len))) {
+		return 1;
+	}
+	record = (const struct thumbpack_record *) (pack->data + slot.offset);
+	if (record->magic != THUMBPACK_RECORD_MAGIC ||
+			record->length != slot.length ||
+			memcmp(record->key, key, THUMBPACK_KEY_LEN) ||
+			thumbpack_checksum(record + 1, record->length) !=
+			record->checksum) {
+		return 1;
+	}
+
+	*data = record + 1;
+	*len = record->length;
+
+	return 0;
+}
+
+
+
+int
+thumbpack_get_stats(struct thumbpack *pack, struct thumbpack_stats *stats)
+{
+	uint32_t i;
+
+	if (remap(pack)) {
+		return 1;
+	}
+
+	memset(stats, 0, sizeof(struct thumbpack_stats));
+	for (i = 0; i < pack->header->n_slots; i++) {
+		if (pack->slots[i].state == THUMBPACK_SLOT_LIVE) {
+			stats->entries++;
+		}
+	}
+	stats->n_slots = pack->header->n_slots;
+	stats->generation = pack->header->generation;
+	stats->live_bytes = pack->header->live_bytes;
+	stats->dead_bytes = pack->header->dead_bytes;
+
+	return 0;
+}
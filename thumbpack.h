@@ -0,0 +1,106 @@
+#ifndef THUMBPACK_H
+#define THUMBPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Thumbnails of the profiles configured with "pack" are not files of their
+ * own but records in one data file per profile, found through a hash table
+ * in an index file, both in the thumbnail directory:
+ *
+ *	<profile>.idx		struct thumbpack_header, then n_slots slots
+ *	<profile>.pack.<gen>	struct thumbpack_file_header, then each
+ *				struct thumbpack_record followed by its image
+ *
+ * Keys are the MD5 sums a thumbnail file would be named after. The daemon
+ * appends records and updates slots in place under an flock() of the index.
+ * To grow the table, or compact the data into the next generation, it
+ * renames a new index over the old one and flags the old one replaced.
+ *
+ * Readers take no lock: they map both files and check the record a slot
+ * points at against the key, the length and the checksum, taking anything
+ * that does not match for a miss.
+ */
+
+#define THUMBPACK_MAGIC 0x4b505446	/* "FTPK" */
+#define THUMBPACK_RECORD_MAGIC 0x52505446	/* "FTPR" */
+#define THUMBPACK_VERSION 1
+
+#define THUMBPACK_KEY_LEN 16
+
+/* records start at multiples of this */
+#define THUMBPACK_ALIGN 8
+
+enum {
+	THUMBPACK_SLOT_EMPTY,
+	THUMBPACK_SLOT_LIVE,
+	THUMBPACK_SLOT_DELETED,	/* keeps its key, for probing past it */
+};
+
+struct thumbpack_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t n_slots;	/* a power of two */
+	uint32_t used;		/* slots not empty, deleted ones too */
+	uint64_t generation;	/* of the data file */
+	uint64_t live_bytes;	/* in records of live slots */
+	uint64_t dead_bytes;	/* in records nothing points at any more */
+	uint32_t replaced;	/* a newer index has taken the name */
+	uint32_t reserved;
+};
+
+struct thumbpack_slot {
+	uint8_t key[THUMBPACK_KEY_LEN];
+	uint64_t offset;	/* of the record in the data file */
+	uint32_t length;	/* of the image */
+	uint32_t state;
+};
+
+struct thumbpack_file_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t generation;
+};
+
+struct thumbpack_record {
+	uint32_t magic;
+	uint32_t length;
+	uint8_t key[THUMBPACK_KEY_LEN];
+	uint32_t checksum;	/* thumbpack_checksum() of the image */
+	uint32_t reserved;
+};
+
+struct thumbpack_stats {
+	uint32_t entries;
+	uint32_t n_slots;
+	uint64_t generation;
+	uint64_t live_bytes;
+	uint64_t dead_bytes;
+};
+
+struct thumbpack;
+
+/* NULL if the profile has no pack, or not yet */
+struct thumbpack *thumbpack_open(const char *thumb_dir, const char *profile);
+void thumbpack_close(struct thumbpack *pack);
+
+/*
+ * The thumbnail keyed by hash, the 32 hex digits of the MD5 sum of the URI
+ * of its file: 0 and where it is mapped, which stays valid until the next
+ * call with pack, or 1 if there is none.
+ */
+int thumbpack_lookup(struct thumbpack *pack, const char *hash,
+		const void **data, size_t *len);
+
+int thumbpack_get_stats(struct thumbpack *pack, struct thumbpack_stats *stats);
+
+/* shared with the daemon, which writes the packs */
+int thumbpack_parse_key(const char *hash, uint8_t *key);
+uint32_t thumbpack_checksum(const void *data, size_t len);
+uint32_t thumbpack_first_slot(const uint8_t *key, uint32_t n_slots);
+char *thumbpack_index_name(const char *thumb_dir, const char *profile);
+char *thumbpack_data_name(const char *thumb_dir, const char *profile,
+		uint64_t generation);
+
+#endif
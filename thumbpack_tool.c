@@ -0,0 +1,283 @@
+/*
+ * Serves thumbnails out of the packs of the profiles configured with "pack",
+ * through libthumbpack as any client would:
+ *
+ *	get	the thumbnail of a file, to stdout
+ *	stat	what a pack holds
+ *	bench	how long a grid of thumbnails takes to load from a pack, and
+ *		from the files of a profile that has them one to a file
+ *
+ * Files are named by their paths as the daemon indexed them; bench reads
+ * them from stdin, one to a line. Its first round is reported on its own,
+ * as it is the one to show the page cache cold, after
+ * `echo 3 >/proc/sys/vm/drop_caches'.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include "thumbpack.h"
+
+#define ROUNDS 5
+
+
+
+static void
+make_hash(char *hash, const char *fn)
+{
+	gchar *uri;
+	gchar *digest;
+
+	uri = g_strconcat("file://", fn, NULL);
+	digest = g_compute_checksum_for_string(G_CHECKSUM_MD5, uri, -1);
+	memcpy(hash, digest, 32);
+	hash[32] = '\0';
+	g_free(digest);
+	g_free(uri);
+}
+
+
+
+static int
+get(const char *thumb_dir, const char *profile, const char *fn)
+{
+	struct thumbpack *pack;
+	char hash[16 * 2 + 1];
+	const void *data;
+	size_t len;
+	int err = 0;
+
+	pack = thumbpack_open(thumb_dir, profile);
+	if (! pack) {
+		fprintf(stderr, "%s/%s: no pack\n", thumb_dir, profile);
+		return 1;
+	}
+	make_hash(hash, fn);
+	if (thumbpack_lookup(pack, hash, &data, &len)) {
+		fprintf(stderr, "%s: no thumbnail\n", fn);
+		err = 1;
+	} else if (fwrite(data, 1, len, stdout) != len) {
+		perror("stdout");
+		err = 1;
+	}
+	thumbpack_close(pack);
+
+	return err;
+}
+
+
+
+static int
+stat_pack(const char *thumb_dir, const char *profile)
+{
+	struct thumbpack_stats stats;
+	struct thumbpack *pack;
+
+	pack = thumbpack_open(thumb_dir, profile);
+	if (! pack || thumbpack_get_stats(pack, &stats)) {
+		fprintf(stderr, "%s/%s: no pack\n", thumb_dir, profile);
+		thumbpack_close(pack);
+		return 1;
+	}
+	fprintf(stdout, "%s: %u thumbnails in %u slots, generation %llu, "
+			"%llu bytes live, %llu dead\n", profile,
+			stats.entries, stats.n_slots,
+			(unsigned long long) stats.generation,
+			(unsigned long long) stats.live_bytes,
+			(unsigned long long) stats.dead_bytes);
+	thumbpack_close(pack);
+
+	return 0;
+}
+
+
+
+/* the way the grid would have them, every byte of each */
+static unsigned int
+touch(const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	unsigned int sum = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		sum += p[i];
+	}
+
+	return sum;
+}
+
+
+
+/* the pack is opened anew, as a client showing the grid would */
+static double
+load_packed(const char *thumb_dir, const char *profile, char **hashes,
+		int n, int *missing, unsigned int *sum)
+{
+	struct thumbpack *pack;
+	const void *data;
+	GTimer *timer;
+	double elapsed;
+	size_t len;
+	int i;
+
+	timer = g_timer_new();
+	pack = thumbpack_open(thumb_dir, profile);
+	for (i = 0; i < n; i++) {
+		if (! pack || thumbpack_lookup(pack, hashes[i], &data, &len)) {
+			(*missing)++;
+			continue;
+		}
+		*sum += touch(data, len);
+	}
+	thumbpack_close(pack);
+	elapsed = g_timer_elapsed(timer, NULL);
+	g_timer_destroy(timer);
+
+	return elapsed;
+}
+
+
+
+static double
+load_files(const char *thumb_dir, const char *profile, const char *suffix,
+		char **hashes, int n, int *missing, unsigned int *sum)
+{
+	char fn[FILENAME_MAX];
+	struct stat st;
+	GTimer *timer;
+	double elapsed;
+	char *buf = NULL;
+	size_t buf_len = 0;
+	int fd;
+	int i;
+
+	timer = g_timer_new();
+	for (i = 0; i < n; i++) {
+		snprintf(fn, FILENAME_MAX, "%s/%s/%s.%s", thumb_dir, profile,
+				hashes[i], suffix);
+		fd = open(fn, O_RDONLY);
+		if (fd < 0) {
+			(*missing)++;
+			continue;
+		}
+		if (! fstat(fd, &st) && (size_t) st.st_size > buf_len) {
+			buf_len = st.st_size;
+			buf = g_realloc(buf, buf_len);
+		}
+		if (read(fd, buf, st.st_size) == st.st_size) {
+			*sum += touch(buf, st.st_size);
+		} else {
+			(*missing)++;
+		}
+		close(fd);
+	}
+	elapsed = g_timer_elapsed(timer, NULL);
+	g_timer_destroy(timer);
+	g_free(buf);
+
+	return elapsed;
+}
+
+
+
+static int
+bench(const char *thumb_dir, const char *packed, const char *profile,
+		const char *suffix)
+{
+	char line[FILENAME_MAX];
+	GPtrArray *hashes;
+	unsigned int sum = 0;
+	int pack_missing, file_missing;
+	double pack_s[ROUNDS], file_s[ROUNDS];
+	double pack_warm = 0.0, file_warm = 0.0;
+	char *hash;
+	int round;
+	int n;
+
+	hashes = g_ptr_array_new();
+	while (fgets(line, sizeof(line), stdin)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (! *line) {
+			continue;
+		}
+		hash = g_malloc(16 * 2 + 1);
+		make_hash(hash, line);
+		g_ptr_array_add(hashes, hash);
+	}
+	n = hashes->len;
+	if (! n) {
+		fprintf(stderr, "no files on stdin\n");
+		g_ptr_array_free(hashes, TRUE);
+		return 1;
+	}
+
+	for (round = 0; round < ROUNDS; round++) {
+		pack_missing = file_missing = 0;
+		/* in turns, so that neither has the cache to itself */
+		pack_s[round] = load_packed(thumb_dir, packed,
+				(char **) hashes->pdata, n, &pack_missing,
+				&sum);
+		file_s[round] = load_files(thumb_dir, profile, suffix,
+				(char **) hashes->pdata, n, &file_missing,
+				&sum);
+		if (round) {
+			pack_warm += pack_s[round] / (ROUNDS - 1);
+			file_warm += file_s[round] / (ROUNDS - 1);
+		}
+	}
+
+	fprintf(stdout, "%d thumbnails, ms to load the grid (us each):\n", n);
+	fprintf(stdout, "%-12s %8s %8s %10s %10s %8s\n", "", "first", "",
+			"warm", "", "missing");
+	fprintf(stdout, "%-12s %8.1f %8.1f %10.1f %10.2f %8d\n", packed,
+			pack_s[0] * 1000, pack_s[0] * 1e6 / n,
+			pack_warm * 1000, pack_warm * 1e6 / n, pack_missing);
+	fprintf(stdout, "%-12s %8.1f %8.1f %10.1f %10.2f %8d\n", profile,
+			file_s[0] * 1000, file_s[0] * 1e6 / n,
+			file_warm * 1000, file_warm * 1e6 / n, file_missing);
+	/* so that the loads cannot be optimised away */
+	fprintf(stderr, "checksum %08x\n", sum);
+
+	g_ptr_array_foreach(hashes, (GFunc) g_free, NULL);
+	g_ptr_array_free(hashes, TRUE);
+
+	return 0;
+}
+
+
+
+static void
+usage(const char *self)
+{
+	fprintf(stderr, "Usage: %s get <THUMBNAIL DIR> <PROFILE> <FILE>\n"
+			"       %s stat <THUMBNAIL DIR> <PROFILE>\n"
+			"       %s bench <THUMBNAIL DIR> <PACKED PROFILE> "
+			"<FILE PROFILE> <SUFFIX> <FILES\n",
+			self, self, self);
+}
+
+
+
+int
+main(int argc, char *argv[])
+{
+	if (argc == 5 && ! strcmp(argv[1], "get")) {
+		return get(argv[2], argv[3], argv[4]);
+	}
+	if (argc == 4 && ! strcmp(argv[1], "stat")) {
+		return stat_pack(argv[2], argv[3]);
+	}
+	if (argc == 6 && ! strcmp(argv[1], "bench")) {
+		return bench(argv[2], argv[3], argv[4], argv[5]);
+	}
+
+	usage(argv[0]);
+	return 1;
+}
@@ -0,0 +1,320 @@
+#include "walk.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+/* how long an idle thread waits before looking for work again */
+#define IDLE_US 1000
+#define PROGRESS_INTERVAL_S 5
+
+
+
+struct walk_dir {
+	char *src;
+	char *dest;
+};
+
+
+struct walk;
+
+struct walker {
+	struct walk *walk;
+	int id;
+
+	GMutex *lock;
+	GQueue *dirs;		/* struct walk_dir *, owner works at the tail */
+};
+
+
+struct walk {
+	struct walker *walkers;
+	int n_walkers;
+
+	/* directories queued or being read, only zero when all is done */
+	volatile gint pending;
+
+	walk_file_fn file_fn;
+	void *data;
+	volatile int *stop;
+
+	struct walk_stats stats;	/* updated atomically */
+
+	GMutex *done_lock;
+	GCond *done;
+	int exited;
+};
+
+
+
+static void
+free_dir(struct walk_dir *dir)
+{
+	g_free(dir->src);
+	g_free(dir->dest);
+	free(dir);
+}
+
+
+
+/* takes ownership of src and dest */
+static int
+push_dir(struct walker *walker, char *src, char *dest)
+{
+	struct walk_dir *dir;
+
+	dir = malloc(sizeof(struct walk_dir));
+	if (! dir) {
+		g_free(src);
+		g_free(dest);
+		return 1;
+	}
+	dir->src = src;
+	dir->dest = dest;
+
+	g_atomic_int_inc(&walker->walk->pending);
+	g_mutex_lock(walker->lock);
+	g_queue_push_tail(walker->dirs, dir);
+	g_mutex_unlock(walker->lock);
+
+	return 0;
+}
+
+
+
+static struct walk_dir *
+take_dir(struct walker *walker)
+{
+	struct walk_dir *dir;
+
+	g_mutex_lock(walker->lock);
+	dir = g_queue_pop_tail(walker->dirs);
+	g_mutex_unlock(walker->lock);
+
+	return dir;
+}
+
+
+
+static struct walk_dir *
+steal_dir(struct walker *thief)
+{
+	struct walk *walk = thief->walk;
+	struct walk_dir *dir = NULL;
+	int i;
+
+	for (i = 1; i < walk->n_walkers && ! dir; i++) {
+		struct walker *victim;
+
+		victim = &walk->walkers[(thief->id + i) % walk->n_walkers];
+		g_mutex_lock(victim->lock);
+		dir = g_queue_pop_head(victim->dirs);
+		g_mutex_unlock(victim->lock);
+	}
+
+	return dir;
+}
+
+
+
+static void
+read_dir(struct walker *walker, const struct walk_dir *dir)
+{
+	struct walk *walk = walker->walk;
+	struct dirent *ent;
+	struct stat st;
+	DIR *d;
+
+	d = opendir(dir->src);
+	if (! d) {
+		fprintf(stderr, "%s: cannot read\n", dir->src);
+		g_atomic_int_inc(&walk->stats.errors);
+		return;
+	}
+	g_atomic_int_inc(&walk->stats.dirs);
+
+	while (! *walk->stop && (ent = readdir(d))) {
+		char *src, *dest;
+
+		if (strcmp(ent->d_name, ".") == 0 ||
+				strcmp(ent->d_name, "..") == 0) {
+			continue;
+		}
+		if (fstatat(dirfd(d), ent->d_name, &st,
+					AT_SYMLINK_NOFOLLOW)) {
+			g_atomic_int_inc(&walk->stats.errors);
+			continue;
+		}
+		if (! S_ISDIR(st.st_mode) && ! S_ISREG(st.st_mode)) {
+			continue;
+		}
+
+		src = g_strdup_printf("%s/%s", dir->src, ent->d_name);
+		dest = g_strdup_printf("%s/%s", dir->dest, ent->d_name);
+
+		if (S_ISDIR(st.st_mode)) {
+			if (push_dir(walker, src, dest)) {
+				g_atomic_int_inc(&walk->stats.errors);
+			}
+			continue;
+		}
+
+		g_atomic_int_inc(&walk->stats.files);
+		walk->file_fn(src, dest, &st, walk->data);
+		g_free(src);
+		g_free(dest);
+	}
+	closedir(d);
+}
+
+
+
+static gpointer
+walk_main(gpointer data)
+{
+	struct walker *walker = data;
+	struct walk *walk = walker->walk;
+	struct walk_dir *dir;
+
+	while (! *walk->stop) {
+		dir = take_dir(walker);
+		if (! dir) {
+			dir = steal_dir(walker);
+		}
+		if (! dir) {
+			if (g_atomic_int_get(&walk->pending) == 0) {
+				break;
+			}
+			/* someone is still reading, there may be more soon */
+			g_usleep(IDLE_US);
+			continue;
+		}
+
+		read_dir(walker, dir);
+		free_dir(dir);
+		/* subdirectories have been counted by now */
+		g_atomic_int_add(&walk->pending, -1);
+	}
+
+	g_mutex_lock(walk->done_lock);
+	walk->exited++;
+	g_cond_signal(walk->done);
+	g_mutex_unlock(walk->done_lock);
+
+	return NULL;
+}
+
+
+
+static void
+get_stats(struct walk *walk, struct walk_stats *stats)
+{
+	stats->dirs = g_atomic_int_get(&walk->stats.dirs);
+	stats->files = g_atomic_int_get(&walk->stats.files);
+	stats->errors = g_atomic_int_get(&walk->stats.errors);
+}
+
+
+
+int
+walk_trees(const struct walk_root *roots, int n_roots, int n_threads,
+		walk_file_fn file_fn, walk_progress_fn progress_fn, void *data,
+		volatile int *stop, struct walk_stats *stats)
+{
+	struct walk walk;
+	GThread **threads;
+	struct walk_dir *dir;
+	int n_started = 0;
+	int i;
+
+	if (n_threads < 1) {
+		n_threads = 1;
+	}
+
+	memset(&walk, 0, sizeof(walk));
+	walk.file_fn = file_fn;
+	walk.data = data;
+	walk.stop = stop;
+	walk.n_walkers = n_threads;
+	walk.walkers = calloc(n_threads, sizeof(struct walker));
+	threads = calloc(n_threads, sizeof(GThread *));
+	if (! walk.walkers || ! threads) {
+		free(walk.walkers);
+		free(threads);
+		return 1;
+	}
+	walk.done_lock = g_mutex_new();
+	walk.done = g_cond_new();
+
+	for (i = 0; i < n_threads; i++) {
+		walk.walkers[i].walk = &walk;
+		walk.walkers[i].id = i;
+		walk.walkers[i].lock = g_mutex_new();
+		walk.walkers[i].dirs = g_queue_new();
+	}
+	for (i = 0; i < n_roots; i++) {
+		push_dir(&walk.walkers[i % n_threads], g_strdup(roots[i].src),
+				g_strdup(roots[i].dest));
+	}
+
+	/* the threads started take over the deques of those that failed */
+	for (i = 0; i < n_threads; i++) {
+		threads[i] = g_thread_create(walk_main, &walk.walkers[i], TRUE,
+				NULL);
+		if (threads[i]) {
+			n_started++;
+		}
+	}
+	if (n_started == 0) {
+		n_started = 1;
+		walk_main(&walk.walkers[0]);
+	}
+
+	g_mutex_lock(walk.done_lock);
+	while (walk.exited < n_started) {
+		GTimeVal until;
+
+		g_get_current_time(&until);
+		g_time_val_add(&until, PROGRESS_INTERVAL_S * G_USEC_PER_SEC);
+		if (! g_cond_timed_wait(walk.done, walk.done_lock, &until) &&
+				progress_fn) {
+			struct walk_stats now;
+
+			g_mutex_unlock(walk.done_lock);
+			get_stats(&walk, &now);
+			progress_fn(&now, data);
+			g_mutex_lock(walk.done_lock);
+		}
+	}
+	g_mutex_unlock(walk.done_lock);
+
+	for (i = 0; i < n_threads; i++) {
+		if (threads[i]) {
+			g_thread_join(threads[i]);
+		}
+	}
+
+	/* left over when stopped */
+	for (i = 0; i < n_threads; i++) {
+		while ((dir = g_queue_pop_head(walk.walkers[i].dirs))) {
+			free_dir(dir);
+		}
+		g_queue_free(walk.walkers[i].dirs);
+		g_mutex_free(walk.walkers[i].lock);
+	}
+	g_cond_free(walk.done);
+	g_mutex_free(walk.done_lock);
+	free(walk.walkers);
+	free(threads);
+
+	if (stats) {
+		get_stats(&walk, stats);
+	}
+
+	return 0;
+}
@@ -0,0 +1,41 @@
+#ifndef WALK_H
+#define WALK_H
+
+#include <sys/stat.h>
+
+/*
+ * Parallel walk of directory trees that are mirrored at another path.
+ *
+ * Directories are spread over a pool of threads that each keep a deque of
+ * their own. A thread reads the directory it found last (walking depth first,
+ * which keeps the deques short) and, once its deque is empty, steals the
+ * oldest directory of another thread, which is likely to hold a large
+ * subtree. Symbolic links are not followed.
+ */
+
+struct walk_root {
+	const char *src;	/* directory to walk */
+	const char *dest;	/* path that mirrors it */
+};
+
+struct walk_stats {
+	int dirs;		/* directories read */
+	int files;		/* regular files found */
+	int errors;		/* entries that could not be read */
+};
+
+/* called for every regular file, from any of the walking threads */
+typedef void (*walk_file_fn)(const char *src, const char *dest,
+		const struct stat *st, void *data);
+/* called every few seconds from the thread running walk_trees() */
+typedef void (*walk_progress_fn)(const struct walk_stats *stats, void *data);
+
+/*
+ * Returns once every tree has been walked or *stop has been set. Fills in
+ * stats at the end.
+ */
+int walk_trees(const struct walk_root *roots, int n_roots, int n_threads,
+		walk_file_fn file_fn, walk_progress_fn progress_fn, void *data,
+		volatile int *stop, struct walk_stats *stats);
+
+#endif
@@ -0,0 +1,341 @@
+#define _GNU_SOURCE
+#include "writeback.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+
+
+struct writeback {
+	enum writeback_durability durability;
+	int batch_len;
+	int delay_ms;
+
+	GMutex *lock;
+	GCond *work;		/* signalled when the first file is pending */
+	GHashTable *pending;	/* final name to temporary one */
+	GHashTable *committing;	/* likewise, being synced and renamed */
+	GTimeVal deadline;	/* to commit the pending ones by */
+
+	/* held by the commit under way, so that batches land in order */
+	GMutex *commit_lock;
+
+	GThread *thread;
+	int quit;
+
+	struct writeback_stats stats;
+};
+
+
+
+static const char *durability_names[WRITEBACK_N] = {
+	[WRITEBACK_NONE] = "none",
+	[WRITEBACK_BATCH] = "batch",
+	[WRITEBACK_SYNC] = "sync",
+};
+
+
+
+int
+writeback_parse_durability(const char *name)
+{
+	int i;
+
+	for (i = 0; i < WRITEBACK_N; i++) {
+		if (! strcmp(name, durability_names[i])) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+
+
+struct writeback *
+writeback_new(enum writeback_durability durability, int batch_len,
+		int delay_ms)
+{
+	struct writeback *wb;
+
+	wb = calloc(1, sizeof(struct writeback));
+	if (! wb) {
+		return NULL;
+	}
+	wb->durability = durability;
+	wb->batch_len = batch_len > 0 ? batch_len : 1;
+	wb->delay_ms = delay_ms;
+	wb->lock = g_mutex_new();
+	wb->work = g_cond_new();
+	wb->commit_lock = g_mutex_new();
+	wb->pending = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+			g_free);
+
+	return wb;
+}
+
+
+
+static void
+start_sync(gpointer key, gpointer value, gpointer data)
+{
+	const char *tmp = value;
+	GArray *fds = data;
+	int fd;
+
+	fd = open(tmp, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: cannot open: %s\n", tmp, strerror(errno));
+		return;
+	}
+#ifdef SYNC_FILE_RANGE_WRITE
+	sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+	g_array_append_val(fds, fd);
+}
+
+
+
+static void
+put_in_place(gpointer key, gpointer value, gpointer data)
+{
+	const char *fn = key;
+	const char *tmp = value;
+	GHashTable *dirs = data;
+
+	if (rename(tmp, fn)) {
+		fprintf(stderr, "%s: cannot rename to %s: %s\n", tmp, fn,
+				strerror(errno));
+		unlink(tmp);
+		return;
+	}
+	g_hash_table_replace(dirs, g_path_get_dirname(fn), NULL);
+}
+
+
+
+static void
+sync_dir(gpointer key, gpointer value, gpointer data)
+{
+	const char *dir = key;
+	int fd;
+
+	fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (fd < 0 || fsync(fd)) {
+		fprintf(stderr, "%s: cannot sync: %s\n", dir, strerror(errno));
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+}
+
+
+
+/*
+ * The data of every file is on its way to the disk before the first is
+ * waited for, and once that has been committed the others mostly have been
+ * too. Likewise syncing one directory commits the renames in the others.
+ */
+static void
+commit_batch(struct writeback *wb, GHashTable *batch)
+{
+	GHashTable *dirs;
+	GTimer *timer;
+	GArray *fds;
+	int fd;
+	guint i;
+
+	timer = g_timer_new();
+	fds = g_array_new(FALSE, FALSE, sizeof(int));
+	g_hash_table_foreach(batch, start_sync, fds);
+	for (i = 0; i < fds->len; i++) {
+		fd = g_array_index(fds, int, i);
+		if (fdatasync(fd)) {
+			perror("fdatasync");
+		}
+		close(fd);
+	}
+	g_array_free(fds, TRUE);
+
+	dirs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	g_hash_table_foreach(batch, put_in_place, dirs);
+	g_hash_table_foreach(dirs, sync_dir, NULL);
+	g_hash_table_destroy(dirs);
+
+	g_mutex_lock(wb->lock);
+	wb->stats.batches++;
+	wb->stats.sync_s += g_timer_elapsed(timer, NULL);
+	g_mutex_unlock(wb->lock);
+	g_timer_destroy(timer);
+}
+
+
+
+void
+writeback_commit(struct writeback *wb)
+{
+	GHashTable *batch;
+
+	g_mutex_lock(wb->commit_lock);
+	g_mutex_lock(wb->lock);
+	batch = wb->pending;
+	wb->pending = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+			g_free);
+	wb->committing = batch;
+	wb->stats.files += g_hash_table_size(batch);
+	g_mutex_unlock(wb->lock);
+
+	if (g_hash_table_size(batch)) {
+		commit_batch(wb, batch);
+	}
+	g_mutex_lock(wb->lock);
+	wb->committing = NULL;
+	g_mutex_unlock(wb->lock);
+	g_mutex_unlock(wb->commit_lock);
+	g_hash_table_destroy(batch);
+}
+
+
+
+static gpointer
+writeback_main(gpointer data)
+{
+	struct writeback *wb = data;
+	GTimeVal now;
+
+	g_mutex_lock(wb->lock);
+	while (! wb->quit) {
+		if (! g_hash_table_size(wb->pending)) {
+			g_cond_wait(wb->work, wb->lock);
+			continue;
+		}
+		g_get_current_time(&now);
+		if (now.tv_sec < wb->deadline.tv_sec ||
+				(now.tv_sec == wb->deadline.tv_sec &&
+				 now.tv_usec < wb->deadline.tv_usec)) {
+			g_cond_timed_wait(wb->work, wb->lock, &wb->deadline);
+			continue;
+		}
+		g_mutex_unlock(wb->lock);
+		writeback_commit(wb);
+		g_mutex_lock(wb->lock);
+	}
+	g_mutex_unlock(wb->lock);
+
+	return NULL;
+}
+
+
+
+int
+writeback_add(struct writeback *wb, const char *tmp, const char *fn)
+{
+	int full;
+
+	if (wb->durability == WRITEBACK_NONE) {
+		g_mutex_lock(wb->lock);
+		wb->stats.files++;
+		g_mutex_unlock(wb->lock);
+		if (rename(tmp, fn)) {
+			fprintf(stderr, "%s: cannot rename to %s: %s\n", tmp,
+					fn, strerror(errno));
+			unlink(tmp);
+			return 1;
+		}
+		return 0;
+	}
+
+	g_mutex_lock(wb->lock);
+	/* here rather than in writeback_new(), see start_workers() */
+	if (! wb->thread) {
+		wb->thread = g_thread_create(writeback_main, wb, TRUE, NULL);
+	}
+	if (g_hash_table_lookup(wb->pending, fn)) {
+		unlink(g_hash_table_lookup(wb->pending, fn));
+		wb->stats.replaced++;
+	}
+	g_hash_table_replace(wb->pending, g_strdup(fn), g_strdup(tmp));
+	if (g_hash_table_size(wb->pending) == 1) {
+		g_get_current_time(&wb->deadline);
+		g_time_val_add(&wb->deadline, wb->delay_ms * 1000L);
+		g_cond_signal(wb->work);
+	}
+	full = g_hash_table_size(wb->pending) >= (guint) wb->batch_len;
+	g_mutex_unlock(wb->lock);
+
+	if (full) {
+		writeback_commit(wb);
+	}
+
+	return 0;
+}
+
+
+
+int
+writeback_pending(struct writeback *wb, const char *fn)
+{
+	int pending;
+
+	g_mutex_lock(wb->lock);
+	pending = g_hash_table_lookup(wb->pending, fn) ||
+		(wb->committing && g_hash_table_lookup(wb->committing, fn));
+	g_mutex_unlock(wb->lock);
+
+	return pending;
+}
+
+
+
+void
+writeback_job_done(struct writeback *wb)
+{
+	if (wb->durability == WRITEBACK_SYNC) {
+		writeback_commit(wb);
+	}
+}
+
+
+
+void
+writeback_get_stats(struct writeback *wb, struct writeback_stats *stats)
+{
+	g_mutex_lock(wb->lock);
+	*stats = wb->stats;
+	g_mutex_unlock(wb->lock);
+}
+
+
+
+void
+writeback_free(struct writeback *wb)
+{
+	if (wb == NULL) {
+		return;
+	}
+
+	g_mutex_lock(wb->lock);
+	wb->quit = 1;
+	g_cond_signal(wb->work);
+	g_mutex_unlock(wb->lock);
+	if (wb->thread) {
+		g_thread_join(wb->thread);
+	}
+	writeback_commit(wb);
+
+	fprintf(stdout, "writeback: %lu thumbnails in %lu batches, %.2f s "
+			"syncing, %lu replaced while pending\n",
+			wb->stats.files, wb->stats.batches, wb->stats.sync_s,
+			wb->stats.replaced);
+
+	g_hash_table_destroy(wb->pending);
+	g_mutex_free(wb->commit_lock);
+	g_cond_free(wb->work);
+	g_mutex_free(wb->lock);
+	free(wb);
+}
@@ -0,0 +1,63 @@
+#ifndef WRITEBACK_H
+#define WRITEBACK_H
+
+#include <stdio.h>
+
+/*
+ * Puts thumbnails written to temporary files in place by renaming them, so
+ * that nobody ever sees one half written. Unless durability is
+ * WRITEBACK_NONE, the data of a batch of them is synced before they are
+ * renamed and their directories after, so that a crash leaves either the
+ * old thumbnail or the new one: syncing many files and directories together
+ * takes about as few journal commits as syncing one.
+ */
+
+enum writeback_durability {
+	WRITEBACK_NONE,		/* renamed at once and never synced */
+	WRITEBACK_BATCH,	/* synced and renamed batch_len or delay_ms
+				   after the first, whichever comes first */
+	WRITEBACK_SYNC,		/* also at the end of each job */
+	WRITEBACK_N
+};
+
+struct writeback_stats {
+	unsigned long files;	/* thumbnails put in place */
+	unsigned long replaced;	/* dropped for a newer one of the same name */
+	unsigned long batches;	/* commits with anything to sync */
+	double sync_s;		/* seconds spent syncing */
+};
+
+struct writeback;
+
+struct writeback *writeback_new(enum writeback_durability durability,
+		int batch_len, int delay_ms);
+/* commits whatever is pending */
+void writeback_free(struct writeback *wb);
+
+/* -1 if name is not one of "none", "batch" and "sync" */
+int writeback_parse_durability(const char *name);
+
+/*
+ * tmp, a complete file in the directory of fn, is to become fn. Only fails
+ * if with durability WRITEBACK_NONE the rename does, tmp is removed then.
+ */
+int writeback_add(struct writeback *wb, const char *tmp, const char *fn);
+
+/* a job is done, which with WRITEBACK_SYNC commits what it wrote */
+void writeback_job_done(struct writeback *wb);
+
+/*
+ * Put everything pending in place now, as before renaming or removing
+ * thumbnails that may be among them.
+ */
+void writeback_commit(struct writeback *wb);
+
+/*
+ * 1 if fn is yet to be put in place. Checked before looking for fn itself,
+ * one that is not pending either is there or was never added.
+ */
+int writeback_pending(struct writeback *wb, const char *fn);
+
+void writeback_get_stats(struct writeback *wb, struct writeback_stats *stats);
+
+#endif